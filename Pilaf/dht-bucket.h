@@ -0,0 +1,914 @@
+/***********************************************
+ *                                             *
+ * -__ /\\     ,,         /\\                  *
+ *   ||  \\  ' ||   _    ||                    *
+ *  /||__|| \\ ||  < \, =||=                   *
+ *  \||__|| || ||  /-||  ||                    *
+ *   ||  |, || || (( ||  ||                    *
+ * _-||-_/  \\ \\  \/\\  \\,                   *
+ *   ||                                        *
+ *                                             *
+ *   Pilaf Infiniband DHT                      *
+ *   (c) 2012-2013 Christopher Mitchell et al. *
+ *   New York University, Courant Institute    *
+ *   Networking and Wide-Area Systems Group    *
+ *   All rights reserved.                      *
+ *                                             *
+ *   dht-bucket.h: Set-associative cuckoo      *
+ *          table shard: two candidate         *
+ *          buckets of several ways each.      *
+ *                                             *
+ ***********************************************/
+
+#ifndef DHT_BUCKET_H
+#define DHT_BUCKET_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <utility>
+#include "dht.h"
+#include "dht-inline.h"
+
+#define BUCKET_WAYS 4             // ways per bucket, 4 or 8
+#define BUCKET_CHOICES 2          // candidate buckets per key
+#define BUCKET_SIZE (BUCKET_WAYS*32)  // bytes: two cache lines for 4 ways, four for 8
+#define BUCKET_BFS_NODES 256      // most buckets searched for a cuckoo path
+
+/**
+ * Alternative to DHT whose unit is a bucket of BUCKET_WAYS ways rather
+ * than a single row, with each key hashed to BUCKET_CHOICES buckets.
+ * A client fetches a whole bucket, guard and all, with one RDMA read,
+ * so a lookup reads at most two buckets and usually one. Every way
+ * carries a 16-bit fingerprint of its key in the bucket header: a
+ * client only fetches the extents of ways whose fingerprint matches,
+ * so misses and collisions rarely cost an extents read.
+ *
+ * With this much associativity, a breadth-first search for the
+ * shortest path of displacements keeps inserts cheap well past 90%
+ * occupancy, so kLoadFactor is set much higher than in DHT. Keys and
+ * values always live in the extents, as in DHT; a bucket holds their
+ * address, lengths and checksum (or seqlock version).
+ */
+template<class K, class V>
+class BucketDHT {
+
+public:
+  struct __attribute__ ((__packed__)) bucket_way {
+    char* ext;                    // key+value
+    uint64_t ext_crc;             // CRC of key+value, or their version
+    uint32_t val_len;
+    uint32_t ext_capacity;
+    uint16_t key_len;
+  };
+  struct __attribute__ ((__packed__)) dht_data {
+    uint16_t fp[BUCKET_WAYS];     // fingerprint of each way's key
+    uint8_t used;                 // bitmap of ways in use
+    uint8_t reserved;
+    struct bucket_way way[BUCKET_WAYS];
+  };
+  struct __attribute__ ((aligned(64))) dht_block {
+#if DHT_CONSISTENCY==CONSISTENCY_SEQLOCK
+    uint32_t version;             // head copy of guard
+#endif
+    struct dht_data d;
+    uint64_t guard;               // checksum of d, or the bucket's version
+  };
+
+  typedef std::vector<dht_block, aligned_allocator<dht_block,64> > slot_vector;
+
+  static_assert(sizeof(dht_block) == BUCKET_SIZE, "bucket must fill its cache lines exactly");
+  static_assert(BUCKET_WAYS <= 8, "the used bitmap has room for 8 ways");
+
+  // DHT, in buckets
+  slot_vector buckets_;
+
+  // DHT Extents; regions as in DHT
+  void* memregion;
+  std::vector<size_t> ext_regions_;
+  size_t ext_size_;
+
+  // DHT shard attributes
+  size_t size_;     //buckets
+  size_t entries_;  //pairs stored
+
+private:
+  Integrity64 crc;
+  uint64_t version_;        // last seqlock version handed out
+
+  struct dht_block blankrow;
+
+  SlabMalloc pool;
+
+  int (*pre_resize_hook) (size_t, slot_vector*, void*);
+  void* pre_resize_context;
+  int (*post_resize_hook)(size_t, slot_vector*, void*);
+  void* post_resize_context;
+  int (*extents_hook)(int, void*, size_t, void*);
+  void* extents_context;
+  int (*retire_hook)(size_t, slot_vector*, void*);
+  void* retire_context;
+
+  // Incremental resize, as in DHT, a bucket at a time
+  slot_vector next_;
+  size_t next_size_;
+  size_t next_entries_;
+  size_t migrate_pos_;
+  bool migrating_;
+
+  slot_vector retired_;
+  size_t retired_size_;
+  size_t retired_entries_;
+  bool retiring_;
+
+  bool shadow_;             // next_ or retired_ is swapped into buckets_
+
+  // Bulk loading, as in DHT; dirty_ holds buckets
+  std::vector<size_t> dirty_;
+  bool bulk_;
+
+  // One node of the search for a cuckoo path: the way of the parent
+  // bucket whose occupant would move into this bucket
+  struct bfs_node {
+    size_t bucket;
+    int parent;
+    int way;
+  };
+
+public:
+  BucketDHT() {
+    size_ = 0;
+    entries_ = 0;
+    buckets_.clear();
+
+    next_size_ = next_entries_ = migrate_pos_ = 0;
+    retired_size_ = retired_entries_ = 0;
+    migrating_ = retiring_ = shadow_ = false;
+    bulk_ = false;
+    version_ = 0;
+
+    pre_resize_hook = NULL;
+    pre_resize_context = NULL;
+    post_resize_hook = NULL;
+    post_resize_context = NULL;
+    extents_hook = NULL;
+    extents_context = NULL;
+    retire_hook = NULL;
+    retire_context = NULL;
+
+    memregion = extents_reserve();
+    if (NULL == memregion) {
+      fprintf(stderr,"Failed to reserve address space for extents");
+      exit(-1);
+    }
+    ext_size_ = 0;
+    add_extents_region(INIT_EXTENTS_SIZE);
+
+    memset(&blankrow,0,sizeof(struct dht_block));
+    fix_guard(&blankrow);
+
+    resize(INIT_KV_CAPACITY/BUCKET_WAYS);
+  }
+
+  ~BucketDHT() {
+    munmap(memregion,(size_t)EXTENTS_MAX_REGIONS<<EXTENTS_REGION_SHIFT);
+  }
+
+  /**
+   * Returns the number of buckets this table shard contains
+   */
+  size_t buckets() {
+    return size_;
+  }
+
+  /**
+   * Pretends to resize the DHT to trigger any resize hooks.
+   */
+  void resize(void) {
+    if (pre_resize_hook) pre_resize_hook(size_, &buckets_, pre_resize_context);
+    if (post_resize_hook) post_resize_hook(size_, &buckets_, post_resize_context);
+  }
+
+  /**
+   * Resizes the table to capacity buckets, synchronously.
+   */
+  void resize(size_t capacity) {
+    assert(capacity >= size_);
+    finish_resize();
+    if (capacity <= size_)
+      return;
+
+    begin_resize(capacity);
+    finish_resize();
+  }
+
+  /**
+   * Starts growing the table to capacity buckets in the background;
+   * see DHT::begin_resize().
+   */
+  void begin_resize(size_t capacity) {
+    if (migrating_ || capacity <= size_)
+      return;
+    retire();
+
+    printf("Resizing DHT from %lu to %lu buckets.\n",size_,capacity);
+
+    next_.assign(capacity,blankrow);
+    next_size_ = capacity;
+    next_entries_ = 0;
+    migrate_pos_ = 0;
+    migrating_ = true;
+  }
+
+  /**
+   * Copies up to rows buckets into the table being built, and switches
+   * over once all are copied. Returns whether the resize is still
+   * under way.
+   */
+  bool migrate_step(size_t rows) {
+    if (!migrating_)
+      return false;
+
+    size_t end = (rows < size_-migrate_pos_)?migrate_pos_+rows:size_;
+    for(; migrate_pos_ < end; migrate_pos_++) {
+      for(int w = 0; w < BUCKET_WAYS; w++) {
+        if (buckets_[migrate_pos_].d.used & (1<<w))
+          mirror(migrate_pos_,w);
+      }
+    }
+
+    if (migrate_pos_ == size_)
+      flip();
+    return migrating_;
+  }
+
+  void finish_resize(void) {
+    while (migrating_)
+      migrate_step(size_);
+  }
+
+  bool migrating(void) {
+    return migrating_;
+  }
+
+  bool retiring(void) {
+    return retiring_;
+  }
+
+  /**
+   * Frees the table replaced by the last resize, after the retire hook.
+   */
+  void retire(void) {
+    if (!retiring_)
+      return;
+    retiring_ = false;
+
+    if (retire_hook) retire_hook(retired_size_, &retired_, retire_context);
+    slot_vector().swap(retired_);
+  }
+
+  /**
+   * Pre-sizes the table for entries pairs with kv_bytes of keys
+   * and values between them; see DHT::reserve().
+   */
+  void reserve(size_t entries, size_t kv_bytes) {
+    size_t capacity = buckets_for(entries);
+    if (capacity > size_)
+      resize(capacity);
+
+    size_t ext = pool.footprint(entries,kv_bytes);
+    if (ext > ext_size_)
+      resize_extents(ext);
+  }
+
+  /**
+   * Grows the table now, if need be, so that more pairs can be
+   * inserted without a resize starting part-way through them.
+   * Grows at least twice as large, as a resize would.
+   */
+  void make_room(size_t more) {
+    finish_resize();
+    if (entries_+more <= kLoadFactor*size_*BUCKET_WAYS)
+      return;
+
+    size_t capacity = buckets_for(entries_+more);
+    resize((capacity > 1+2*size_)?capacity:1+2*size_);
+  }
+
+  /**
+   * Starts a batch of writes whose bucket guards are computed once, by
+   * commit_bulk(). Until then, clients see those buckets as locked.
+   */
+  void begin_bulk(void) {
+    bulk_ = true;
+  }
+
+  void commit_bulk(void) {
+    seal_dirty();
+    bulk_ = false;
+  }
+
+  /**
+   * Grows the extents to at least capacity bytes by adding regions;
+   * pairs never move.
+   */
+  void resize_extents(size_t capacity) {
+    while (ext_size_ < capacity) {
+      size_t size = capacity-ext_size_;
+      if (size > ((size_t)1<<EXTENTS_REGION_SHIFT))
+        size = (size_t)1<<EXTENTS_REGION_SHIFT;
+
+      printf("Adding DHT extents region %zu of %zu bytes.\n",ext_regions_.size(),size);
+
+      int region = add_extents_region(size);
+      if (extents_hook)
+        extents_hook(region, extents_region_base(memregion,region), ext_regions_[region], extents_context);
+    }
+  }
+
+  int add_extents_region(size_t size) {
+    int region = ext_regions_.size();
+    char* base = extents_region_base(memregion,region);
+    size = (size+SLAB_PAGE_SIZE-1)/SLAB_PAGE_SIZE*SLAB_PAGE_SIZE;
+
+    if (region == EXTENTS_MAX_REGIONS || mprotect(base,size,PROT_READ|PROT_WRITE)) {
+      fprintf(stderr,"Failed to add extents region %d of %zu bytes",region,size);
+      exit(-1);
+    }
+    pool.add_region(base,size);
+    ext_regions_.push_back(size);
+    ext_size_ += size;
+    return region;
+  }
+
+  /**
+   * Insert a k,v pair into the table, or update it if it exists.
+   */
+  void insert(const K& key, size_t key_len, V value, size_t val_len, uint64_t crc_ = 0, bool have_crc = false) {
+    update(key,key_len,value,val_len,crc_,have_crc);
+  }
+
+  /**
+   * Stores a k,v pair, reusing the way's extents when they are large
+   * enough. The client-supplied crc covers key+value, which is exactly
+   * what the extents hold. A background resize starts once the table
+   * is kLoadFactor full.
+   */
+  void update(const K& key, size_t key_len, V value, size_t val_len, uint64_t crc_ = 0, bool have_crc = false) {
+    key_hash h = crc.hash128(key,key_len);
+    size_t index = find(h,key,key_len);
+
+    if (index != BUCKET_NOT_FOUND) {
+      size_t b = index/BUCKET_WAYS;
+      int w = index%BUCKET_WAYS;
+      open_row(&buckets_[b]);
+      fill(&buckets_[b].d.way[w],key,key_len,value,val_len,crc_,have_crc);
+      seal(b);
+      mirror(b,w);
+      _write_barrier();
+      return;
+    }
+
+    struct bucket_way row;
+    memset(&row,0,sizeof(row));
+    fill(&row,key,key_len,value,val_len,crc_,have_crc);
+    while (!place(h,row))
+      grow();
+    _write_barrier();
+
+    if (!migrating_ && !retiring_ && entries_ > kLoadFactor*size_*BUCKET_WAYS)
+      begin_resize(1+2*size_);
+  }
+
+  /**
+   * Removes a k,v pair if it exists, freeing its extents.
+   */
+  void remove(const K& key, size_t key_len) {
+    size_t index = find(key,key_len);
+    if (index == BUCKET_NOT_FOUND)
+      return;
+
+    size_t b = index/BUCKET_WAYS;
+    int w = index%BUCKET_WAYS;
+    unmirror(key,key_len);
+    open_row(&buckets_[b]);
+    release_extents(&buckets_[b].d.way[w]);
+    buckets_[b].d.used &= ~(1<<w);
+    fix_guard(&buckets_[b]);
+    entries_--;
+  }
+
+  /**
+   * Returns 1 for existing keys, 0 otherwise.
+   */
+  bool contains(const K& key, size_t key_len) {
+    return find(key,key_len) != BUCKET_NOT_FOUND;
+  }
+
+  /**
+   * Local lookup, used for server-mediated reads. The value points
+   * into the extents and is only valid until the next write.
+   */
+  bool get(const K& key, size_t key_len, const char*& value, size_t& val_len) {
+    size_t index = find(key,key_len);
+    if (index == BUCKET_NOT_FOUND)
+      return false;
+    const struct bucket_way* way = &buckets_[index/BUCKET_WAYS].d.way[index%BUCKET_WAYS];
+    value = way->ext+way->key_len;
+    val_len = way->val_len;
+    return true;
+  }
+
+  /**
+   * Returns the way holding key, numbered bucket*BUCKET_WAYS+way, or
+   * BUCKET_NOT_FOUND.
+   */
+  size_t find(const K& key, size_t key_len) {
+    return find(crc.hash128(key,key_len),key,key_len);
+  }
+
+  size_t find(const key_hash& h, const K& key, size_t key_len) {
+    uint16_t fp = Integrity64::fingerprint(h);
+    for(int i=0; i < BUCKET_CHOICES; i++) {
+      size_t b = bucket_idx(h,i);
+      const struct dht_data* d = &buckets_[b].d;
+      for(int w = 0; w < BUCKET_WAYS; w++) {
+        if ((d->used & (1<<w)) && d->fp[w] == fp &&
+            binarycmp(d->way[w].ext,d->way[w].key_len,key,key_len))
+          return b*BUCKET_WAYS+w;
+      }
+    }
+    return BUCKET_NOT_FOUND;
+  }
+
+  /**
+   * Starts a write to a bucket clients may be reading; see
+   * DHT::open_row().
+   */
+  inline void open_row(struct dht_block* block) {
+#if DHT_CONSISTENCY==CONSISTENCY_SEQLOCK
+    block->guard = (uint32_t)++version_;
+    _write_barrier();
+#endif
+  }
+
+  /**
+   * Updates the CRC attached to a bucket for self-validation
+   */
+  inline void fix_guard(struct dht_block* block) {
+#if DHT_CONSISTENCY==CONSISTENCY_SEQLOCK
+    _write_barrier();
+    block->version = (uint32_t)block->guard;
+#else
+    block->guard = crc.crc((char*)&(block->d),sizeof(struct dht_data));
+#endif
+  }
+
+  /**
+   * Returns a bucket index for a given key's hash.
+   * Disregards whether the key is actually there.
+   */
+  inline size_t bucket_idx(const key_hash& h, int hash = 0) {
+    return Integrity64::reduce(Integrity64::probe(h,hash),size_);
+  }
+
+  void set_resize_hooks(int(*pre_hook)(size_t, slot_vector*, void*), void* pre_context,
+                        int(*post_hook)(size_t, slot_vector*, void*), void* post_context) {
+    pre_resize_hook = pre_hook;
+    pre_resize_context  = pre_context;
+    post_resize_hook = post_hook;
+    post_resize_context = post_context;
+  }
+
+  void set_extents_hook(int(*hook)(int, void*, size_t, void*), void* context) {
+    extents_hook = hook;
+    extents_context = context;
+  }
+
+  void set_retire_hook(int(*hook)(size_t, slot_vector*, void*), void* context) {
+    retire_hook = hook;
+    retire_context = context;
+  }
+
+  /**
+   * Prints the extents allocator's counters and size classes.
+   */
+  void dump_extents(FILE* out) const {
+    pool.dump(out);
+  }
+
+  void dump_table(void) {
+    printf("Bucket   \tWay\tFp\tKey\n");
+    for(size_t i=0; i<size_; i++) {
+      const struct dht_data* d = &buckets_[i].d;
+      if (!d->used)
+        printf("%9zu\t [EMPTY] -----------------------\n",i);
+      for(int w = 0; w < BUCKET_WAYS; w++) {
+        if (d->used & (1<<w))
+          printf("%9zu\t%3d\t%04x\t%.*s\n",i,w,d->fp[w],(int)d->way[w].key_len,d->way[w].ext);
+      }
+    }
+  }
+
+private:
+  // When loading gets beyond this fraction of all ways, resize
+  static constexpr double kLoadFactor = 0.93;
+
+  static size_t buckets_for(size_t entries) {
+    return 1+(size_t)(entries/(kLoadFactor*BUCKET_WAYS));
+  }
+
+  void grow(void) {
+    if (migrating_)
+      finish_resize();
+    else
+      resize(1+2*size_);
+  }
+
+  void flip(void) {
+    seal_dirty();
+
+    if (pre_resize_hook) pre_resize_hook(size_, &buckets_, pre_resize_context);
+
+    retired_.swap(buckets_);
+    buckets_.swap(next_);
+    retired_size_ = size_;
+    retired_entries_ = entries_;
+    size_ = next_size_;
+    entries_ = next_entries_;
+    migrating_ = false;
+    retiring_ = true;
+
+    if (post_resize_hook) post_resize_hook(size_, &buckets_, post_resize_context);
+
+    if (!retire_hook)
+      retire();
+  }
+
+  /**
+   * Guards a live bucket just written, or leaves it for commit_bulk().
+   */
+  inline void seal(size_t b) {
+    if (bulk_ && !shadow_)
+      dirty_.push_back(b);
+    else
+      fix_guard(&buckets_[b]);
+  }
+
+  void seal_dirty(void) {
+    std::sort(dirty_.begin(),dirty_.end());
+    dirty_.erase(std::unique(dirty_.begin(),dirty_.end()),dirty_.end());
+    for(size_t i = 0; i < dirty_.size(); i++)
+      fix_guard(&buckets_[dirty_[i]]);
+    dirty_.clear();
+    _write_barrier();
+  }
+
+  void swap_table(slot_vector& table, size_t& size, size_t& entries) {
+    buckets_.swap(table);
+    std::swap(size_,size);
+    std::swap(entries_,entries);
+    shadow_ = !shadow_;
+  }
+
+  /**
+   * Copies a way just written to the live table into the table being
+   * built, and into the retired one if it already holds the key.
+   */
+  void mirror(size_t b, int w) {
+    if (shadow_ || !(migrating_ || retiring_))
+      return;
+
+    struct bucket_way row = buckets_[b].d.way[w];
+    if (migrating_) {
+      while (!mirror_into(next_,next_size_,next_entries_,row,true))
+        grow_next();
+    }
+    if (retiring_)
+      mirror_into(retired_,retired_size_,retired_entries_,row,false);
+  }
+
+  bool mirror_into(slot_vector& table, size_t& size, size_t& entries, const struct bucket_way& row, bool add) {
+    bool placed = true;
+
+    swap_table(table,size,entries);
+    key_hash h = crc.hash128(row.ext,row.key_len);
+    size_t index = find(h,(K)row.ext,row.key_len);
+    if (index != BUCKET_NOT_FOUND) {
+      size_t b = index/BUCKET_WAYS;
+      open_row(&buckets_[b]);
+      buckets_[b].d.way[index%BUCKET_WAYS] = row;
+      fix_guard(&buckets_[b]);
+    } else if (add) {
+      placed = place(h,row);
+    }
+    swap_table(table,size,entries);
+    return placed;
+  }
+
+  void unmirror(const K& key, size_t key_len) {
+    if (migrating_)
+      unmirror_from(next_,next_size_,next_entries_,key,key_len);
+    if (retiring_)
+      unmirror_from(retired_,retired_size_,retired_entries_,key,key_len);
+  }
+
+  void unmirror_from(slot_vector& table, size_t& size, size_t& entries, const K& key, size_t key_len) {
+    swap_table(table,size,entries);
+    size_t index = find(key,key_len);
+    if (index != BUCKET_NOT_FOUND) {
+      size_t b = index/BUCKET_WAYS;
+      open_row(&buckets_[b]);
+      buckets_[b].d.used &= ~(1<<(index%BUCKET_WAYS));
+      fix_guard(&buckets_[b]);
+      entries_--;
+    }
+    swap_table(table,size,entries);
+  }
+
+  /**
+   * Rebuilds the table being built twice as large when it runs out of
+   * cuckoo paths.
+   */
+  void grow_next(void) {
+    slot_vector old_b;
+    old_b.swap(next_);
+    next_size_ = 1+2*next_size_;
+    next_.assign(next_size_,blankrow);
+    next_entries_ = 0;
+
+    for(size_t i = 0; i < old_b.size(); i++) {
+      for(int w = 0; w < BUCKET_WAYS; w++) {
+        if (old_b[i].d.used & (1<<w)) {
+          while (!mirror_into(next_,next_size_,next_entries_,old_b[i].d.way[w],true))
+            grow_next();
+        }
+      }
+    }
+  }
+
+  /**
+   * Writes key and value into a way's extents, replacing them if
+   * they are too small, and records their lengths and checksum.
+   */
+  void fill(struct bucket_way* way, const char* key, size_t key_len, const char* value, size_t val_len,
+            uint64_t crc_, bool have_crc) {
+    if (way->ext && way->ext_capacity < ext_footprint(key_len+val_len)-EXT_HEAD_SIZE)
+      release_extents(way);
+    if (!way->ext)
+      reserve_extents(way,key_len,val_len);
+#if DHT_CONSISTENCY==CONSISTENCY_SEQLOCK
+    else  // rewritten in place; readers of the old pair must fail
+      ext_stamp(way->ext,way->key_len+way->val_len,++version_);
+#endif
+    memcpy(way->ext,key,key_len);
+    memcpy(way->ext+key_len,value,val_len);
+#if DHT_CONSISTENCY==CONSISTENCY_SEQLOCK
+    way->ext_crc = ++version_;
+    ext_stamp(way->ext,key_len+val_len,way->ext_crc);
+#else
+    way->ext_crc = have_crc ? crc_ : crc.crc(way->ext,key_len+val_len);
+#endif
+    way->key_len = key_len;
+    way->val_len = val_len;
+  }
+
+  void reserve_extents(struct bucket_way* way, size_t key_len, size_t val_len) {
+    size_t need = ext_footprint(key_len+val_len);
+    size_t extsize = pool.chunk_size(need)-EXT_HEAD_SIZE;
+    char* chunk = (char*)pool.alloc(need);
+
+    while (chunk == NULL) {  //out of memory
+      size_t more = (ext_size_ > (1024L*1024L*1024L))?ext_size_/4:ext_size_;
+      resize_extents(ext_size_+std::max(more,need+SLAB_PAGE_SIZE));
+      chunk = (char*)pool.alloc(need);
+    }
+    way->ext = chunk+EXT_HEAD_SIZE;
+    way->ext_capacity = extsize;
+  }
+
+  void release_extents(struct bucket_way* way) {
+    if (!way->ext)
+      return;
+#if DHT_CONSISTENCY==CONSISTENCY_SEQLOCK
+    ext_stamp(way->ext,way->key_len+way->val_len,++version_);
+#else
+    way->ext[0]++;  //make the CRC wrong for readers in flight
+#endif
+    pool.release(way->ext-EXT_HEAD_SIZE);
+    way->ext = NULL;
+    way->ext_capacity = 0;
+  }
+
+  /**
+   * The first free way of bucket b, or -1.
+   */
+  inline int free_way(size_t b) {
+    uint8_t used = buckets_[b].d.used;
+    for(int w = 0; w < BUCKET_WAYS; w++) {
+      if (!(used & (1<<w)))
+        return w;
+    }
+    return -1;
+  }
+
+  /**
+   * The other candidate bucket of the pair in way w of bucket b, or b
+   * itself if both its choices are b.
+   */
+  inline size_t alt_bucket(size_t b, int w) {
+    const struct bucket_way* way = &buckets_[b].d.way[w];
+    key_hash h = crc.hash128(way->ext,way->key_len);
+    size_t b0 = bucket_idx(h,0);
+    return (b0 != b)?b0:bucket_idx(h,1);
+  }
+
+  /**
+   * Cuckoo placement of a filled way. Searches breadth-first from both
+   * candidate buckets for the shortest path of displacements ending in
+   * a free way, then shifts the pairs along it backwards, so every
+   * resident pair stays readable throughout. Returns false, without
+   * touching the table, if no path was found within BUCKET_BFS_NODES
+   * buckets.
+   */
+  bool place(const key_hash& h, const struct bucket_way& row) {
+    uint16_t fp = Integrity64::fingerprint(h);
+    std::vector<struct bfs_node> nodes;
+
+    for(int i=0; i < BUCKET_CHOICES; i++) {
+      size_t b = bucket_idx(h,i);
+      int w = free_way(b);
+      if (w >= 0) {
+        store(b,w,row,fp);
+        entries_++;
+        return true;
+      }
+      if (i == 0 || b != nodes[0].bucket) {
+        struct bfs_node root = {b,-1,-1};
+        nodes.push_back(root);
+      }
+    }
+
+    // Every bucket in nodes is full, so a bucket with a free way is
+    // never one already on the path
+    for(size_t n = 0; n < nodes.size(); n++) {
+      size_t b = nodes[n].bucket;
+
+      for(int w = 0; w < BUCKET_WAYS; w++) {
+        size_t alt = alt_bucket(b,w);
+        if (alt == b)
+          continue;
+
+        int f = free_way(alt);
+        if (f >= 0) {
+          // Shift backwards from the free way to a root
+          size_t to = alt;
+          int to_way = f;
+          for(int p = n, from_way = w; ; from_way = nodes[p].way, p = nodes[p].parent) {
+            struct bucket_way moved = buckets_[nodes[p].bucket].d.way[from_way];
+            store(to,to_way,moved,buckets_[nodes[p].bucket].d.fp[from_way]);
+            to = nodes[p].bucket;
+            to_way = from_way;
+            if (nodes[p].parent < 0)
+              break;
+          }
+          store(to,to_way,row,fp);
+          entries_++;
+          return true;
+        }
+
+        if (nodes.size() == BUCKET_BFS_NODES)
+          continue;
+        bool seen = false;
+        for(size_t s = 0; s < nodes.size() && !seen; s++)
+          seen = (nodes[s].bucket == alt);
+        if (!seen) {
+          struct bfs_node next = {alt,(int)n,w};
+          nodes.push_back(next);
+        }
+      }
+    }
+    return false;
+  }
+
+  /**
+   * Writes a way of a bucket and mirrors it.
+   */
+  void store(size_t b, int w, const struct bucket_way& row, uint16_t fp) {
+    open_row(&buckets_[b]);
+    buckets_[b].d.way[w] = row;
+    buckets_[b].d.fp[w] = fp;
+    buckets_[b].d.used |= 1<<w;
+    seal(b);
+    mirror(b,w);
+  }
+
+}; // end class BucketDHT
+
+template<class K, class V>
+class BucketDHTClient {
+private:
+  typedef typename BucketDHT<K,V>::dht_block dht_block;
+  typedef typename BucketDHT<K,V>::dht_data dht_data;
+  typedef typename BucketDHT<K,V>::bucket_way bucket_way;
+
+  void* dht_;
+  size_t dht_size_;
+
+  Integrity64 crc;
+
+public:
+  BucketDHTClient(void* dht, size_t dht_size) {
+    dht_ = dht;
+    dht_size_ = dht_size;
+  }
+
+  /**
+   * A whole bucket, fetched with one read.
+   */
+  static size_t slot_size() {
+    return sizeof(dht_block);
+  }
+
+  key_hash hash_key(K key, size_t key_len) {
+    return crc.hash128(key,key_len);
+  }
+
+  int server_for_key(int server_count, const key_hash& h) {
+    return Integrity64::reduce(Integrity64::server_hash(h),server_count);
+  }
+
+  int server_for_key(int server_count, K key, size_t key_len) {
+    return server_for_key(server_count,hash_key(key,key_len));
+  }
+
+  uint64_t check_crc(void* mem, size_t len) {
+    return crc.crc((char*)mem,len);
+  }
+
+  /**
+   * The extents of way w, and the span of them to fetch; see DHTClient.
+   */
+  static inline uintptr_t ext_addr(const dht_block* block, int w) {
+    return (uintptr_t)block->d.way[w].ext;
+  }
+  static inline uintptr_t ext_fetch_addr(const dht_block* block, int w) {
+    return (uintptr_t)block->d.way[w].ext-EXT_HEAD_SIZE;
+  }
+  static inline size_t ext_fetch_len(const dht_block* block, int w) {
+    return block->d.way[w].ext_capacity+EXT_HEAD_SIZE;
+  }
+  static inline size_t val_len(const dht_block* block, int w) {
+    return block->d.way[w].val_len;
+  }
+
+  void* pre_get(const key_hash& h, int hash_idx) {
+    size_t offset = Integrity64::reduce(Integrity64::probe(h,hash_idx),dht_size_);
+    return (void*)(((char*)dht_) + offset*sizeof(dht_block));
+  }
+
+  void* pre_get(K key, size_t key_len, int hash_idx) {
+    return pre_get(hash_key(key,key_len),hash_idx);
+  }
+
+  /**
+   * Checks a fetched bucket and looks for the next way, from way on,
+   * whose fingerprint matches the key's. Returns POST_GET_SPILLED with
+   * way set to it, whose extents must be read to confirm the key,
+   * POST_GET_MISSING if there is none, or POST_GET_LOCKED.
+   */
+  inline int post_get(const dht_block* block, const key_hash& h, int& way, bool skip_crc = false) {
+#if DHT_CONSISTENCY==CONSISTENCY_SEQLOCK
+    if (!skip_crc && block->guard != block->version)
+#else
+    if (!skip_crc && block->guard != crc.crc((char*)&(block->d),sizeof(dht_data)))
+#endif
+      return POST_GET_LOCKED;
+
+    uint16_t fp = Integrity64::fingerprint(h);
+    for(; way < BUCKET_WAYS; way++) {
+      if ((block->d.used & (1<<way)) && block->d.fp[way] == fp)
+        return POST_GET_SPILLED;
+    }
+    return POST_GET_MISSING;
+  }
+
+  /**
+   * Checks the key+value of way w, fetched into ext, for a bucket
+   * that post_get() pointed at it.
+   */
+  inline int post_get_extents(const dht_block* block, int w, const char* ext, K key, size_t key_len, bool skip_crc = false) {
+    const bucket_way* way = &block->d.way[w];
+#if DHT_CONSISTENCY==CONSISTENCY_SEQLOCK
+    if (!skip_crc && !ext_stamped(ext,way->key_len+way->val_len,way->ext_crc))
+#else
+    if (!skip_crc && way->ext_crc != crc.crc(ext,way->key_len+way->val_len))
+#endif
+      return POST_GET_LOCKED;
+    if (!binarycmp(key,key_len,ext,way->key_len))
+      return POST_GET_COLLISION;
+    return POST_GET_FOUND;
+  }
+
+};
+
+#endif // DHT_BUCKET_H
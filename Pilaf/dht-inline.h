@@ -0,0 +1,941 @@
+/***********************************************
+ *                                             *
+ * -__ /\\     ,,         /\\                  *
+ *   ||  \\  ' ||   _    ||                    *
+ *  /||__|| \\ ||  < \, =||=                   *
+ *  \||__|| || ||  /-||  ||                    *
+ *   ||  |, || || (( ||  ||                    *
+ * _-||-_/  \\ \\  \/\\  \\,                   *
+ *   ||                                        *
+ *                                             *
+ *   Pilaf Infiniband DHT                      *
+ *   (c) 2012-2013 Christopher Mitchell et al. *
+ *   New York University, Courant Institute    *
+ *   Networking and Wide-Area Systems Group    *
+ *   All rights reserved.                      *
+ *                                             *
+ *   dht-inline.h: Cuckoo table shard with     *
+ *          cache-line slots that hold small   *
+ *          keys and values inline.            *
+ *                                             *
+ ***********************************************/
+
+#ifndef DHT_INLINE_H
+#define DHT_INLINE_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+#include <utility>
+#include "dht.h"
+
+#define INLINE_SLOT_SIZE 64       // one cache line; raise in multiples of 64
+#if DHT_CONSISTENCY==CONSISTENCY_SEQLOCK
+#define INLINE_SLOT_HEADER 40     // as below, plus the head version
+#else
+#define INLINE_SLOT_HEADER 36     // sizeof(inline_slot_data) minus inline bytes, plus guard
+#endif
+#define INLINE_DATA_SIZE (INLINE_SLOT_SIZE-INLINE_SLOT_HEADER)
+
+// inline_slot_data.flags
+#define SLOT_IN_USE     0x01
+#define SLOT_KEY_INLINE 0x02      // key is in inline_data
+#define SLOT_VAL_INLINE 0x04      // value follows the key in inline_data
+#define SLOT_HASH_SHIFT 4         // hash index in the upper nibble
+
+/**
+ * Allocator for std::vector that honors alignments larger than
+ * the platform's default, so slots never straddle cache lines.
+ */
+template<class T, size_t Align>
+struct aligned_allocator {
+  typedef T value_type;
+  template<class U> struct rebind { typedef aligned_allocator<U,Align> other; };
+
+  aligned_allocator() {}
+  template<class U> aligned_allocator(const aligned_allocator<U,Align>&) {}
+
+  T* allocate(size_t n) {
+    void* p;
+    if (posix_memalign(&p, Align, n*sizeof(T)))
+      throw std::bad_alloc();
+    return (T*)p;
+  }
+  void deallocate(T* p, size_t) { free(p); }
+
+  template<class U> bool operator==(const aligned_allocator<U,Align>&) const { return true; }
+  template<class U> bool operator!=(const aligned_allocator<U,Align>&) const { return false; }
+};
+
+/**
+ * Alternative to DHT whose slots are exactly one cache line. Keys and
+ * values that fit in INLINE_DATA_SIZE live in the slot itself, so a
+ * client hit completes with a single RDMA read. Larger pairs spill
+ * into the extents pool exactly like DHT (key then value), and the key
+ * is still kept inline when it fits so collisions are detected without
+ * touching the extents.
+ */
+template<class K, class V>
+class InlineDHT {
+
+public:
+  struct __attribute__ ((__packed__)) dht_data {
+    char* ext;                    // spilled key+value, NULL if all inline
+    uint64_t ext_crc;             // CRC of the spilled key+value, or their version
+    uint32_t val_len;
+    uint32_t ext_capacity;
+    uint16_t key_len;
+    uint8_t flags;
+    uint8_t reserved;
+    char inline_data[INLINE_DATA_SIZE];
+  };
+  struct __attribute__ ((aligned(INLINE_SLOT_SIZE))) dht_block {
+#if DHT_CONSISTENCY==CONSISTENCY_SEQLOCK
+    uint32_t version;             // head copy of guard
+#endif
+    struct dht_data d;
+    uint64_t guard;               // checksum of d, or the slot's version
+  };
+
+  typedef std::vector<dht_block, aligned_allocator<dht_block,INLINE_SLOT_SIZE> > slot_vector;
+
+  static_assert(sizeof(dht_block) == INLINE_SLOT_SIZE, "slot must fill its cache lines exactly");
+
+  // DHT
+  slot_vector buckets_;
+
+  // DHT Extents, for spilled pairs; regions as in DHT
+  void* memregion;
+  std::vector<size_t> ext_regions_;
+  size_t ext_size_;
+
+  // DHT shard attributes
+  size_t size_;     //current capacity
+  size_t entries_;  //filled  capacity
+
+private:
+  Integrity64 crc;
+  uint64_t version_;        // last seqlock version handed out
+
+  struct dht_block blankrow;
+
+  SlabMalloc pool;
+
+  int (*pre_resize_hook) (size_t, slot_vector*, void*);
+  void* pre_resize_context;
+  int (*post_resize_hook)(size_t, slot_vector*, void*);
+  void* post_resize_context;
+  int (*extents_hook)(int, void*, size_t, void*);
+  void* extents_context;
+  int (*retire_hook)(size_t, slot_vector*, void*);
+  void* retire_context;
+
+  // Incremental resize, as in DHT: next_ is built in the background
+  // from buckets_, then takes over, and the old table is kept in
+  // retired_ until retire() is called. Both mirror every write.
+  slot_vector next_;
+  size_t next_size_;
+  size_t next_entries_;
+  size_t migrate_pos_;
+  bool migrating_;
+
+  slot_vector retired_;
+  size_t retired_size_;
+  size_t retired_entries_;
+  bool retiring_;
+
+  bool shadow_;             // next_ or retired_ is swapped into buckets_
+
+  // Bulk loading, as in DHT: guards of live slots written between
+  // begin_bulk() and commit_bulk() are computed once at commit
+  std::vector<size_t> dirty_;
+  bool bulk_;
+
+public:
+  InlineDHT() {
+    size_ = 0;
+    entries_ = 0;
+    buckets_.clear();
+
+    next_size_ = next_entries_ = migrate_pos_ = 0;
+    retired_size_ = retired_entries_ = 0;
+    migrating_ = retiring_ = shadow_ = false;
+    bulk_ = false;
+    version_ = 0;
+
+    pre_resize_hook = NULL;
+    pre_resize_context = NULL;
+    post_resize_hook = NULL;
+    post_resize_context = NULL;
+    extents_hook = NULL;
+    extents_context = NULL;
+    retire_hook = NULL;
+    retire_context = NULL;
+
+    memregion = extents_reserve();
+    if (NULL == memregion) {
+      fprintf(stderr,"Failed to reserve address space for extents");
+      exit(-1);
+    }
+    ext_size_ = 0;
+    add_extents_region(INIT_EXTENTS_SIZE);
+
+    memset(&blankrow,0,sizeof(struct dht_block));
+    fix_guard(&blankrow);
+
+    resize(INIT_KV_CAPACITY);
+  }
+
+  ~InlineDHT() {
+    munmap(memregion,(size_t)EXTENTS_MAX_REGIONS<<EXTENTS_REGION_SHIFT);
+  }
+
+  /**
+   * Returns the number of slots this table shard contains
+   */
+  size_t buckets() {
+    return size_;
+  }
+
+  /**
+   * Accessors for a slot's key and value, wherever they live.
+   */
+  static inline const char* slot_key(const struct dht_block* block) {
+    return (block->d.flags & SLOT_KEY_INLINE) ? block->d.inline_data : block->d.ext;
+  }
+  static inline const char* slot_value(const struct dht_block* block) {
+    return (block->d.flags & SLOT_VAL_INLINE) ? block->d.inline_data+block->d.key_len
+                                              : block->d.ext+block->d.key_len;
+  }
+  static inline int slot_hash(const struct dht_block* block) {
+    return block->d.flags >> SLOT_HASH_SHIFT;
+  }
+
+  /**
+   * Pretends to resize the DHT to trigger any resize hooks.
+   */
+  void resize(void) {
+    if (pre_resize_hook) pre_resize_hook(size_, &buckets_, pre_resize_context);
+    if (post_resize_hook) post_resize_hook(size_, &buckets_, post_resize_context);
+  }
+
+  /**
+   * Resizes the table, synchronously. Slots are moved whole, so
+   * spilled pairs keep their extents.
+   */
+  void resize(size_t capacity) {
+    assert(capacity >= size_);
+    finish_resize();
+    if (capacity <= size_)
+      return;
+
+    begin_resize(capacity);
+    finish_resize();
+  }
+
+  /**
+   * Starts growing the table to capacity in the background; see
+   * DHT::begin_resize().
+   */
+  void begin_resize(size_t capacity) {
+    if (migrating_ || capacity <= size_)
+      return;
+    retire();
+
+    printf("Resizing DHT from %lu to %lu entries.\n",size_,capacity);
+
+    next_.assign(capacity,blankrow);
+    next_size_ = capacity;
+    next_entries_ = 0;
+    migrate_pos_ = 0;
+    migrating_ = true;
+  }
+
+  /**
+   * Copies up to rows slots into the table being built, and switches
+   * over once all are copied. Returns whether the resize is still
+   * under way.
+   */
+  bool migrate_step(size_t rows) {
+    if (!migrating_)
+      return false;
+
+    size_t end = (rows < size_-migrate_pos_)?migrate_pos_+rows:size_;
+    for(; migrate_pos_ < end; migrate_pos_++) {
+      if (buckets_[migrate_pos_].d.flags & SLOT_IN_USE)
+        mirror(buckets_[migrate_pos_]);
+    }
+
+    if (migrate_pos_ == size_)
+      flip();
+    return migrating_;
+  }
+
+  void finish_resize(void) {
+    while (migrating_)
+      migrate_step(size_);
+  }
+
+  bool migrating(void) {
+    return migrating_;
+  }
+
+  bool retiring(void) {
+    return retiring_;
+  }
+
+  /**
+   * Frees the table replaced by the last resize, after the retire hook.
+   */
+  void retire(void) {
+    if (!retiring_)
+      return;
+    retiring_ = false;
+
+    if (retire_hook) retire_hook(retired_size_, &retired_, retire_context);
+    slot_vector().swap(retired_);
+  }
+
+  /**
+   * Pre-sizes the table for entries pairs with kv_bytes of keys and
+   * values between them; see DHT::reserve(). Extents are only
+   * reserved if the average pair is too large to be stored inline.
+   */
+  void reserve(size_t entries, size_t kv_bytes) {
+    size_t capacity = 1+(size_t)(entries/kLoadFactor);
+    if (capacity > size_)
+      resize(capacity);
+
+    if (entries == 0 || kv_bytes/entries <= INLINE_DATA_SIZE)
+      return;
+    size_t ext = pool.footprint(entries,kv_bytes);
+    if (ext > ext_size_)
+      resize_extents(ext);
+  }
+
+  /**
+   * Grows the table now, if need be, so that more pairs can be
+   * inserted without a resize starting part-way through them.
+   * Grows at least twice as large, as a resize would.
+   */
+  void make_room(size_t more) {
+    finish_resize();
+    if (entries_+more <= kLoadFactor*size_)
+      return;
+
+    size_t capacity = 1+(size_t)((entries_+more)/kLoadFactor);
+    resize((capacity > 1+2*size_)?capacity:1+2*size_);
+  }
+
+  /**
+   * Starts a batch of writes whose slot guards are computed once, by
+   * commit_bulk(). Until then, clients see those slots as locked.
+   */
+  void begin_bulk(void) {
+    bulk_ = true;
+  }
+
+  void commit_bulk(void) {
+    seal_dirty();
+    bulk_ = false;
+  }
+
+  /**
+   * Grows the extents to at least capacity bytes by adding regions;
+   * spilled pairs never move.
+   */
+  void resize_extents(size_t capacity) {
+    while (ext_size_ < capacity) {
+      size_t size = capacity-ext_size_;
+      if (size > ((size_t)1<<EXTENTS_REGION_SHIFT))
+        size = (size_t)1<<EXTENTS_REGION_SHIFT;
+
+      printf("Adding DHT extents region %zu of %zu bytes.\n",ext_regions_.size(),size);
+
+      int region = add_extents_region(size);
+      if (extents_hook)
+        extents_hook(region, extents_region_base(memregion,region), ext_regions_[region], extents_context);
+    }
+  }
+
+  int add_extents_region(size_t size) {
+    int region = ext_regions_.size();
+    char* base = extents_region_base(memregion,region);
+    size = (size+SLAB_PAGE_SIZE-1)/SLAB_PAGE_SIZE*SLAB_PAGE_SIZE;
+
+    if (region == EXTENTS_MAX_REGIONS || mprotect(base,size,PROT_READ|PROT_WRITE)) {
+      fprintf(stderr,"Failed to add extents region %d of %zu bytes",region,size);
+      exit(-1);
+    }
+    pool.add_region(base,size);
+    ext_regions_.push_back(size);
+    ext_size_ += size;
+    return region;
+  }
+
+  /**
+   * Insert a k,v pair into the table, or update it if it exists.
+   */
+  void insert(const K& key, size_t key_len, V value, size_t val_len, uint64_t crc_ = 0, bool have_crc = false) {
+    update(key,key_len,value,val_len,crc_,have_crc);
+  }
+
+  /**
+   * Stores a k,v pair. Pairs that fit are written inline; otherwise
+   * the slot's extents are reused if large enough, or replaced. The
+   * client-supplied crc covers key+value, which is exactly what a
+   * spilled pair stores. A background resize starts once the table is
+   * kLoadFactor full.
+   */
+  void update(const K& key, size_t key_len, V value, size_t val_len, uint64_t crc_ = 0, bool have_crc = false) {
+    key_hash h = crc.hash128(key,key_len);
+    size_t index = find(h,key,key_len);
+
+    if (index != BUCKET_NOT_FOUND) {
+      open_row(&buckets_[index]);
+      fill(&buckets_[index],key,key_len,value,val_len,crc_,have_crc);
+      seal(index);
+      mirror(buckets_[index]);
+      _write_barrier();
+      return;
+    }
+
+    struct dht_block row = blankrow;
+    fill(&row,key,key_len,value,val_len,crc_,have_crc);
+    while (!place(h,row))
+      grow();
+    _write_barrier();
+
+    if (!migrating_ && !retiring_ && entries_ > kLoadFactor*size_)
+      begin_resize(1+2*size_);
+  }
+
+  /**
+   * Removes a k,v pair if it exists, freeing any extents.
+   */
+  void remove(const K& key, size_t key_len) {
+    size_t index = find(key,key_len);
+    if (index == BUCKET_NOT_FOUND)
+      return;
+
+    unmirror(key,key_len);
+    open_row(&buckets_[index]);
+    release_extents(&buckets_[index]);
+    buckets_[index].d.flags &= ~SLOT_IN_USE;
+    fix_guard(&buckets_[index]);
+    entries_--;
+  }
+
+  /**
+   * Returns 1 for existing keys, 0 otherwise.
+   */
+  bool contains(const K& key, size_t key_len) {
+    return find(key,key_len) != BUCKET_NOT_FOUND;
+  }
+
+  /**
+   * Local lookup, used for server-mediated reads. The value points
+   * into the table and is only valid until the next write.
+   */
+  bool get(const K& key, size_t key_len, const char*& value, size_t& val_len) {
+    size_t index = find(key,key_len);
+    if (index == BUCKET_NOT_FOUND)
+      return false;
+    value = slot_value(&buckets_[index]);
+    val_len = buckets_[index].d.val_len;
+    return true;
+  }
+
+  /**
+   * Returns the slot holding key, or BUCKET_NOT_FOUND.
+   */
+  size_t find(const K& key, size_t key_len) {
+    return find(crc.hash128(key,key_len),key,key_len);
+  }
+
+  size_t find(const key_hash& h, const K& key, size_t key_len) {
+    for(int i=0; i < CUCKOO_D; i++) {
+      size_t index = bucket_idx(h,i);
+      struct dht_block* b = &buckets_[index];
+      if ((b->d.flags & SLOT_IN_USE) &&
+          binarycmp(slot_key(b),b->d.key_len,key,key_len))
+        return index;
+    }
+    return BUCKET_NOT_FOUND;
+  }
+
+  /**
+   * Starts a write to a slot clients may be reading; see
+   * DHT::open_row().
+   */
+  inline void open_row(struct dht_block* block) {
+#if DHT_CONSISTENCY==CONSISTENCY_SEQLOCK
+    block->guard = (uint32_t)++version_;
+    _write_barrier();
+#endif
+  }
+
+  /**
+   * Updates the CRC attached to a row for self-validation
+   */
+  inline void fix_guard(struct dht_block* block) {
+#if DHT_CONSISTENCY==CONSISTENCY_SEQLOCK
+    _write_barrier();
+    block->version = (uint32_t)block->guard;
+#else
+    block->guard = crc.crc((char*)&(block->d),sizeof(struct dht_data));
+#endif
+  }
+
+  /**
+   * Overwrites a slot's contents with another's, leaving its guard
+   * to the caller.
+   */
+  inline void copy_row(struct dht_block* dst, const struct dht_block& src) {
+    open_row(dst);
+    dst->d = src.d;
+  }
+
+  /**
+   * Returns a bucket index for a given key's hash.
+   * Disregards whether the key is actually there.
+   */
+  inline size_t bucket_idx(const key_hash& h, int hash = 0) {
+    return Integrity64::reduce(Integrity64::probe(h,hash),size_);
+  }
+
+  void set_resize_hooks(int(*pre_hook)(size_t, slot_vector*, void*), void* pre_context,
+                        int(*post_hook)(size_t, slot_vector*, void*), void* post_context) {
+    pre_resize_hook = pre_hook;
+    pre_resize_context  = pre_context;
+    post_resize_hook = post_hook;
+    post_resize_context = post_context;
+  }
+
+  void set_extents_hook(int(*hook)(int, void*, size_t, void*), void* context) {
+    extents_hook = hook;
+    extents_context = context;
+  }
+
+  void set_retire_hook(int(*hook)(size_t, slot_vector*, void*), void* context) {
+    retire_hook = hook;
+    retire_context = context;
+  }
+
+  /**
+   * Prints the extents allocator's counters and size classes.
+   */
+  void dump_extents(FILE* out) const {
+    pool.dump(out);
+  }
+
+  void dump_table(void) {
+    printf("Slot     \tHx\tIn\tKey\n");
+    for(size_t i=0; i<size_; i++) {
+      struct dht_block* b = &buckets_[i];
+      if (b->d.flags & SLOT_IN_USE) {
+        printf("%9zu\t%2d\t%c%c\t%.*s\n",i,slot_hash(b),
+               (b->d.flags & SLOT_KEY_INLINE)?'k':'-',(b->d.flags & SLOT_VAL_INLINE)?'v':'-',
+               (int)b->d.key_len,slot_key(b));
+      } else {
+        printf("%9zu\t [EMPTY] -----------------------\n",i);
+      }
+    }
+  }
+
+private:
+  // When loading gets beyond this fraction, resize
+  static constexpr double kLoadFactor = 0.75;
+
+  void grow(void) {
+    if (migrating_)
+      finish_resize();
+    else
+      resize(1+2*size_);
+  }
+
+  void flip(void) {
+    seal_dirty();
+
+    if (pre_resize_hook) pre_resize_hook(size_, &buckets_, pre_resize_context);
+
+    retired_.swap(buckets_);
+    buckets_.swap(next_);
+    retired_size_ = size_;
+    retired_entries_ = entries_;
+    size_ = next_size_;
+    entries_ = next_entries_;
+    migrating_ = false;
+    retiring_ = true;
+
+    if (post_resize_hook) post_resize_hook(size_, &buckets_, post_resize_context);
+
+    if (!retire_hook)
+      retire();
+  }
+
+  /**
+   * Guards a live slot just written, or leaves it for commit_bulk().
+   */
+  inline void seal(size_t b) {
+    if (bulk_ && !shadow_)
+      dirty_.push_back(b);
+    else
+      fix_guard(&buckets_[b]);
+  }
+
+  void seal_dirty(void) {
+    std::sort(dirty_.begin(),dirty_.end());
+    dirty_.erase(std::unique(dirty_.begin(),dirty_.end()),dirty_.end());
+    for(size_t i = 0; i < dirty_.size(); i++)
+      fix_guard(&buckets_[dirty_[i]]);
+    dirty_.clear();
+    _write_barrier();
+  }
+
+  void swap_table(slot_vector& table, size_t& size, size_t& entries) {
+    buckets_.swap(table);
+    std::swap(size_,size);
+    std::swap(entries_,entries);
+    shadow_ = !shadow_;
+  }
+
+  /**
+   * Copies a slot just written to the live table into the table being
+   * built, and into the retired one if it already holds the key.
+   */
+  void mirror(const struct dht_block& live) {
+    if (shadow_ || !(migrating_ || retiring_))
+      return;
+
+    struct dht_block row = live;
+    if (migrating_) {
+      while (!mirror_into(next_,next_size_,next_entries_,row,true))
+        grow_next();
+    }
+    if (retiring_)
+      mirror_into(retired_,retired_size_,retired_entries_,row,false);
+  }
+
+  bool mirror_into(slot_vector& table, size_t& size, size_t& entries, const struct dht_block& row, bool add) {
+    bool placed = true;
+
+    swap_table(table,size,entries);
+    key_hash h = crc.hash128(slot_key(&row),row.d.key_len);
+    size_t index = find(h,(K)slot_key(&row),row.d.key_len);
+    if (index != BUCKET_NOT_FOUND) {
+      int hash = slot_hash(&buckets_[index]);
+      copy_row(&buckets_[index],row);
+      set_hash(&buckets_[index],hash);
+      fix_guard(&buckets_[index]);
+    } else if (add) {
+      placed = place(h,row);
+    }
+    swap_table(table,size,entries);
+    return placed;
+  }
+
+  void unmirror(const K& key, size_t key_len) {
+    if (migrating_)
+      unmirror_from(next_,next_size_,next_entries_,key,key_len);
+    if (retiring_)
+      unmirror_from(retired_,retired_size_,retired_entries_,key,key_len);
+  }
+
+  void unmirror_from(slot_vector& table, size_t& size, size_t& entries, const K& key, size_t key_len) {
+    swap_table(table,size,entries);
+    size_t index = find(key,key_len);
+    if (index != BUCKET_NOT_FOUND) {
+      open_row(&buckets_[index]);
+      buckets_[index].d.flags &= ~SLOT_IN_USE;
+      fix_guard(&buckets_[index]);
+      entries_--;
+    }
+    swap_table(table,size,entries);
+  }
+
+  /**
+   * Rebuilds the table being built twice as large when it runs out of
+   * cuckoo paths.
+   */
+  void grow_next(void) {
+    slot_vector old_b;
+    old_b.swap(next_);
+    next_size_ = 1+2*next_size_;
+    next_.assign(next_size_,blankrow);
+    next_entries_ = 0;
+
+    for(size_t i = 0; i < old_b.size(); i++) {
+      if (old_b[i].d.flags & SLOT_IN_USE) {
+        while (!mirror_into(next_,next_size_,next_entries_,old_b[i],true))
+          grow_next();
+      }
+    }
+  }
+
+  /**
+   * Writes key and value into a slot (not its guard), inline if they
+   * fit, otherwise into extents.
+   */
+  void fill(struct dht_block* block, const char* key, size_t key_len, const char* value, size_t val_len,
+            uint64_t crc_, bool have_crc) {
+    uint8_t flags = (block->d.flags & ~(SLOT_KEY_INLINE|SLOT_VAL_INLINE)) | SLOT_IN_USE;
+
+    if (key_len+val_len <= INLINE_DATA_SIZE) {
+      release_extents(block);
+      memcpy(block->d.inline_data,key,key_len);
+      memcpy(block->d.inline_data+key_len,value,val_len);
+      block->d.ext_crc = 0;
+      flags |= SLOT_KEY_INLINE|SLOT_VAL_INLINE;
+    } else {
+      if (block->d.ext && block->d.ext_capacity < ext_footprint(key_len+val_len)-EXT_HEAD_SIZE)
+        release_extents(block);
+      if (!block->d.ext)
+        reserve_extents(block,key_len,val_len);
+#if DHT_CONSISTENCY==CONSISTENCY_SEQLOCK
+      else  // rewritten in place; readers of the old pair must fail
+        ext_stamp(block->d.ext,block->d.key_len+block->d.val_len,++version_);
+#endif
+      memcpy(block->d.ext,key,key_len);
+      memcpy(block->d.ext+key_len,value,val_len);
+#if DHT_CONSISTENCY==CONSISTENCY_SEQLOCK
+      block->d.ext_crc = ++version_;
+      ext_stamp(block->d.ext,key_len+val_len,block->d.ext_crc);
+#else
+      block->d.ext_crc = have_crc ? crc_ : crc.crc(block->d.ext,key_len+val_len);
+#endif
+      if (key_len <= INLINE_DATA_SIZE) {
+        memcpy(block->d.inline_data,key,key_len);
+        flags |= SLOT_KEY_INLINE;
+      }
+    }
+
+    block->d.key_len = key_len;
+    block->d.val_len = val_len;
+    block->d.flags = flags;
+  }
+
+  void reserve_extents(struct dht_block* block, size_t key_len, size_t val_len) {
+    size_t need = ext_footprint(key_len+val_len);
+    size_t extsize = pool.chunk_size(need)-EXT_HEAD_SIZE;
+    char* chunk = (char*)pool.alloc(need);
+
+    while (chunk == NULL) {  //out of memory
+      size_t more = (ext_size_ > (1024L*1024L*1024L))?ext_size_/4:ext_size_;
+      resize_extents(ext_size_+std::max(more,need+SLAB_PAGE_SIZE));
+      chunk = (char*)pool.alloc(need);
+    }
+    block->d.ext = chunk+EXT_HEAD_SIZE;
+    block->d.ext_capacity = extsize;
+  }
+
+  void release_extents(struct dht_block* block) {
+    if (!block->d.ext)
+      return;
+#if DHT_CONSISTENCY==CONSISTENCY_SEQLOCK
+    ext_stamp(block->d.ext,block->d.key_len+block->d.val_len,++version_);
+#else
+    block->d.ext[0]++;  //make the CRC wrong for readers in flight
+#endif
+    pool.release(block->d.ext-EXT_HEAD_SIZE);
+    block->d.ext = NULL;
+    block->d.ext_capacity = 0;
+  }
+
+  /**
+   * Cuckoo placement of a filled slot. As in DHT, the path of
+   * displacements is found first and then shifted backwards, so every
+   * resident pair stays readable throughout. Returns false if no path
+   * was found within MAX_INSERT_CYCLES.
+   */
+  bool place(const key_hash& h, const struct dht_block& row) {
+    size_t hv[CUCKOO_D];
+
+    for(int i=0; i < CUCKOO_D; i++) {
+      hv[i] = bucket_idx(h,i);
+      if (!(buckets_[hv[i]].d.flags & SLOT_IN_USE)) {
+        store(hv[i],row,i);
+        mirror(buckets_[hv[i]]);
+        return true;
+      }
+    }
+
+    std::vector<size_t> path;     // slots whose occupant moves one step
+    std::vector<uint8_t> hashes;  // hash index each occupant moves to
+    size_t cur = hv[0];
+    size_t target = BUCKET_NOT_FOUND;
+
+    for(int cycles = 0; cycles < MAX_INSERT_CYCLES && target == BUCKET_NOT_FOUND; cycles++) {
+      const struct dht_block* b = &buckets_[cur];
+      int hp = slot_hash(b);
+      size_t next = BUCKET_NOT_FOUND;
+      int next_hash = 0;
+      key_hash bh = crc.hash128(slot_key(b),b->d.key_len);
+
+      for(int j = 1; j < CUCKOO_D; j++) {
+        int n = (hp+j) % CUCKOO_D;
+        size_t idx = bucket_idx(bh,n);
+        if (!(buckets_[idx].d.flags & SLOT_IN_USE)) {
+          target = idx;
+          next_hash = n;
+          break;
+        }
+        if (next == BUCKET_NOT_FOUND) {
+          next = idx;
+          next_hash = n;
+        }
+      }
+
+      path.push_back(cur);
+      hashes.push_back(next_hash);
+      if (target != BUCKET_NOT_FOUND)
+        break;
+
+      // Walked back into our own path
+      for(size_t p = 0; p < path.size(); p++)
+        if (path[p] == next)
+          return false;
+      cur = next;
+    }
+
+    if (target == BUCKET_NOT_FOUND)
+      return false;
+
+    for(int i = path.size()-1; i >= 0; i--) {
+      copy_row(&buckets_[target],buckets_[path[i]]);
+      set_hash(&buckets_[target],hashes[i]);
+      seal(target);
+      mirror(buckets_[target]);
+      target = path[i];
+    }
+    store(hv[0],row,0);
+    mirror(buckets_[hv[0]]);
+    return true;
+  }
+
+  void store(size_t b, const struct dht_block& row, int hash) {
+    copy_row(&buckets_[b],row);
+    set_hash(&buckets_[b],hash);
+    seal(b);
+    entries_++;
+  }
+
+  static inline void set_hash(struct dht_block* block, int hash) {
+    block->d.flags = (block->d.flags & ((1<<SLOT_HASH_SHIFT)-1)) | (hash << SLOT_HASH_SHIFT);
+  }
+
+}; // end class InlineDHT
+
+template<class K, class V>
+class InlineDHTClient {
+private:
+  typedef typename InlineDHT<K,V>::dht_block dht_block;
+  typedef typename InlineDHT<K,V>::dht_data dht_data;
+
+  void* dht_;
+  size_t dht_size_;
+
+  Integrity64 crc;
+
+public:
+  InlineDHTClient(void* dht, size_t dht_size) {
+    dht_ = dht;
+    dht_size_ = dht_size;
+  }
+
+  static size_t slot_size() {
+    return sizeof(dht_block);
+  }
+
+  key_hash hash_key(K key, size_t key_len) {
+    return crc.hash128(key,key_len);
+  }
+
+  int server_for_key(int server_count, const key_hash& h) {
+    return Integrity64::reduce(Integrity64::server_hash(h),server_count);
+  }
+
+  int server_for_key(int server_count, K key, size_t key_len) {
+    return server_for_key(server_count,hash_key(key,key_len));
+  }
+
+  uint64_t check_crc(void* mem, size_t len) {
+    return crc.crc((char*)mem,len);
+  }
+
+  /**
+   * The span of a slot's extents to fetch; see DHTClient.
+   */
+  static inline uintptr_t ext_fetch_addr(const dht_block* block) {
+    return (uintptr_t)block->d.ext-EXT_HEAD_SIZE;
+  }
+  static inline size_t ext_fetch_len(const dht_block* block) {
+    return block->d.ext_capacity+EXT_HEAD_SIZE;
+  }
+
+  void* pre_get(const key_hash& h, int hash_idx) {
+    size_t offset = Integrity64::reduce(Integrity64::probe(h,hash_idx),dht_size_);
+    return (void*)(((char*)dht_) + offset*sizeof(dht_block));
+  }
+
+  void* pre_get(K key, size_t key_len, int hash_idx) {
+    return pre_get(hash_key(key,key_len),hash_idx);
+  }
+
+  /**
+   * Checks a fetched slot. Returns POST_GET_FOUND when the pair is
+   * entirely inline, POST_GET_SPILLED when the value (and possibly the
+   * key) must still be read from extents, or the usual LOCKED, MISSING
+   * and COLLISION states.
+   */
+  inline int post_get(const dht_block* block, K key, size_t key_len, bool skip_crc = false) {
+#if DHT_CONSISTENCY==CONSISTENCY_SEQLOCK
+    if (!skip_crc && block->guard != block->version)
+#else
+    if (!skip_crc && block->guard != crc.crc((char*)&(block->d),sizeof(dht_data)))
+#endif
+      return POST_GET_LOCKED;
+
+    if (!(block->d.flags & SLOT_IN_USE))
+      return POST_GET_MISSING;
+
+    if (block->d.flags & SLOT_KEY_INLINE) {
+      if (!binarycmp(key,key_len,block->d.inline_data,block->d.key_len))
+        return POST_GET_COLLISION;
+      if (block->d.flags & SLOT_VAL_INLINE)
+        return POST_GET_FOUND;
+    }
+    return POST_GET_SPILLED;
+  }
+
+  /**
+   * Checks the spilled key+value fetched into ext for a slot that
+   * post_get() reported as POST_GET_SPILLED.
+   */
+  inline int post_get_extents(const dht_block* block, const char* ext, K key, size_t key_len, bool skip_crc = false) {
+#if DHT_CONSISTENCY==CONSISTENCY_SEQLOCK
+    if (!skip_crc && !ext_stamped(ext,block->d.key_len+block->d.val_len,block->d.ext_crc))
+#else
+    if (!skip_crc && block->d.ext_crc != crc.crc(ext,block->d.key_len+block->d.val_len))
+#endif
+      return POST_GET_LOCKED;
+    if (!binarycmp(key,key_len,ext,block->d.key_len))
+      return POST_GET_COLLISION;
+    return POST_GET_FOUND;
+  }
+
+  /**
+   * Whether a slot accepted by post_get() needs no further read to
+   * answer contains().
+   */
+  static inline bool key_inline(const dht_block* block) {
+    return block->d.flags & SLOT_KEY_INLINE;
+  }
+
+  static inline const char* inline_value(const dht_block* block) {
+    return block->d.inline_data+block->d.key_len;
+  }
+
+};
+
+#endif // DHT_INLINE_H
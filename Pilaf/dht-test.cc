@@ -76,6 +76,7 @@ static struct option long_options[] = {
   {"randomize", no_argument,     0,  'r' },
   {"presize", no_argument,       0,  'P' },
   {"thru",    no_argument,       0,  'T' },
+  {"workers", required_argument, 0,  'w' },
   {0,         0,                 0,  0   }
 };
 
@@ -92,13 +93,14 @@ int main(int argc, char **argv) {
   bool randomize = false;
   bool thru = false;
   size_t presize = 0;
+  int workers = 1;
 
   int c;
   while (1) {
     int this_option_optind = optind ? optind : 1;
     int option_index = 0;
 
-    c = getopt_long(argc, argv, "c:s:t:l:vqTP:r",
+    c = getopt_long(argc, argv, "c:s:t:l:vqTP:rw:",
                     long_options, &option_index);
     if (c == -1)
       break;
@@ -150,6 +152,10 @@ int main(int argc, char **argv) {
         presize = (size_t)strtoul(optarg,NULL,0);
         break;
 
+      case 'w':
+        workers = atoi(optarg);
+        break;
+
       default:
         printf("Invalid argument (%c)\n",c);
 
@@ -167,14 +173,16 @@ int main(int argc, char **argv) {
 
     s->setup();
     s->verbosity((ibman_verb)verb);
+    s->set_workers(workers);
 
     if (logfile != NULL) {
       s->set_logging(true,logfile);
     }
 
-    size_t keys = 4 * 1024 * 1024;
-    s->dht.resize(keys * 2 + 1);
-    s->dht.resize_extents(keys * 40);
+    // Pre-size for the workload, so loading it never resizes
+    size_t keys = presize ? presize : 4 * 1024 * 1024;
+    size_t pair_len = (test[0] == 'L') ? 64 + 1024 : 8 + 64;
+    s->reserve(keys, keys * pair_len);
 
     // Start the server running
     if (argc >= 3) {
@@ -439,6 +447,16 @@ int main(int argc, char **argv) {
           if (rval) diewithcode("Put failed",rval);
       }
 
+      // The server answers contains() from its own table, so a key it
+      // just stored must be a hit without any retrying.
+      for(itk = keys.begin(); itk < keys.end(); itk++) {
+        rval = c->contains(*itk);
+        if (1 != rval) {
+          fprintf(stderr,"Server-mode contains missed key %s [%d]\n", *itk, rval);
+          die("aborting.");
+        }
+      }
+
       itk = keys.begin();
       itv = vals.begin();
       for(; itk < keys.end(); itk++, itv++) {
@@ -509,7 +527,7 @@ int main(int argc, char **argv) {
 
 void usage(const char *argv0)
 {
-  fprintf(stderr, "usage: %s <server|s> [<listen_port>]\n",argv0);
+  fprintf(stderr, "usage: %s <server|s> [-w <workers>] [<listen_port>]\n",argv0);
   fprintf(stderr, "usage: %s <client|c> <config_file> [<test_type>]\n",argv0);
   fprintf(stderr,"  <config_file>: lines of \"ip port\"\n");
   fprintf(stderr,"  <test_type>: 'g' (get) or 'p' (put) [optional]\n");
@@ -28,8 +28,11 @@
 #include <assert.h>
 #include <stdio.h>
 #include <cstdint>
+#include <algorithm>
+#include <utility>
+#include <sys/mman.h>
 #include "table_types.h"
-#include "mem/mem5.h"
+#include "mem/slab.h"
 
 // Contains CRC and hash functions
 #include "integrity.h"
@@ -37,16 +40,83 @@
 #define BUCKET_NOT_FOUND SIZE_MAX
 
 #define INIT_EXTENTS_SIZE (1<<20)	//1 MB
+#define EXTENTS_REGION_SHIFT 36		//each extents region has 64 GB of address space
+#define EXTENTS_MAX_REGIONS 64
 #define INIT_KV_CAPACITY 16
 
-#define EXTENTS_MARGIN 1.25			//25% spare space in extents
-
 #define	CUCKOO_D 3
 #define MAX_INSERT_CYCLES 32
 
-#define _write_barrier() __asm__ volatile ( "sfence" )
+#define MIGRATE_STEP_ROWS 1024		//rows copied per migrate_step() during a resize
+
+#define _write_barrier() __asm__ volatile ( "sfence" ::: "memory" )
+
+/**
+ * Seqlock versions (DHT_CONSISTENCY==CONSISTENCY_SEQLOCK). Each row
+ * has a version word at either end. A write first moves the tail one
+ * on, then changes the row, then copies the tail into the head. An
+ * RDMA read fetches the row in address order, head first, so a reader
+ * that finds both words equal raced no write, and two compares replace
+ * the checksum. Extents get the same two words, before the key and
+ * after the value (rounded up to 8 bytes). The row keeps the version
+ * its extents must carry, so extents rewritten or freed under a reader
+ * are caught as well.
+ */
+#if DHT_CONSISTENCY==CONSISTENCY_SEQLOCK
+#define EXT_HEAD_SIZE sizeof(uint64_t)
+#define EXT_TAIL_SIZE sizeof(uint64_t)
+#else
+#define EXT_HEAD_SIZE 0
+#define EXT_TAIL_SIZE 0
+#endif
+
+/**
+ * Bytes of extents a key+value of len bytes takes, counting from
+ * EXT_HEAD_SIZE before the key.
+ */
+inline size_t ext_footprint(size_t len) {
+  if (EXT_TAIL_SIZE == 0)
+    return len;
+  return EXT_HEAD_SIZE + ((len+7) & ~(size_t)7) + EXT_TAIL_SIZE;
+}
+
+#if DHT_CONSISTENCY==CONSISTENCY_SEQLOCK
+/**
+ * Sets the version words of the extents at ext, which hold len bytes
+ * of key+value: the tail, then the head.
+ */
+inline void ext_stamp(char* ext, size_t len, uint64_t version) {
+  *(volatile uint64_t*)(ext + ((len+7) & ~(size_t)7)) = version;
+  _write_barrier();
+  *(volatile uint64_t*)(ext - EXT_HEAD_SIZE) = version;
+}
+
+inline bool ext_stamped(const char* ext, size_t len, uint64_t version) {
+  return *(const uint64_t*)(ext - EXT_HEAD_SIZE) == version &&
+         *(const uint64_t*)(ext + ((len+7) & ~(size_t)7)) == version;
+}
+#endif
+
+/**
+ * Extents regions sit at fixed offsets in one range of address space
+ * reserved up front, so the region holding an extent follows from its
+ * address: region i starts at base+(i<<EXTENTS_REGION_SHIFT). Regions
+ * are only ever added, and a region never moves.
+ */
+inline void* extents_reserve(void) {
+  void* base = mmap(NULL, (size_t)EXTENTS_MAX_REGIONS<<EXTENTS_REGION_SHIFT, PROT_NONE,
+                    MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+  return (base == MAP_FAILED)?NULL:base;
+}
+
+inline char* extents_region_base(void* base, int region) {
+  return (char*)base + ((size_t)region<<EXTENTS_REGION_SHIFT);
+}
+
+inline int extents_region(const void* base, const void* addr) {
+  return (int)(((uintptr_t)addr-(uintptr_t)base)>>EXTENTS_REGION_SHIFT);
+}
 
-#define EXTENTSIZE(kl,vl) (size_t)(EXTENTS_MARGIN*((kl)+(vl)))
 inline bool binarycmp(const char * p1, size_t p1_len, const char *p2, size_t p2_len) {
   if (p1_len != p2_len) return false;
 
@@ -69,23 +139,29 @@ public:
 
       size_t key_len;
       size_t val_len;
-      uint64_t crc;
+      uint64_t crc;						//of key+value, or the version of their extents
       unsigned int ext_capacity;		//extents
 
       bool in_use:1;
       int  hash:7;
     };
   struct __attribute__ ((__packed__)) dht_block {
+#if DHT_CONSISTENCY==CONSISTENCY_SEQLOCK
+    uint32_t version;					//head copy of guard
+#endif
     struct dht_data d;
-    uint64_t guard;
+    uint64_t guard;						//checksum of d, or the row's version
   };
 
+  typedef std::vector<dht_block> slot_vector;
+
   // DHT
   std::vector<dht_block> buckets_;
 
   // DHT Extents
-  void* memregion;					//used for extents
-  size_t ext_size_;
+  void* memregion;					//reserved range holding the extents regions
+  std::vector<size_t> ext_regions_;	//size of each region
+  size_t ext_size_;					//over all regions
 
   // DHT shard attributes
   size_t size_;			//current capacity
@@ -98,11 +174,12 @@ private:
   static constexpr double kLoadFactor = 0.75;
 
   Integrity64 crc;
+  uint64_t version_;		//last seqlock version handed out
 
   struct dht_block blankrow;
 
   // DHT shard extents attributes
-  PoolMalloc pool;
+  SlabMalloc pool;
   // entries should be the same as entries_
 
   // Callback for before table is resized
@@ -113,13 +190,35 @@ private:
   int (*post_resize_hook)(size_t, std::vector<dht_block>*, void*);
   void* post_resize_context;
 
-  // Callback for before extents are resized
-  int (*pre_resize_extents_hook) (size_t, std::vector<dht_block>*, void*);
-  void* pre_resize_extents_context;
+  // Callback for after an extents region is added
+  int (*extents_hook)(int, void*, size_t, void*);
+  void* extents_context;
+
+  // Callback for before a retired table is freed
+  int (*retire_hook)(size_t, std::vector<dht_block>*, void*);
+  void* retire_context;
 
-  // Callback for after extents are resized
-  int (*post_resize_extents_hook)(size_t, std::vector<dht_block>*, void*);
-  void* post_resize_extents_context;
+  // Incremental resize. While migrating_, next_ is filled from buckets_
+  // a few rows at a time and every write to buckets_ is mirrored into
+  // it. Once complete it takes over, and the old table stays in
+  // retired_, still mirrored, until retire() is called.
+  std::vector<dht_block> next_;
+  size_t next_size_;
+  size_t next_entries_;
+  size_t migrate_pos_;		//next row of buckets_ to copy
+  bool migrating_;
+
+  std::vector<dht_block> retired_;
+  size_t retired_size_;
+  size_t retired_entries_;
+  bool retiring_;
+
+  bool shadow_;				//next_ or retired_ is swapped into buckets_
+
+  // Bulk loading. Between begin_bulk() and commit_bulk(), the guards
+  // of live rows written are left stale and computed once at commit.
+  std::vector<size_t> dirty_;
+  bool bulk_;
 
 public:
   DHT() {
@@ -127,6 +226,12 @@ public:
     entries_ = 0;
     buckets_.clear();
 
+    next_size_ = next_entries_ = migrate_pos_ = 0;
+    retired_size_ = retired_entries_ = 0;
+    migrating_ = retiring_ = shadow_ = false;
+    bulk_ = false;
+    version_ = 0;
+
     // DHT shard itself
     pre_resize_hook = NULL;
     pre_resize_context = NULL;
@@ -134,19 +239,19 @@ public:
     post_resize_context = NULL;
 
     // DHT shard extents
-    pre_resize_extents_hook = NULL;
-    pre_resize_extents_context = NULL;
-    post_resize_extents_hook = NULL;
-    post_resize_extents_context = NULL;
+    extents_hook = NULL;
+    extents_context = NULL;
+    retire_hook = NULL;
+    retire_context = NULL;
 
     // Start table with some extents capacity
-    memregion = (void*)malloc(INIT_EXTENTS_SIZE);
+    memregion = extents_reserve();
     if (NULL == memregion) {
-      fprintf(stderr,"Failed to allocate memregion for extents");
+      fprintf(stderr,"Failed to reserve address space for extents");
       exit(-1);
     }
-    ext_size_ = INIT_EXTENTS_SIZE;
-    pool.memsys5Init(memregion,ext_size_,3);	//minimum 1<<3 = 8 bytes per k-v
+    ext_size_ = 0;
+    add_extents_region(INIT_EXTENTS_SIZE);
 
     blankrow.d.in_use = 0;
     blankrow.d.hash = 0;
@@ -157,6 +262,7 @@ public:
     blankrow.d.val_len = 0;
     blankrow.d.ext_capacity = 0;
     blankrow.d.crc = 0;
+    blankrow.guard = 0;
 
     fix_guard(&blankrow);
 
@@ -165,6 +271,10 @@ public:
 
   }
 
+  ~DHT() {
+    munmap(memregion,(size_t)EXTENTS_MAX_REGIONS<<EXTENTS_REGION_SHIFT);
+  }
+
   /**
    * Returns the number of slots this table shard contains
    */
@@ -188,128 +298,226 @@ public:
   }
 
   /**
-   * Resizes the DHT itself
+   * Resizes the DHT itself, synchronously. Any resize already under
+   * way is finished first.
    */
   void resize(size_t capacity) {
     // Sanity-checking
     assert(capacity >= size_);
-    if (capacity == size_)
+    finish_resize();
+    if (capacity <= size_)
+      return;
+
+    begin_resize(capacity);
+    finish_resize();
+  }
+
+  /**
+   * Starts growing the table to capacity in the background. Until
+   * migrate_step() has copied every row, buckets_ stays the live table;
+   * then the new one takes over and the resize hooks run. A previous
+   * table that has not been retired yet is retired now.
+   */
+  void begin_resize(size_t capacity) {
+    if (migrating_ || capacity <= size_)
       return;
+    retire();
 
     printf("Resizing DHT from %lu to %lu entries.\n",size_,capacity);
 
-    // Back up the bucket for restoration
-    std::vector<dht_block> old_b = buckets_;
+    next_.assign(capacity,blankrow);
+    next_size_ = capacity;
+    next_entries_ = 0;
+    migrate_pos_ = 0;
+    migrating_ = true;
+  }
 
-    // Pre-resize hook
-    if (pre_resize_hook) pre_resize_hook(size_, &buckets_, pre_resize_context);
+  /**
+   * Copies up to rows rows of the live table into the one being built,
+   * and switches over once all are copied. Returns whether the resize
+   * is still under way.
+   */
+  bool migrate_step(size_t rows) {
+    if (!migrating_)
+      return false;
 
-    // Perform the resize, protect and clear, propagate new size
-    buckets_.resize(capacity);
-    for(size_t i = 0; i < capacity; i++) {
-      memcpy(&buckets_[i],&blankrow,sizeof(struct dht_block));
+    size_t end = (rows < size_-migrate_pos_)?migrate_pos_+rows:size_;
+    for(; migrate_pos_ < end; migrate_pos_++) {
+      if (buckets_[migrate_pos_].d.in_use)
+        mirror(buckets_[migrate_pos_]);
     }
 
-    // Copy in new contents and save new size;
-    size_t oldsize = size_;
-    size_ = capacity;
-    entries_ = 0;
-    for(size_t i = 0; i < oldsize; i++) {
-      if (old_b[i].d.in_use) {
-        insert_internal(old_b[i].d.key, old_b[i].d.key_len, old_b[i].d.value, old_b[i].d.val_len, old_b[i].d.crc, true, old_b[i].d.ext_capacity);
-      }
-    }
-    old_b.clear();
+    if (migrate_pos_ == size_)
+      flip();
+    return migrating_;
+  }
 
-    // Post-resize hook
-    if (post_resize_hook) post_resize_hook(size_, &buckets_, post_resize_context);
+  /**
+   * Completes a resize under way, if any.
+   */
+  void finish_resize(void) {
+    while (migrating_)
+      migrate_step(size_);
+  }
+
+  bool migrating(void) {
+    return migrating_;
+  }
 
+  bool retiring(void) {
+    return retiring_;
   }
 
   /**
-   * Resizes the extents of the DHT, when necessary. This
-   * operation is not synchronous with DHT resizing.
+   * Frees the table replaced by the last resize, once nobody reads it
+   * any more. The retire hook runs first.
    */
-  void resize_extents(size_t capacity) {
+  void retire(void) {
+    if (!retiring_)
+      return;
+    retiring_ = false;
 
-    printf("Resizing DHT extents to %zu bytes.\n",capacity);
+    if (retire_hook) retire_hook(retired_size_, &retired_, retire_context);
+    std::vector<dht_block>().swap(retired_);
+  }
 
-    // Create a new memory pool and initialize
-    // it with a new malloc'd chunk of heap.
-    PoolMalloc newpool;
-    void* newmemregion = (void*)malloc(capacity);
-    if (NULL == newmemregion) {
-      fprintf(stderr,"Failed to allocate memregion for extents");
-      exit(-1);
-    }
-    ext_size_ = capacity;
-    newpool.memsys5Init(newmemregion,ext_size_,3);	//minimum 1<<3 = 8 bytes per k-v
+  /**
+   * Pre-sizes the table for entries pairs with kv_bytes of keys
+   * and values between them, so that loading them resizes neither
+   * the table nor the extents. Never shrinks.
+   */
+  void reserve(size_t entries, size_t kv_bytes) {
+    size_t capacity = 1+(size_t)(entries/kLoadFactor);
+    if (capacity > size_)
+      resize(capacity);
+
+    size_t ext = pool.footprint(entries,kv_bytes);
+    if (ext > ext_size_)
+      resize_extents(ext);
+  }
 
-    // Pre-resize extents hook
-    if (pre_resize_extents_hook)
-      pre_resize_extents_hook(size_, &buckets_, pre_resize_extents_context);
+  /**
+   * Grows the table now, if need be, so that more pairs can be
+   * inserted without a resize starting part-way through them.
+   * Grows at least twice as large, as a resize would.
+   */
+  void make_room(size_t more) {
+    finish_resize();
+    if (entries_+more <= kLoadFactor*size_)
+      return;
 
-    // Move all extents into new memory area
-    for(size_t i = 0; i < size_; i++) {
-      if (buckets_[i].d.in_use) {
+    size_t capacity = 1+(size_t)((entries_+more)/kLoadFactor);
+    resize((capacity > 1+2*size_)?capacity:1+2*size_);
+  }
 
-        void* newspace = newpool.memsys5Malloc(buckets_[i].d.ext_capacity);
-        if (newspace == NULL) {
-          fprintf(stderr,"Fatal bug: ran out of memory during extents resize");
-          *((char*)0) = 0;
-          exit(-1);
-        }
+  /**
+   * Starts a batch of writes whose row guards are computed once, by
+   * commit_bulk(), rather than on every write and cuckoo move. Until
+   * then, clients see the rows written as locked and re-read them.
+   */
+  void begin_bulk(void) {
+    bulk_ = true;
+  }
 
-        memcpy(newspace,buckets_[i].d.key,buckets_[i].d.ext_capacity);
-        buckets_[i].d.key[0]++; //invalid old crc
-        buckets_[i].d.key = (K)newspace;
-        buckets_[i].d.value = (V)((char*)newspace+buckets_[i].d.key_len);
-        fix_guard(&buckets_[i]);
-        // No point in pool.memsys5Free() since we're going to throw out
-        // the entire memory region
+  /**
+   * Guards every row written since begin_bulk().
+   */
+  void commit_bulk(void) {
+    seal_dirty();
+    bulk_ = false;
+  }
 
-      }
-    }
+  /**
+   * Grows the extents to at least capacity bytes by adding regions.
+   * Nothing already in the extents moves, so clients keep reading
+   * throughout; the extents hook announces each new region.
+   */
+  void resize_extents(size_t capacity) {
+    while (ext_size_ < capacity) {
+      size_t size = capacity-ext_size_;
+      if (size > ((size_t)1<<EXTENTS_REGION_SHIFT))
+        size = (size_t)1<<EXTENTS_REGION_SHIFT;
 
-    // Delete old pool and free its memory
-    pool.memsys5Shutdown();
-    free(memregion);
+      printf("Adding DHT extents region %zu of %zu bytes.\n",ext_regions_.size(),size);
 
-    // Set member variables for new region/pool
-    memregion = newmemregion;
-    pool = newpool;
+      int region = add_extents_region(size);
+      if (extents_hook)
+        extents_hook(region, extents_region_base(memregion,region), ext_regions_[region], extents_context);
+    }
+  }
 
-    // Post-resize extents hook
-    if (post_resize_extents_hook)
-      post_resize_extents_hook(size_, &buckets_, post_resize_extents_context);
+  /**
+   * Maps the next region of the reserved range and hands it to the
+   * pool. Returns its index.
+   */
+  int add_extents_region(size_t size) {
+    int region = ext_regions_.size();
+    char* base = extents_region_base(memregion,region);
+    size = (size+SLAB_PAGE_SIZE-1)/SLAB_PAGE_SIZE*SLAB_PAGE_SIZE;
 
+    if (region == EXTENTS_MAX_REGIONS || mprotect(base,size,PROT_READ|PROT_WRITE)) {
+      fprintf(stderr,"Failed to add extents region %d of %zu bytes",region,size);
+      exit(-1);
+    }
+    pool.add_region(base,size);
+    ext_regions_.push_back(size);
+    ext_size_ += size;
+    return region;
   }
 
   /**
-   * Reserves extents for a k,v pair
+   * Reserves extents for a k,v pair. The pair gets the whole chunk
+   * the pool rounds it up to, as room for later updates to grow.
    */
   size_t reserve_extents(const K& key, size_t key_len, V value, size_t val_len, dht_block* block) {
-    size_t extsize = EXTENTSIZE(key_len,val_len);
-    block->d.key = (K)pool.memsys5Malloc(extsize);
+    size_t need = ext_footprint(key_len+val_len);
+    size_t extsize = pool.chunk_size(need)-EXT_HEAD_SIZE;
+    char* chunk = (char*)pool.alloc(need);
 
-    while (block->d.key == NULL) {	//out of memory
-      block->d.in_use = 0;
+    while (chunk == NULL) {	//out of memory
+      // Double, or add a quarter past 1 GB, and fit at least this pair
+      size_t more = (ext_size_ > (1024L*1024L*1024L))?ext_size_/4:ext_size_;
+      resize_extents(ext_size_+std::max(more,need+SLAB_PAGE_SIZE));
 
-      if (ext_size_ > (1024L*1024L*1024L)) {
-        resize_extents(1.25*ext_size_);
-      } else {
-        resize_extents(2*ext_size_);
-      }
-
-      block->d.key = (K)pool.memsys5Malloc(extsize);
-      block->d.in_use = 1;
+      chunk = (char*)pool.alloc(need);
     }
 
+    block->d.key = (K)(chunk+EXT_HEAD_SIZE);
     block->d.ext_capacity = extsize;
 	  block->d.value = block->d.key+key_len;
     return extsize;
   }
 
+  /**
+   * Frees a row's extents, first making them fail the checks
+   * of any reader still fetching them.
+   */
+  void release_extents(dht_block* block) {
+#if DHT_CONSISTENCY==CONSISTENCY_SEQLOCK
+    ext_stamp(block->d.key,block->d.key_len+block->d.val_len,++version_);
+#else
+    block->d.key[0]++;	//make the CRC wrong
+#endif
+    pool.release(block->d.key-EXT_HEAD_SIZE);
+  }
+
+  /**
+   * Records in a row what its freshly written extents hold: their
+   * checksum, which a client may have sent along, or with seqlock
+   * versions a new version, stamped on the extents as well.
+   */
+  inline void seal_extents(dht_block* block, uint64_t crc_, bool have_crc) {
+#if DHT_CONSISTENCY==CONSISTENCY_SEQLOCK
+    block->d.crc = ++version_;
+    ext_stamp(block->d.key,block->d.key_len+block->d.val_len,block->d.crc);
+#else
+    if (have_crc)
+      block->d.crc = crc_;
+    else
+      block->d.crc = crc.crc(block->d.key,block->d.key_len+block->d.val_len);
+#endif
+  }
+
   /**
    * An insert triggered by resize. For key/vals
    * that are strings, this should not re-reserve
@@ -324,21 +532,46 @@ public:
    * extra nocopy argument is if this insert is
    * coming from a resize operation and the
    * strings should not be re-reserved/copied.
+   * Starts a background resize once the table
+   * is kLoadFactor full, so that it can finish
+   * before inserts start failing.
    */
   void insert(const K& key, size_t key_len, V value, size_t val_len, uint64_t crc_ = 0, bool have_crc = false, bool nocopy = false, size_t capacity = 0) {
+    insert(crc.hash128(key,key_len),key,key_len,value,val_len,crc_,have_crc,nocopy,capacity);
+  }
+
+  /**
+   * insert() for a key already hashed.
+   */
+  void insert(const key_hash& h, const K& key, size_t key_len, V value, size_t val_len, uint64_t crc_, bool have_crc, bool nocopy, size_t capacity) {
+    while (!place(h,key,key_len,value,val_len,crc_,have_crc,nocopy,capacity))
+      grow();
+
+    if (!migrating_ && !retiring_ && entries_ > kLoadFactor*size_)
+      begin_resize(1+2*size_);
+  }
+
+  /**
+   * Cuckoo placement for insert(). Returns false,
+   * without touching the table, if no path of
+   * displacements was found.
+   */
+  bool place(const key_hash& h, const K& key, size_t key_len, V value, size_t val_len, uint64_t crc_, bool have_crc, bool nocopy, size_t capacity) {
     size_t hv[CUCKOO_D];
 
     for(int i=0; i < CUCKOO_D; i++) {
-      size_t b = hv[i] = bucket_idx(key,key_len,i);
+      size_t b = hv[i] = bucket_idx(h,i);
 
       if (!buckets_[b].d.in_use) {
+        open_row(&buckets_[b]);
 		    buckets_[b].d.hash = i;
         set(b,key,key_len,value,val_len,crc_,have_crc,nocopy,capacity);
         entries_++;
-        return;
+        mirror(buckets_[b]);
+        return true;
       } else if (binarycmp(buckets_[b].d.key,buckets_[b].d.key_len,key,key_len)) {
-        update(key,key_len,value,val_len,crc_,have_crc);
-        return;
+        update(h,key,key_len,value,val_len,crc_,have_crc);
+        return true;
       }
 
     }
@@ -365,8 +598,9 @@ public:
     int foundslot = -1;
 
     do {
+      key_hash th = crc.hash128(tempkey,tempkey_len);
       for(int i = hash_ixq; i != hash_ixp; i=(i+1)%CUCKOO_D) {
-        hv[i] = bucket_idx(tempkey,tempkey_len,i);
+        hv[i] = bucket_idx(th,i);
         if (!buckets_[hv[i]].d.in_use) {
           foundslot = i;
           break;
@@ -397,11 +631,8 @@ public:
     } while(foundslot == -1 && cycles < MAX_INSERT_CYCLES && start != hash_ixq);
 
     // Time to resize or insert
-    if (foundslot == -1) {
-      resize(1+2*size_);
-      insert(key,key_len,value,val_len,crc_,have_crc,nocopy,capacity);
-      return;
-    }
+    if (foundslot == -1)
+      return false;
 
     // found spot, must walk backwards shifting pieces around
     // move items until we get back to where we started
@@ -409,22 +640,27 @@ public:
     size_t target = hv[foundslot];
 	  for (int i=traceback.size()-1; i >= 0; i--) {
       size_t current = traceback[i];
-      memcpy(&(buckets_[target]),&(buckets_[current]),sizeof(struct dht_block));
+      open_row(&buckets_[target]);
+      buckets_[target].d = buckets_[current].d;
       buckets_[target].d.hash = hashback[i];
-      fix_guard(&buckets_[target]);
+      seal(target);
+      mirror(buckets_[target]);
       target = current;
     }
 
+    open_row(&buckets_[start]);
 	  buckets_[start].d.hash = 0;
     set(start,key,key_len,value,val_len,crc_,have_crc,nocopy,capacity);
     entries_++;
+    mirror(buckets_[start]);
+    return true;
 
   }
 
 
   void set(size_t b, const K& key, size_t key_len, V value, size_t val_len, uint64_t crc_ = 0, bool have_crc = false, bool nocopy = false, size_t capacity = 0) {
 
-	// caller should set buckets_[b].d.hash
+	// caller should open_row() and set buckets_[b].d.hash
 
     buckets_[b].d.in_use = 1;
     if (!nocopy) {
@@ -445,12 +681,14 @@ public:
     buckets_[b].d.key_len = key_len;
     buckets_[b].d.val_len = val_len;
 
-    if (have_crc)
-      buckets_[b].d.crc = crc_;
+#if DHT_CONSISTENCY==CONSISTENCY_SEQLOCK
+    if (nocopy)
+      buckets_[b].d.crc = crc_;		//the extents keep their version
     else
-      buckets_[b].d.crc = crc.crc(buckets_[b].d.key,2+key_len+val_len);
+#endif
+    seal_extents(&buckets_[b],crc_,have_crc);
 
-    fix_guard(&buckets_[b]);
+    seal(b);
     _write_barrier();   // Must make sure it is in mem before replying to client (13-01-25)
 
   }
@@ -463,22 +701,32 @@ public:
    * enlarged.
    */
   void update(const K& key, size_t key_len, V value, size_t val_len, uint64_t crc_ = 0, bool have_crc = false) {
+    update(crc.hash128(key,key_len),key,key_len,value,val_len,crc_,have_crc);
+  }
+
+  /**
+   * update() for a key already hashed.
+   */
+  void update(const key_hash& h, const K& key, size_t key_len, V value, size_t val_len, uint64_t crc_, bool have_crc) {
     size_t index;
 
     for(int i=0; i < CUCKOO_D; i++) {
-      index = bucket_idx(key,key_len,i);
+      index = bucket_idx(h,i);
       if (buckets_[index].d.in_use) {
         if (binarycmp(buckets_[index].d.key,buckets_[index].d.key_len,key,key_len)) {
-          if (buckets_[index].d.ext_capacity >= key_len+val_len) {
+          open_row(&buckets_[index]);
+          if (buckets_[index].d.ext_capacity >= ext_footprint(key_len+val_len)-EXT_HEAD_SIZE) {
 
             // Fits in current extents
+#if DHT_CONSISTENCY==CONSISTENCY_SEQLOCK
+            ext_stamp(buckets_[index].d.key,buckets_[index].d.key_len+buckets_[index].d.val_len,++version_);
+#endif
             memcpy(buckets_[index].d.value,value,val_len);
 
           } else {
 
             // Needs new extents
-            buckets_[index].d.key[0]++; //mess up the CRC
-            pool.memsys5Free(buckets_[index].d.key);
+            release_extents(&buckets_[index]);
             reserve_extents(key,key_len,value,val_len,&(buckets_[index]));
 
             memcpy(buckets_[index].d.key,key,key_len);
@@ -487,19 +735,16 @@ public:
 
           buckets_[index].d.key_len = key_len;
           buckets_[index].d.val_len = val_len;
+          seal_extents(&buckets_[index],crc_,have_crc);
 
-          if (have_crc)
-            buckets_[index].d.crc = crc_;
-          else
-            buckets_[index].d.crc = crc.crc(buckets_[index].d.key,key_len+val_len);
-
-          fix_guard(&buckets_[index]);
+          seal(index);
+          mirror(buckets_[index]);
           return;
         } // end key matches
       } // end in_use
     } // end for
 
-    insert(key,key_len,value,val_len,crc_,have_crc);
+    insert(h,key,key_len,value,val_len,crc_,have_crc,false,0);
     return;
   }
 
@@ -508,14 +753,16 @@ public:
    * invalidates and frees the extents as well.
    */
   void remove(const K& key,size_t key_len) {
+    key_hash h = crc.hash128(key,key_len);
     size_t index;
 
     for(int i=0; i < CUCKOO_D; i++) {
-      index = bucket_idx(key,key_len,i);
+      index = bucket_idx(h,i);
       if (buckets_[index].d.in_use) {
         if (binarycmp(buckets_[index].d.key,buckets_[index].d.key_len,key,key_len)) {
-          buckets_[index].d.key[0]++; //make the CRC wrong
-          pool.memsys5Free(buckets_[index].d.key);
+          unmirror(key,key_len);
+          open_row(&buckets_[index]);
+          release_extents(&buckets_[index]);
           buckets_[index].d.in_use = 0;
           fix_guard(&buckets_[index]);
           entries_--;
@@ -525,20 +772,38 @@ public:
     } //end for
   }
 
+  /**
+   * Starts a write to a row clients may be reading. With seqlock
+   * versions, moves its tail on so that readers reject the row until
+   * fix_guard() brings the head level again.
+   */
+  inline void open_row(struct dht_block* block) {
+#if DHT_CONSISTENCY==CONSISTENCY_SEQLOCK
+    block->guard = (uint32_t)++version_;
+    _write_barrier();
+#endif
+  }
+
   /**
    * Updates the CRC attached to a row for self-validation
    */
   inline void fix_guard(struct dht_block* block) {
+#if DHT_CONSISTENCY==CONSISTENCY_SEQLOCK
+    _write_barrier();
+    block->version = (uint32_t)block->guard;
+#else
     block->guard = crc.crc((char*)&(block->d),sizeof(struct dht_data));
+#endif
   }
 
   /**
    * Returns 1 for existing keys, 0 otherwise.
    */
   bool contains(const K& key, size_t key_len) {
+    key_hash h = crc.hash128(key,key_len);
     size_t index;
     for(int i=0; i < CUCKOO_D; i++) {
-      index = bucket_idx(key,key_len,i);
+      index = bucket_idx(h,i);
       if (buckets_[index].d.in_use) {
         if (binarycmp(buckets_[index].d.key,buckets_[index].d.key_len,key,key_len))
           return true;
@@ -548,11 +813,26 @@ public:
   }
 
   /**
-   * Returns a bucket index for a given key.
+   * Returns the slot holding key, or BUCKET_NOT_FOUND.
+   */
+  size_t find(const K& key, size_t key_len) {
+    key_hash h = crc.hash128(key,key_len);
+    size_t index;
+    for(int i=0; i < CUCKOO_D; i++) {
+      index = bucket_idx(h,i);
+      if (buckets_[index].d.in_use &&
+          binarycmp(buckets_[index].d.key,buckets_[index].d.key_len,key,key_len))
+        return index;
+    }
+    return BUCKET_NOT_FOUND;
+  }
+
+  /**
+   * Returns a bucket index for a given key's hash.
    * Disregards whether the key is actually there.
    */
-  inline size_t bucket_idx(const K& key, size_t key_len, int hash = 0) {		//starting position from hash
-    return crc.hashN(key,key_len,hash) % size_;
+  inline size_t bucket_idx(const key_hash& h, int hash = 0) {		//starting position from hash
+    return Integrity64::reduce(Integrity64::probe(h,hash),size_);
   }
 
   /**
@@ -567,14 +847,28 @@ public:
   }
 
   /**
-   * Set callbacks for resizing the DHT (not extents)
+   * Set callback for after an extents region is added, with the
+   * region's index, base address and size.
+   */
+  void set_extents_hook(int(*hook)(int, void*, size_t, void*), void* context) {
+    extents_hook = hook;
+    extents_context = context;
+  }
+
+  /**
+   * Set callback for before a retired table is freed. The
+   * hook must make sure no client reads it any more.
    */
-  void set_resize_extents_hooks(int(*pre_hook)(size_t, std::vector<dht_block>*, void*), void* pre_context,
-                                int(*post_hook)(size_t, std::vector<dht_block>*, void*), void* post_context) {
-    pre_resize_extents_hook = pre_hook;
-    pre_resize_extents_context  = pre_context;
-    post_resize_extents_hook = post_hook;
-    post_resize_extents_context = post_context;
+  void set_retire_hook(int(*hook)(size_t, std::vector<dht_block>*, void*), void* context) {
+    retire_hook = hook;
+    retire_context = context;
+  }
+
+  /**
+   * Prints the extents allocator's counters and size classes.
+   */
+  void dump_extents(FILE* out) const {
+    pool.dump(out);
   }
 
   void dump_table(void) {
@@ -588,6 +882,158 @@ public:
     }
   }
 
+private:
+  /**
+   * Makes room after a failed insert: finishes the resize
+   * under way, or else runs a whole one now.
+   */
+  void grow(void) {
+    if (migrating_)
+      finish_resize();
+    else
+      resize(1+2*size_);
+  }
+
+  /**
+   * The new table is complete; make it the live one and
+   * keep the old one until it is retired.
+   */
+  void flip(void) {
+    // Pending guards are for rows of the outgoing table
+    seal_dirty();
+
+    if (pre_resize_hook) pre_resize_hook(size_, &buckets_, pre_resize_context);
+
+    retired_.swap(buckets_);
+    buckets_.swap(next_);
+    retired_size_ = size_;
+    retired_entries_ = entries_;
+    size_ = next_size_;
+    entries_ = next_entries_;
+    migrating_ = false;
+    retiring_ = true;
+
+    if (post_resize_hook) post_resize_hook(size_, &buckets_, post_resize_context);
+
+    // Without a hook, nobody else can be reading the old table
+    if (!retire_hook)
+      retire();
+  }
+
+  /**
+   * Guards a live row just written, or leaves it for
+   * commit_bulk(). Rows of the other tables, which clients
+   * do not read yet, are always guarded at once.
+   */
+  inline void seal(size_t b) {
+    if (bulk_ && !shadow_)
+      dirty_.push_back(b);
+    else
+      fix_guard(&buckets_[b]);
+  }
+
+  void seal_dirty(void) {
+    std::sort(dirty_.begin(),dirty_.end());
+    dirty_.erase(std::unique(dirty_.begin(),dirty_.end()),dirty_.end());
+    for(size_t i = 0; i < dirty_.size(); i++)
+      fix_guard(&buckets_[dirty_[i]]);
+    dirty_.clear();
+    _write_barrier();
+  }
+
+  /**
+   * Exchanges another table with buckets_, so the ordinary
+   * operations work on it. Call again to swap back.
+   */
+  void swap_table(std::vector<dht_block>& table, size_t& size, size_t& entries) {
+    buckets_.swap(table);
+    std::swap(size_,size);
+    std::swap(entries_,entries);
+    shadow_ = !shadow_;
+  }
+
+  /**
+   * Copies a row just written to the live table into the
+   * table being built and the retired one. Rows keep their
+   * extents, which the tables share.
+   */
+  void mirror(const struct dht_block& live) {
+    if (shadow_ || !(migrating_ || retiring_))
+      return;
+
+    struct dht_block row = live;
+    if (migrating_) {
+      while (!mirror_into(next_,next_size_,next_entries_,row,true))
+        grow_next();
+    }
+    // Keys new to the retired table are not added, since only
+    // clients that have not switched yet read it
+    if (retiring_)
+      mirror_into(retired_,retired_size_,retired_entries_,row,false);
+  }
+
+  bool mirror_into(std::vector<dht_block>& table, size_t& size, size_t& entries, const struct dht_block& row, bool add) {
+    bool placed = true;
+
+    swap_table(table,size,entries);
+    size_t index = find(row.d.key,row.d.key_len);
+    if (index != BUCKET_NOT_FOUND) {
+      int hash = buckets_[index].d.hash;
+      open_row(&buckets_[index]);
+      buckets_[index].d = row.d;
+      buckets_[index].d.hash = hash;
+      fix_guard(&buckets_[index]);
+    } else if (add) {
+      placed = place(crc.hash128(row.d.key,row.d.key_len),row.d.key,row.d.key_len,row.d.value,row.d.val_len,
+                     row.d.crc,true,true,row.d.ext_capacity);
+    }
+    swap_table(table,size,entries);
+    return placed;
+  }
+
+  /**
+   * Drops a key about to be removed from the live table
+   * from the others. Its extents are freed by the caller.
+   */
+  void unmirror(const K& key, size_t key_len) {
+    if (migrating_)
+      unmirror_from(next_,next_size_,next_entries_,key,key_len);
+    if (retiring_)
+      unmirror_from(retired_,retired_size_,retired_entries_,key,key_len);
+  }
+
+  void unmirror_from(std::vector<dht_block>& table, size_t& size, size_t& entries, const K& key, size_t key_len) {
+    swap_table(table,size,entries);
+    size_t index = find(key,key_len);
+    if (index != BUCKET_NOT_FOUND) {
+      open_row(&buckets_[index]);
+      buckets_[index].d.in_use = 0;
+      fix_guard(&buckets_[index]);
+      entries_--;
+    }
+    swap_table(table,size,entries);
+  }
+
+  /**
+   * The table being built ran out of cuckoo paths; rebuild
+   * it twice as large. Clients never read it, so this is
+   * invisible to them.
+   */
+  void grow_next(void) {
+    std::vector<dht_block> old_b;
+    old_b.swap(next_);
+    next_size_ = 1+2*next_size_;
+    next_.assign(next_size_,blankrow);
+    next_entries_ = 0;
+
+    for(size_t i = 0; i < old_b.size(); i++) {
+      if (old_b[i].d.in_use) {
+        while (!mirror_into(next_,next_size_,next_entries_,old_b[i],true))
+          grow_next();
+      }
+    }
+  }
+
 }; // end class DHT
 
 enum post_get_state {
@@ -596,7 +1042,8 @@ enum post_get_state {
   POST_GET_MISSING = -2,     // slot is not in_use
   POST_GET_FAILURE = -3,     // IB problem
   POST_GET_COLLISION = -4,   // slot is filled, but with wrong key
-  POST_CONTAINS_FAILURE = -5 // contains failed for some reason
+  POST_CONTAINS_FAILURE = -5, // contains failed for some reason
+  POST_GET_SPILLED = -6      // slot matches, value must be read from extents
 };
 
 #define POST_PUT_FAILURE POST_GET_FAILURE
@@ -615,20 +1062,51 @@ public:
     dht_size_ = dht_size;
   }
 
+  static size_t slot_size() {
+    return sizeof(struct DHT<K,V>::dht_block);
+  }
+
+  /**
+   * Hashes a key once for server_for_key() and every pre_get() of
+   * one operation.
+   */
+  key_hash hash_key(K key, size_t key_len) {
+    return crc.hash128(key,key_len);
+  }
+
+  int server_for_key(int server_count, const key_hash& h) {
+    return Integrity64::reduce(Integrity64::server_hash(h),server_count);
+  }
+
   int server_for_key(int server_count, K key, size_t key_len) {
-    return crc.hashN(key,key_len,0) % server_count;
+    return server_for_key(server_count,hash_key(key,key_len));
   }
 
   uint64_t check_crc(void* mem, size_t len) {
     return crc.crc((char*)mem,len);
   }
 
-  void* pre_get(K key, size_t key_len, int hash_idx) {
-    size_t offset = crc.hashN(key,key_len,hash_idx) % dht_size_;
+  /**
+   * The span of a row's extents to fetch: the key and value, and
+   * their version words if any. The key lands EXT_HEAD_SIZE bytes in.
+   */
+  static inline uintptr_t ext_fetch_addr(const struct DHT<K,V>::dht_block* block) {
+    return (uintptr_t)block->d.key-EXT_HEAD_SIZE;
+  }
+  static inline size_t ext_fetch_len(const struct DHT<K,V>::dht_block* block) {
+    return block->d.ext_capacity+EXT_HEAD_SIZE;
+  }
+
+  void* pre_get(const key_hash& h, int hash_idx) {
+    size_t offset = Integrity64::reduce(Integrity64::probe(h,hash_idx),dht_size_);
     void* mem_off = (void*)(((char*)dht_) + ((offset) * sizeof(struct DHT<K,V>::dht_block)));
     return mem_off;
   }
 
+  void* pre_get(K key, size_t key_len, int hash_idx) {
+    return pre_get(hash_key(key,key_len),hash_idx);
+  }
+
   inline int post_get(struct DHT<K,V>::dht_block* block, K key, size_t key_len, V& value, bool skip_crc = false) {
     int rval = post_contains(block, key, key_len, skip_crc);
     return rval;
@@ -637,7 +1115,11 @@ public:
   inline int post_contains(struct DHT<K,V>::dht_block* block, K key, size_t key_len, bool skip_crc = false) {
 
     // 2012-10-02: Guards changed to increasing numbers
+#if DHT_CONSISTENCY==CONSISTENCY_SEQLOCK
+    if (!skip_crc && block->guard != block->version) {
+#else
     if (!skip_crc && block->guard != crc.crc((char*)&(block->d),sizeof(struct DHT<K,V>::dht_data))) {
+#endif
       return POST_GET_LOCKED;
     }
 
@@ -662,8 +1144,12 @@ public:
 
   inline int post_contains_extents(struct DHT<K,V>::dht_block* block, K key, size_t key_len, bool skip_crc = false) {
     // This assumes post_get() was already called to check guards
+#if DHT_CONSISTENCY==CONSISTENCY_SEQLOCK
+    if (!skip_crc && !ext_stamped(block->d.key,block->d.key_len+block->d.val_len,block->d.crc))
+#else
     if (!skip_crc && block->d.crc != crc.crc(block->d.key,
         block->d.key_len+block->d.val_len))
+#endif
     {
       return POST_GET_LOCKED;
     }
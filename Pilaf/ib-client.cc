@@ -123,7 +123,7 @@ int IBClient::add_server(const char* server_host, const char* server_port) {
 
   TEST_NZ(getaddrinfo(server_host, server_port, NULL, &addr));
 
-  TEST_NZ(rdma_create_id(manager->get_ec(), &(server.conn), &server, RDMA_PS_TCP));
+  TEST_NZ(manager->transport()->create_id(manager->get_ec(), &(server.conn), &server));
 
   // Set up other member vars
   server.ready = 0;
@@ -138,7 +138,7 @@ int IBClient::add_server(const char* server_host, const char* server_port) {
   server.connection->set_ready_hook(hook_ready,(void*)&server);
   server.connection->set_send_complete_hook(hook_send_complete,(void*)&server);
 
-  TEST_NZ(rdma_resolve_addr(server.conn, NULL, addr->ai_addr, TIMEOUT_IN_MS));
+  TEST_NZ(manager->transport()->resolve_addr(server.conn, NULL, addr->ai_addr, TIMEOUT_IN_MS));
   freeaddrinfo(addr);
 
   return 0;
@@ -202,7 +202,7 @@ int IBClient::on_addr_resolved(struct ServerInfo* server, struct rdma_cm_id *id)
   fprintf(stdout,"client: address resolved.\n");
 
   server->connection->build_connection(id);
-  TEST_NZ(rdma_resolve_route(id, TIMEOUT_IN_MS));
+  TEST_NZ(manager->transport()->resolve_route(id, TIMEOUT_IN_MS));
 
   return 0;
 }
@@ -236,14 +236,14 @@ int IBClient::on_disconnect(struct ServerInfo* server, struct rdma_cm_id *id) {
 
   TEST_NZ(getaddrinfo(server->server_host, server->server_port, NULL, &addr));
 
-  TEST_NZ(rdma_create_id(manager->get_ec(), &(server->conn), NULL, RDMA_PS_TCP));
+  TEST_NZ(manager->transport()->create_id(manager->get_ec(), &(server->conn), NULL));
 
   // Initialize required hooks
   server->connection->set_recv_hook(hook_ibv_recv,(void*)server);
   server->connection->set_rdma_recv_hook(hook_rdma_recv,(void*)server);
   server->connection->set_ready_hook(hook_ready,(void*)server);
 
-  TEST_NZ(rdma_resolve_addr(server->conn, NULL, addr->ai_addr, TIMEOUT_IN_MS));
+  TEST_NZ(manager->transport()->resolve_addr(server->conn, NULL, addr->ai_addr, TIMEOUT_IN_MS));
   freeaddrinfo(addr);
 
   fprintf(stderr, "Attempting to reconnect to %s:%s\n",server->server_host,server->server_port);
@@ -265,7 +265,7 @@ int IBClient::on_route_resolved(struct ServerInfo* server, struct rdma_cm_id *id
 
   printf("client: route resolved to %s:%s.\n",server->server_host,server->server_port);
   server->connection->build_params(&cm_params);
-  TEST_NZ(rdma_connect(id, &cm_params));
+  TEST_NZ(manager->transport()->connect(id, &cm_params));
 
   return 0;
 }
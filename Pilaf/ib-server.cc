@@ -75,11 +75,11 @@ int IBServer::ready(unsigned short port) {
   addr.sin_family = AF_INET;
   addr.sin_port = htons(port);
 
-  TEST_NZ(rdma_create_id(manager->get_ec(), &listener, this, RDMA_PS_TCP));
-  TEST_NZ(rdma_bind_addr(listener, (struct sockaddr *)&addr));
-  TEST_NZ(rdma_listen(listener, 10)); /* backlog=10 is arbitrary */
+  TEST_NZ(manager->transport()->create_id(manager->get_ec(), &listener, this));
+  TEST_NZ(manager->transport()->bind_addr(listener, (struct sockaddr *)&addr));
+  TEST_NZ(manager->transport()->listen(listener, 10)); /* backlog=10 is arbitrary */
 
-  port = ntohs(rdma_get_src_port(listener));
+  port = ntohs(manager->transport()->get_src_port(listener));
   manager->log(VERB_INFO,"server: listening on port %d.\n", port);
 
   is_ready = true;
@@ -90,7 +90,7 @@ int IBServer::ready(unsigned short port) {
   } while(!rval);
   manager->log(VERB_ERROR,"%s terminating because rgce returned %d.\n","server",errno);
 
-  rdma_destroy_id(listener);
+  manager->transport()->destroy_id(listener);
 
   return 0;
 }
@@ -120,7 +120,7 @@ int IBServer::on_connect_request(struct rdma_cm_id *id) {
   if (!is_ready) { 
     manager->log(VERB_INFO,"server: received connection request, rejecting\n");
     const char* action = "retry";
-    TEST_NZ(rdma_reject(id, action, 1+strlen(action)));
+    IBConn::reject(manager,id,action);
     return 0;
   }
 
@@ -139,7 +139,7 @@ int IBServer::on_connect_request(struct rdma_cm_id *id) {
   create_mrs(thisconn);
 
   clients.push_back(thisconn);
-  if (rdma_accept(id, &cm_params)) {
+  if (manager->transport()->accept(id, &cm_params)) {
     manager->log(VERB_ERROR,"server: client disconnected before receiving accept; destroying connection\n");
     thisconn->disconnect();
     thisconn->disconnect();
@@ -38,6 +38,7 @@ void diewithcode(const char *reason, int code)
 IBConn::IBConn(IBConnManager* manager, size_t msgbuf_size) {
 
   manager_ = manager;
+  cq_ = 0;
 
   s_ctx = NULL;
   s_conn = NULL;
@@ -48,6 +49,9 @@ IBConn::IBConn(IBConnManager* manager, size_t msgbuf_size) {
   on_rdma_recv_hook = NULL;
   rdma_recv_hook_context = NULL;
 
+  on_rdma_tag_hook = NULL;
+  rdma_tag_hook_context = NULL;
+
   on_ready_hook = NULL;
   ready_hook_context = NULL;
 
@@ -62,6 +66,16 @@ IBConn::IBConn(IBConnManager* manager, size_t msgbuf_size) {
 
   // This is a recv_buf for on_completion
   send_buf = NULL;
+  ctrl_buf = NULL;
+
+  rndv_building = NULL;
+  rndv_recv = NULL;
+  rndv_recv_len = 0;
+  rndv_last = NULL;
+  rndv_tag.buf.msg = NULL;
+  rndv_tag.buf.mr = NULL;
+  rndv_tag.buf.instance = this;
+  rndv_tag.op = NULL;
 
   // Set when connection is established and MRs exchanged
   ready = 0;
@@ -94,14 +108,20 @@ int IBConn::build_connection(struct rdma_cm_id *id) {
     manager_->log(VERB_ERROR,"build_context() failed\n");
     return rval;
   }
+
+  // Fresh QP, empty send queue
+  sq_pending.clear();
+  batch_wr.clear();
+  batch_sge.clear();
   if (rval = build_qp_attr(&qp_attr)) {
     manager_->log(VERB_ERROR,"build_context() failed\n");
     return rval;
   }
+  qp_attr.srq = manager_->get_srq(cq_, manager_->gpd ? manager_->gpd : id->pd);
 
   // manager_->gpd is either NULL or valid
-  if (0 != (rval = rdma_create_qp(id, manager_->gpd, &qp_attr))) {
-    manager_->log(VERB_ERROR,"rdma_create_qp in build_connection failed with code %d\n",errno);
+  if (0 != (rval = manager_->transport_->create_qp(id, manager_->gpd, &qp_attr))) {
+    manager_->log(VERB_ERROR,"create_qp in build_connection failed with code %d\n",errno);
     return -1;
   }
 
@@ -111,10 +131,12 @@ int IBConn::build_connection(struct rdma_cm_id *id) {
 
   conn->id = id;
   conn->qp = id->qp;
+  if (conn->qp->srq)
+    manager_->attach_qp(conn->qp->qp_num, this);
 
   register_memory(conn);
 
-  for(int i=0; i<RECV_BUFS; i++) {
+  for(int i=0; i<recv_bufs.size(); i++) {
     struct recv_buf* this_buf = recv_bufs[i];
     recv_pend_post.push(this_buf);
     manager_->log(VERB_DEBUG,"Pushed %d/%d bufs onto pend_post queue\n",i+1,RECV_BUFS);
@@ -141,17 +163,17 @@ int IBConn::build_context(struct rdma_cm_id *id) {
   s_ctx->ctx = id->verbs;
 
   // Create a completion queue, if needed, otherwise use shared CQ.
-  if (manager_->gcq == NULL) {
-    if (NULL == (s_ctx->cq = ibv_create_cq(s_ctx->ctx, 256, NULL, NULL, 0))) { /* cqe=10 is arbitrary */
+  if (manager_->cqs_[cq_] == NULL) {
+    if (NULL == (s_ctx->cq = manager_->transport_->create_cq(s_ctx->ctx, CQ_ENTRIES))) {
       manager_->log(VERB_ERROR,"Failed to create completion queue\n");
       return errno;
     }
-    manager_->gcq = s_ctx->cq;
+    manager_->cqs_[cq_] = s_ctx->cq;
   } else {
-    s_ctx->cq = manager_->gcq;
+    s_ctx->cq = manager_->cqs_[cq_];
   }
 
-  if (rval = ibv_req_notify_cq(s_ctx->cq, 0)) {
+  if (rval = manager_->transport_->req_notify_cq(s_ctx->cq)) {
     return rval;
   }
 
@@ -161,7 +183,7 @@ int IBConn::build_context(struct rdma_cm_id *id) {
 void IBConn::destroy_context(void) {
 
   if (s_ctx && s_ctx->cq)
-    TEST_Z(ibv_destroy_cq(s_ctx->cq));
+    TEST_Z(manager_->transport_->destroy_cq(s_ctx->cq));
   if (s_ctx) {
     free(s_ctx);
     s_ctx = NULL;
@@ -171,7 +193,7 @@ void IBConn::destroy_context(void) {
 void IBConn::build_params(struct rdma_conn_param *params) {
   memset(params, 0, sizeof(*params));
 
-  params->initiator_depth = params->responder_resources = 1;
+  params->initiator_depth = params->responder_resources = MAX_RDMA_READS;
   params->rnr_retry_count = 7; /* infinite retry */
 }
 
@@ -181,9 +203,9 @@ int IBConn::build_qp_attr(struct ibv_qp_init_attr *qp_attr) {
   qp_attr->send_cq = s_ctx->cq;
   qp_attr->recv_cq = s_ctx->cq;
   qp_attr->qp_type = IBV_QPT_RC;
-  qp_attr->sq_sig_all = 1;
+  qp_attr->sq_sig_all = 0;   // WRs choose; see post_batch()
 
-  qp_attr->cap.max_send_wr = 10;
+  qp_attr->cap.max_send_wr = MAX_SEND_WR;
   qp_attr->cap.max_recv_wr = 10;
   qp_attr->cap.max_send_sge = 1;
   qp_attr->cap.max_recv_sge = 1;
@@ -201,12 +223,30 @@ void IBConn::destroy_connection() {
 
   destroy_context();
 
-  rdma_destroy_qp(s_conn->id);
+  if (s_conn->qp->srq)
+    manager_->detach_qp(s_conn->qp->qp_num);
+  manager_->transport_->destroy_qp(s_conn->id);
+
+  manager_->transport_->dereg_mr(s_conn->send_mr);
+  manager_->transport_->dereg_mr(ctrl_buf->mr);
+  free(ctrl_buf->msg);
+  free(ctrl_buf);
+  ctrl_buf = NULL;
 
-  ibv_dereg_mr(s_conn->send_mr);
+  // Shared receive buffers held behind a rendezvous read go back
+  for(; !rndv_held.empty(); rndv_held.pop_front()) {
+    if (rndv_held.front().first->instance == NULL)
+      manager_->repost_srq(cq_, rndv_held.front().first);
+  }
+  for(; !rndv_sending.empty(); rndv_sending.pop_front())
+    manager_->rndv_put(rndv_sending.front());
+  manager_->rndv_put(rndv_building);
+  manager_->rndv_put(rndv_recv);
+  manager_->rndv_put(rndv_last);
+  rndv_building = rndv_recv = rndv_last = NULL;
 
   for(int i=0; i<recv_bufs.size(); i++) {
-    ibv_dereg_mr(recv_bufs[i]->mr);
+    manager_->transport_->dereg_mr(recv_bufs[i]->mr);
     free(recv_bufs[i]->msg);
     free(recv_bufs[i]);
   }
@@ -215,7 +255,7 @@ void IBConn::destroy_connection() {
   for(struct mr_chain_node* node = s_conn->local_mrs; node != NULL; ) {
     struct mr_chain_node* next = node->next;
     if (node->location == MR_LOC_LOCAL) {
-      ibv_dereg_mr(node->mr);
+      manager_->transport_->dereg_mr(node->mr);
     }
     free(node);
     node = next;
@@ -225,7 +265,7 @@ void IBConn::destroy_connection() {
   free(s_conn->send_msg);
   free(send_buf);
 
-  rdma_destroy_id(s_conn->id);
+  manager_->transport_->destroy_id(s_conn->id);
 
   free(s_conn);
 
@@ -233,6 +273,11 @@ void IBConn::destroy_connection() {
 }
 
 void IBConn::on_completion(struct ibv_wc *wc) {
+  struct recv_buf* this_buf = (struct recv_buf*)(wc->wr_id);
+
+  // A failed receive from a shared queue still belongs to that queue
+  if (wc->status != IBV_WC_SUCCESS && this_buf->instance == NULL)
+    manager_->repost_srq(cq_, this_buf);
 
   if (wc->status != IBV_WC_SUCCESS && (s_conn->disconnecting ||
                                        s_conn->connected > CONN_READY)
@@ -261,8 +306,7 @@ void IBConn::on_completion(struct ibv_wc *wc) {
                 wc->opcode,wc->wr_id,((struct recv_buf*)wc->wr_id)->instance);
 */
 
-  struct recv_buf* this_buf = (struct recv_buf*)(wc->wr_id);
-  if (this_buf->instance != this)
+  if (this_buf->instance != this && this_buf->instance != NULL)
     die("Critical wr_id instance mismatch in on_completion: completion is not for this connection");
 
   IBC_INCREF();
@@ -273,6 +317,10 @@ void IBConn::on_completion(struct ibv_wc *wc) {
   else if (wc->opcode == IBV_WC_SEND)
     s_conn->send_nonce++;
 
+  // Unsignaled WRs before this one have completed too
+  if (!(wc->opcode & IBV_WC_RECV))
+    retire_send_queue();
+
   // Deal with the completion
   if (wc->opcode & IBV_WC_RECV) {
 
@@ -332,32 +380,23 @@ void IBConn::on_completion(struct ibv_wc *wc) {
         }
       }
 
-    } else { //tell our hooked app about it
-
-      s_conn->recv_state++;
-
-      if (on_recv_hook)
-        on_recv_hook(this_buf->msg->type,this_buf->msg,wc->byte_len,this,recv_hook_context);
+    } else if (rndv_recv != NULL && this_buf->msg->type != MSG_RNDV_DONE) {
+      // Keep it behind the message being read
+      rndv_held.push_back(std::make_pair(this_buf,(size_t)wc->byte_len));
+      IBC_DECREF();
+      return;
 
+    } else { //tell our hooked app about it
+      deliver(this_buf->msg,wc->byte_len);
     }
 
-    recv_pend_post.push(this_buf);
-    post_receives(s_conn); // done with buffer, now others can use it.
+    repost(this_buf); // done with buffer, now others can use it.
 
 
   } else if ((wc->opcode == IBV_WC_RDMA_READ | wc->opcode == IBV_WC_RDMA_WRITE) && s_conn->send_state >= SS_MR_SENT && s_conn->recv_state >= RS_MR_RECV) {
-    if (on_rdma_recv_hook) {
+    complete_rdma(wc->wr_id);
 
-#if KEY_VAL_PAIRTYPE==KVPT_CHARP_CHARP
-      on_rdma_recv_hook(this_buf->msg->type,this,recv_hook_context);
-#else
-
-      on_rdma_recv_hook(this_buf->msg->type,this,recv_hook_context);
-#endif
-
-    }
-
-  } else if (wc->opcode == IBV_WC_SEND) {
+  } else if (wc->opcode == IBV_WC_SEND && this_buf != ctrl_buf) {
     if (s_conn->send_state == SS_MR_SENDING) {
 
       if (s_conn->sending_mrs == NULL) {
@@ -397,17 +436,7 @@ int IBConn::rdma_push(uintptr_t addr, size_t length, uintptr_t local_addr, struc
   static struct ibv_send_wr wr, *bad_wr = NULL;
   static struct ibv_sge sge;
 
-  if ((void*)addr < remote_mr->addr ||
-      (void*)((char*)addr+length) > (void*)((char*)remote_mr->addr + remote_mr->length))
-  {
-    manager_->log(VERB_ERROR,
-                  "Caught and prevented invalid memory access at %p of size %zu\n",
-                  (void*)addr,length);
-    manager_->log(VERB_ERROR,
-                  "Valid for this MR are %p-%p\n",remote_mr->addr,
-                  (void*)((char*)remote_mr->addr+remote_mr->length));
-    exit(-1);
-  }
+  check_rdma_bounds(addr,length,remote_mr);
   wr.wr_id = (uintptr_t)(send_buf);
   wr.opcode = IBV_WR_RDMA_WRITE;
   wr.sg_list = &sge;
@@ -420,13 +449,27 @@ int IBConn::rdma_push(uintptr_t addr, size_t length, uintptr_t local_addr, struc
   wr.wr.rdma.remote_addr = (uintptr_t)addr;
   sge.length = length;
 
-  return ibv_post_send(s_conn->qp, &wr, &bad_wr);
+  int rval = manager_->transport_->post_send(s_conn->qp, &wr, &bad_wr);
+  if (!rval)
+    sq_record(wr.wr_id, true, true);
+  return rval;
 
 }
 
 uint64_t pilaf_n_rdma_read = 0;
 
 int IBConn::rdma_fetch(uintptr_t addr, size_t length, struct ibv_mr* remote_mr, ibv_mr* local_mr) {
+  return rdma_fetch(addr, length, (uintptr_t)(local_mr->addr), remote_mr, local_mr);
+}
+
+/**
+ * RDMA read into an arbitrary offset of local_mr, so several reads
+ * can be outstanding into disjoint parts of one buffer. With a tag,
+ * the completion goes to the rdma tag hook along with tag->op instead
+ * of the rdma recv hook.
+ */
+int IBConn::rdma_fetch(uintptr_t addr, size_t length, uintptr_t local_addr, struct ibv_mr* remote_mr, ibv_mr* local_mr,
+                       struct rdma_tag* tag) {
   // XXX TODO Solve the issue with segfault on the first ibv_post_send after
   // a reconnect, which I suspect is due to it trying to clean up the last failed
   // rdma_fetch. Make freeing of s_conn structure get deferred until after the first ibv_post_send
@@ -436,17 +479,7 @@ int IBConn::rdma_fetch(uintptr_t addr, size_t length, struct ibv_mr* remote_mr,
 //  struct ibv_send_wr* bad_wr = NULL;
   pilaf_n_rdma_read++;
 
-  if ((void*)addr < remote_mr->addr ||
-      (void*)((char*)addr+length) > (void*)((char*)remote_mr->addr + remote_mr->length))
-  {
-    manager_->log(VERB_ERROR,
-                  "Caught and prevented invalid memory access at %p of size %zu\n",
-                  (void*)addr,length);
-    manager_->log(VERB_ERROR,
-                  "Valid for this MR are %p-%p\n",remote_mr->addr,
-                  (void*)((char*)remote_mr->addr+remote_mr->length));
-    exit(-1);
-  }
+  check_rdma_bounds(addr,length,remote_mr);
 
 /*
   s_conn->ts_wr_rf.wr_id = (uintptr_t)(send_buf);
@@ -461,30 +494,202 @@ int IBConn::rdma_fetch(uintptr_t addr, size_t length, struct ibv_mr* remote_mr,
   s_conn->ts_wr_rf.wr.rdma.remote_addr = (uintptr_t)addr;
   s_conn->ts_sge_rf.length = length;
 
-  return ibv_post_send(s_conn->qp, &(s_conn->ts_wr_rf), &bad_wr);  //bad_wr will essentially get thrown out; no biggie
+  return manager_->transport_->post_send(s_conn->qp, &(s_conn->ts_wr_rf), &bad_wr);  //bad_wr will essentially get thrown out; no biggie
 */
-  wr.wr_id = (uintptr_t)(send_buf);
+  if (tag) {
+    tag->buf.instance = this;
+    wr.wr_id = (uintptr_t)tag;
+  } else {
+    wr.wr_id = (uintptr_t)(send_buf);
+  }
   wr.opcode = IBV_WR_RDMA_READ;
   wr.sg_list = &sge;
   wr.num_sge = 1;
   wr.send_flags = IBV_SEND_SIGNALED;
   wr.wr.rdma.rkey = remote_mr->rkey;
-  sge.addr = (uintptr_t)(local_mr->addr);
+  sge.addr = local_addr;
   sge.lkey = local_mr->lkey;
 
   wr.wr.rdma.remote_addr = (uintptr_t)addr;
   sge.length = length;
 
-  return ibv_post_send(s_conn->qp, &wr, &bad_wr);
+  int rval = manager_->transport_->post_send(s_conn->qp, &wr, &bad_wr);
+  if (!rval)
+    sq_record(wr.wr_id, true, true);
+  return rval;
+
+}
+
+/**
+ * Queue an RDMA read for the next post_batch(). Same arguments as
+ * rdma_fetch().
+ */
+void IBConn::rdma_fetch_batch(uintptr_t addr, size_t length, uintptr_t local_addr, struct ibv_mr* remote_mr,
+                              ibv_mr* local_mr, struct rdma_tag* tag) {
+  struct ibv_send_wr wr;
+  struct ibv_sge sge;
+
+  pilaf_n_rdma_read++;
+  check_rdma_bounds(addr,length,remote_mr);
+
+  memset(&wr, 0, sizeof(wr));
+  if (tag) {
+    tag->buf.instance = this;
+    wr.wr_id = (uintptr_t)tag;
+  } else {
+    wr.wr_id = (uintptr_t)(send_buf);
+  }
+  wr.opcode = IBV_WR_RDMA_READ;
+  wr.num_sge = 1;
+  wr.wr.rdma.rkey = remote_mr->rkey;
+  wr.wr.rdma.remote_addr = (uintptr_t)addr;
+
+  sge.addr = local_addr;
+  sge.length = length;
+  sge.lkey = local_mr->lkey;
+
+  batch_wr.push_back(wr);
+  batch_sge.push_back(sge);
+}
+
+/**
+ * Post queued RDMA reads as one chain, i.e. with a single doorbell.
+ * Only every SIGNAL_INTERVAL-th WR and the last one generate a CQE;
+ * the others are completed by retire_send_queue() when a later
+ * signaled WR completes, since an RC send queue completes in order.
+ */
+int IBConn::post_batch(void) {
+  struct ibv_send_wr* bad_wr = NULL;
+  size_t n = batch_wr.size();
+
+  if (sq_credits() < (int)n)
+    n = (sq_credits() > 0) ? sq_credits() : 0;
+  if (n == 0)
+    return batch_wr.size();
+
+  for(size_t i = 0; i < n; i++) {
+    batch_wr[i].sg_list = &batch_sge[i];
+    batch_wr[i].next = (i+1 < n) ? &batch_wr[i+1] : NULL;
+    batch_wr[i].send_flags = (i+1 == n || (i+1) % SIGNAL_INTERVAL == 0) ? IBV_SEND_SIGNALED : 0;
+  }
+
+  if (manager_->transport_->post_send(s_conn->qp, &batch_wr[0], &bad_wr)) {
+    manager_->log(VERB_ERROR,"Error: unable to post batch of %zu WRs with error %d\n",n,errno);
+    batch_wr.clear();
+    batch_sge.clear();
+    return -1;
+  }
+
+  for(size_t i = 0; i < n; i++)
+    sq_record(batch_wr[i].wr_id, batch_wr[i].send_flags & IBV_SEND_SIGNALED, true);
+
+  batch_wr.erase(batch_wr.begin(), batch_wr.begin()+n);
+  batch_sge.erase(batch_sge.begin(), batch_sge.begin()+n);
+  return batch_wr.size();
+}
+
+void IBConn::sq_record(uint64_t wr_id, bool signaled, bool rdma) {
+  struct sq_entry e;
+  e.wr_id = wr_id;
+  e.signaled = signaled;
+  e.rdma = rdma;
+  sq_pending.push_back(e);
+}
+
+/**
+ * Called for every send-side completion: completes the unsignaled
+ * WRs posted before the signaled one that just completed, then
+ * drops that one too.
+ */
+void IBConn::retire_send_queue(void) {
+  while (!sq_pending.empty()) {
+    struct sq_entry e = sq_pending.front();
+    sq_pending.pop_front();
+    if (e.signaled)
+      return;
+    if (e.rdma)
+      complete_rdma(e.wr_id);
+  }
+}
+
+/**
+ * Hand an RDMA completion to the tag hook or the rdma recv hook, or
+ * finish a rendezvous receive.
+ */
+void IBConn::complete_rdma(uint64_t wr_id) {
+  if (wr_id == (uintptr_t)&rndv_tag) {
+    rndv_finish();
+
+  } else if (wr_id != (uintptr_t)send_buf) {
+    // Tagged read
+    if (on_rdma_tag_hook)
+      on_rdma_tag_hook(((struct rdma_tag*)wr_id)->op,this,rdma_tag_hook_context);
+
+  } else if (on_rdma_recv_hook) {
+    on_rdma_recv_hook(send_buf->msg->type,this,recv_hook_context);
+  }
+}
+
+void IBConn::check_rdma_bounds(uintptr_t addr, size_t length, struct ibv_mr* remote_mr) {
+  if ((void*)addr < remote_mr->addr ||
+      (void*)((char*)addr+length) > (void*)((char*)remote_mr->addr + remote_mr->length))
+  {
+    manager_->log(VERB_ERROR,
+                  "Caught and prevented invalid memory access at %p of size %zu\n",
+                  (void*)addr,length);
+    manager_->log(VERB_ERROR,
+                  "Valid for this MR are %p-%p\n",remote_mr->addr,
+                  (void*)((char*)remote_mr->addr+remote_mr->length));
+    exit(-1);
+  }
+}
 
+message* IBConn::get_send_buf(size_t len) {
+  size_t msg_size = sizeof(s_conn->send_msg->type)+len;
+
+  if (msg_size <= send_buf_size)
+    return s_conn->send_msg;
+
+  if (rndv_building && rndv_building->size < msg_size) {
+    manager_->rndv_put(rndv_building);
+    rndv_building = NULL;
+  }
+  if (rndv_building == NULL)
+    rndv_building = manager_->rndv_get(msg_size);
+  return rndv_building->msg;
 }
 
 void IBConn::send_message_ext(int type, char* data, size_t data_len) {
+  size_t msg_size = sizeof(s_conn->send_msg->type)+data_len;
+  struct rndv_buf* rb = rndv_building;
+
+  rndv_building = NULL;
+
+  if (msg_size > send_buf_size) {
+    // Too large for the peer's receive buffers: say where to read it
+    if (rb == NULL || rb->size < msg_size || data != (char*)&(rb->msg->mdata)) {
+      struct rndv_buf* copy = manager_->rndv_get(msg_size);
+      memcpy((char*)&(copy->msg->mdata),data,data_len);
+      manager_->rndv_put(rb);
+      rb = copy;
+    }
+    rb->msg->type = type;
+    rndv_sending.push_back(rb);
+
+    struct rndv_message* rmsg = (struct rndv_message*)(s_conn->send_msg);
+    rmsg->type = MSG_RNDV;
+    rmsg->rkey = rb->mr->rkey;
+    rmsg->addr = (uintptr_t)rb->msg;
+    rmsg->len = msg_size;
+    send_message(s_conn,sizeof(struct rndv_message));
+    return;
+  }
 
   // Copy the data to the proper buffer, if necessary
   if (data != (char*)&(s_conn->send_msg->mdata)) {
     memcpy((char*)&(s_conn->send_msg->mdata),data,data_len);
   }
+  manager_->rndv_put(rb);   // built in more room than it needed
 
   // Set the message type and send it
   s_conn->send_msg->type = type;
@@ -498,7 +703,7 @@ void IBConn::disconnect() {
   if (s_conn->connected >= CONN_SETUP && s_conn->connected < CONN_TEARD && s_conn->disconnecting == 0) {
     s_conn->disconnecting = 1;
     s_conn->connected = CONN_TEARD;
-    if (rdma_disconnect(s_conn->id)) {
+    if (manager_->transport_->disconnect(s_conn->id)) {
       manager_->log(VERB_WARN,"Warning: connection was not fit for rdma_disconnect() in disconnect()\n");
     }
 
@@ -517,8 +722,8 @@ void IBConn::disconnect() {
 
 }
 
-void IBConn::reject(rdma_cm_id* id, const char* imm = NULL) {
-  if (rdma_reject(id, imm, (NULL==imm)?0:1+strlen(imm))) {
+void IBConn::reject(IBConnManager* manager, rdma_cm_id* id, const char* imm) {
+  if (manager->transport_->reject(id, imm, (NULL==imm)?0:1+strlen(imm))) {
     diewithcode("rdma_reject failed",errno);
   }
 }
@@ -527,6 +732,123 @@ void IBConn::on_connect() {
   s_conn->connected = CONN_SETUP;
 }
 
+void IBConn::repost(struct recv_buf* buf) {
+  if (buf->instance == NULL) {
+    manager_->repost_srq(cq_, buf);
+  } else {
+    recv_pend_post.push(buf);
+    post_receives(s_conn);
+  }
+}
+
+/**
+ * Handle a received message other than an MR.
+ */
+void IBConn::deliver(struct message* msg, size_t len) {
+  s_conn->recv_state++;
+
+  if (msg->type == MSG_RNDV) {
+    rndv_start((struct rndv_message*)msg);
+
+  } else if (msg->type == MSG_RNDV_DONE) {
+    if (!rndv_sending.empty()) {
+      manager_->rndv_put(rndv_sending.front());
+      rndv_sending.pop_front();
+    }
+
+  } else {
+    // The last rendezvous message was good until this one
+    manager_->rndv_put(rndv_last);
+    rndv_last = NULL;
+
+    if (on_recv_hook)
+      on_recv_hook(msg->type,msg,len,this,recv_hook_context);
+  }
+}
+
+/**
+ * Read a rendezvous message into a buffer from the pool. Later
+ * messages wait in rndv_held until it has been delivered.
+ */
+void IBConn::rndv_start(struct rndv_message* rmsg) {
+  struct ibv_send_wr wr, *bad_wr = NULL;
+  struct ibv_sge sge;
+
+  rndv_recv = manager_->rndv_get(rmsg->len);
+  rndv_recv_len = rmsg->len;
+
+  memset(&wr, 0, sizeof(wr));
+  wr.wr_id = (uintptr_t)&rndv_tag;
+  wr.opcode = IBV_WR_RDMA_READ;
+  wr.sg_list = &sge;
+  wr.num_sge = 1;
+  wr.send_flags = IBV_SEND_SIGNALED;
+  wr.wr.rdma.rkey = rmsg->rkey;
+  wr.wr.rdma.remote_addr = rmsg->addr;
+
+  sge.addr = (uintptr_t)rndv_recv->msg;
+  sge.length = rmsg->len;
+  sge.lkey = rndv_recv->mr->lkey;
+
+  if (manager_->transport_->post_send(s_conn->qp, &wr, &bad_wr)) {
+    manager_->log(VERB_ERROR,"Error: unable to read %zu-byte rendezvous message with error %d\n",
+                  rndv_recv_len,errno);
+    disconnect();
+    return;
+  }
+  sq_record(wr.wr_id, true, true);
+}
+
+/**
+ * The rendezvous read is done: release the sender's buffer, deliver
+ * the message, then what arrived behind it.
+ */
+void IBConn::rndv_finish(void) {
+  send_ctrl(MSG_RNDV_DONE);
+
+  manager_->rndv_put(rndv_last);
+  rndv_last = rndv_recv;
+  rndv_recv = NULL;
+
+  if (on_recv_hook)
+    on_recv_hook(rndv_last->msg->type,rndv_last->msg,rndv_recv_len,this,recv_hook_context);
+
+  while (rndv_recv == NULL && !rndv_held.empty()) {
+    std::pair<struct recv_buf*,size_t> held = rndv_held.front();
+    rndv_held.pop_front();
+    deliver(held.first->msg,held.second);
+    repost(held.first);
+  }
+}
+
+/**
+ * Send a bare message type from ctrl_buf, leaving send_msg alone.
+ */
+void IBConn::send_ctrl(int type) {
+  struct ibv_send_wr wr, *bad_wr = NULL;
+  struct ibv_sge sge;
+
+  ctrl_buf->msg->type = type;
+
+  memset(&wr, 0, sizeof(wr));
+  wr.wr_id = (uintptr_t)ctrl_buf;
+  wr.opcode = IBV_WR_SEND;
+  wr.sg_list = &sge;
+  wr.num_sge = 1;
+  wr.send_flags = IBV_SEND_SIGNALED | IBV_SEND_INLINE;
+
+  sge.addr = (uintptr_t)ctrl_buf->msg;
+  sge.length = sizeof(ctrl_buf->msg->type);
+  sge.lkey = ctrl_buf->mr->lkey;
+
+  if (manager_->transport_->post_send(s_conn->qp, &wr, &bad_wr)) {
+    manager_->log(VERB_ERROR,"Error: unable to send control message %d with error %d\n",type,errno);
+    disconnect();
+    return;
+  }
+  sq_record(wr.wr_id, true, false);
+}
+
 void IBConn::post_receives(struct connection *conn) {
   struct ibv_recv_wr wr, *bad_wr = NULL;
   struct ibv_sge sge;
@@ -544,7 +866,7 @@ void IBConn::post_receives(struct connection *conn) {
     sge.length = recv_buf_size;
     sge.lkey = thispend->mr->lkey;
 
-    int rv = ibv_post_recv(conn->qp, &wr, &bad_wr);
+    int rv = manager_->transport_->post_recv(conn->qp, &wr, &bad_wr);
     if (rv) diewithcode("Failed to ibv_post_recv",rv);
 
     recv_pend_post.pop();
@@ -553,8 +875,8 @@ void IBConn::post_receives(struct connection *conn) {
 
 void IBConn::register_memory(struct connection *conn) {
 
-
-  for (int i=0; i<RECV_BUFS; i++) {
+  // With a shared receive queue, the manager's buffers stand in
+  for (int i=0; i<RECV_BUFS && conn->qp->srq == NULL; i++) {
     struct recv_buf* thisbuf = (struct recv_buf*)malloc(sizeof(struct recv_buf));
     struct message* recv_msg = (struct message*)malloc(recv_buf_size);
     struct ibv_mr* recv_mr = NULL;
@@ -564,7 +886,7 @@ void IBConn::register_memory(struct connection *conn) {
       die("");
     }
 
-    if (NULL == (recv_mr = ibv_reg_mr(
+    if (NULL == (recv_mr = manager_->transport_->reg_mr(
       manager_->gpd,
       recv_msg,
       recv_buf_size,
@@ -589,7 +911,7 @@ void IBConn::register_memory(struct connection *conn) {
   send_buf = (struct recv_buf*)malloc(sizeof(struct recv_buf));
   conn->send_msg = (struct message*)malloc(send_buf_size);
 
-  if (NULL == (conn->send_mr = ibv_reg_mr(
+  if (NULL == (conn->send_mr = manager_->transport_->reg_mr(
     manager_->gpd,
     conn->send_msg,
     send_buf_size,
@@ -604,6 +926,20 @@ void IBConn::register_memory(struct connection *conn) {
   send_buf->mr = conn->send_mr;
   send_buf->instance = this;
 
+  ctrl_buf = (struct recv_buf*)malloc(sizeof(struct recv_buf));
+  ctrl_buf->msg = (struct message*)malloc(sizeof(struct message));
+  ctrl_buf->instance = this;
+
+  if (NULL == (ctrl_buf->mr = manager_->transport_->reg_mr(
+    manager_->gpd,
+    ctrl_buf->msg,
+    sizeof(struct message),
+    IBV_ACCESS_LOCAL_WRITE)))
+  {
+    manager_->log(VERB_ERROR,"Failed to register ctrl_mr memory region at %p\n",ctrl_buf->msg);
+    diewithcode("Failed with code",errno);
+  }
+
 }
 
 void IBConn::send_message(struct connection *conn, int msg_size) {
@@ -635,10 +971,11 @@ void IBConn::send_message(struct connection *conn, int msg_size) {
 
   while (!conn->connected);
 
-  if (rval = (ibv_post_send(conn->qp, &wr, &bad_wr))) {
+  if (rval = (manager_->transport_->post_send(conn->qp, &wr, &bad_wr))) {
     manager_->log(VERB_ERROR,"Error: unable to ibv_post_send() with error %d and bad_wr %p\n",errno,bad_wr);
     die("");
   }
+  sq_record(wr.wr_id, true, false);
 }
 
 int IBConn::send_head_mr() {
@@ -661,6 +998,7 @@ int IBConn::send_head_mr() {
   free(node);
 
   send_message(s_conn,sizeof(struct mrmessage));
+  return 0;
 }
 
 // Tell peer about my memory region
@@ -767,6 +1105,13 @@ void IBConn::set_rdma_recv_hook(void(*rdma_recv_hook)(int,IBConn*,void*),
   rdma_recv_hook_context = rdma_recv_context;
 }
 
+void IBConn::set_rdma_tag_hook(void(*rdma_tag_hook)(void*,IBConn*,void*),
+  void* rdma_tag_context)
+{
+  on_rdma_tag_hook = rdma_tag_hook;
+  rdma_tag_hook_context = rdma_tag_context;
+}
+
 void IBConn::set_mr_hook(void(*mr_hook)(int* status, struct ibv_mr* mr, int* mr_id, void*),
   void* mr_context)
 {
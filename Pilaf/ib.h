@@ -9,6 +9,8 @@
 #include <rdma/rdma_cma.h>
 #include <vector>
 #include <queue>
+#include <deque>
+#include <utility>
 
 #define TEST_NZ(x) do { if ( (x)) die("error: " #x " failed (returned non-zero)." ); } while (0)
 #define TEST_Z(x)  do { if (!(x)) die("error: " #x " failed (returned zero/null)."); } while (0)
@@ -27,6 +29,13 @@ const int RDMA_BUFFER_SIZE = 1024 * 10;
 const int CQ_ACK_THRESH = 16;
 const int RECV_BUFS = 8;
 const int MAX_INLINE_SEND = 400; //bytes
+const int MAX_SEND_WR = 128;        // outstanding sends and RDMA ops per QP
+const int MAX_RDMA_READS = 16;      // RDMA reads in flight per QP, at either end
+const int CQ_ENTRIES = 4096;        // shared by all connections on a CQ
+const int CQ_POLL_BATCH = 32;       // completions taken from a CQ per poll
+const int SIGNAL_INTERVAL = 16;     // a batch signals at least every Nth WR
+const int MSG_EAGER_SIZE = 4096;    // receive buffer size; larger messages go by rendezvous
+const int RNDV_POOL_KEEP = 4;       // idle rendezvous buffers kept per size class
 
 #pragma pack(push)
 #pragma pack(4)
@@ -48,6 +57,8 @@ enum conn_state {
 enum msg_type {
   MSG_MR,
   MSG_DONE,
+  MSG_RNDV,         // a message too large to send: read it from here
+  MSG_RNDV_DONE,    // the oldest such message has been read
 
   MSG_USER_FIRST
 };
@@ -92,6 +103,19 @@ struct mrmessage {
   bool last;
 };
 
+/**
+ * Stands in for a message larger than the peer's receive buffers. The
+ * receiver reads len bytes from addr into a buffer of its own, hands
+ * them to its receive hook as if they had been sent, and answers
+ * MSG_RNDV_DONE so the sender can reuse the memory.
+ */
+struct rndv_message {
+  int type;
+  uint32_t rkey;
+  uint64_t addr;
+  uint64_t len;
+};
+
 struct context {
   struct ibv_context *ctx;
   struct ibv_pd *pd;
@@ -107,12 +131,37 @@ struct mr_chain_node {
   struct mr_chain_node* next;	//pointer to next node in list, or null
 };
 
+/**
+ * A receive buffer, or the wr_id of a send. instance is the owning
+ * IBConn, or NULL for buffers posted to a shared receive queue, whose
+ * completions the manager routes by QP number.
+ */
 struct recv_buf {
   struct message* msg;
   struct ibv_mr* mr;
   void* instance;
 };
 
+/**
+ * A registered buffer from the manager's rendezvous pool; size is the
+ * capacity of its size class.
+ */
+struct rndv_buf {
+  struct message* msg;
+  struct ibv_mr* mr;
+  size_t size;
+};
+
+/**
+ * wr_id of a tagged RDMA read. Starts like a recv_buf so the manager
+ * can find the owning connection, and carries the caller's operation
+ * so completions of many outstanding reads can be told apart.
+ */
+struct rdma_tag {
+  struct recv_buf buf;
+  void* op;
+};
+
 struct connection {
 
   struct rdma_cm_id *id;
@@ -150,6 +199,16 @@ const char* role_to_str(int s_role);
 
 class IBConnManager;
 
+/**
+ * A WR on the send queue that has not completed yet. Unsignaled WRs
+ * complete implicitly with the next signaled one.
+ */
+struct sq_entry {
+  uint64_t wr_id;
+  bool signaled;
+  bool rdma;
+};
+
 class IBConn {
 private:
   int build_context(struct rdma_cm_id* id);
@@ -157,6 +216,8 @@ private:
   char* get_peer_message_region(struct connection *conn);
   void on_completion(struct ibv_wc *);
   void post_receives(struct connection *conn);
+  void repost(struct recv_buf* buf);
+  void deliver(struct message* msg, size_t len);
   void register_memory(struct connection *conn);
   void send_message(struct connection *conn, int msg_size);
   int  send_head_mr();
@@ -170,10 +231,33 @@ private:
 
   // Send & RDMA buffers
   struct recv_buf* send_buf;
+  struct recv_buf* ctrl_buf;        // MSG_RNDV_DONE, sent beside send_buf
+
+  // Rendezvous messages; see struct rndv_message
+  struct rndv_buf* rndv_building;   // from get_send_buf(), not sent yet
+  std::deque<struct rndv_buf*> rndv_sending;  // sent, oldest first, until MSG_RNDV_DONE
+  struct rndv_buf* rndv_recv;       // being read from the peer
+  size_t rndv_recv_len;
+  struct rndv_buf* rndv_last;       // last one delivered, valid until the next message
+  struct rdma_tag rndv_tag;         // wr_id of the read
+  std::deque<std::pair<struct recv_buf*,size_t> > rndv_held;  // arrived during the read
+  void rndv_start(struct rndv_message* rmsg);
+  void rndv_finish(void);
+  void send_ctrl(int type);
+
+  // Batched posting and send queue tracking
+  std::vector<struct ibv_send_wr> batch_wr;
+  std::vector<struct ibv_sge> batch_sge;
+  std::deque<struct sq_entry> sq_pending;   // posted, oldest first
+  void sq_record(uint64_t wr_id, bool signaled, bool rdma);
+  void retire_send_queue(void);
+  void complete_rdma(uint64_t wr_id);
+  void check_rdma_bounds(uintptr_t addr, size_t length, struct ibv_mr* remote_mr);
 
   // Used for the callbacks
   void (*on_recv_hook)(int, struct message*, size_t, IBConn*, void*);
   void (*on_rdma_recv_hook)(int, IBConn*, void*);
+  void (*on_rdma_tag_hook)(void*, IBConn*, void*);
   void (*on_ready_hook)(void*);
   void (*on_mr_hook)(int*, struct ibv_mr*, int*, void*);
   void (*on_send_complete_hook)(void*);
@@ -181,11 +265,13 @@ private:
   // Contexts for the callbacks
   void* recv_hook_context;
   void* rdma_recv_hook_context;
+  void* rdma_tag_hook_context;
   void* ready_hook_context;
   void* mr_hook_context;
   void* send_complete_hook_context;
 
   IBConnManager* manager_;
+  int cq_;                          // which of the manager's CQs this connection uses
 
 public:
   IBConn(IBConnManager* manager, size_t msgbuf_size);
@@ -198,7 +284,7 @@ public:
 
   void on_connect();
   void disconnect();
-  static void reject(struct rdma_cm_id *id, const char* imm);
+  static void reject(IBConnManager* manager, struct rdma_cm_id *id, const char* imm = NULL);
   void *get_local_message_region();
   int send_mr();
 
@@ -206,6 +292,7 @@ public:
   // The last void* arg to all these hooks is the context
   void set_recv_hook(void(*recv_hook)(int,struct message*,size_t,IBConn*,void*), void* recv_context);
   void set_rdma_recv_hook(void(*rdma_recv_hook)(int,/*void*,void*,*/IBConn*,void*), void* rdma_recv_context);
+  void set_rdma_tag_hook(void(*rdma_tag_hook)(void* op,IBConn*,void*), void* rdma_tag_context);
   void set_ready_hook(void(*ready_hook)(/*void*,size_t,*/ void*), void* rdma_recv_context);
   void set_mr_hook(void(*mr_hook)(int* status, struct ibv_mr* mr, int* mr_id, void*), void* mr_context);
   void set_send_complete_hook(void(*send_complete_hook)(void*), void* send_complete_context);
@@ -213,10 +300,25 @@ public:
   // External messages/commands
   void send_message_ext(int type, char* data, size_t data_len);
   int rdma_fetch(uintptr_t addr, size_t length, struct ibv_mr* remote_mr, ibv_mr* local_mr);
+  int rdma_fetch(uintptr_t addr, size_t length, uintptr_t local_addr, struct ibv_mr* remote_mr, ibv_mr* local_mr,
+                 struct rdma_tag* tag = NULL);
   int rdma_push(uintptr_t addr, size_t length, uintptr_t local_addr, struct ibv_mr* remote_mr, ibv_mr* local_mr);
 
-  message* get_send_buf(void) { return s_conn->send_msg; }
+  // Batched RDMA reads: queue any number, then post them all behind one
+  // doorbell. post_batch() signals only every SIGNAL_INTERVAL-th WR and
+  // the last, posts no more than the send queue has room for, and
+  // returns how many WRs are still queued (or -1 on error).
+  void rdma_fetch_batch(uintptr_t addr, size_t length, uintptr_t local_addr, struct ibv_mr* remote_mr,
+                        ibv_mr* local_mr, struct rdma_tag* tag = NULL);
+  int post_batch(void);
+  int sq_credits(void) { return MAX_SEND_WR - (int)sq_pending.size(); }
+
+  // Buffer to build a message of len bytes after the type in, to be
+  // passed to send_message_ext(); beyond the receive buffer size it is
+  // a rendezvous buffer
+  message* get_send_buf(size_t len = 0);
   int is_connected(void) { return (s_conn->connected); }
+  int cq_index(void) { return cq_; }
 
   // Connection and management
   struct connection *s_conn;
@@ -20,35 +20,36 @@
  ***********************************************/
 
 #include "ibman.h"
+#include <algorithm>
 
-IBConnManager::IBConnManager(int role) {
+/**
+ * With no transport given, the PILAF_TRANSPORT environment variable
+ * picks one (see transport_create()).
+ */
+IBConnManager::IBConnManager(int role, Transport* transport) {
  gpd = NULL;
- gcq = NULL;
+ cqs_.assign(1, (struct ibv_cq*)NULL);
  gec = NULL;
  global_mrs = NULL;
  n_global_mrs = 0;
  s_role = role;
  verb_ = VERB_ERROR;
+ srq_depth_ = 0;
+ srq_buf_size_ = 0;
+ pthread_mutex_init(&lock_, NULL);
+ transport_ = transport ? transport : transport_create(NULL);
 
- // Create shared event channel
- if (NULL == (gec = rdma_create_event_channel())) {
+ // Create shared, non-blocking event channel
+ if (NULL == (gec = transport_->create_event_channel())) {
    log(VERB_ERROR,"Failed to create global event channel\n"); 
    die("");
  }
 
- // Change the blocking mode of the event channel
- int flags = fcntl(gec->fd, F_GETFL);
- int rc = fcntl(gec->fd, F_SETFL, flags | O_NONBLOCK);
- if (rc < 0) {
-   log(VERB_ERROR,"Failed to change file descriptor of event channel\n");
-   die("");
- }
-
 }
 
 struct ibv_mr* IBConnManager::create_mr(void* addr, size_t length, int flags, enum mr_scope scope, IBConn* IBC) {
   struct ibv_mr* rval;
-  if (NULL == (rval = ibv_reg_mr(
+  if (NULL == (rval = transport_->reg_mr(
     /*(scope == MR_SCOPE_GLOBAL?*/IBC->s_conn->id->qp->pd/*global_pd*/ /*:IBC->s_ctx->pd)*/, 
     addr,
     length,
@@ -61,37 +62,106 @@ struct ibv_mr* IBConnManager::create_mr(void* addr, size_t length, int flags, en
 }
 
 int IBConnManager::poll_cq(int do_not_terminate) {
-  struct rdma_cm_event *event = NULL;
+  int rval;
 
   do {
 
-    if (gcq) {
-      // If we get a completion queue event, deal with it.
-      // Unless we're disconnecting, in which case failures are expected.
-      while (ibv_poll_cq(gcq, 1, &wc))
-        ((IBConn*)((struct recv_buf*)wc.wr_id)->instance)->on_completion(&wc);
+    // If we get completion queue events, deal with them.
+    // Unless we're disconnecting, in which case failures are expected.
+    for(int i = 0; i < (int)cqs_.size(); i++) {
+      int n;
+      while ((n = poll_cq_batch(i, wc, CQ_POLL_BATCH)) > 0) {
+        for(int j = 0; j < n; j++)
+          complete(&wc[j]);
+        if (n < CQ_POLL_BATCH)
+          break;
+      }
     }
 
-    if (gec) {
-      // Poll event channel
-      int rgce_rval;
-      if ((rgce_rval = rdma_get_cm_event(gec, &event)) != 0) {
-        if (errno != EAGAIN)
-         return errno;
-      } else {
+    if (rval = poll_events())
+      return rval;
+
+  } while(do_not_terminate);
+
+  return 0;
+}
 
-        //events are waiting
-        struct rdma_cm_event event_copy;
+/**
+ * Spread connections over n CQs; see new_conn().
+ */
+void IBConnManager::set_cq_count(int n) {
+  for(int i = 0; i < (int)cqs_.size(); i++) {
+    if (cqs_[i] != NULL)
+      die("BUG: set_cq_count() after a CQ was created");
+  }
+  cqs_.assign((n < 1) ? 1 : n, (struct ibv_cq*)NULL);
+}
 
-        memcpy(&event_copy, event, sizeof(*event));
-        rdma_ack_cm_event(event);
+/**
+ * Take up to n completions from one CQ, without handling them.
+ */
+int IBConnManager::poll_cq_batch(int cq, struct ibv_wc* wcs, int n) {
+  if (cqs_[cq] == NULL)
+    return 0;
+  return transport_->poll_cq(cqs_[cq], n, wcs);
+}
 
-        if (on_event_hook(&event_copy,event_hook_context,event_copy.id->context))
-          return 1;
+/**
+ * Hand a completion to the connection it belongs to. A shared receive
+ * buffer names no connection, so its QP does; one whose connection is
+ * gone is simply posted again.
+ */
+void IBConnManager::complete(struct ibv_wc* wc) {
+  struct recv_buf* buf = (struct recv_buf*)wc->wr_id;
+  IBConn* conn = (IBConn*)buf->instance;
+  int cq = -1;
+
+  if (conn == NULL) {
+    // No lock_ here; see qp_conns_
+    std::map<uint32_t,IBConn*>::iterator it = qp_conns_.find(wc->qp_num);
+    if (it == qp_conns_.end()) {
+      pthread_mutex_lock(&lock_);
+      for(int i = 0; i < (int)srq_bufs_.size() && cq < 0; i++) {
+        if (std::find(srq_bufs_[i].begin(), srq_bufs_[i].end(), buf) != srq_bufs_[i].end())
+          cq = i;
       }
+      pthread_mutex_unlock(&lock_);
+
+      if (cq >= 0)
+        repost_srq(cq, buf);
+      return;
     }
+    conn = it->second;
+  }
 
-  } while(do_not_terminate);
+  conn->on_completion(wc);
+}
+
+/**
+ * Handle at most one connection event. Returns nonzero when the event
+ * channel fails or the event hook asks to stop.
+ */
+int IBConnManager::poll_events(void) {
+  struct rdma_cm_event *event = NULL;
+
+  if (gec) {
+    // Poll event channel
+    int rgce_rval;
+    if ((rgce_rval = transport_->get_cm_event(gec, &event)) != 0) {
+      if (errno != EAGAIN)
+       return errno;
+    } else {
+
+      //events are waiting
+      struct rdma_cm_event event_copy;
+
+      memcpy(&event_copy, event, sizeof(*event));
+      transport_->ack_cm_event(event);
+
+      if (on_event_hook(&event_copy,event_hook_context,event_copy.id->context))
+        return 1;
+    }
+  }
 
   return 0;
 }
@@ -158,7 +228,7 @@ int IBConnManager::unset_mr(enum mr_scope scope, int mr_id, IBConn* IBC) {
   while (node != NULL) {
     if (node->mr_id == mr_id) {
       if (node->location == MR_LOC_LOCAL) {
-        ibv_dereg_mr(node->mr);
+        transport_->dereg_mr(node->mr);
       }
       free(node->mr);
       struct mr_chain_node* next = node->next;
@@ -179,6 +249,23 @@ int IBConnManager::unset_mr(enum mr_scope scope, int mr_id, IBConn* IBC) {
   return -1;
 }
 
+/**
+ * Take a local MR off a connection without deregistering it, so that
+ * it outlives the connection and can be set on the next one.
+ */
+int IBConnManager::release_mr(int mr_id, IBConn* IBC) {
+  for(struct mr_chain_node** prev = &(IBC->s_conn->local_mrs); *prev != NULL; prev = &((*prev)->next)) {
+    struct mr_chain_node* node = *prev;
+    if (node->mr_id == mr_id && node->location == MR_LOC_LOCAL) {
+      *prev = node->next;
+      free(node->mr);
+      free(node);
+      return 0;
+    }
+  }
+  return -1;
+}
+
 // Find the MR with the given mr_id, and return its stats
 struct ibv_mr* IBConnManager::fetch_mr(enum mr_location location, int mr_id, IBConn* IBC) {
 
@@ -209,7 +296,7 @@ void IBConnManager::destroy_global_mrs(void) {
     struct mr_chain_node* next = node->next;
     if (node->location == MR_LOC_LOCAL) {
       //free(node->mr->addr);
-      ibv_dereg_mr(node->mr);
+      transport_->dereg_mr(node->mr);
     }
     free(node);
     node = next;
@@ -218,9 +305,159 @@ void IBConnManager::destroy_global_mrs(void) {
   gpd = nullptr;
 }
 
-IBConn* IBConnManager::new_conn(size_t msgbuf_size) {
+void IBConnManager::set_srq(int depth, size_t buf_size) {
+  srq_depth_ = depth;
+  srq_buf_size_ = buf_size;
+}
+
+/**
+ * The SRQ of a CQ, created and filled by its first connection; NULL
+ * if there are to be none. A transport without SRQs turns them off.
+ */
+struct ibv_srq* IBConnManager::get_srq(int cq, struct ibv_pd* pd) {
+  struct ibv_srq* srq;
+
+  if (srq_depth_ <= 0)
+    return NULL;
+
+  pthread_mutex_lock(&lock_);
+  if (srqs_.size() < cqs_.size()) {
+    srqs_.resize(cqs_.size(), (struct ibv_srq*)NULL);
+    srq_bufs_.resize(cqs_.size());
+  }
+
+  if (NULL == (srq = srqs_[cq])) {
+    if (NULL == (srq = transport_->create_srq(pd, srq_depth_))) {
+      log(VERB_WARN,"Warning: shared receive queue unavailable (code %d); "
+          "connections will use their own receive buffers\n",errno);
+      srq_depth_ = 0;
+      pthread_mutex_unlock(&lock_);
+      return NULL;
+    }
+    srqs_[cq] = srq;
+
+    for(int i = 0; i < srq_depth_; i++) {
+      struct recv_buf* thisbuf = (struct recv_buf*)malloc(sizeof(struct recv_buf));
+      struct message* recv_msg = (struct message*)malloc(srq_buf_size_);
+
+      if (thisbuf == NULL || recv_msg == NULL)
+        die("Ran out of memory registering shared receive buffers");
+
+      if (NULL == (thisbuf->mr = transport_->reg_mr(pd, recv_msg, srq_buf_size_, IBV_ACCESS_LOCAL_WRITE))) {
+        log(VERB_ERROR,"Failed to register shared receive buffer at %p, size %zu\n",recv_msg,srq_buf_size_);
+        diewithcode("Failed with code",errno);
+      }
+      thisbuf->msg = recv_msg;
+      thisbuf->instance = NULL;
+      srq_bufs_[cq].push_back(thisbuf);
+      post_srq_buf(srq, thisbuf);
+    }
+  }
+  pthread_mutex_unlock(&lock_);
+  return srq;
+}
+
+void IBConnManager::repost_srq(int cq, struct recv_buf* buf) {
+  // srqs_ is read without lock_, like qp_conns_
+  post_srq_buf(srqs_[cq], buf);
+}
+
+void IBConnManager::post_srq_buf(struct ibv_srq* srq, struct recv_buf* buf) {
+  struct ibv_recv_wr wr, *bad_wr = NULL;
+  struct ibv_sge sge;
+
+  wr.wr_id = (uintptr_t)buf;
+  wr.next = NULL;
+  wr.sg_list = &sge;
+  wr.num_sge = 1;
+
+  sge.addr = (uintptr_t)buf->msg;
+  sge.length = srq_buf_size_;
+  sge.lkey = buf->mr->lkey;
+
+  int rv = transport_->post_srq_recv(srq, &wr, &bad_wr);
+  if (rv) diewithcode("Failed to ibv_post_srq_recv",rv);
+}
+
+void IBConnManager::attach_qp(uint32_t qp_num, IBConn* IBC) {
+  pthread_mutex_lock(&lock_);
+  qp_conns_[qp_num] = IBC;
+  pthread_mutex_unlock(&lock_);
+}
+
+void IBConnManager::detach_qp(uint32_t qp_num) {
+  pthread_mutex_lock(&lock_);
+  qp_conns_.erase(qp_num);
+  pthread_mutex_unlock(&lock_);
+}
+
+/**
+ * A buffer of at least len bytes, registered for local writes and
+ * remote reads: an idle one of its size class if there is one.
+ */
+struct rndv_buf* IBConnManager::rndv_get(size_t len) {
+  struct rndv_buf* buf = NULL;
+  size_t c = 12;
+
+  while (((size_t)1 << c) < len)
+    c++;
+
+  pthread_mutex_lock(&lock_);
+  if (rndv_free_.size() <= c)
+    rndv_free_.resize(c+1);
+  if (!rndv_free_[c].empty()) {
+    buf = rndv_free_[c].back();
+    rndv_free_[c].pop_back();
+  }
+  pthread_mutex_unlock(&lock_);
+
+  if (buf)
+    return buf;
+
+  buf = (struct rndv_buf*)malloc(sizeof(struct rndv_buf));
+  if (buf == NULL || NULL == (buf->msg = (struct message*)malloc((size_t)1 << c)))
+    die("Ran out of memory allocating a rendezvous buffer");
+  buf->size = (size_t)1 << c;
+
+  if (NULL == (buf->mr = transport_->reg_mr(gpd, buf->msg, buf->size,
+                                            IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ))) {
+    log(VERB_ERROR,"Failed to register rendezvous buffer at %p, size %zu\n",buf->msg,buf->size);
+    diewithcode("Failed with code",errno);
+  }
+  return buf;
+}
+
+/**
+ * Return a rendezvous buffer, freeing it if its class has enough idle.
+ */
+void IBConnManager::rndv_put(struct rndv_buf* buf) {
+  size_t c = 12;
+
+  if (buf == NULL)
+    return;
+  while (((size_t)1 << c) < buf->size)
+    c++;
+
+  pthread_mutex_lock(&lock_);
+  if (rndv_free_.size() <= c)
+    rndv_free_.resize(c+1);
+  if (rndv_free_[c].size() < (size_t)RNDV_POOL_KEEP) {
+    rndv_free_[c].push_back(buf);
+    buf = NULL;
+  }
+  pthread_mutex_unlock(&lock_);
+
+  if (buf) {
+    transport_->dereg_mr(buf->mr);
+    free(buf->msg);
+    free(buf);
+  }
+}
+
+IBConn* IBConnManager::new_conn(size_t msgbuf_size, int cq) {
   IBConn* conn = new IBConn(this, msgbuf_size);
   conn->s_role = s_role;
+  conn->cq_ = (cq >= 0 && cq < (int)cqs_.size()) ? cq : 0;
   return conn;
 }
 
@@ -9,8 +9,12 @@
 #include <rdma/rdma_cma.h>
 #include <stdarg.h>
 #include "ib.h"
+#include "transport.h"
 #include <sys/time.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <vector>
+#include <map>
 
 enum ibman_verb {
     VERB_VITAL = -1,
@@ -27,19 +31,41 @@ private:
   int n_global_mrs;
   int s_role;
   enum ibman_verb verb_;
+  Transport* transport_;
 
   struct ibv_pd* gpd; //shared protection domain
-  struct ibv_cq* gcq; //shared completion queue
+  std::vector<struct ibv_cq*> cqs_; //completion queues, each shared by its connections
   struct rdma_event_channel* gec; //shared event channel
 
   int (*on_event_hook)(struct rdma_cm_event*, void*, void*);
   void* event_hook_context;
 
   // Make the manager thread-safe
-  struct ibv_wc wc;
+  struct ibv_wc wc[CQ_POLL_BATCH];
+  pthread_mutex_t lock_;            // guards what follows
+
+  // Shared receive queues, one per CQ, and the connections they feed.
+  // srqs_ and qp_conns_ only change while a connection is built or
+  // destroyed. Only the server shares receive queues, and it does both
+  // under the write side of its table_lock while every completion is
+  // handled under the read side, so complete() and repost_srq() read
+  // them without lock_. A change elsewhere must keep that invariant.
+  std::vector<struct ibv_srq*> srqs_;
+  std::vector<std::vector<struct recv_buf*> > srq_bufs_;
+  int srq_depth_;
+  size_t srq_buf_size_;
+  std::map<uint32_t,IBConn*> qp_conns_;
+  struct ibv_srq* get_srq(int cq, struct ibv_pd* pd);
+  void repost_srq(int cq, struct recv_buf* buf);
+  void post_srq_buf(struct ibv_srq* srq, struct recv_buf* buf);
+  void attach_qp(uint32_t qp_num, IBConn* IBC);
+  void detach_qp(uint32_t qp_num);
+
+  // Idle rendezvous buffers by power-of-two size class
+  std::vector<std::vector<struct rndv_buf*> > rndv_free_;
 
 public:
-  IBConnManager(int role);
+  IBConnManager(int role, Transport* transport = NULL);
   void verbosity(enum ibman_verb verb);
   void log(enum ibman_verb loglevel, char* fmt, ...);
 
@@ -47,16 +73,37 @@ public:
   struct ibv_mr* create_mr(void* addr, size_t length, int flags, enum mr_scope scope, IBConn* IBC);
   int set_mr(enum mr_location location, enum mr_scope scope, struct ibv_mr* mr, int mr_id, IBConn* IBC);
   int unset_mr(enum mr_scope scope, int mr_id, IBConn* IBC);
+  int release_mr(int mr_id, IBConn* IBC);
   struct ibv_mr* fetch_mr(enum mr_location location, int mr_id, IBConn* IBC);
   void destroy_global_mrs(void);
 
   int poll_cq(int do_not_terminate);
   void set_event_hook(int(*event_hook)(struct rdma_cm_event *event, void* ec_context, void* event_context), void* ec_context);
 
-  // Grab a new connection
-  IBConn* new_conn(size_t msgbuf_size);
+  // Several CQs, for several threads polling their own connections.
+  // set_cq_count() must come before the first connection is built;
+  // each thread then calls poll_cq_batch() on its CQ and complete() on
+  // what it returns, and one thread calls poll_events().
+  void set_cq_count(int n);
+  int cq_count(void) { return (int)cqs_.size(); }
+  int poll_cq_batch(int cq, struct ibv_wc* wcs, int n);
+  void complete(struct ibv_wc* wc);
+  int poll_events(void);
+
+  // Feed connections built from now on from shared receive queues of
+  // depth buffers of buf_size bytes, one per CQ, instead of buffers of
+  // their own; receive memory then follows load, not connection count
+  void set_srq(int depth, size_t buf_size);
+
+  // Registered buffers for rendezvous messages, from any thread
+  struct rndv_buf* rndv_get(size_t len);
+  void rndv_put(struct rndv_buf* buf);
+
+  // Grab a new connection, completing on the given CQ
+  IBConn* new_conn(size_t msgbuf_size, int cq = 0);
   ibv_pd* get_pd(void) { return gpd; }
   struct rdma_event_channel* get_ec() { return gec; }
+  Transport* transport(void) { return transport_; }
   void hint_client_count(size_t n_clients);
 
   friend class IBConn;
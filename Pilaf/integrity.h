@@ -1,7 +1,37 @@
 #ifndef INTEGRITY_H
 #define INTEGRITY_H
+#include <stdint.h>
+#include <string.h>
 #include <tr1/functional>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+#include "table_types.h"
 
+/**
+ * 128 bits of hash for one key. The server holding the key and each of
+ * its cuckoo buckets are all derived from these, so a key is hashed
+ * once per operation rather than once per candidate.
+ */
+struct key_hash {
+  uint64_t lo;
+  uint64_t hi;
+};
+
+/**
+ * Checksums and hashes for the DHT. crc() guards rows and extents
+ * against torn reads on both ends of an RDMA read, so it is on every
+ * lookup's critical path; DHT_CHECKSUM (table_types.h) picks it:
+ *
+ * - CHECKSUM_CRC64: the original table-driven CRC-64, a byte at a time.
+ * - CHECKSUM_CRC32C: CRC-32C with the SSE4.2 crc32 instruction, eight
+ *   bytes at a time in three interleaved streams for long inputs, or a
+ *   table when the CPU lacks it. Both give the same value.
+ * - CHECKSUM_XXH64: xxHash64, four 8-byte lanes per 32-byte stripe.
+ *
+ * Whichever is chosen, crc() returns it as a uint64_t, so the slot
+ * layouts stay the same.
+ */
 class Integrity64 {
 
 #define BIG_CONSTANT(x) (x##LLU)
@@ -10,12 +40,19 @@ class Integrity64 {
     // CRC variables/constants
     #define poly_lys_add 0x42F0E1EBA9EA3693
     #define hvinit 0x0060034000F0D50B
+    #define poly_crc32c 0x82F63B78      // reflected Castagnoli polynomial
+    #define CRC32C_LONG 8192            // interleaved stream lengths
+    #define CRC32C_SHORT 256
     uint64_t crc_table[256];
-	uint64_t seeds[4];
+    uint32_t crc32c_table[256];
+    uint32_t crc32c_long[4][256];       // shift a CRC over CRC32C_LONG zeros
+    uint32_t crc32c_short[4][256];      // ... over CRC32C_SHORT zeros
+    bool have_sse42;
+    #define key_hash_seed 0x199999999999997F
   public:
 
     Integrity64() {
-      // Initialize the 256-entry CRC table
+      // Initialize the 256-entry CRC tables
       for(int i=0; i<256; i++) {
         uint64_t part = (uint64_t)i;
         uint64_t hv = 0L;
@@ -25,18 +62,34 @@ class Integrity64 {
             hv ^= poly_lys_add;
         }
         crc_table[i] = hv;
-      }
 
-      // Initialize the hash seeds
-      seeds[0] = 0x199999999999997F;
-      seeds[1] = 0x1999999999999990;
-      seeds[2] = 0x01000193;
-      seeds[3] = 0x0100019D;
+        uint32_t cv = (uint32_t)i;
+        for(int j=0; j<8; j++)
+          cv = (cv & 1) ? (cv >> 1) ^ poly_crc32c : (cv >> 1);
+        crc32c_table[i] = cv;
+      }
+      crc32c_zeros(crc32c_long,CRC32C_LONG);
+      crc32c_zeros(crc32c_short,CRC32C_SHORT);
 
+#if defined(__x86_64__)
+      have_sse42 = __builtin_cpu_supports("sse4.2");
+#else
+      have_sse42 = false;
+#endif
     }
 
-    // Calculate the 64-bit hash
+    // Calculate the 64-bit checksum selected by DHT_CHECKSUM
     uint64_t crc(const char* msg, size_t len) {
+#if DHT_CHECKSUM==CHECKSUM_CRC32C
+      return crc32c(msg,len);
+#elif DHT_CHECKSUM==CHECKSUM_XXH64
+      return xxh64(msg,len,0);
+#else
+      return crc64(msg,len);
+#endif
+    }
+
+    uint64_t crc64(const char* msg, size_t len) {
       uint64_t output = hvinit;
       const uint8_t* msg_ = (uint8_t*)msg;
       for(size_t i=0; i<len; i++) {
@@ -45,8 +98,144 @@ class Integrity64 {
       return output;
     }
 
-    uint64_t hashN(const void * key, size_t key_len, int n = 0) {
-      return hash(key,seeds[n],key_len);
+    uint32_t crc32c(const char* msg, size_t len) {
+#if defined(__x86_64__)
+      if (have_sse42)
+        return ~crc32c_hw(~(uint32_t)0,(const uint8_t*)msg,len);
+#endif
+      return ~crc32c_sw(~(uint32_t)0,(const uint8_t*)msg,len);
+    }
+
+    uint64_t xxh64(const void* msg, size_t len, uint64_t seed) {
+      const uint64_t p1 = BIG_CONSTANT(11400714785074694791);
+      const uint64_t p2 = BIG_CONSTANT(14029467366897019727);
+      const uint64_t p3 = BIG_CONSTANT(1609587929392839161);
+      const uint64_t p4 = BIG_CONSTANT(9650029242287828579);
+      const uint64_t p5 = BIG_CONSTANT(2870177450012600261);
+      const uint8_t* p = (const uint8_t*)msg;
+      const uint8_t* end = p + len;
+      uint64_t h;
+
+      if (len >= 32) {
+        uint64_t v1 = seed + p1 + p2, v2 = seed + p2, v3 = seed, v4 = seed - p1;
+        do {
+          v1 = xxh64_round(v1,read64(p));
+          v2 = xxh64_round(v2,read64(p+8));
+          v3 = xxh64_round(v3,read64(p+16));
+          v4 = xxh64_round(v4,read64(p+24));
+          p += 32;
+        } while (p + 32 <= end);
+        h = rotl64(v1,1) + rotl64(v2,7) + rotl64(v3,12) + rotl64(v4,18);
+        h = (h ^ xxh64_round(0,v1)) * p1 + p4;
+        h = (h ^ xxh64_round(0,v2)) * p1 + p4;
+        h = (h ^ xxh64_round(0,v3)) * p1 + p4;
+        h = (h ^ xxh64_round(0,v4)) * p1 + p4;
+      } else {
+        h = seed + p5;
+      }
+      h += (uint64_t)len;
+
+      for(; p + 8 <= end; p += 8)
+        h = rotl64(h ^ xxh64_round(0,read64(p)),27) * p1 + p4;
+      if (p + 4 <= end) {
+        uint32_t k;
+        memcpy(&k,p,sizeof(k));
+        h = rotl64(h ^ ((uint64_t)k * p1),23) * p2 + p3;
+        p += 4;
+      }
+      for(; p < end; p++)
+        h = rotl64(h ^ (*p * p5),11) * p1;
+
+      h ^= h >> 33;
+      h *= p2;
+      h ^= h >> 29;
+      h *= p3;
+      h ^= h >> 32;
+      return h;
+    }
+
+    // MurmurHash3_x64_128
+    key_hash hash128(const void* key, size_t len, uint64_t seed = key_hash_seed) {
+      const uint64_t c1 = BIG_CONSTANT(0x87c37b91114253d5);
+      const uint64_t c2 = BIG_CONSTANT(0x4cf5ad432745937f);
+      const uint8_t* data = (const uint8_t*)key;
+      const uint8_t* tail = data + (len & ~(size_t)15);
+      uint64_t h1 = seed, h2 = seed, k1, k2;
+
+      for(; data != tail; data += 16) {
+        k1 = read64(data);
+        k2 = read64(data+8);
+        h1 ^= rotl64(k1*c1,31)*c2;
+        h1 = (rotl64(h1,27)+h2)*5+0x52dce729;
+        h2 ^= rotl64(k2*c2,33)*c1;
+        h2 = (rotl64(h2,31)+h1)*5+0x38495ab5;
+      }
+
+      k1 = k2 = 0;
+      switch(len & 15)
+      {
+      case 15: k2 ^= uint64_t(tail[14]) << 48;
+      case 14: k2 ^= uint64_t(tail[13]) << 40;
+      case 13: k2 ^= uint64_t(tail[12]) << 32;
+      case 12: k2 ^= uint64_t(tail[11]) << 24;
+      case 11: k2 ^= uint64_t(tail[10]) << 16;
+      case 10: k2 ^= uint64_t(tail[9]) << 8;
+      case  9: k2 ^= uint64_t(tail[8]);
+               h2 ^= rotl64(k2*c2,33)*c1;
+      case  8: k1 ^= uint64_t(tail[7]) << 56;
+      case  7: k1 ^= uint64_t(tail[6]) << 48;
+      case  6: k1 ^= uint64_t(tail[5]) << 40;
+      case  5: k1 ^= uint64_t(tail[4]) << 32;
+      case  4: k1 ^= uint64_t(tail[3]) << 24;
+      case  3: k1 ^= uint64_t(tail[2]) << 16;
+      case  2: k1 ^= uint64_t(tail[1]) << 8;
+      case  1: k1 ^= uint64_t(tail[0]);
+               h1 ^= rotl64(k1*c1,31)*c2;
+      };
+
+      h1 ^= len;
+      h2 ^= len;
+      h1 += h2;
+      h2 += h1;
+      h1 = fmix64(h1);
+      h2 = fmix64(h2);
+      h1 += h2;
+      h2 += h1;
+
+      key_hash h = { h1, h2 };
+      return h;
+    }
+
+    /**
+     * Candidate n of a key, by double hashing: n steps of hi from lo.
+     * Reduce it onto the table with reduce().
+     */
+    static inline uint64_t probe(const key_hash& h, int n) {
+      return h.lo + (uint64_t)n*h.hi;
+    }
+
+    /**
+     * The hash picking a key's server, remixed so that keys sharing a
+     * server still spread over every bucket.
+     */
+    static inline uint64_t server_hash(const key_hash& h) {
+      return fmix64(h.hi);
+    }
+
+    /**
+     * A short tag of the key for bucketized tables, taken from the
+     * low bits of hi, which barely move the bucket or the server.
+     */
+    static inline uint16_t fingerprint(const key_hash& h) {
+      return (uint16_t)h.hi;
+    }
+
+    /**
+     * Maps a hash uniformly onto [0,n) with a multiply and a shift
+     * instead of a division. Uses the high bits of x.
+     */
+    static inline size_t reduce(uint64_t x, size_t n) {
+      return (size_t)(((unsigned __int128)x * n) >> 64);
     }
 
     // This is the Murmur Hash
@@ -93,6 +282,118 @@ class Integrity64 {
       return h;
     }
 
+  private:
+    static inline uint64_t fmix64(uint64_t k) {
+      k ^= k >> 33;
+      k *= BIG_CONSTANT(0xff51afd7ed558ccd);
+      k ^= k >> 33;
+      k *= BIG_CONSTANT(0xc4ceb9fe1a85ec53);
+      k ^= k >> 33;
+      return k;
+    }
+
+    static inline uint64_t rotl64(uint64_t x, int r) {
+      return (x << r) | (x >> (64 - r));
+    }
+
+    static inline uint64_t read64(const uint8_t* p) {
+      uint64_t v;
+      memcpy(&v,p,sizeof(v));
+      return v;
+    }
+
+    static inline uint64_t xxh64_round(uint64_t acc, uint64_t input) {
+      acc += input * BIG_CONSTANT(14029467366897019727);
+      return rotl64(acc,31) * BIG_CONSTANT(11400714785074694791);
+    }
+
+    uint32_t crc32c_sw(uint32_t crc, const uint8_t* p, size_t len) {
+      for(size_t i=0; i<len; i++)
+        crc = crc32c_table[(uint8_t)(crc ^ p[i])] ^ (crc >> 8);
+      return crc;
+    }
+
+#if defined(__x86_64__)
+    // Three independent crc32 chains hide the instruction's latency;
+    // the partial CRCs are then shifted into place and combined
+    __attribute__((target("sse4.2")))
+    uint32_t crc32c_hw(uint32_t crc, const uint8_t* p, size_t len) {
+      uint64_t c0 = crc;
+      for(; len > 0 && ((uintptr_t)p & 7); len--, p++)
+        c0 = _mm_crc32_u8((uint32_t)c0,*p);
+
+      for(; len >= 3*CRC32C_LONG; len -= 3*CRC32C_LONG, p += 3*CRC32C_LONG)
+        c0 = crc32c_hw3(c0,p,CRC32C_LONG,crc32c_long);
+      for(; len >= 3*CRC32C_SHORT; len -= 3*CRC32C_SHORT, p += 3*CRC32C_SHORT)
+        c0 = crc32c_hw3(c0,p,CRC32C_SHORT,crc32c_short);
+
+      for(; len >= 8; len -= 8, p += 8)
+        c0 = _mm_crc32_u64(c0,read64(p));
+      for(; len > 0; len--, p++)
+        c0 = _mm_crc32_u8((uint32_t)c0,*p);
+      return (uint32_t)c0;
+    }
+
+    __attribute__((target("sse4.2")))
+    uint32_t crc32c_hw3(uint64_t c0, const uint8_t* p, size_t stream, uint32_t (*shift)[256]) {
+      uint64_t c1 = 0, c2 = 0;
+      const uint8_t* end = p + stream;
+      do {
+        c0 = _mm_crc32_u64(c0,read64(p));
+        c1 = _mm_crc32_u64(c1,read64(p + stream));
+        c2 = _mm_crc32_u64(c2,read64(p + 2*stream));
+        p += 8;
+      } while (p < end);
+      c0 = crc32c_shift(shift,(uint32_t)c0) ^ c1;
+      return crc32c_shift(shift,(uint32_t)c0) ^ c2;
+    }
+#endif
+
+    static inline uint32_t crc32c_shift(uint32_t (*shift)[256], uint32_t crc) {
+      return shift[0][crc & 0xff] ^ shift[1][(crc >> 8) & 0xff] ^
+             shift[2][(crc >> 16) & 0xff] ^ shift[3][crc >> 24];
+    }
+
+    // GF(2) matrix helpers for building the shift tables
+    static uint32_t gf2_times(const uint32_t* mat, uint32_t vec) {
+      uint32_t sum = 0;
+      for(; vec; vec >>= 1, mat++)
+        if (vec & 1)
+          sum ^= *mat;
+      return sum;
+    }
+
+    static void gf2_square(uint32_t* square, const uint32_t* mat) {
+      for(int n=0; n<32; n++)
+        square[n] = gf2_times(mat,mat[n]);
+    }
+
+    // Tables that advance a CRC over len zero bytes (len a power of two)
+    static void crc32c_zeros(uint32_t (*shift)[256], size_t len) {
+      uint32_t op[32], odd[32];
+      odd[0] = poly_crc32c;
+      for(int n=1; n<32; n++)
+        odd[n] = 1u << (n - 1);
+      gf2_square(op,odd);       // two zero bits
+      gf2_square(odd,op);       // four zero bits
+      for(;;) {
+        gf2_square(op,odd);     // one zero byte the first time round
+        if ((len >>= 1) == 0)
+          break;
+        gf2_square(odd,op);
+        if ((len >>= 1) == 0) {
+          memcpy(op,odd,sizeof(op));
+          break;
+        }
+      }
+      for(int n=0; n<256; n++) {
+        shift[0][n] = gf2_times(op,n);
+        shift[1][n] = gf2_times(op,n << 8);
+        shift[2][n] = gf2_times(op,n << 16);
+        shift[3][n] = gf2_times(op,n << 24);
+      }
+    }
+
 };
 
 #endif // INTEGRITY_H
@@ -0,0 +1,386 @@
+/**
+ * Size-class slab allocator for DHT extents.
+ *
+ * Carves allocations out of one or more caller-supplied regions, which
+ * it never touches except to write free-list links into free chunks,
+ * so the regions can be registered with the HCA as they are.
+ *
+ * - Requests up to SLAB_MAX_CHUNK bytes are rounded up to one of
+ *   SLAB_CLASS_STEPS size classes per power of two (8-byte aligned),
+ *   so at most 12.5% of a chunk past 64 bytes is slack, rather than
+ *   up to half of it with a buddy allocator. Each class fills whole
+ *   SLAB_PAGE_SIZE pages and keeps an intrusive free list. A page
+ *   stays with its class once assigned.
+ * - Larger requests take a run of SLAB_UNIT units of their own.
+ *   Freed runs coalesce with their neighbors.
+ * - More space is added with add_region(); nothing already allocated
+ *   moves.
+ *
+ * Page and run bookkeeping lives outside the regions (four bytes per
+ * unit), and all counters are 64-bit.
+ */
+
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <vector>
+#include <map>
+#include <algorithm>
+
+#define SLAB_UNIT 1024              // granularity of pages and large runs
+#define SLAB_PAGE_SIZE (1<<16)      // every page holds chunks of one class
+#define SLAB_MIN_CHUNK 16
+#define SLAB_MAX_CHUNK (SLAB_PAGE_SIZE/4)
+#define SLAB_CLASS_STEPS 8          // size classes per doubling
+#define SLAB_ALIGN 8
+
+#define SLAB_DESC_FREE 0            // unit is free, or inside a large run
+#define SLAB_DESC_LARGE 0x80000000u // first unit of a large run; low bits are its units
+
+struct slab_stats {
+  uint64_t regions;
+  uint64_t region_bytes;      // managed, over all regions
+  uint64_t out_bytes;         // checked out: chunk and run sizes
+  uint64_t out_count;         // live allocations
+  uint64_t max_out_bytes;
+  uint64_t max_out_count;
+  uint64_t page_bytes;        // assigned to size classes
+  uint64_t free_chunk_bytes;  // in class pages, but not checked out (internal fragmentation)
+  uint64_t large_bytes;       // checked out as large runs
+  uint64_t free_bytes;        // in neither a page nor a run
+  uint64_t n_alloc;           // successful allocations, ever
+  uint64_t n_fail;            // failed allocations, ever
+  uint64_t total_request;     // bytes asked for, ever
+  uint64_t total_excess;      // bytes of rounding handed out with them, ever
+  uint64_t max_request;
+};
+
+class SlabMalloc {
+public:
+  SlabMalloc() {
+    // SLAB_CLASS_STEPS evenly spaced classes in each doubling, never
+    // closer together than the alignment
+    for (size_t base = SLAB_MIN_CHUNK; base < SLAB_MAX_CHUNK; base *= 2) {
+      size_t step = std::max((size_t)SLAB_ALIGN, base/SLAB_CLASS_STEPS);
+      for (size_t size = base; size < 2*base; size += step)
+        if (class_size_.empty() || size > class_size_.back())
+          class_size_.push_back(size);
+    }
+    class_size_.push_back(SLAB_MAX_CHUNK);
+    classes_.resize(class_size_.size());
+    for (size_t c = 0; c < classes_.size(); c++) {
+      classes_[c].free = NULL;
+      classes_[c].bump = classes_[c].bump_end = NULL;
+      classes_[c].pages = classes_[c].out = 0;
+    }
+    memset(&stats_, 0, sizeof(stats_));
+  }
+
+  /**
+   * Adds size bytes at base to the space allocations are carved from.
+   * Returns the region's index, or -1 if it is too small or overlaps
+   * one already added.
+   */
+  int add_region(void* base, size_t size) {
+    size_t units = size/SLAB_UNIT;
+    if (!base || !units || units >= SLAB_DESC_LARGE)
+      return -1;
+
+    char* b = (char*)base;
+    std::map<char*,int>::iterator it = by_base_.lower_bound(b+size);
+    if (it != by_base_.begin() && region_end(regions_[(--it)->second]) > b)
+      return -1;
+
+    struct slab_region r;
+    r.base = b;
+    r.units = units;
+    r.desc.assign(units, SLAB_DESC_FREE);
+    regions_.push_back(r);
+    int id = regions_.size()-1;
+    by_base_[b] = id;
+    add_run(regions_[id], 0, units);
+
+    stats_.regions++;
+    stats_.region_bytes += units*SLAB_UNIT;
+    stats_.free_bytes += units*SLAB_UNIT;
+    return id;
+  }
+
+  /**
+   * The number of bytes an allocation of n bytes actually gets.
+   */
+  size_t chunk_size(size_t n) const {
+    if (n > SLAB_MAX_CHUNK)
+      return units_for(n)*SLAB_UNIT;
+    return class_size_[class_for(n)];
+  }
+
+  /**
+   * Returns chunk_size(n) bytes, or NULL if no region has room.
+   */
+  void* alloc(size_t n) {
+    if (n == 0) n = 1;
+    void* p = (n > SLAB_MAX_CHUNK)?alloc_large(n):alloc_small(n);
+    if (p == NULL) {
+      stats_.n_fail++;
+      return NULL;
+    }
+
+    size_t got = chunk_size(n);
+    stats_.n_alloc++;
+    stats_.total_request += n;
+    stats_.total_excess += got-n;
+    stats_.max_request = std::max(stats_.max_request, (uint64_t)n);
+    stats_.out_bytes += got;
+    stats_.out_count++;
+    stats_.max_out_bytes = std::max(stats_.max_out_bytes, stats_.out_bytes);
+    stats_.max_out_count = std::max(stats_.max_out_count, stats_.out_count);
+    return p;
+  }
+
+  /**
+   * Returns an allocation made by alloc(). NULL is ignored.
+   */
+  void release(void* p) {
+    if (p == NULL)
+      return;
+
+    struct slab_region* r = region_for(p);
+    assert(r != NULL);
+    size_t unit = ((char*)p-r->base)/SLAB_UNIT;
+    uint32_t desc = r->desc[unit];
+    size_t got;
+
+    if (desc & SLAB_DESC_LARGE) {
+      assert((char*)p == r->base+unit*SLAB_UNIT);
+      size_t units = desc & ~SLAB_DESC_LARGE;
+      r->desc[unit] = SLAB_DESC_FREE;
+      add_run(*r, unit, units);
+      got = units*SLAB_UNIT;
+      stats_.large_bytes -= got;
+      stats_.free_bytes += got;
+    } else {
+      assert(desc != SLAB_DESC_FREE);
+      struct slab_class& sc = classes_[desc-1];
+      *(void**)p = sc.free;
+      sc.free = p;
+      sc.out--;
+      got = class_size_[desc-1];
+      stats_.free_chunk_bytes += got;
+    }
+
+    stats_.out_bytes -= got;
+    stats_.out_count--;
+  }
+
+  /**
+   * The usable size of an allocation made by alloc().
+   */
+  size_t usable_size(const void* p) const {
+    const struct slab_region* r = region_for(p);
+    uint32_t desc = r->desc[((const char*)p-r->base)/SLAB_UNIT];
+    if (desc & SLAB_DESC_LARGE)
+      return (desc & ~SLAB_DESC_LARGE)*SLAB_UNIT;
+    return class_size_[desc-1];
+  }
+
+  /**
+   * The index of the region holding p, or -1.
+   */
+  int region_of(const void* p) const {
+    const struct slab_region* r = region_for(p);
+    return r?(r-&regions_[0]):-1;
+  }
+
+  /**
+   * An upper bound on the region space that count allocations of
+   * bytes between them need: the rounding to classes and units, plus
+   * a partly filled page for each class.
+   */
+  size_t footprint(size_t count, size_t bytes) const {
+    return bytes + bytes/SLAB_CLASS_STEPS + count*SLAB_ALIGN
+           + class_size_.size()*SLAB_PAGE_SIZE;
+  }
+
+  void get_stats(struct slab_stats* s) const {
+    *s = stats_;
+  }
+
+  /**
+   * Prints the counters and the classes in use, with how much of
+   * the managed space is slack.
+   */
+  void dump(FILE* out) const {
+    const struct slab_stats& s = stats_;
+    uint64_t used = s.page_bytes + s.large_bytes;
+    fprintf(out, "slab: %llu regions, %llu bytes: %llu out in %llu allocations (max %llu in %llu), "
+                 "%llu free\n",
+            (unsigned long long)s.regions, (unsigned long long)s.region_bytes,
+            (unsigned long long)s.out_bytes, (unsigned long long)s.out_count,
+            (unsigned long long)s.max_out_bytes, (unsigned long long)s.max_out_count,
+            (unsigned long long)s.free_bytes);
+    fprintf(out, "slab: %llu in class pages (%llu of it in free chunks), %llu in large runs\n",
+            (unsigned long long)s.page_bytes, (unsigned long long)s.free_chunk_bytes,
+            (unsigned long long)s.large_bytes);
+    fprintf(out, "slab: %llu allocations (%llu failed), %llu bytes requested, %.2f%% rounding, "
+                 "%.2f%% of used space in free chunks\n",
+            (unsigned long long)s.n_alloc, (unsigned long long)s.n_fail,
+            (unsigned long long)s.total_request,
+            s.total_request?100.0*s.total_excess/s.total_request:0.0,
+            used?100.0*s.free_chunk_bytes/used:0.0);
+    for (size_t c = 0; c < classes_.size(); c++) {
+      if (!classes_[c].pages)
+        continue;
+      fprintf(out, "slab:   %6zu bytes: %6llu pages, %10llu chunks out\n", class_size_[c],
+              (unsigned long long)classes_[c].pages, (unsigned long long)classes_[c].out);
+    }
+  }
+
+private:
+  struct slab_region {
+    char* base;
+    size_t units;
+    std::vector<uint32_t> desc;               // per unit: class+1, or a SLAB_DESC_* value
+    std::map<size_t,size_t> runs;             // free runs, first unit -> units
+    std::multimap<size_t,size_t> runs_by_len; // the same runs, units -> first unit
+  };
+
+  struct slab_class {
+    void* free;                     // freed chunks, linked through their first word
+    char* bump;                     // rest of the newest page, not yet handed out
+    char* bump_end;
+    uint64_t pages;
+    uint64_t out;
+  };
+
+  std::vector<size_t> class_size_;
+  std::vector<struct slab_class> classes_;
+  std::vector<struct slab_region> regions_;
+  std::map<char*,int> by_base_;
+  struct slab_stats stats_;
+
+  static char* region_end(const struct slab_region& r) {
+    return r.base + r.units*SLAB_UNIT;
+  }
+
+  static size_t units_for(size_t n) {
+    return (n+SLAB_UNIT-1)/SLAB_UNIT;
+  }
+
+  size_t class_for(size_t n) const {
+    return std::lower_bound(class_size_.begin(), class_size_.end(), n) - class_size_.begin();
+  }
+
+  const struct slab_region* region_for(const void* p) const {
+    std::map<char*,int>::const_iterator it = by_base_.upper_bound((char*)p);
+    if (it == by_base_.begin())
+      return NULL;
+    const struct slab_region& r = regions_[(--it)->second];
+    return ((const char*)p < region_end(r))?&r:NULL;
+  }
+
+  struct slab_region* region_for(const void* p) {
+    return const_cast<struct slab_region*>(((const SlabMalloc*)this)->region_for(p));
+  }
+
+  void drop_run(struct slab_region& r, std::map<size_t,size_t>::iterator it) {
+    std::multimap<size_t,size_t>::iterator l = r.runs_by_len.lower_bound(it->second);
+    while (l->second != it->first)
+      l++;
+    r.runs_by_len.erase(l);
+    r.runs.erase(it);
+  }
+
+  // Frees units from start, merging with the free runs either side
+  void add_run(struct slab_region& r, size_t start, size_t units) {
+    std::map<size_t,size_t>::iterator next = r.runs.lower_bound(start);
+    if (next != r.runs.end() && next->first == start+units) {
+      units += next->second;
+      drop_run(r, next++);
+    }
+    if (next != r.runs.begin()) {
+      std::map<size_t,size_t>::iterator prev = next;
+      prev--;
+      if (prev->first+prev->second == start) {
+        start = prev->first;
+        units += prev->second;
+        drop_run(r, prev);
+      }
+    }
+    r.runs[start] = units;
+    r.runs_by_len.insert(std::make_pair(units, start));
+  }
+
+  // Takes the smallest free run that fits, oldest region first
+  char* take_units(size_t units, uint32_t desc, bool whole) {
+    for (size_t i = 0; i < regions_.size(); i++) {
+      struct slab_region& r = regions_[i];
+      std::multimap<size_t,size_t>::iterator l = r.runs_by_len.lower_bound(units);
+      if (l == r.runs_by_len.end())
+        continue;
+
+      size_t start = l->second;
+      size_t len = l->first;
+      drop_run(r, r.runs.find(start));
+      if (len > units)
+        add_run(r, start+units, len-units);
+
+      if (whole) {
+        r.desc[start] = desc;
+      } else {
+        for (size_t u = start; u < start+units; u++)
+          r.desc[u] = desc;
+      }
+      stats_.free_bytes -= units*SLAB_UNIT;
+      return r.base + start*SLAB_UNIT;
+    }
+    return NULL;
+  }
+
+  void* alloc_large(size_t n) {
+    size_t units = units_for(n);
+    char* p = take_units(units, SLAB_DESC_LARGE|units, true);
+    if (p)
+      stats_.large_bytes += units*SLAB_UNIT;
+    return p;
+  }
+
+  void* alloc_small(size_t n) {
+    size_t c = class_for(n);
+    struct slab_class& sc = classes_[c];
+    size_t size = class_size_[c];
+    void* p;
+
+    if (sc.free) {
+      p = sc.free;
+      sc.free = *(void**)p;
+      stats_.free_chunk_bytes -= size;
+    } else {
+      if (sc.bump == NULL || sc.bump+size > sc.bump_end) {
+        // A new page counts as free chunks until carved, and so does
+        // any tail too short for one
+        char* page = take_units(SLAB_PAGE_SIZE/SLAB_UNIT, c+1, false);
+        if (page == NULL)
+          return NULL;
+        sc.bump = page;
+        sc.bump_end = page + SLAB_PAGE_SIZE;
+        sc.pages++;
+        stats_.page_bytes += SLAB_PAGE_SIZE;
+        stats_.free_chunk_bytes += SLAB_PAGE_SIZE;
+      }
+      p = sc.bump;
+      sc.bump += size;
+      stats_.free_chunk_bytes -= size;
+    }
+
+    sc.out++;
+    return p;
+  }
+};
+
+#endif // SLAB_H
@@ -20,6 +20,17 @@
 #include "store-client.h"
 #include "store-constants.h"
 
+/**
+ * Hand a value found by a lookup to the caller: copied into the
+ * caller's buffer, or for OP_GET_VIEW, pointed at where it landed.
+ */
+static inline void deliver_value(VAL_TYPE& value, const char* src, size_t val_len, int op) {
+  if (op == OP_GET_VIEW)
+    value = (VAL_TYPE)src;
+  else
+    memcpy(value,src,val_len);
+}
+
 /**
  * Client constructor. Creates a connection manager,
  * initialize statistics variables.
@@ -27,16 +38,40 @@
 Client::Client() {
   server_count = 0;
   servers.clear();
-  read_mode = READ_MODE_RDMA;
 
   manager = new IBConnManager(R_CLIENT);
   manager->verbosity(VERB_WARN);
   manager->set_event_hook(on_event,(void*)this);
 
+  // Over TCP every "RDMA" read is a round trip through the server's
+  // transport anyway, so let the server do the whole lookup
+  read_mode = (manager->transport()->type() == TRANSPORT_TCP)?READ_MODE_SERVER:READ_MODE_RDMA;
+
   stats_rdma_rts = 0;
   stats_rdma_ht_reprobes = 0;
   stats_rdma_locked = 0;
   stats_rdma_bad_extents = 0;
+  stats_slot_hints_used = 0;
+  stats_slot_hints_wrong = 0;
+  stats_adapt_rdma = 0;
+  stats_adapt_server = 0;
+
+  adapt_rdma_cost = 1;
+  adapt_rndv_share = 0;
+  adapt_lookups = 0;
+
+  async_ops.resize(ASYNC_MAX_OPS);
+  for(int i = ASYNC_MAX_OPS-1; i >= 0; i--) {
+    async_ops[i].state = ASYNC_FREE;
+    async_ops[i].tag.op = &async_ops[i];
+    async_free.push_back(i);
+  }
+  async_pending = 0;
+
+  epoch_seed = getpid();
+  bufs_init = false;
+  fetch_buf = fetch_ext_buf = async_buf = NULL;
+  fetch_buf_mr = fetch_ext_buf_mr = async_buf_mr = NULL;
 }
 
 /**
@@ -56,6 +91,59 @@ void Client::set_read_mode(read_modes mode) {
   read_mode = mode;
 }
 
+/**
+ * Remember, for up to entries keys (rounded up to a power of two),
+ * which probe each was last found at, so that RDMA reads of a key
+ * that lives in its second or later slot go straight there. A hint
+ * is only used on the connection epoch and table it was recorded
+ * on, and a wrong one costs a read before the usual probe order.
+ * Meant for tables mostly read between rebuilds; 0 turns it off.
+ */
+void Client::set_slot_cache(size_t entries) {
+  size_t n = 0;
+
+  if (entries > 0) {
+    n = 1;
+    while (n < entries)
+      n <<= 1;
+  }
+  slot_hints.assign(n, slot_hint());
+}
+
+/**
+ * The probe to start a lookup at: a hinted one, or 0.
+ */
+int Client::hint_probe_(struct ServerInfo* server, const key_hash& h) {
+  if (slot_hints.empty())
+    return 0;
+
+  struct slot_hint* e = &slot_hints[h.hi & (slot_hints.size()-1)];
+  if (e->hash_idx == 0 || e->fp != h.lo || e->epoch != server->epoch || e->table_gen != server->table_gen)
+    return 0;
+  stats_slot_hints_used++;
+  return e->hash_idx;
+}
+
+/**
+ * Record the probe a key was found at. The first probe needs no hint,
+ * so it only clears a stale one.
+ */
+void Client::note_probe_(struct ServerInfo* server, const key_hash& h, int hash_idx) {
+  if (slot_hints.empty())
+    return;
+
+  struct slot_hint* e = &slot_hints[h.hi & (slot_hints.size()-1)];
+  if (hash_idx == 0) {
+    if (e->fp == h.lo)
+      e->hash_idx = 0;
+    return;
+  }
+  e->fp = h.lo;
+  e->epoch = server->epoch;
+  e->table_gen = server->table_gen;
+  e->hash_idx = hash_idx;
+}
+
 /**
  * Checks if the (set of) underlying DHT server(s) contains
  * the given key or not.
@@ -64,11 +152,7 @@ int Client::contains(const KEY_TYPE key) {
 
   VAL_TYPE dummy;
   size_t val_len;
-  if (read_mode == READ_MODE_RDMA) {
-    return read_(key, strlen(key), dummy, val_len, OP_CONTAINS);
-  } else { //read_mode == READ_MODE_SERVER
-    return read_server_(key, strlen(key), dummy, val_len, OP_CONTAINS);
-  }
+  return lookup_(key, strlen(key), dummy, val_len, OP_CONTAINS);
 }
 
 /**
@@ -79,11 +163,7 @@ int Client::get(const KEY_TYPE key, VAL_TYPE& value) {
 
   size_t val_len;
 
-  if (read_mode == READ_MODE_RDMA) {
-    return read_(key, strlen(key), value, val_len, OP_GET);
-  } else { //read_mode == READ_MODE_SERVER
-    return read_server_(key, strlen(key), value, val_len, OP_GET);
-  }
+  return lookup_(key, strlen(key), value, val_len, OP_GET);
 }
 
 /**
@@ -104,6 +184,361 @@ int Client::remove(const KEY_TYPE key) {
   return write_(key, strlen(key), (VAL_TYPE)NULL, 0, OP_DELETE);
 }
 
+/**
+ * Dispatch a get() or contains() to the reader for the current read
+ * mode, or in adaptive mode, for the mode picked for this lookup.
+ */
+int Client::lookup_(const KEY_TYPE key, size_t key_len, VAL_TYPE& value, size_t& val_len, int op) {
+  int mode = (read_mode == READ_MODE_ADAPTIVE)?adapt_pick_():read_mode;
+  size_t rts = stats_rdma_rts;
+  int rval;
+
+  if (mode == READ_MODE_RDMA_PARALLEL) {
+    rval = read_parallel_(key, key_len, value, val_len, op);
+  } else if (mode == READ_MODE_RDMA) {
+    rval = read_(key, key_len, value, val_len, op);
+  } else { //mode == READ_MODE_SERVER
+    rval = read_server_(key, key_len, value, val_len, op);
+  }
+
+  if (read_mode == READ_MODE_ADAPTIVE && rval != POST_GET_FAILURE)
+    adapt_note_(mode, stats_rdma_rts - rts, (op != OP_CONTAINS && rval == POST_GET_FOUND)?val_len:0);
+  return rval;
+}
+
+/**
+ * Pick the mode of one adaptive lookup. An RDMA lookup costs the
+ * reads it takes: one per probe, one per extents fetch, and one per
+ * retry after a locked row, so reprobes, spilled values and writers
+ * racing the client all raise it. A server-mediated one costs
+ * ADAPT_SERVER_COST, which weighs its round-trip and the server CPU
+ * it takes against RDMA reads, plus a read when the value is too
+ * large for an eager reply. Only RDMA lookups measure the RDMA cost,
+ * so while the server is preferred every ADAPT_EXPLORE-th lookup goes
+ * over RDMA to notice when the table has become cheap to read again.
+ * The server cost is fixed apart from the rendezvous share, which
+ * lookups in either mode measure, so there is nothing to explore in
+ * the other direction.
+ */
+int Client::adapt_pick_(void) {
+  double server_cost = ADAPT_SERVER_COST + adapt_rndv_share;
+  if (adapt_rdma_cost <= server_cost)
+    return READ_MODE_RDMA;
+
+  if (++adapt_lookups % ADAPT_EXPLORE == 0)
+    return READ_MODE_RDMA;
+  return READ_MODE_SERVER;
+}
+
+/**
+ * Fold one adaptive lookup into the running costs. rts is the RDMA
+ * reads it issued, val_len the size of the value it found, if any.
+ */
+void Client::adapt_note_(int mode, size_t rts, size_t val_len) {
+  if (mode == READ_MODE_SERVER) {
+    stats_adapt_server++;
+  } else {
+    stats_adapt_rdma++;
+    adapt_rdma_cost += ((double)rts - adapt_rdma_cost)/ADAPT_WEIGHT;
+  }
+
+  if (val_len) {
+    double rndv = (sizeof(size_t) + val_len > (size_t)MSG_BUF_SIZE)?1:0;
+    adapt_rndv_share += (rndv - adapt_rndv_share)/ADAPT_WEIGHT;
+  }
+}
+
+/**
+ * Wait until count RDMA reads to this server have completed since
+ * rdma_reads_done was reset, or until the connection is bumped.
+ * Returns nonzero if the event loop failed.
+ */
+int Client::wait_rdma_(struct ServerInfo* server, unsigned int serverepoch, unsigned int count) {
+  int rval = 0;
+  do {
+    rval = do_event_loop();
+  } while(!rval && server->rdma_reads_done < count && server->epoch == serverepoch);
+  server->rdma_msg_ready = false;
+  return rval;
+}
+
+/**
+ * Post every RDMA read queued on this server's connection, running
+ * the event loop whenever the send queue is out of credits. Returns
+ * nonzero on failure.
+ */
+int Client::post_batch_(struct ServerInfo* server, unsigned int serverepoch) {
+  int queued;
+  while ((queued = server->connection->post_batch()) > 0) {
+    if (do_event_loop())
+      return POST_GET_FAILURE;
+    if (server->epoch != serverepoch)   // the queue went with the old connection
+      return 0;
+  }
+  return (queued < 0)?POST_GET_FAILURE:0;
+}
+
+#if DHT_LAYOUT==DHT_LAYOUT_BUCKET
+
+/**
+ * Variant of read_() that reads both candidate buckets in one batch,
+ * then fetches the extents of every way whose fingerprint matches the
+ * key in a second. Barring fingerprint collisions, a hit fetches one
+ * set of extents and a miss none, in at most two round-trips.
+ */
+int Client::read_parallel_(const KEY_TYPE key, size_t key_len, VAL_TYPE& value, size_t& val_len, int op) {
+  size_t slot_len = RemoteDHTClient::slot_size();
+  unsigned int serverepoch = 0;
+  int cand_bucket[DHT_PROBES*BUCKET_WAYS];
+  int cand_way[DHT_PROBES*BUCKET_WAYS];
+  size_t ext_off[DHT_PROBES*BUCKET_WAYS];
+  struct ibv_mr* ext_mrs[DHT_PROBES*BUCKET_WAYS];
+  int n_candidates, result;
+  bool locked;
+
+  if (op != OP_GET && op != OP_GET_VIEW && op != OP_CONTAINS)
+    diewithcode("Invalid op",op);
+
+  key_hash h = servers[0]->dhtclient->hash_key(key,key_len);
+
+re_read:
+  int whichserver = servers[0]->dhtclient->server_for_key(server_count,h);
+  struct ServerInfo* server = servers[whichserver];
+  serverepoch = server->epoch;
+  adopt_table_(server);
+
+  // Bucket i of the key lands at offset i*slot_len of the fetch buffer
+  server->rdma_reads_done = 0;
+  for(int i = 0; i < DHT_PROBES; i++) {
+    stats_rdma_rts++;
+    server->connection->rdma_fetch_batch((uintptr_t)server->dhtclient->pre_get(h,i), slot_len,
+                                         (uintptr_t)server->rdma_fetch_buf + i*slot_len,
+                                         server->dht_table_mr, server->rdma_fetch_buf_mr);
+  }
+  if (post_batch_(server, serverepoch) || wait_rdma_(server, serverepoch, DHT_PROBES))
+    return POST_GET_FAILURE;
+  if (server->epoch != serverepoch) // connection bumped; start again
+    goto re_read;
+
+  n_candidates = 0;
+  locked = false;
+  for(int i = 0; i < DHT_PROBES; i++) {
+    RemoteDHTBlock* bucket = (RemoteDHTBlock*)((char*)server->rdma_fetch_buf + i*slot_len);
+    int way = 0;
+
+    while ((result = server->dhtclient->post_get(bucket,h,way,way > 0)) == POST_GET_SPILLED) {
+      cand_bucket[n_candidates] = i;
+      cand_way[n_candidates++] = way++;
+    }
+    if (result == POST_GET_LOCKED)
+      locked = true;
+  }
+
+  // Look up the regions before queueing any extents read
+  for(int c = 0; c < n_candidates; c++) {
+    RemoteDHTBlock* bucket = (RemoteDHTBlock*)((char*)server->rdma_fetch_buf + cand_bucket[c]*slot_len);
+    ext_mrs[c] = ext_mr_(server,RemoteDHTClient::ext_addr(bucket,cand_way[c]),serverepoch);
+    if (ext_mrs[c] == NULL)
+      goto re_read;
+  }
+
+  // Fetch candidate extents, as many per round-trip as the buffer holds
+  for(int first = 0; first < n_candidates; ) {
+    size_t off = 0;
+    int last = first;
+
+    server->rdma_reads_done = 0;
+    while (last < n_candidates) {
+      RemoteDHTBlock* bucket = (RemoteDHTBlock*)((char*)server->rdma_fetch_buf + cand_bucket[last]*slot_len);
+      size_t len = RemoteDHTClient::ext_fetch_len(bucket,cand_way[last]);
+      if (last > first && off + len > RECV_EXT_SIZE)
+        break;
+      ext_off[last] = off;
+      stats_rdma_rts++;
+      server->connection->rdma_fetch_batch(RemoteDHTClient::ext_fetch_addr(bucket,cand_way[last]), len,
+                                           (uintptr_t)server->rdma_fetch_ext_buf + off,
+                                           ext_mrs[last], server->rdma_fetch_ext_buf_mr);
+      off += len;
+      last++;
+    }
+    if (post_batch_(server, serverepoch) || wait_rdma_(server, serverepoch, last-first))
+      return POST_GET_FAILURE;
+    if (server->epoch != serverepoch)
+      goto re_read;
+
+    for(int c = first; c < last; c++) {
+      RemoteDHTBlock* bucket = (RemoteDHTBlock*)((char*)server->rdma_fetch_buf + cand_bucket[c]*slot_len);
+      char* ext = (char*)server->rdma_fetch_ext_buf + ext_off[c] + EXT_HEAD_SIZE;
+
+      result = server->dhtclient->post_get_extents(bucket,cand_way[c],ext,key,key_len);
+      if (result == POST_GET_FOUND) {
+        if (op != OP_CONTAINS) {
+          val_len = RemoteDHTClient::val_len(bucket,cand_way[c]);
+          deliver_value(value,ext+key_len,val_len,op);
+        }
+        return (op == OP_CONTAINS)?1:result;
+      }
+      if (result == POST_GET_LOCKED) {
+        stats_rdma_bad_extents++;
+        locked = true;
+      }
+    }
+    first = last;
+  }
+
+  // A locked bucket may have been hiding the key; read everything again
+  if (locked) {
+    stats_rdma_locked++;
+    goto re_read;
+  }
+
+  return (op == OP_CONTAINS)?0:POST_GET_MISSING;
+}
+
+#else
+
+/**
+ * Variant of read_() that posts the reads of all CUCKOO_D candidate
+ * slots back to back instead of probing them one round-trip at a time,
+ * then fetches the extents of every candidate that may hold the key in
+ * a second batch. A lookup, hit or miss, thus costs at most two
+ * round-trips (one when the pair is inline) at the price of reading
+ * CUCKOO_D slots.
+ */
+int Client::read_parallel_(const KEY_TYPE key, size_t key_len, VAL_TYPE& value, size_t& val_len, int op) {
+  size_t slot_len = RemoteDHTClient::slot_size();
+  unsigned int serverepoch = 0;
+  int candidates[CUCKOO_D];
+  size_t ext_off[CUCKOO_D];
+  struct ibv_mr* ext_mrs[CUCKOO_D];
+  int n_candidates, result;
+  bool locked;
+
+  if (op != OP_GET && op != OP_GET_VIEW && op != OP_CONTAINS)
+    diewithcode("Invalid op",op);
+
+  key_hash h = servers[0]->dhtclient->hash_key(key,key_len);
+
+re_read:
+  int whichserver = servers[0]->dhtclient->server_for_key(server_count,h);
+  struct ServerInfo* server = servers[whichserver];
+  serverepoch = server->epoch;
+  adopt_table_(server);
+
+  // Slot i of the key lands at offset i*slot_len of the fetch buffer
+  server->rdma_reads_done = 0;
+  for(int i = 0; i < CUCKOO_D; i++) {
+    stats_rdma_rts++;
+    server->connection->rdma_fetch_batch((uintptr_t)server->dhtclient->pre_get(h,i), slot_len,
+                                         (uintptr_t)server->rdma_fetch_buf + i*slot_len,
+                                         server->dht_table_mr, server->rdma_fetch_buf_mr);
+  }
+  if (post_batch_(server, serverepoch) || wait_rdma_(server, serverepoch, CUCKOO_D))
+    return POST_GET_FAILURE;
+  if (server->epoch != serverepoch) // connection bumped; start again
+    goto re_read;
+
+  n_candidates = 0;
+  locked = false;
+  for(int i = 0; i < CUCKOO_D; i++) {
+    RemoteDHTBlock* slot = (RemoteDHTBlock*)((char*)server->rdma_fetch_buf + i*slot_len);
+
+#if DHT_LAYOUT==DHT_LAYOUT_INLINE
+    result = server->dhtclient->post_get(slot,key,key_len);
+    if (result == POST_GET_SPILLED && op == OP_CONTAINS && RemoteDHTClient::key_inline(slot))
+      return 1;
+    if (result == POST_GET_FOUND) {
+      if (op != OP_CONTAINS) {
+        val_len = slot->d.val_len;
+        deliver_value(value,RemoteDHTClient::inline_value(slot),val_len,op);
+      }
+      return (op == OP_CONTAINS)?1:result;
+    }
+    if (result == POST_GET_SPILLED)
+      candidates[n_candidates++] = i;
+#else
+    // Only a row placed with hash function i can be this key's
+    result = server->dhtclient->post_contains(slot,key,key_len);
+    if (result == POST_GET_FOUND && slot->d.hash == i)
+      candidates[n_candidates++] = i;
+#endif
+    if (result == POST_GET_LOCKED)
+      locked = true;
+  }
+
+  // Look up the regions before queueing any extents read
+  for(int c = 0; c < n_candidates; c++) {
+    RemoteDHTBlock* slot = (RemoteDHTBlock*)((char*)server->rdma_fetch_buf + candidates[c]*slot_len);
+#if DHT_LAYOUT==DHT_LAYOUT_INLINE
+    ext_mrs[c] = ext_mr_(server,(uintptr_t)slot->d.ext,serverepoch);
+#else
+    ext_mrs[c] = ext_mr_(server,(uintptr_t)slot->d.key,serverepoch);
+#endif
+    if (ext_mrs[c] == NULL)
+      goto re_read;
+  }
+
+  // Fetch candidate extents, as many per round-trip as the buffer holds
+  for(int first = 0; first < n_candidates; ) {
+    size_t off = 0;
+    int last = first;
+
+    server->rdma_reads_done = 0;
+    while (last < n_candidates) {
+      RemoteDHTBlock* slot = (RemoteDHTBlock*)((char*)server->rdma_fetch_buf + candidates[last]*slot_len);
+      size_t len = RemoteDHTClient::ext_fetch_len(slot);
+      if (last > first && off + len > RECV_EXT_SIZE)
+        break;
+      ext_off[last] = off;
+      stats_rdma_rts++;
+      server->connection->rdma_fetch_batch(RemoteDHTClient::ext_fetch_addr(slot), len,
+                                           (uintptr_t)server->rdma_fetch_ext_buf + off,
+                                           ext_mrs[last], server->rdma_fetch_ext_buf_mr);
+      off += len;
+      last++;
+    }
+    if (post_batch_(server, serverepoch) || wait_rdma_(server, serverepoch, last-first))
+      return POST_GET_FAILURE;
+    if (server->epoch != serverepoch)
+      goto re_read;
+
+    for(int c = first; c < last; c++) {
+      RemoteDHTBlock* slot = (RemoteDHTBlock*)((char*)server->rdma_fetch_buf + candidates[c]*slot_len);
+      char* ext = (char*)server->rdma_fetch_ext_buf + ext_off[c] + EXT_HEAD_SIZE;
+
+#if DHT_LAYOUT==DHT_LAYOUT_INLINE
+      result = server->dhtclient->post_get_extents(slot,ext,key,key_len);
+#else
+      slot->d.value += ext - slot->d.key;
+      slot->d.key = ext;
+      result = server->dhtclient->post_get_extents(slot,key,key_len);
+#endif
+      if (result == POST_GET_FOUND) {
+        if (op != OP_CONTAINS) {
+          val_len = slot->d.val_len;
+          deliver_value(value,ext+key_len,val_len,op);
+        }
+        return (op == OP_CONTAINS)?1:result;
+      }
+      if (result == POST_GET_LOCKED) {
+        stats_rdma_bad_extents++;
+        locked = true;
+      }
+    }
+    first = last;
+  }
+
+  // A locked row may have been hiding the key; read everything again
+  if (locked) {
+    stats_rdma_locked++;
+    goto re_read;
+  }
+
+  return (op == OP_CONTAINS)?0:POST_GET_MISSING;
+}
+
+#endif // DHT_LAYOUT
+
 /**
  * Perform an RDMA read sequence. This is used for the get() and contains()
  * operations when RDMA (client-mediated) mode is active. It performs one or
@@ -113,20 +548,255 @@ int Client::remove(const KEY_TYPE key) {
  * resizes the occur while it's working.
  */
 
+#if DHT_LAYOUT==DHT_LAYOUT_BUCKET
+
+/**
+ * With buckets, one RDMA read fetches every way a candidate bucket
+ * has, and only ways whose fingerprint matches the key have their
+ * extents read. A lookup reads the second bucket only if the first
+ * does not hold the key.
+ */
+int Client::read_(const KEY_TYPE key, size_t key_len, VAL_TYPE& value, size_t& val_len, int op) {
+  int rval = 0;
+  size_t hash_idx = 0;
+  unsigned int serverepoch = 0;
+  bool hinted = false, hint_missed = false;
+  int result, way;
+
+  if (op != OP_GET && op != OP_GET_VIEW && op != OP_CONTAINS)
+    diewithcode("Invalid op",op);
+
+  key_hash h = servers[0]->dhtclient->hash_key(key,key_len);
+
+re_read:
+  int whichserver = servers[0]->dhtclient->server_for_key(server_count,h);
+  struct ServerInfo* server = servers[whichserver];
+  serverepoch = server->epoch;
+  if (hash_idx == 0) {  // never switch tables between the probes of one lookup
+    adopt_table_(server);
+    if (!hint_missed)
+      hash_idx = hint_probe_(server,h);
+    hinted = (hash_idx > 0);
+  }
+
+  uintptr_t remoteaddr = (uintptr_t)server->dhtclient->pre_get(h,hash_idx);
+
+  stats_rdma_rts++;
+  server->connection->rdma_fetch(remoteaddr, BLOCK_READ_COUNT*RemoteDHTClient::slot_size(),
+                                 server->dht_table_mr, server->rdma_fetch_buf_mr);
+
+  do {
+    rval = do_event_loop();
+  } while(!rval && !server->rdma_msg_ready && server->epoch == serverepoch);
+  server->rdma_msg_ready = false;
+
+  if (rval) return POST_GET_FAILURE;
+
+  if (server->epoch != serverepoch) // connection bumped; start again
+    goto re_read;
+
+  RemoteDHTBlock* bucket = (RemoteDHTBlock*)(server->rdma_fetch_buf);
+  way = 0;
+
+next_way:
+  result = server->dhtclient->post_get(bucket,h,way,way > 0);
+
+  if (result == POST_GET_SPILLED) {
+    struct ibv_mr* ext_mr = ext_mr_(server,RemoteDHTClient::ext_addr(bucket,way),serverepoch);
+    if (ext_mr == NULL) {
+      hash_idx = 0;
+      goto re_read;
+    }
+
+    stats_rdma_rts++;
+    server->connection->rdma_fetch(RemoteDHTClient::ext_fetch_addr(bucket,way),RemoteDHTClient::ext_fetch_len(bucket,way),
+                                   ext_mr, server->rdma_fetch_ext_buf_mr);
+
+    do {
+      rval = do_event_loop();
+    } while(!rval && !server->rdma_msg_ready && server->epoch == serverepoch);
+    server->rdma_msg_ready = false;
+
+    if (rval) return POST_GET_FAILURE;
+
+    if (server->epoch != serverepoch)
+      goto re_read;
+
+    const char* ext = (const char*)server->rdma_fetch_ext_buf + EXT_HEAD_SIZE;
+    result = server->dhtclient->post_get_extents(bucket,way,ext,key,key_len);
+    if (result == POST_GET_LOCKED) {
+      stats_rdma_bad_extents++;
+      hash_idx = 0;
+      goto re_read;
+    }
+    if (result == POST_GET_COLLISION) {   // same fingerprint; try the bucket's other ways
+      way++;
+      goto next_way;
+    }
+    if (op != OP_CONTAINS) {
+      val_len = RemoteDHTClient::val_len(bucket,way);
+      deliver_value(value,ext+key_len,val_len,op);
+    }
+    note_probe_(server,h,hash_idx);
+    return (op == OP_CONTAINS)?1:result;
+  }
+
+  if (result == POST_GET_LOCKED) {
+    hash_idx = 0;
+    stats_rdma_locked++;
+    goto re_read;
+  }
+
+  // POST_GET_MISSING: not in this bucket
+  if (hinted) {         // it moved since it was cached; probe in order
+    stats_slot_hints_wrong++;
+    hint_missed = true;
+    hash_idx = 0;
+    goto re_read;
+  }
+  stats_rdma_ht_reprobes++;
+  hash_idx++;
+  if (hash_idx == DHT_PROBES)
+    return (op == OP_CONTAINS)?0:POST_GET_MISSING;
+  goto re_read;
+}
 
+#elif DHT_LAYOUT==DHT_LAYOUT_INLINE
+
+/**
+ * With inline slots, a single RDMA read of the slot answers a get() for
+ * small pairs and every contains() whose key is inline. Only spilled
+ * values need a second round-trip to the extents.
+ */
 int Client::read_(const KEY_TYPE key, size_t key_len, VAL_TYPE& value, size_t& val_len, int op) {
   int rval = 0;
   size_t hash_idx = 0;
   unsigned int serverepoch = 0;
+  bool hinted = false, hint_missed = false;
+  int result;
+
+  if (op != OP_GET && op != OP_GET_VIEW && op != OP_CONTAINS)
+    diewithcode("Invalid op",op);
+
+  key_hash h = servers[0]->dhtclient->hash_key(key,key_len);
+
+re_read:
+  int whichserver = servers[0]->dhtclient->server_for_key(server_count,h);
+  struct ServerInfo* server = servers[whichserver];
+  serverepoch = server->epoch;
+  if (hash_idx == 0) {  // never switch tables between the probes of one lookup
+    adopt_table_(server);
+    if (!hint_missed)
+      hash_idx = hint_probe_(server,h);
+    hinted = (hash_idx > 0);
+  }
+
+  uintptr_t remoteaddr = (uintptr_t)server->dhtclient->pre_get(h,hash_idx);
+
+  stats_rdma_rts++;
+  server->connection->rdma_fetch(remoteaddr, RemoteDHTClient::slot_size(), server->dht_table_mr, server->rdma_fetch_buf_mr);
+
+  do {
+    rval = do_event_loop();
+  } while(!rval && !server->rdma_msg_ready && server->epoch == serverepoch);
+  server->rdma_msg_ready = false;
+
+  if (rval) return POST_GET_FAILURE;
+
+  if (server->epoch != serverepoch) // connection bumped; start again
+    goto re_read;
+
+  RemoteDHTBlock* slot = (RemoteDHTBlock*)(server->rdma_fetch_buf);
+  result = server->dhtclient->post_get(slot,key,key_len);
+
+  if (result == POST_GET_SPILLED && op == OP_CONTAINS && RemoteDHTClient::key_inline(slot))
+    result = POST_GET_FOUND;
+
+  if (result == POST_GET_SPILLED) {
+    struct ibv_mr* ext_mr = ext_mr_(server,(uintptr_t)slot->d.ext,serverepoch);
+    if (ext_mr == NULL) {
+      hash_idx = 0;
+      goto re_read;
+    }
+
+    stats_rdma_rts++;
+    server->connection->rdma_fetch(RemoteDHTClient::ext_fetch_addr(slot),RemoteDHTClient::ext_fetch_len(slot),
+                                   ext_mr, server->rdma_fetch_ext_buf_mr);
+
+    do {
+      rval = do_event_loop();
+    } while(!rval && !server->rdma_msg_ready && server->epoch == serverepoch);
+    server->rdma_msg_ready = false;
+
+    if (rval) return POST_GET_FAILURE;
+
+    if (server->epoch != serverepoch)
+      goto re_read;
+
+    const char* ext = (const char*)server->rdma_fetch_ext_buf + EXT_HEAD_SIZE;
+    result = server->dhtclient->post_get_extents(slot,ext,key,key_len);
+    if (result == POST_GET_LOCKED) {
+      stats_rdma_bad_extents++;
+      hash_idx = 0;
+      goto re_read;
+    }
+    if (result == POST_GET_FOUND && op != OP_CONTAINS) {
+      val_len = slot->d.val_len;
+      deliver_value(value,ext+key_len,val_len,op);
+    }
+  } else if (result == POST_GET_FOUND && op != OP_CONTAINS) {
+    val_len = slot->d.val_len;
+    deliver_value(value,RemoteDHTClient::inline_value(slot),val_len,op);
+  }
+
+  if (result == POST_GET_LOCKED) {
+    hash_idx = 0;
+    stats_rdma_locked++;
+    goto re_read;
+
+  } else if (result == POST_GET_MISSING || result == POST_GET_COLLISION) {
+    if (hinted) {       // it moved since it was cached; probe in order
+      stats_slot_hints_wrong++;
+      hint_missed = true;
+      hash_idx = 0;
+      goto re_read;
+    }
+    stats_rdma_ht_reprobes++;
+    hash_idx++;
+    if (hash_idx == CUCKOO_D)
+      return (op == OP_CONTAINS)?0:POST_GET_MISSING;
+    goto re_read;
+
+  } else if (result == POST_GET_FOUND) {
+    note_probe_(server,h,hash_idx);
+    return (op == OP_CONTAINS)?1:result;
+  }
+  return result;
+}
+
+#else
+
+int Client::read_(const KEY_TYPE key, size_t key_len, VAL_TYPE& value, size_t& val_len, int op) {
+  int rval = 0;
+  size_t hash_idx = 0;
+  unsigned int serverepoch = 0;
+  bool hinted = false, hint_missed = false;
+  key_hash h = servers[0]->dhtclient->hash_key(key,key_len);
 
 re_read:
   // Figure out which server has the key we need
-  int whichserver = servers[0]->dhtclient->server_for_key(server_count,key,key_len);
+  int whichserver = servers[0]->dhtclient->server_for_key(server_count,h);
   serverepoch = servers[whichserver]->epoch;
+  if (hash_idx == 0) {  // never switch tables between the probes of one lookup
+    adopt_table_(servers[whichserver]);
+    if (!hint_missed)
+      hash_idx = hint_probe_(servers[whichserver],h);
+    hinted = (hash_idx > 0);
+  }
 
   // Figure out where in that server's DHT this key should be
-  uintptr_t remoteaddr = (uintptr_t)servers[whichserver]->dhtclient->pre_get(key,key_len,hash_idx);
-  size_t remotelen = BLOCK_READ_COUNT*(sizeof(DHT<KEY_TYPE,VAL_TYPE>::dht_block));
+  uintptr_t remoteaddr = (uintptr_t)servers[whichserver]->dhtclient->pre_get(h,hash_idx);
+  size_t remotelen = BLOCK_READ_COUNT*RemoteDHTClient::slot_size();
 
   // Issue DHT get request
   stats_rdma_rts++;
@@ -146,19 +816,24 @@ re_read:
   if (servers[whichserver]->epoch != serverepoch) // connection bumped; start again
     goto re_read;
 
-  DHT<const KEY_TYPE,VAL_TYPE>::dht_block* dhtb =
-      (DHT<const KEY_TYPE,VAL_TYPE>::dht_block*)(servers[whichserver]->rdma_fetch_buf);
+  RemoteDHTBlock* dhtb = (RemoteDHTBlock*)(servers[whichserver]->rdma_fetch_buf);
 
   // Store value, get status
   int result;
 
-  if (op == OP_GET)
+  if (op == OP_GET || op == OP_GET_VIEW)
     result = servers[whichserver]->dhtclient->post_get(dhtb,key,key_len,value);
   else if (op == OP_CONTAINS)
     result = servers[whichserver]->dhtclient->post_contains(dhtb,key,key_len);
   else diewithcode("Invalid op",op);
 
   if (result == POST_GET_MISSING) {
+    if (hinted) {       // it moved since it was cached; probe in order
+      stats_slot_hints_wrong++;
+      hint_missed = true;
+      hash_idx = 0;
+      goto re_read;
+    }
     stats_rdma_ht_reprobes++;
     hash_idx++;
     if (hash_idx == CUCKOO_D)
@@ -167,9 +842,16 @@ re_read:
   }
 
   if (result == POST_GET_FOUND) {
+    struct ibv_mr* ext_mr = ext_mr_(servers[whichserver],(uintptr_t)dhtb->d.key,serverepoch);
+    if (ext_mr == NULL) {
+      hash_idx = 0;
+      goto re_read;
+    }
+
     stats_rdma_rts++;
-    servers[whichserver]->connection->rdma_fetch((uintptr_t)dhtb->d.key,dhtb->d.ext_capacity,
-                                                 servers[whichserver]->dht_ext_mr,
+    servers[whichserver]->connection->rdma_fetch(RemoteDHTClient::ext_fetch_addr(dhtb),
+                                                 RemoteDHTClient::ext_fetch_len(dhtb),
+                                                 ext_mr,
                                                  servers[whichserver]->rdma_fetch_ext_buf_mr);
   } else { //LOCKED
     hash_idx = 0;     // Jinyang's call
@@ -191,12 +873,13 @@ re_read:
     goto re_read;
 
   // Extents received
-  dhtb = (DHT<const KEY_TYPE,VAL_TYPE>::dht_block*)servers[whichserver]->rdma_fetch_buf;
+  dhtb = (RemoteDHTBlock*)servers[whichserver]->rdma_fetch_buf;
 
-  dhtb->d.value += (char*)servers[whichserver]->rdma_fetch_ext_buf - dhtb->d.key;
-  dhtb->d.key = (char*)servers[whichserver]->rdma_fetch_ext_buf;
+  char* ext = (char*)servers[whichserver]->rdma_fetch_ext_buf + EXT_HEAD_SIZE;
+  dhtb->d.value += ext - dhtb->d.key;
+  dhtb->d.key = ext;
 
-  if (op == OP_GET)
+  if (op == OP_GET || op == OP_GET_VIEW)
     result = servers[whichserver]->dhtclient->post_get_extents(dhtb,key,key_len);
   else if (op == OP_CONTAINS)
     result = servers[whichserver]->dhtclient->post_contains_extents(dhtb,key,key_len);
@@ -216,6 +899,12 @@ re_read:
     //manager->log(VERB_VITAL, "POST_GET_COLLISION!\n");
     //exit(0);
     //read_fail++;
+    if (hinted) {       // it moved since it was cached; probe in order
+      stats_slot_hints_wrong++;
+      hint_missed = true;
+      hash_idx = 0;
+      goto re_read;
+    }
     stats_rdma_ht_reprobes++;
     hash_idx++;
     if (hash_idx == CUCKOO_D)
@@ -224,10 +913,11 @@ re_read:
 
   } else if (result == POST_GET_FOUND) {
     //manager->log(VERB_VITAL, "POST_GET_FOUND!\n");
-    if (op == OP_GET) {
+    if (op != OP_CONTAINS) {
       val_len = dhtb->d.val_len;
-      memcpy(value,dhtb->d.value,val_len);
+      deliver_value(value,dhtb->d.value,val_len,op);
     }
+    note_probe_(servers[whichserver],h,hash_idx);
     return (op == OP_CONTAINS)?1:result;
 
   } else if (result == POST_GET_MISSING) {
@@ -238,6 +928,8 @@ re_read:
   } 
 }
 
+#endif // DHT_LAYOUT
+
 /**
  * Perform a server-mediated (verb msg) read to a server, for the
  * get() and contains() operations when the server-mediated mode has
@@ -249,11 +941,13 @@ int Client::read_server_(const KEY_TYPE key, size_t key_len, VAL_TYPE& value, si
 re_read:
   int whichserver = servers[0]->dhtclient->server_for_key(server_count,key,key_len);
   unsigned int serverepoch = servers[whichserver]->epoch;
-  struct dht_message* send_msg = (struct dht_message*)(servers[whichserver]->connection->get_send_buf());
+  adopt_table_(servers[whichserver]);
+  struct dht_message* send_msg = (struct dht_message*)(servers[whichserver]->connection->get_send_buf(
+                                  sizeof(send_msg->data.put) + key_len));
   size_t sendlen = 0;
 
   // Construct DHT put request
-  send_msg->type = (op == OP_GET)?MSG_DHT_GET:MSG_DHT_CONTAINS;
+  send_msg->type = (op == OP_CONTAINS)?MSG_DHT_CONTAINS:MSG_DHT_GET;
 
   // Set up message body
   send_msg->data.put.key_len = key_len;
@@ -264,7 +958,7 @@ re_read:
   //sendlen = sizeof(struct dht_message) + key_len - 1; // -1 for the fake 'char' that is .body
   sendlen = sizeof(send_msg->data.put) + key_len;
 
-  servers[whichserver]->connection->send_message_ext((op == OP_GET)?MSG_DHT_GET:MSG_DHT_CONTAINS,
+  servers[whichserver]->connection->send_message_ext((op == OP_CONTAINS)?MSG_DHT_CONTAINS:MSG_DHT_GET,
                                                      (char*)&(send_msg->data),sendlen);
 
   // Wait for response
@@ -285,7 +979,7 @@ re_read:
   struct dht_message* retmsg = (struct dht_message*)servers[whichserver]->ibv_recv_buf;
   char* retmsg_body = &(retmsg->data.valresp);
 
-  if (op == OP_GET) {
+  if (op != OP_CONTAINS) {
     // GET and contains response?
     if (retmsg->type == MSG_DHT_GET_DONE_MISSING) {
       return POST_GET_MISSING;
@@ -293,7 +987,7 @@ re_read:
       return POST_GET_FAILURE;
     }
     val_len = *((size_t *)retmsg_body);
-    memcpy(value, (char*)(retmsg_body+sizeof(size_t)), val_len);
+    deliver_value(value, retmsg_body+sizeof(size_t), val_len, op);
   } else {
 
     // CONTAINS and contains response?
@@ -307,6 +1001,280 @@ re_read:
 
 }
 
+/**
+ * Start an asynchronous RDMA get(). value must stay valid, and
+ * val_len is set, by the time the operation completes.
+ */
+int Client::get_async(const KEY_TYPE key, size_t key_len, VAL_TYPE value, size_t& val_len) {
+  return start_async_(key, key_len, value, &val_len, OP_GET);
+}
+
+/**
+ * Start an asynchronous RDMA contains().
+ */
+int Client::contains_async(const KEY_TYPE key, size_t key_len) {
+  return start_async_(key, key_len, NULL, NULL, OP_CONTAINS);
+}
+
+int Client::start_async_(const KEY_TYPE key, size_t key_len, VAL_TYPE value, size_t* val_len, int op) {
+  if (async_free.empty())
+    return -1;
+
+  int handle = async_free.back();
+  async_free.pop_back();
+
+  struct async_op* a = &async_ops[handle];
+  if (NULL == (a->key = (char*)malloc(key_len)))
+    die("Failed to allocate key for asynchronous operation");
+  memcpy(a->key,key,key_len);
+  a->key_len = key_len;
+  a->hash = servers[0]->dhtclient->hash_key(key,key_len);
+  a->value = value;
+  a->val_len = val_len;
+  a->op = op;
+  a->hash_idx = 0;
+  a->hint_missed = false;
+  async_pending++;
+
+  issue_async_(handle);
+  return handle;
+}
+
+/**
+ * Queue the slot read for an operation's current hash index. It is
+ * posted by the next poll(), together with every other queued read
+ * to the same server.
+ */
+void Client::issue_async_(int handle) {
+  struct async_op* a = &async_ops[handle];
+
+  a->server = servers[0]->dhtclient->server_for_key(server_count,a->hash);
+  struct ServerInfo* server = servers[a->server];
+  a->epoch = server->epoch;
+
+  // Probes of one operation all go to the same table
+  adopt_table_(server);
+  if (a->table_gen != server->table_gen) {
+    a->table_gen = server->table_gen;
+    a->hash_idx = 0;
+  }
+  if (a->hash_idx == 0) {
+    if (!a->hint_missed)
+      a->hash_idx = hint_probe_(server,a->hash);
+    a->hinted = (a->hash_idx > 0);
+  }
+  a->state = ASYNC_SLOT;
+  a->ready = false;
+  a->way = 0;
+
+  stats_rdma_rts++;
+  server->connection->rdma_fetch_batch((uintptr_t)server->dhtclient->pre_get(a->hash,a->hash_idx),
+                                       RemoteDHTClient::slot_size(),
+                                       (uintptr_t)server->async_buf + handle*ASYNC_BUF_SIZE,
+                                       server->dht_table_mr, server->async_buf_mr, &a->tag);
+}
+
+/**
+ * Record the result of an operation in the form get()/contains()
+ * would have returned it.
+ */
+void Client::finish_async_(int handle, int result) {
+  struct async_op* a = &async_ops[handle];
+
+  if (a->op == OP_CONTAINS && (result == POST_GET_FOUND || result == POST_GET_MISSING))
+    result = (result == POST_GET_FOUND)?1:0;
+  a->result = result;
+  a->state = ASYNC_DONE;
+  async_pending--;
+}
+
+/**
+ * Advance an operation whose read completed, or whose connection was
+ * bumped. Follows the same probe sequence as read_().
+ */
+void Client::advance_async_(int handle) {
+  struct async_op* a = &async_ops[handle];
+  struct ServerInfo* server = servers[a->server];
+  char* buf = (char*)server->async_buf + handle*ASYNC_BUF_SIZE;
+  RemoteDHTBlock* slot = (RemoteDHTBlock*)buf;
+  char* ext = buf + RemoteDHTClient::slot_size() + EXT_HEAD_SIZE;
+  int result;
+
+  if (server->epoch != a->epoch) { // connection bumped; start again
+    issue_async_(handle);
+    return;
+  }
+  a->ready = false;
+
+  if (a->state == ASYNC_SLOT) {
+#if DHT_LAYOUT==DHT_LAYOUT_BUCKET
+    result = server->dhtclient->post_get(slot,a->hash,a->way,a->way > 0);
+    uintptr_t ext_addr = RemoteDHTClient::ext_addr(slot,a->way);
+    uintptr_t fetch_addr = RemoteDHTClient::ext_fetch_addr(slot,a->way);
+    size_t fetch_len = RemoteDHTClient::ext_fetch_len(slot,a->way);
+#elif DHT_LAYOUT==DHT_LAYOUT_INLINE
+    result = server->dhtclient->post_get(slot,a->key,a->key_len);
+    if (result == POST_GET_SPILLED && a->op == OP_CONTAINS && RemoteDHTClient::key_inline(slot)) {
+      result = POST_GET_FOUND;
+    } else if (result == POST_GET_FOUND && a->op == OP_GET) {
+      *a->val_len = slot->d.val_len;
+      memcpy(a->value,RemoteDHTClient::inline_value(slot),slot->d.val_len);
+    }
+    uintptr_t ext_addr = (uintptr_t)slot->d.ext;
+    uintptr_t fetch_addr = RemoteDHTClient::ext_fetch_addr(slot);
+    size_t fetch_len = RemoteDHTClient::ext_fetch_len(slot);
+#else
+    result = server->dhtclient->post_contains(slot,a->key,a->key_len);
+    if (result == POST_GET_FOUND)
+      result = POST_GET_SPILLED;    // the key is only in the extents
+    uintptr_t ext_addr = (uintptr_t)slot->d.key;
+    uintptr_t fetch_addr = RemoteDHTClient::ext_fetch_addr(slot);
+    size_t fetch_len = RemoteDHTClient::ext_fetch_len(slot);
+#endif
+
+    if (result == POST_GET_SPILLED) {
+      if (fetch_len > ASYNC_BUF_SIZE-RemoteDHTClient::slot_size()) {
+        // Too large for this operation's buffer; fall back to a blocking read,
+        // which uses the server's own buffers and untagged completions
+        size_t dummy_len;
+        VAL_TYPE dummy_val = NULL;
+        result = read_(a->key, a->key_len, a->op == OP_GET ? a->value : dummy_val,
+                       a->op == OP_GET ? *a->val_len : dummy_len, a->op);
+        // contains answers 1 or 0; errors pass through for wait() to return
+        if (a->op == OP_CONTAINS && (result == 1 || result == 0))
+          result = result ? POST_GET_FOUND : POST_GET_MISSING;
+        finish_async_(handle, result);
+        return;
+      }
+      struct ibv_mr* ext_mr = ext_mr_(server, ext_addr, a->epoch);
+      if (ext_mr == NULL) {
+        a->hash_idx = 0;
+        issue_async_(handle);
+        return;
+      }
+
+      a->state = ASYNC_EXTENTS;
+      stats_rdma_rts++;
+      server->connection->rdma_fetch_batch(fetch_addr, fetch_len, (uintptr_t)ext - EXT_HEAD_SIZE,
+                                           ext_mr, server->async_buf_mr, &a->tag);
+      return;
+    }
+
+  } else { // ASYNC_EXTENTS
+#if DHT_LAYOUT==DHT_LAYOUT_BUCKET
+    result = server->dhtclient->post_get_extents(slot,a->way,ext,a->key,a->key_len);
+    if (result == POST_GET_COLLISION) {   // same fingerprint; try the bucket's other ways
+      a->way++;
+      a->state = ASYNC_SLOT;
+      advance_async_(handle);
+      return;
+    }
+    size_t found_len = RemoteDHTClient::val_len(slot,a->way);
+#elif DHT_LAYOUT==DHT_LAYOUT_INLINE
+    result = server->dhtclient->post_get_extents(slot,ext,a->key,a->key_len);
+    size_t found_len = slot->d.val_len;
+#else
+    slot->d.value += ext - slot->d.key;
+    slot->d.key = ext;
+    result = server->dhtclient->post_get_extents(slot,a->key,a->key_len);
+    size_t found_len = slot->d.val_len;
+#endif
+    if (result == POST_GET_FOUND && a->op == OP_GET) {
+      *a->val_len = found_len;
+      memcpy(a->value,ext+a->key_len,found_len);
+    } else if (result == POST_GET_LOCKED) {
+      stats_rdma_bad_extents++;
+    }
+  }
+
+  if (result == POST_GET_LOCKED) {
+    if (a->state == ASYNC_SLOT)
+      stats_rdma_locked++;
+    a->hash_idx = 0;
+    issue_async_(handle);
+
+  } else if (result == POST_GET_MISSING || result == POST_GET_COLLISION) {
+    if (a->hinted) {    // it moved since it was cached; probe in order
+      stats_slot_hints_wrong++;
+      a->hint_missed = true;
+      a->hash_idx = 0;
+      issue_async_(handle);
+      return;
+    }
+    stats_rdma_ht_reprobes++;
+    if (++a->hash_idx == DHT_PROBES) {
+      finish_async_(handle, POST_GET_MISSING);
+    } else {
+      issue_async_(handle);
+    }
+
+  } else {
+    if (result == POST_GET_FOUND)
+      note_probe_(server,a->hash,a->hash_idx);
+    finish_async_(handle, result);
+  }
+}
+
+/**
+ * Run the event loop once, advance every operation that can make
+ * progress, and post the reads they queued with one doorbell per
+ * server. Returns the number of operations still in flight, or
+ * POST_GET_FAILURE if the event loop failed.
+ */
+int Client::poll(void) {
+  if (do_event_loop())
+    return POST_GET_FAILURE;
+
+  for(int i = 0; i < ASYNC_MAX_OPS; i++) {
+    struct async_op* a = &async_ops[i];
+    if (a->state != ASYNC_SLOT && a->state != ASYNC_EXTENTS)
+      continue;
+
+    struct ServerInfo* server = servers[a->server];
+    if (server->ready && (a->ready || server->epoch != a->epoch))
+      advance_async_(i);
+  }
+
+  for(int i = 0; i < servers.size(); i++) {
+    if (servers[i]->ready && servers[i]->connection->post_batch() < 0)
+      return POST_GET_FAILURE;
+  }
+  return async_pending;
+}
+
+bool Client::done(int handle) {
+  return async_ops[handle].state == ASYNC_DONE;
+}
+
+/**
+ * Block until an operation completes, then return its result and
+ * free its handle.
+ */
+int Client::wait(int handle) {
+  struct async_op* a = &async_ops[handle];
+
+  while (a->state != ASYNC_DONE) {
+    if (poll() == POST_GET_FAILURE)
+      return POST_GET_FAILURE;
+  }
+
+  free(a->key);
+  a->key = NULL;
+  a->state = ASYNC_FREE;
+  async_free.push_back(handle);
+  return a->result;
+}
+
+/**
+ * Block until no operation is in flight. Results stay available
+ * to wait().
+ */
+int Client::wait_all(void) {
+  int rval;
+  while ((rval = poll()) > 0);
+  return rval;
+}
+
 /**
  * Perform a verb-msg based write, used for the put() and remove()
  * operations. Sends only one message, and waits for a return
@@ -319,7 +1287,9 @@ int Client::write_(const KEY_TYPE key, size_t key_len, const VAL_TYPE value, siz
 re_write:
   int whichserver = servers[0]->dhtclient->server_for_key(server_count,key,key_len);
   unsigned int serverepoch = servers[whichserver]->epoch;
-  struct dht_message* send_msg = (struct dht_message*)(servers[whichserver]->connection->get_send_buf());
+  adopt_table_(servers[whichserver]);
+  struct dht_message* send_msg = (struct dht_message*)(servers[whichserver]->connection->get_send_buf(
+                                  sizeof(send_msg->data.put) + sizeof(uint64_t) + key_len + val_len));
   size_t sendlen = 0;
 
   // Construct DHT put request
@@ -380,6 +1350,162 @@ re_write:
 }
 
 
+/**
+ * Ask every server to pre-size for its share of a load of entries
+ * pairs with kv_bytes of keys and values. Keys hash evenly over the
+ * servers, so each is asked for an equal share.
+ */
+int Client::reserve(size_t entries, size_t kv_bytes) {
+  int rval = 0;
+  struct dht_capacity cap;
+  cap.entries = (entries+server_count-1)/server_count;
+  cap.kv_bytes = (kv_bytes+server_count-1)/server_count;
+
+  for(int i = 0; i < server_count; i++) {
+re_reserve:
+    unsigned int serverepoch = servers[i]->epoch;
+    servers[i]->connection->send_message_ext(MSG_DHT_CAPACITY,(char*)&cap,sizeof(cap));
+
+    do {
+      rval = do_event_loop();
+    } while(!rval && !servers[i]->ibv_msg_ready && servers[i]->epoch == serverepoch);
+    servers[i]->ibv_msg_ready = false;
+
+    if (servers[i]->epoch != serverepoch) // connection bumped; ask again
+      goto re_reserve;
+
+    if (rval || servers[i]->ibv_recv_buf->type != MSG_DHT_CAPACITY_DONE)
+      return POST_PUT_FAILURE;
+  }
+  return 0;
+}
+
+/**
+ * Stores count (key, value) pairs, using the strings' lengths.
+ */
+int Client::put_batch(const KEY_TYPE const* keys, const VAL_TYPE const* values, size_t count) {
+  std::vector<size_t> key_lens(count), val_lens(count);
+  for(size_t i = 0; i < count; i++) {
+    key_lens[i] = strlen(keys[i]);
+    val_lens[i] = strlen(values[i]);
+  }
+  return put_batch_with_size(keys, values, &key_lens[0], &val_lens[0], count);
+}
+
+/**
+ * Stores count (key, value) pairs with MSG_DHT_PUT_BATCH. Every
+ * server with pairs left gets one batch at a time, and all servers
+ * work on theirs concurrently. A batch interrupted by a reconnection
+ * is sent again whole, which is harmless since puts are idempotent.
+ */
+int Client::put_batch_with_size(const KEY_TYPE const* keys, const VAL_TYPE const* values,
+                                const size_t* key_lens, const size_t* val_lens, size_t count) {
+  int rval = 0;
+
+  std::vector<int> owner(count);
+  for(size_t i = 0; i < count; i++)
+    owner[i] = servers[0]->dhtclient->server_for_key(server_count,keys[i],key_lens[i]);
+
+  // Per server: first pair not yet stored, end of the batch in flight
+  // (0 if none), and the epoch it was sent in
+  std::vector<size_t> next(server_count,0);
+  std::vector<size_t> end(server_count,0);
+  std::vector<unsigned int> epochs(server_count,0);
+
+  bool remaining;
+  do {
+    for(int s = 0; s < server_count; s++) {
+      while (next[s] < count && owner[next[s]] != s)
+        next[s]++;
+      if (next[s] < count && !end[s]) {
+        adopt_table_(servers[s]);
+        epochs[s] = servers[s]->epoch;
+        end[s] = send_batch_(s, keys, values, key_lens, val_lens, owner, next[s], count);
+      }
+    }
+
+    // Wait for every batch in flight to be acknowledged or bumped
+    bool waiting;
+    do {
+      rval = do_event_loop();
+      waiting = false;
+      for(int s = 0; s < server_count; s++)
+        if (end[s] && !servers[s]->ibv_msg_ready && servers[s]->epoch == epochs[s])
+          waiting = true;
+    } while(!rval && waiting);
+
+    if (rval) return POST_PUT_FAILURE;
+
+    remaining = false;
+    for(int s = 0; s < server_count; s++) {
+      if (end[s]) {
+        if (servers[s]->epoch == epochs[s]) {   // else connection bumped; send it again
+          servers[s]->ibv_msg_ready = false;
+          if (servers[s]->ibv_recv_buf->type != MSG_DHT_PUT_BATCH_DONE)
+            return POST_PUT_FAILURE;
+          next[s] = end[s];
+        }
+        end[s] = 0;
+      }
+      if (next[s] < count)
+        remaining = true;
+    }
+  } while(remaining);
+
+  return 0;
+}
+
+/**
+ * Fills a server's send buffer with a MSG_DHT_PUT_BATCH of its pairs
+ * from first on, up to PUT_BATCH_BYTES (but at least one pair), and
+ * sends it. Returns the index after the last pair included.
+ */
+size_t Client::send_batch_(int whichserver, const KEY_TYPE const* keys, const VAL_TYPE const* values,
+                           const size_t* key_lens, const size_t* val_lens, const std::vector<int>& owner,
+                           size_t first, size_t count) {
+  struct ServerInfo* server = servers[whichserver];
+  size_t packed = 0, bytes = 0, end, i;
+
+  // Size the batch first, for a send buffer to fit it
+  for(end = first; end < count; end++) {
+    if (owner[end] != whichserver)
+      continue;
+
+    size_t len = sizeof(struct dht_batch_rec)+key_lens[end]+val_lens[end];
+    if (packed && bytes+len > PUT_BATCH_BYTES)
+      break;
+    bytes += len;
+    packed++;
+  }
+
+  struct dht_message* send_msg = (struct dht_message*)(server->connection->get_send_buf(
+                                   sizeof(send_msg->data.batch.count)+bytes));
+  char* rec = &(send_msg->data.batch.body);
+
+  send_msg->type = MSG_DHT_PUT_BATCH;
+
+  for(i = first; i < end; i++) {
+    if (owner[i] != whichserver)
+      continue;
+
+    size_t len = sizeof(struct dht_batch_rec)+key_lens[i]+val_lens[i];
+    struct dht_batch_rec* hdr = (struct dht_batch_rec*)rec;
+    char* kptr = rec+sizeof(struct dht_batch_rec);
+    hdr->key_len = key_lens[i];
+    hdr->val_len = val_lens[i];
+    memcpy(kptr, keys[i], key_lens[i]);
+    memcpy(kptr+key_lens[i], values[i], val_lens[i]);
+    hdr->crc = server->dhtclient->check_crc(kptr,key_lens[i]+val_lens[i]);
+
+    rec += len;
+  }
+
+  send_msg->data.batch.count = packed;
+  server->connection->send_message_ext(MSG_DHT_PUT_BATCH,(char*)&(send_msg->data),
+                                       sizeof(send_msg->data.batch.count)+bytes);
+  return i;
+}
+
 /**
  * For future use. Parallels server setup() method.
  */
@@ -403,10 +1529,15 @@ int Client::add_server(const char* server_host, const char* server_port) {
     return -1;
 
   // Set an epoch number so we can detect if the server connection bounces
-  srand(getpid());
-  this_info->epoch = rand();
+  this_info->epoch = rand_r(&epoch_seed);
 
   this_info->reconnecting = false;
+  this_info->table_gen = 0;
+  this_info->addr_resolved = false;
+  this_info->mr_init = false;
+  this_info->connection = NULL;
+  this_info->dhtclient = NULL;
+  this_info->ready = 0;
 
   // Reserve space for host/port strings
   if (NULL == (this_info->server_host = (char*)malloc(1+strlen(server_host))))
@@ -418,21 +1549,95 @@ int Client::add_server(const char* server_host, const char* server_port) {
   strcpy(this_info->server_host,server_host);
   strcpy(this_info->server_port,server_port);
 
-  // Initialize every other field
-  init_serverinfo(this_info);
-
+  // The connection is started by ready(), with all the others
   servers.push_back(this_info);
   server_count++;
 
   return 0;
 }
 
+struct host_lookup {
+  const char* host;
+  const char* port;
+  struct sockaddr_storage addr;
+  int rval;
+  pthread_t thread;
+};
+
+int Client::lookup_host_(const char* host, const char* port, struct sockaddr_storage* addr) {
+  struct addrinfo hints, *res;
+  int rval;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_socktype = SOCK_STREAM;    // one answer per address, not per socket type
+  if (0 != (rval = getaddrinfo(host, port, &hints, &res)))
+    return rval;
+
+  memcpy(addr, res->ai_addr, res->ai_addrlen);
+  freeaddrinfo(res);
+  return 0;
+}
+
+void* Client::lookup_main(void* arg) {
+  struct host_lookup* l = (struct host_lookup*)arg;
+  l->rval = lookup_host_(l->host, l->port, &(l->addr));
+  return NULL;
+}
+
+/**
+ * Look up the addresses of all servers not yet resolved, each
+ * distinct host and port once and all of them at the same time, so
+ * startup waits for the slowest name lookup rather than their sum.
+ */
+void Client::resolve_hosts_(void) {
+  std::vector<struct host_lookup> lookups;
+  std::vector<size_t> which(servers.size());
+
+  for(size_t i = 0; i < servers.size(); i++) {
+    if (servers[i]->addr_resolved)
+      continue;
+
+    size_t j;
+    for(j = 0; j < lookups.size(); j++) {
+      if (!strcmp(lookups[j].host, servers[i]->server_host) && !strcmp(lookups[j].port, servers[i]->server_port))
+        break;
+    }
+    if (j == lookups.size()) {
+      lookups.push_back(host_lookup());
+      lookups[j].host = servers[i]->server_host;
+      lookups[j].port = servers[i]->server_port;
+    }
+    which[i] = j;
+  }
+
+  if (lookups.size() == 1) {
+    lookup_main(&lookups[0]);
+  } else {
+    for(size_t j = 0; j < lookups.size(); j++)
+      TEST_NZ(pthread_create(&lookups[j].thread, NULL, lookup_main, &lookups[j]));
+    for(size_t j = 0; j < lookups.size(); j++)
+      pthread_join(lookups[j].thread, NULL);
+  }
+
+  for(size_t i = 0; i < servers.size(); i++) {
+    if (servers[i]->addr_resolved)
+      continue;
+
+    struct host_lookup& l = lookups[which[i]];
+    if (l.rval) {
+      manager->log(VERB_ERROR,"client: Failed to look up %s:%s: %s\n",l.host,l.port,gai_strerror(l.rval));
+      die("");
+    }
+    memcpy(&(servers[i]->addr), &(l.addr), sizeof(l.addr));
+    servers[i]->addr_resolved = true;
+  }
+}
+
 /**
  * Helper function for generic setup of a ServerInfo
- * structure.
+ * structure, which starts connecting to the server.
  */
 void Client::init_serverinfo(struct ServerInfo* this_info) {
-  struct addrinfo *addr;
 
   // MRs not yet initialized for this connection
   this_info->mr_init = false;
@@ -441,14 +1646,11 @@ void Client::init_serverinfo(struct ServerInfo* this_info) {
   this_info->client = this;
   this_info->state = CS_CREATED;
 
-  this_info->rdma_fetch_buf = NULL;
-  this_info->rdma_fetch_ext_buf = NULL;
+  this_info->table_pending = false;
 
   this_info->connection = manager->new_conn(MSG_BUF_SIZE);
 
-  TEST_NZ(getaddrinfo(this_info->server_host, this_info->server_port, NULL, &addr));
-
-  TEST_NZ(rdma_create_id(manager->get_ec(), &(this_info->conn), this_info, RDMA_PS_TCP));
+  TEST_NZ(manager->transport()->create_id(manager->get_ec(), &(this_info->conn), this_info));
 
 
   // Set up other member vars
@@ -458,58 +1660,77 @@ void Client::init_serverinfo(struct ServerInfo* this_info) {
   // Initialize required hooks
   this_info->connection->set_recv_hook(hook_ibv_recv,(void*)this_info);
   this_info->connection->set_rdma_recv_hook(hook_rdma_recv,(void*)this_info);
+  this_info->connection->set_rdma_tag_hook(hook_rdma_tag,(void*)this_info);
   this_info->connection->set_ready_hook(hook_ready,(void*)this_info);
 
-  TEST_NZ(rdma_resolve_addr(this_info->conn, NULL, addr->ai_addr, TIMEOUT_IN_MS));
-  freeaddrinfo(addr);
+  TEST_NZ(manager->transport()->resolve_addr(this_info->conn, NULL, (struct sockaddr*)&(this_info->addr),
+                                             TIMEOUT_IN_MS));
 }
 
 /**
  * Create the necessary client memory regions
- * for RDMA reads and such.
+ * for RDMA reads and such, the first time, and
+ * hand them to a server's connection.
  */
 void Client::create_mrs(struct ServerInfo* this_info) {
 
   if (this_info->mr_init == true) // don't do it twice
     return;
 
-  this_info->rdma_fetch_buf = malloc(RECV_BUF_SIZE);
+  if (!bufs_init) {
+    fetch_buf = malloc(RECV_BUF_SIZE);
 #if KEY_VAL_PAIRTYPE==KVPT_CHARP_CHARP
-  this_info->rdma_fetch_ext_buf = malloc(RECV_EXT_SIZE);
+    fetch_ext_buf = malloc(RECV_EXT_SIZE);
 #endif
+    async_buf = malloc(ASYNC_MAX_OPS*ASYNC_BUF_SIZE);
 
-  if (NULL == this_info->rdma_fetch_buf
+    if (NULL == fetch_buf || NULL == async_buf
 #if KEY_VAL_PAIRTYPE==KVPT_CHARP_CHARP
-      || NULL == this_info->rdma_fetch_ext_buf
+        || NULL == fetch_ext_buf
 #endif
-  ) {
-    die("Failed to allocate local RDMA buffers");
-  }
-
-  this_info->rdma_fetch_buf_mr = manager->create_mr(this_info->rdma_fetch_buf,
-                                           RECV_BUF_SIZE,
-                                           IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE,
-                                           MR_SCOPE_LOCAL,
-                                           this_info->connection);
+    ) {
+      die("Failed to allocate local RDMA buffers");
+    }
 
+    fetch_buf_mr = manager->create_mr(fetch_buf,
+                                      RECV_BUF_SIZE,
+                                      IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE,
+                                      MR_SCOPE_LOCAL,
+                                      this_info->connection);
 #if KEY_VAL_PAIRTYPE==KVPT_CHARP_CHARP
-  this_info->rdma_fetch_ext_buf_mr = manager->create_mr(this_info->rdma_fetch_ext_buf,
-                                               RECV_EXT_SIZE,
-                                               IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE,
-                                               MR_SCOPE_LOCAL,
-                                               this_info->connection);
+    fetch_ext_buf_mr = manager->create_mr(fetch_ext_buf,
+                                          RECV_EXT_SIZE,
+                                          IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE,
+                                          MR_SCOPE_LOCAL,
+                                          this_info->connection);
 #endif
+    async_buf_mr = manager->create_mr(async_buf,
+                                      ASYNC_MAX_OPS*ASYNC_BUF_SIZE,
+                                      IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE,
+                                      MR_SCOPE_LOCAL,
+                                      this_info->connection);
 
-  if (NULL == this_info->rdma_fetch_buf_mr
+    if (NULL == fetch_buf_mr || NULL == async_buf_mr
 #if KEY_VAL_PAIRTYPE==KVPT_CHARP_CHARP
-      || NULL == this_info->rdma_fetch_ext_buf_mr
+        || NULL == fetch_ext_buf_mr
 #endif
-  ) {
-    die("Failed to create MRs for local RDMA buffers");
+    ) {
+      die("Failed to create MRs for local RDMA buffers");
+    }
+    bufs_init = true;
   }
 
+  this_info->rdma_fetch_buf = fetch_buf;
+  this_info->rdma_fetch_ext_buf = fetch_ext_buf;
+  this_info->async_buf = async_buf;
+  this_info->rdma_fetch_buf_mr = fetch_buf_mr;
+  this_info->rdma_fetch_ext_buf_mr = fetch_ext_buf_mr;
+  this_info->async_buf_mr = async_buf_mr;
+
   manager->set_mr(MR_LOC_LOCAL, MR_SCOPE_LOCAL, this_info->rdma_fetch_buf_mr,
                   MR_TYPE_RDMA_BUF_TABLE, this_info->connection);
+  manager->set_mr(MR_LOC_LOCAL, MR_SCOPE_LOCAL, this_info->async_buf_mr,
+                  MR_TYPE_RDMA_BUF_ASYNC, this_info->connection);
 #if KEY_VAL_PAIRTYPE==KVPT_CHARP_CHARP
   manager->set_mr(MR_LOC_LOCAL, MR_SCOPE_LOCAL, this_info->rdma_fetch_ext_buf_mr,
                   MR_TYPE_RDMA_BUF_EXTENTS, this_info->connection);
@@ -520,11 +1741,37 @@ void Client::create_mrs(struct ServerInfo* this_info) {
 }
 
 /**
- * Wait for all server connections to be ready before
- * launching any read/write operations.
+ * Take the shared MRs back from a server's connection before it is
+ * destroyed, which would otherwise deregister them.
+ */
+void Client::release_mrs(struct ServerInfo* this_info) {
+
+  if (this_info->mr_init == false)
+    return;
+
+  manager->release_mr(MR_TYPE_RDMA_BUF_TABLE, this_info->connection);
+  manager->release_mr(MR_TYPE_RDMA_BUF_ASYNC, this_info->connection);
+#if KEY_VAL_PAIRTYPE==KVPT_CHARP_CHARP
+  manager->release_mr(MR_TYPE_RDMA_BUF_EXTENTS, this_info->connection);
+#endif
+
+  this_info->mr_init = false;
+}
+
+/**
+ * Connect to all servers at once, and wait for all
+ * server connections to be ready before launching any
+ * read/write operations.
  */
 int Client::ready(void) {
   int rval = 0, ready = 0;
+
+  resolve_hosts_();
+  for(int i = 0; i < servers.size(); i++) {
+    if (servers[i]->connection == NULL)
+      init_serverinfo(servers[i]);
+  }
+
   do {
     rval = do_event_loop();
 
@@ -575,7 +1822,7 @@ int Client::on_addr_resolved(struct ServerInfo* server, struct rdma_cm_id *id) {
   server->state = CS_ADR_RES;
 
   server->connection->build_connection(id);
-  TEST_NZ(rdma_resolve_route(id, TIMEOUT_IN_MS));
+  TEST_NZ(manager->transport()->resolve_route(id, TIMEOUT_IN_MS));
 
   return 0;
 }
@@ -612,12 +1859,12 @@ int Client::on_disconnect(struct ServerInfo* server, struct rdma_cm_id *id) {
   manager->log(VERB_WARN,"Server %s:%s disconnected, attempting to reconnect\n",
                server->server_host,server->server_port);
 
-  free(server->rdma_fetch_buf);
-  server->rdma_fetch_buf = NULL;
-
-  free(server->rdma_fetch_ext_buf);
-  server->rdma_fetch_ext_buf = NULL;
-
+  // Outstanding asynchronous operations restart once the epoch moves.
+  // The local buffers, their MRs and the server's address are kept
+  // for the new connection, so a server that dropped a connected
+  // client (say, for a new table) is redialed straight away; only
+  // a refused or timed-out attempt backs off first.
+  bool backoff = !wasready;
 
   if (server->connection->s_conn->connected < CONN_FINIS) {
     server->connection->disconnect();
@@ -625,6 +1872,8 @@ int Client::on_disconnect(struct ServerInfo* server, struct rdma_cm_id *id) {
   }
 
 reconn_retry:
+  release_mrs(server);
+
   if (server->connection->refcount == 0) {
     server->connection->destroy_connection();
   } else {
@@ -632,8 +1881,6 @@ reconn_retry:
     die("");
   }
 
-  server->mr_init = false;
-
   //server->ready = 0;
   delete server->connection;
 
@@ -643,7 +1890,9 @@ reconn_retry:
   //server->dhtclient = NULL;
   server->epoch++;
 
-  usleep(CONNECT_RETRY_SLEEP);
+  if (backoff)
+    usleep(CONNECT_RETRY_SLEEP);
+  backoff = true;
   init_serverinfo(server);
 
   int rval = 0;
@@ -693,7 +1942,7 @@ int Client::on_route_resolved(struct ServerInfo* server, struct rdma_cm_id *id)
   server->state = CS_RT_RES;
 
   server->connection->build_params(&cm_params);
-  TEST_NZ(rdma_connect(id, &cm_params));
+  TEST_NZ(manager->transport()->connect(id, &cm_params));
 
   return 0;
 }
@@ -771,14 +2020,83 @@ int Client::on_event(struct rdma_cm_event *event, void* ec_context, void* event_
 }
 
 /**
- * Hook called when a verb message is received.
+ * Hook called when a verb message is received. A resized table is
+ * not a reply; it is noted and adopted before the next operation.
+ * Neither is a new extents region, which is usable right away.
  */
 void Client::hook_ibv_recv(int type, struct message* msg, size_t len, IBConn* conn, void* context) {
   struct ServerInfo* server = (struct ServerInfo*)context;
+
+  if (type == MSG_DHT_TABLE) {
+    struct dht_table_desc* desc = &(((struct dht_message*)msg)->data.table);
+    memcpy(&(server->next_table_mr),&(desc->mr),sizeof(struct ibv_mr));
+    server->next_table_gen = desc->gen;
+    server->table_pending = true;
+    return;
+  }
+
+  if (type == MSG_DHT_EXTENTS) {
+    struct dht_extents_desc* desc = &(((struct dht_message*)msg)->data.extents);
+    if (desc->region <= 0 || desc->region >= EXTENTS_MAX_REGIONS)
+      return;
+    server->client->manager->set_mr(MR_LOC_REMOTE, MR_SCOPE_LOCAL, &(desc->mr),
+                                    MR_TYPE_DHT_EXTENTS+desc->region, conn);
+    server->dht_ext_mrs[desc->region] = server->client->manager->fetch_mr(MR_LOC_REMOTE,
+                                          MR_TYPE_DHT_EXTENTS+desc->region, conn);
+    return;
+  }
+
   server->ibv_recv_buf = msg;
   server->ibv_msg_ready = true;
 }
 
+/**
+ * Switch to a resized table the server published, and acknowledge it
+ * so the server can free the old one. Only called where no lookup is
+ * between probes; reads already posted to the old table still complete
+ * first, since the acknowledgement follows them on the same connection.
+ */
+void Client::adopt_table_(struct ServerInfo* server) {
+  if (!server->table_pending || !server->ready)
+    return;
+  server->table_pending = false;
+
+  // fetch_mr() handed out the manager's copy; update it in place
+  memcpy(server->dht_table_mr,&(server->next_table_mr),sizeof(struct ibv_mr));
+  server->entries = server->dht_table_mr->length/RemoteDHTClient::slot_size();
+  server->table = server->dht_table_mr->addr;
+
+  server->table_gen = server->next_table_gen;
+
+  delete server->dhtclient;
+  server->dhtclient = new RemoteDHTClient(server->table,server->entries);
+
+  manager->log(VERB_INFO,"Switched to table with %zu entries on %s:%s\n",
+               server->entries,server->server_host,server->server_port);
+
+  server->connection->send_message_ext(MSG_DHT_TABLE_ACK,(char*)&(server->table_gen),sizeof(server->table_gen));
+}
+
+#if KEY_VAL_PAIRTYPE==KVPT_CHARP_CHARP
+/**
+ * The server's MR for the extents region holding addr. A region is
+ * announced before any row points into it, but the announcement may
+ * still be on its way when the row is read, so wait for it. Returns
+ * NULL if the connection bumped meanwhile, or addr is in no region.
+ */
+struct ibv_mr* Client::ext_mr_(struct ServerInfo* server, uintptr_t addr, unsigned int serverepoch) {
+  unsigned int region = extents_region(server->dht_ext_mrs[0]->addr,(void*)addr);
+  if (region >= EXTENTS_MAX_REGIONS)
+    return NULL;
+
+  while (server->dht_ext_mrs[region] == NULL) {
+    if (do_event_loop() || server->epoch != serverepoch)
+      return NULL;
+  }
+  return server->dht_ext_mrs[region];
+}
+#endif
+
 /**
  * Hook called when an RDMA operation completes.
  */
@@ -786,6 +2104,15 @@ void Client::hook_rdma_recv(int type, IBConn* conn, void* context) {
   struct ServerInfo* server = (struct ServerInfo*)context;
 
   server->rdma_msg_ready = true;
+  server->rdma_reads_done++;
+}
+
+/**
+ * Hook called when a tagged (asynchronous) RDMA read completes.
+ * The operation advances on the next poll().
+ */
+void Client::hook_rdma_tag(void* op, IBConn* conn, void* context) {
+  ((struct async_op*)op)->ready = true;
 }
 
 /**
@@ -803,20 +2130,25 @@ void Client::hook_ready(void* context) {
     die("Failed to get DHT_TABLE_MR after hook_ready triggered");
 
 #if KEY_VAL_PAIRTYPE==KVPT_CHARP_CHARP
-  server->dht_ext_mr = server->client->manager->fetch_mr(MR_LOC_REMOTE, MR_TYPE_DHT_EXTENTS, server->connection);
-  if (server->dht_ext_mr == NULL)
+  // Every region so far came with the MRs; later ones are announced
+  for(int i = 0; i < EXTENTS_MAX_REGIONS; i++)
+    server->dht_ext_mrs[i] = server->client->manager->fetch_mr(MR_LOC_REMOTE, MR_TYPE_DHT_EXTENTS+i,
+                                                               server->connection);
+  if (server->dht_ext_mrs[0] == NULL)
     die("Failed to get DHT_EXT_MR after hook_ready triggered");
 #endif
 
   size_t capacity = server->dht_table_mr->length;
-  size_t entries = capacity/sizeof(DHT<KEY_TYPE,VAL_TYPE>::dht_block);
+  size_t entries = capacity/RemoteDHTClient::slot_size();
 
   server->entries = entries;
   server->table = server->dht_table_mr->addr;
+  server->table_pending = false;    // the MRs just received are current
   server->ibv_msg_ready = false;
   server->rdma_msg_ready = false;
+  server->rdma_reads_done = 0;
 
-  server->dhtclient = new DHTClient<const KEY_TYPE,VAL_TYPE>(server->dht_table_mr->addr,entries);
+  server->dhtclient = new RemoteDHTClient(server->dht_table_mr->addr,entries);
 
   server->client->manager->log(VERB_DEBUG,
                "Ready hook triggered with mem at %p, with %zu entries for %s:%s conn %p\n",
@@ -833,6 +2165,15 @@ void Client::print_stats(void) {
   manager->log(VERB_WARN,"RDMA HT Reprobes: %19d\n",stats_rdma_ht_reprobes);
   manager->log(VERB_WARN,"RDMA Locked Rows: %19d\n",stats_rdma_locked);
   manager->log(VERB_WARN,"RDMA Bad Extents: %19d\n",stats_rdma_bad_extents);
+  if (!slot_hints.empty()) {
+    manager->log(VERB_WARN,"Slot Hints Used:  %19d\n",stats_slot_hints_used);
+    manager->log(VERB_WARN,"Slot Hints Wrong: %19d\n",stats_slot_hints_wrong);
+  }
+  if (read_mode == READ_MODE_ADAPTIVE) {
+    manager->log(VERB_WARN,"Adaptive RDMA:    %19d\n",stats_adapt_rdma);
+    manager->log(VERB_WARN,"Adaptive Server:  %19d\n",stats_adapt_server);
+    manager->log(VERB_WARN,"Adaptive Costs:   %9.2f / %7.2f\n",adapt_rdma_cost,ADAPT_SERVER_COST+adapt_rndv_share);
+  }
 }
 
 
@@ -843,10 +2184,20 @@ int Client::put_with_size(const KEY_TYPE key, const VAL_TYPE value, size_t key_l
 
 int Client::get_with_size(const KEY_TYPE key, VAL_TYPE value, size_t key_len, size_t &val_len){
   
-  if (read_mode == READ_MODE_RDMA) {
-    return read_(key, key_len, value, val_len, OP_GET);
-  } else { //read_mode == READ_MODE_SERVER
-    return read_server_(key, key_len, value, val_len, OP_GET);
-  }
+  return lookup_(key, key_len, value, val_len, OP_GET);
+}
+
+/**
+ * Like get_with_size(), but without copying the value out: on
+ * POST_GET_FOUND, value points at it in the client's fetch buffer
+ * (or at the server's reply, in server read mode). It is only valid
+ * until the next operation on this client, synchronous or not.
+ */
+int Client::get_view(const KEY_TYPE key, size_t key_len, const char*& value, size_t& val_len) {
+  VAL_TYPE view = NULL;
+  int rval = lookup_(key, key_len, view, val_len, OP_GET_VIEW);
+
+  value = (rval == POST_GET_FOUND) ? view : NULL;
+  return rval;
 }
 
@@ -6,18 +6,43 @@
 #include "ib.h"
 #include "ibman.h"
 #include "dht.h"
+#include "dht-inline.h"
+#include "dht-bucket.h"
 #include "table_types.h"
 #include "image_tools.h"
 #include <fcntl.h>
 #include <errno.h>
 #include <sys/time.h>
+#include <sys/socket.h>
 
 #define MAX_BUF 10000000
+
+// DHT_PROBES is the number of slots, or buckets, a lookup may read
+#if DHT_LAYOUT==DHT_LAYOUT_BUCKET
+typedef BucketDHTClient<const KEY_TYPE,VAL_TYPE> RemoteDHTClient;
+typedef BucketDHT<const KEY_TYPE,VAL_TYPE>::dht_block RemoteDHTBlock;
+#define DHT_PROBES BUCKET_CHOICES
+#elif DHT_LAYOUT==DHT_LAYOUT_INLINE
+typedef InlineDHTClient<const KEY_TYPE,VAL_TYPE> RemoteDHTClient;
+typedef InlineDHT<const KEY_TYPE,VAL_TYPE>::dht_block RemoteDHTBlock;
+#define DHT_PROBES CUCKOO_D
+#else
+typedef DHTClient<const KEY_TYPE,VAL_TYPE> RemoteDHTClient;
+typedef DHT<const KEY_TYPE,VAL_TYPE>::dht_block RemoteDHTBlock;
+#define DHT_PROBES CUCKOO_D
+#endif
 enum read_modes {
   READ_MODE_RDMA,
-  READ_MODE_SERVER
+  READ_MODE_SERVER,
+  READ_MODE_RDMA_PARALLEL,  // all cuckoo candidates read at once
+  READ_MODE_ADAPTIVE        // RDMA or server, per lookup, by live costs
 };
 
+// Adaptive read mode. Costs are in RDMA reads per lookup.
+#define ADAPT_WEIGHT 16           // estimates move 1/ADAPT_WEIGHT of the way per lookup
+#define ADAPT_SERVER_COST 3.0     // a server-mediated get: message round-trip and server CPU
+#define ADAPT_EXPLORE 64          // while the server is preferred, every so many lookups try RDMA
+
 class Client;
 
 enum conn_setup_state {
@@ -32,6 +57,8 @@ struct ServerInfo {
   IBConn* connection;
   char* server_host;
   char* server_port;
+  struct sockaddr_storage addr;   // looked up once, reused by reconnects
+  bool addr_resolved;
 //  struct rdma_event_channel* ec;
   struct rdma_cm_event* event;
   struct rdma_cm_id* conn;
@@ -45,26 +72,35 @@ struct ServerInfo {
 //  struct ibv_mr *recv_buf_mr;
   struct ibv_mr *rdma_fetch_buf_mr;
   struct ibv_mr *rdma_fetch_ext_buf_mr;
+  struct ibv_mr *async_buf_mr;
 
   struct ibv_mr* dht_table_mr;
 #if KEY_VAL_PAIRTYPE==KVPT_CHARP_CHARP
-  struct ibv_mr* dht_ext_mr;
+  struct ibv_mr* dht_ext_mrs[EXTENTS_MAX_REGIONS];  // by region; NULL until announced
 #endif
 
   // DHT-relevant items
-  DHTClient<const KEY_TYPE,VAL_TYPE>* dhtclient;
+  RemoteDHTClient* dhtclient;
   void* table;
   size_t entries;
 
-  // Flags and mem to connect to IB
+  // Resized table published by the server, adopted between operations
+  bool table_pending;
+  struct ibv_mr next_table_mr;
+  unsigned int next_table_gen;
+  unsigned int table_gen;         // of the table in use
+
+  // Flags and mem to connect to IB; the client's, shared by all servers
   void* rdma_fetch_buf;
   void* rdma_fetch_ext_buf;
+  void* async_buf;                // ASYNC_MAX_OPS chunks of ASYNC_BUF_SIZE
 
   struct message* ibv_recv_buf;
   bool rdma_msg_ready;
+  unsigned int rdma_reads_done;   // RDMA completions since last reset
   bool ibv_msg_ready;
 
-  bool mr_init;
+  bool mr_init;                   // local MRs set on this connection
   bool reconnecting;
 
 };
@@ -73,7 +109,55 @@ enum dhtClientOps {
   OP_GET = 1,
   OP_PUT = 2,
   OP_CONTAINS = 3,
-  OP_DELETE = 4
+  OP_DELETE = 4,
+  OP_GET_VIEW = 5     // OP_GET that leaves the value where it was fetched
+};
+
+#define PUT_BATCH_BYTES (1<<20)   // most key/value bytes per MSG_DHT_PUT_BATCH
+
+#define ASYNC_MAX_OPS 64          // asynchronous operations in flight per client
+#define ASYNC_BUF_SIZE (1<<14)    // per-operation fetch buffer: slot, then extents
+
+enum async_op_state {
+  ASYNC_FREE = 0,
+  ASYNC_SLOT,       // waiting for a slot read
+  ASYNC_EXTENTS,    // waiting for an extents read
+  ASYNC_DONE        // result not yet collected by wait()
+};
+
+/**
+ * One asynchronous get() or contains(). Operation i reads into chunk
+ * i of its server's async_buf, and its tag is the wr_id of its reads.
+ */
+struct async_op {
+  struct rdma_tag tag;
+  enum async_op_state state;
+  bool ready;             // a read completed since the op last advanced
+  int op;                 // OP_GET or OP_CONTAINS
+  char* key;              // private copy
+  size_t key_len;
+  key_hash hash;          // of key, for every probe
+  VAL_TYPE value;         // caller's buffer
+  size_t* val_len;
+  int server;
+  unsigned int epoch;
+  unsigned int table_gen; // table the probe sequence started on
+  size_t hash_idx;
+  bool hinted;            // hash_idx came from the slot cache
+  bool hint_missed;       // ... and was wrong, so probe in order
+  int way;                // bucket layout: way whose extents are being checked
+  int result;
+};
+
+/**
+ * Slot cache entry: the probe a key was last found at, trusted only
+ * on the connection epoch and table it was seen on.
+ */
+struct slot_hint {
+  uint64_t fp;            // key_hash.lo of the key
+  unsigned int epoch;
+  unsigned int table_gen;
+  int hash_idx;
 };
 
 class Client {
@@ -90,12 +174,61 @@ private:
   int on_route_resolved(struct ServerInfo* server, struct rdma_cm_id *id);
   int on_reject(struct ServerInfo* server, const char* private_data);
 
+  int lookup_(const KEY_TYPE key, size_t key_len, VAL_TYPE& value, size_t& val_len, int op);
+  int adapt_pick_(void);
+  void adapt_note_(int mode, size_t rts, size_t val_len);
   int read_(const KEY_TYPE key, size_t key_len, VAL_TYPE& value, size_t& val_len, int op);
+  int read_parallel_(const KEY_TYPE key, size_t key_len, VAL_TYPE& value, size_t& val_len, int op);
+  int wait_rdma_(struct ServerInfo* server, unsigned int serverepoch, unsigned int count);
+  int post_batch_(struct ServerInfo* server, unsigned int serverepoch);
   int read_server_(const KEY_TYPE key, size_t key_len, VAL_TYPE& value, size_t& val_len, int op);
   int write_(const KEY_TYPE key, size_t key_len, const VAL_TYPE value, size_t val_len, int op);
+  size_t send_batch_(int whichserver, const KEY_TYPE const* keys, const VAL_TYPE const* values,
+                     const size_t* key_lens, const size_t* val_lens, const std::vector<int>& owner,
+                     size_t first, size_t count);
 
   void init_serverinfo(struct ServerInfo* this_info);
   void create_mrs(struct ServerInfo* server);
+  void release_mrs(struct ServerInfo* server);
+  void resolve_hosts_(void);
+  static int lookup_host_(const char* host, const char* port, struct sockaddr_storage* addr);
+  static void* lookup_main(void* arg);
+  unsigned int epoch_seed;
+
+  // Local RDMA buffers. Only one synchronous operation runs at a time
+  // and asynchronous operation i always uses chunk i of async_buf, so
+  // every server shares them; they are registered once and outlive
+  // reconnects.
+  bool bufs_init;
+  void* fetch_buf;
+  void* fetch_ext_buf;
+  void* async_buf;
+  struct ibv_mr* fetch_buf_mr;
+  struct ibv_mr* fetch_ext_buf_mr;
+  struct ibv_mr* async_buf_mr;
+  void adopt_table_(struct ServerInfo* server);
+
+  // Adaptive read mode: running costs of each path
+  double adapt_rdma_cost;         // RDMA reads per lookup, retries included
+  double adapt_rndv_share;        // share of values too large for an eager reply
+  unsigned int adapt_lookups;
+
+  // Slot cache; empty unless set_slot_cache() was called
+  std::vector<struct slot_hint> slot_hints;
+  int hint_probe_(struct ServerInfo* server, const key_hash& h);
+  void note_probe_(struct ServerInfo* server, const key_hash& h, int hash_idx);
+#if KEY_VAL_PAIRTYPE==KVPT_CHARP_CHARP
+  struct ibv_mr* ext_mr_(struct ServerInfo* server, uintptr_t addr, unsigned int serverepoch);
+#endif
+
+  // Asynchronous operations
+  std::vector<struct async_op> async_ops;
+  std::vector<int> async_free;
+  unsigned int async_pending;
+  int start_async_(const KEY_TYPE key, size_t key_len, VAL_TYPE value, size_t* val_len, int op);
+  void issue_async_(int handle);
+  void advance_async_(int handle);
+  void finish_async_(int handle, int result);
 public:
 
   // Setup operations
@@ -103,6 +236,7 @@ public:
   int setup();
   void verbosity(enum ibman_verb verb);
   void set_read_mode(read_modes mode);
+  void set_slot_cache(size_t entries);
   int ready();
   int add_server(const char* server_host, const char* server_port);
 
@@ -112,10 +246,37 @@ public:
   int contains(const KEY_TYPE key);
   int remove(const KEY_TYPE key);
  
+  // Asynchronous DHT operations. Each returns a handle, or -1 if
+  // ASYNC_MAX_OPS operations are already outstanding or uncollected.
+  // Reads are only posted by poll(), so a burst of operations shares
+  // doorbells. poll() makes progress on all of them and returns how
+  // many are still in flight; wait() collects one result as
+  // get()/contains() would have returned it and frees the handle.
+  int get_async(const KEY_TYPE key, size_t key_len, VAL_TYPE value, size_t& val_len);
+  int contains_async(const KEY_TYPE key, size_t key_len);
+  int poll(void);
+  bool done(int handle);
+  int wait(int handle);
+  int wait_all(void);
+
   //similar to get and put, but with size parameter
   int put_with_size(const KEY_TYPE key, const VAL_TYPE value, size_t key_len, size_t val_len);
   int get_with_size(const KEY_TYPE Key, VAL_TYPE value, size_t key_len, size_t& val_en);
 
+  // Zero-copy get: value points into the client's fetch buffer, and
+  // is overwritten by the next operation of any kind
+  int get_view(const KEY_TYPE key, size_t key_len, const char*& value, size_t& val_len);
+
+  // Bulk loading. reserve() pre-sizes the servers for a load of
+  // entries pairs with kv_bytes of keys and values in total.
+  // put_batch() stores count pairs in MSG_DHT_PUT_BATCH messages of
+  // up to PUT_BATCH_BYTES, sent to all servers at once; pairs are
+  // visible to readers once their whole batch has been applied.
+  int reserve(size_t entries, size_t kv_bytes);
+  int put_batch(const KEY_TYPE const* keys, const VAL_TYPE const* values, size_t count);
+  int put_batch_with_size(const KEY_TYPE const* keys, const VAL_TYPE const* values,
+                          const size_t* key_lens, const size_t* val_lens, size_t count);
+
 
   template <class K, class V>
   int get_ext(K key, V& value) {
@@ -124,24 +285,16 @@ public:
 
     int rval;
     size_t val_len;
-    char* val_buf = (char*)malloc(sizeof(char)*MAX_BUF);
+    const char* val_buf;
 
-    if (val_buf == NULL) {
-      manager->log(VERB_VITAL,"MSG_DHT_GET: malloc failed!\n");
-    }
-
-    if (read_mode == READ_MODE_RDMA) {
-      rval = read_(kstr.c_str(), kstr.size(), val_buf, val_len, OP_GET);
-    } else {
-      rval = read_server_(kstr.c_str(), kstr.size(), val_buf, val_len, OP_GET);
-    }
+    // Parsed straight out of the fetch buffer
+    rval = get_view(kstr.c_str(), kstr.size(), val_buf, val_len);
     //manager->log(VERB_VITAL,"MSG_DHT_GET: key:%s value:%s key_len:%lu val_len:%lu\n",
     //             binaryToString(kstr.c_str(), kstr.size()).c_str(),
     //             binaryToString(val_buf, val_len).c_str(), kstr.size(), val_len);
 
     if (rval == POST_GET_FOUND)
-      value.ParseFromString(std::string(val_buf,val_len));
-    free(val_buf);
+      value.ParseFromArray(val_buf,val_len);
     return rval;
   }
 
@@ -165,11 +318,7 @@ public:
     int rval;
     size_t val_len;
     char* val_buf = (char*)malloc(sizeof(char)*MAX_BUF);
-    if (read_mode == READ_MODE_RDMA) {
-      rval = read_(key.c_str(), key.size(), val_buf, val_len, OP_CONTAINS);
-    } else { //read_mode == READ_MODE_SERVER
-      rval = read_server_(key.c_str(), key.size(), val_buf, val_len, OP_CONTAINS);
-    }
+    rval = lookup_(key.c_str(), key.size(), val_buf, val_len, OP_CONTAINS);
     free(val_buf);
     return rval;
   }
@@ -188,6 +337,7 @@ public:
   static void hook_ready(/*void* table, size_t entries,*/ void* context);
   static void hook_ibv_recv(int type, struct message* msg, size_t len, IBConn* conn, void* context);
   static void hook_rdma_recv(int type, /*void* entry, void* extents,*/ IBConn* conn, void* context);
+  static void hook_rdma_tag(void* op, IBConn* conn, void* context);
   static int on_event(struct rdma_cm_event *event, void* ec_context, void* event_context);
 
   // RT stats/variables
@@ -196,6 +346,10 @@ public:
   size_t stats_rdma_ht_reprobes;
   size_t stats_rdma_locked;
   size_t stats_rdma_bad_extents;
+  size_t stats_slot_hints_used;
+  size_t stats_slot_hints_wrong;
+  size_t stats_adapt_rdma;
+  size_t stats_adapt_server;
 };
 
 #endif // STORE_CLIENT_H
@@ -15,7 +15,31 @@ enum app_msg_type {
   MSG_DHT_CONTAINS_DONE,
 
   // Other types of messages
-  MSG_DHT_CAPACITY
+  MSG_DHT_CAPACITY,         // client: pre-size for a load (struct dht_capacity)
+  MSG_DHT_CAPACITY_DONE,
+
+  // Bulk loading
+  MSG_DHT_PUT_BATCH,        // count records of struct dht_batch_rec, key, value
+  MSG_DHT_PUT_BATCH_DONE,
+
+  // Table resizes
+  MSG_DHT_TABLE,            // server: the resized table to read from now on
+  MSG_DHT_TABLE_ACK,        // client: no longer reading the old table
+
+  // Extents growth
+  MSG_DHT_EXTENTS           // server: a new extents region (struct dht_extents_desc)
+};
+
+// Published by the server when a resized table takes over
+struct dht_table_desc {
+  unsigned int gen;         // echoed back in MSG_DHT_TABLE_ACK
+  struct ibv_mr mr;
+};
+
+// Published by the server when the extents gain a region
+struct dht_extents_desc {
+  int region;
+  struct ibv_mr mr;
 };
 
 struct kv_req {
@@ -25,6 +49,19 @@ struct kv_req {
 
 #pragma pack(push)
 #pragma pack(4)
+// Expected load for one server, in MSG_DHT_CAPACITY
+struct dht_capacity {
+  size_t entries;
+  size_t kv_bytes;          // keys and values together
+};
+
+// Precedes each key and value in MSG_DHT_PUT_BATCH
+struct dht_batch_rec {
+  size_t key_len;
+  size_t val_len;
+  uint64_t crc;             // of key+value, as in MSG_DHT_PUT
+};
+
 struct dht_message {
   int type;
 
@@ -43,6 +80,13 @@ struct dht_message {
     } put;
 #endif
     char statusval;
+    struct dht_table_desc table;
+    struct dht_extents_desc extents;
+    struct dht_capacity capacity;
+    struct {
+      size_t count;
+      char body;
+    } batch;
   } data;
 };
 #pragma pack(pop)
@@ -51,17 +95,18 @@ enum mr_types {
   MR_TYPE_RECV_BUF,
   MR_TYPE_SEND_BUF,
   MR_TYPE_DHT_TABLE,
-  MR_TYPE_DHT_EXTENTS,
   MR_TYPE_RDMA_BUF_TABLE,
-  MR_TYPE_RDMA_BUF_EXTENTS
+  MR_TYPE_RDMA_BUF_EXTENTS,
+  MR_TYPE_RDMA_BUF_ASYNC,
+  MR_TYPE_DHT_EXTENTS       // extents region i is MR_TYPE_DHT_EXTENTS+i; keep last
 };
 
 #if KEY_VAL_PAIRTYPE==KVPT_SIZET_DOUBLE
 const int MSG_BUF_SIZE = sizeof(dht_message);			//It will actually be the max of the sizes of the message and mrmessage structs
 
 #else
-const int RECV_EXT_SIZE = (1<<25); /* 16 MB (aka freaking massive, to fit key-val for giant puts) */
-const int MSG_BUF_SIZE = MAX(RECV_EXT_SIZE,sizeof(dht_message));
+const int RECV_EXT_SIZE = (1<<25); /* 32 MB, the client's extents fetch buffer */
+const int MSG_BUF_SIZE = MAX(MSG_EAGER_SIZE,sizeof(dht_message)); // larger messages go by rendezvous
 
 #endif
 
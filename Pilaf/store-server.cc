@@ -18,24 +18,24 @@
  ***********************************************/
 
 #include <string>
+#include <algorithm>
 #include <stdint.h>
 #include "image_tools.h"
 #include "store-server.h"
 #include "store-constants.h"
 
 Server::Server() {
-  resizing = false;
   is_ready = false;
   listener = NULL;
   port = 0;
   dhtclient = NULL;
 
-  // Use this to tell if DHT resized
-  srand(getpid());
-  epoch = rand();
-
   // Deal with sharing MRs
   mr_init = false;
+  dht_table_mr = NULL;
+  retired_table_mr = NULL;
+  table_gen = 0;
+  batch_conn = NULL;
 
   // Logging to disk
   logging = false;
@@ -46,6 +46,16 @@ Server::Server() {
   manager = new IBConnManager(R_SERVER);
   manager->verbosity(VERB_WARN);
   manager->set_event_hook(on_event,(void*)this);
+
+  // Single-threaded unless set_workers() says otherwise. Writers are
+  // preferred, so a stream of reads cannot hold off a put.
+  pthread_rwlockattr_t attr;
+  pthread_rwlockattr_init(&attr);
+  pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+  pthread_rwlock_init(&table_lock, &attr);
+  pthread_rwlockattr_destroy(&attr);
+  stopping = false;
+  set_workers(1);
 }
 
 void Server::verbosity(enum ibman_verb verb) {
@@ -82,6 +92,24 @@ void Server::set_logging(bool state, char* fname = NULL) {
   }
 }
 
+/**
+ * Append a put to the operation log
+ */
+void Server::log_put(const char* key, int key_len, const char* value, int val_len) {
+  // Write the log header
+  log_buf[log_offset] = 'P';
+  memcpy(log_buf+log_offset+sizeof(char),            &key_len,sizeof(int));
+  memcpy(log_buf+log_offset+sizeof(char)+sizeof(int),&val_len,sizeof(int));
+  log_offset += sizeof(char)+sizeof(int)+sizeof(int);
+
+  // Write the log body
+  memcpy(log_buf+log_offset, key, key_len);
+  memcpy(log_buf+log_offset+key_len, value, val_len);
+  log_offset += key_len+val_len;
+
+  log_flush();
+}
+
 /**
  * Flush operation log to disk
  */
@@ -94,87 +122,195 @@ void Server::log_flush(void) {
 }
 
 
-int Server::hook_pre_resize(size_t oldsize, std::vector<DHT<KEY_TYPE,VAL_TYPE>::dht_block>* contents, void* context) {
+/**
+ * Called when a resized table takes over from the old one. Clients
+ * keep their connections: the new table is registered alongside the
+ * old one and published to each of them, and the old one is retired
+ * once all have acknowledged it (see table_released()).
+ */
+int Server::hook_table_flip(size_t newsize, StoreDHT::slot_vector* contents, void* context) {
   Server* myself = (Server*)context;
-  myself->resizing = true;
-
-  myself->manager->log(VERB_INFO,"Beginning resize\n");
 
-  if (myself->dhtclient) {
+  if (myself->dhtclient)
     delete myself->dhtclient;
-    myself->dhtclient = NULL;
-  }
+  myself->dhtclient = new StoreDHTClient((void*)&((*contents)[0]),newsize);
 
-  if (!myself->is_ready)
+  // No client has been told about any table yet
+  if (!myself->mr_init) {
+    myself->dht.retire();
     return 0;
+  }
 
-  int had_clients = myself->clients.size();
-  myself->manager->log(VERB_DEBUG,"Waiting for %d clients to disconnect\n",had_clients);
-  int clients = 0;
-  int iters = 1;
-  do {
-    // Disconnect clients and wait for confirmation
-    for(int i=0; i<myself->clients.size(); i++) {
-      if (myself->clients[i]->is_connected() >= CONN_SETUP &&
-          myself->clients[i]->is_connected() <  CONN_TEARD)
-      {
-        myself->clients[i]->disconnect();
-      } else if (myself->clients[i]->is_connected() == CONN_TEARD && !myself->clients[i]->s_conn->disconnecting) {
-        myself->clients[i]->disconnect();
-      }
+  IBConn* ready_conn = NULL;
+  for(int i=0; i<myself->clients.size(); i++) {
+    if (myself->clients[i]->is_connected() == CONN_READY) {
+      ready_conn = myself->clients[i];
+      break;
     }
-    if (myself->do_event_loop()) {
-      myself->manager->log(VERB_ERROR,
-                           "Something went wrong in the event loop "
-                           "during disconnection. Terminating\n");
-      exit(1);
+  }
+
+  // Clients still exchanging MRs may have the old table; let them
+  // reconnect for the new one
+  for(int i=0; i<myself->clients.size(); i++) {
+    if (myself->clients[i]->is_connected() == CONN_SETUP)
+      myself->clients[i]->disconnect();
+  }
+
+  if (ready_conn == NULL) {
+    myself->manager->destroy_global_mrs();
+    myself->mr_init = false;
+    myself->dht.retire();
+    return 0;
+  }
+
+  myself->retired_table_mr = myself->dht_table_mr;
+  myself->dht_table_mr = myself->manager->create_mr((void*)&((*contents)[0]),
+                                   newsize*sizeof(StoreDHT::dht_block),
+                                   IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ,
+                                   MR_SCOPE_GLOBAL,
+                                   ready_conn);
+  myself->manager->set_mr(MR_LOC_LOCAL,MR_SCOPE_GLOBAL,myself->dht_table_mr,MR_TYPE_DHT_TABLE,NULL);
+
+  struct dht_table_desc desc;
+  desc.gen = ++myself->table_gen;
+  memcpy(&(desc.mr),myself->dht_table_mr,sizeof(struct ibv_mr));
+
+  // A client waiting for its batch reads nothing until it switches
+  myself->table_waiting.clear();
+  for(int i=0; i<myself->clients.size(); i++) {
+    if (myself->clients[i]->is_connected() == CONN_READY) {
+      myself->clients[i]->send_message_ext(MSG_DHT_TABLE,(char*)&desc,sizeof(desc));
+      if (myself->clients[i] != myself->batch_conn)
+        myself->table_waiting.push_back(myself->clients[i]);
     }
-    clients = 0;
-    for(int i=0; i<myself->clients.size(); i++)
-      if (CONN_TEARD > myself->clients[i]->is_connected())
-        clients++;
-  } while (iters++, clients);
+  }
+
+  myself->manager->log(VERB_INFO,"Published table of %zu entries to %zu clients\n",
+                       newsize,myself->table_waiting.size());
+
+  if (myself->table_waiting.empty())
+    myself->dht.retire();
 
-  myself->manager->log(VERB_DEBUG,
-                       "Finished disconnecting %d clients in %d iterations.\n",
-                       had_clients,iters);
+  return 0;
+}
+
+/**
+ * Called before the previous table is freed. Clients that have not
+ * acknowledged the new one yet are disconnected; they pick it up
+ * when they reconnect.
+ */
+int Server::hook_table_retire(size_t oldsize, StoreDHT::slot_vector* contents, void* context) {
+  Server* myself = (Server*)context;
+
+  for(int i=0; i<myself->table_waiting.size(); i++) {
+    IBConn* conn = myself->table_waiting[i];
+    if (conn->is_connected() >= CONN_SETUP && conn->is_connected() < CONN_TEARD) {
+      myself->manager->log(VERB_WARN,"Client %p still reads the old table; disconnecting it\n",conn);
+      conn->disconnect();
+    }
+  }
+  myself->table_waiting.clear();
 
-  myself->manager->destroy_global_mrs();
-  myself->mr_init = false;
+  if (myself->retired_table_mr) {
+    myself->manager->transport()->dereg_mr(myself->retired_table_mr);
+    myself->retired_table_mr = NULL;
+  }
 
   return 0;
 }
 
-int Server::hook_post_resize(size_t newsize, std::vector<DHT<KEY_TYPE,VAL_TYPE>::dht_block>* contents, void* context) {
+/**
+ * Called when the extents gain a region. Nothing in the old regions
+ * moves, so clients keep their connections: the region is registered
+ * and announced to each of them before any row can point into it.
+ */
+int Server::hook_extents_region(int region, void* base, size_t size, void* context) {
   Server* myself = (Server*)context;
 
-  myself->dhtclient = new DHTClient<KEY_TYPE, VAL_TYPE>((void*)&((*contents)[0]),newsize);
+  // Registered with the others when the first client connects
+  if (!myself->mr_init)
+    return 0;
 
-  myself->manager->log(VERB_INFO,"Resizing is complete; accepting clients again\n");
-  myself->resizing = false;
-  myself->epoch++;
+  IBConn* ready_conn = NULL;
+  for(int i=0; i<myself->clients.size(); i++) {
+    if (myself->clients[i]->is_connected() == CONN_READY) {
+      ready_conn = myself->clients[i];
+      break;
+    }
+  }
+
+  // Clients still exchanging MRs may miss the region; let them
+  // reconnect for it
+  for(int i=0; i<myself->clients.size(); i++) {
+    if (myself->clients[i]->is_connected() == CONN_SETUP)
+      myself->clients[i]->disconnect();
+  }
+
+  if (ready_conn == NULL) {
+    myself->manager->destroy_global_mrs();
+    myself->mr_init = false;
+    return 0;
+  }
+
+  struct ibv_mr* mr = myself->manager->create_mr(base,size,
+                                   IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ,
+                                   MR_SCOPE_GLOBAL,
+                                   ready_conn);
+  myself->manager->set_mr(MR_LOC_LOCAL,MR_SCOPE_GLOBAL,mr,MR_TYPE_DHT_EXTENTS+region,NULL);
+
+  struct dht_extents_desc desc;
+  desc.region = region;
+  memcpy(&(desc.mr),mr,sizeof(struct ibv_mr));
+
+  int announced = 0;
+  for(int i=0; i<myself->clients.size(); i++) {
+    if (myself->clients[i]->is_connected() == CONN_READY) {
+      myself->clients[i]->send_message_ext(MSG_DHT_EXTENTS,(char*)&desc,sizeof(desc));
+      announced++;
+    }
+  }
 
+  myself->manager->log(VERB_INFO,"Published extents region %d of %zu bytes to %d clients\n",
+                       region,size,announced);
   return 0;
 }
 
+/**
+ * A client no longer reads the previous table, because it switched or
+ * went away. Retires the table after the last one.
+ */
+void Server::table_released(IBConn* conn) {
+  std::vector<IBConn*>::iterator it = std::find(table_waiting.begin(),table_waiting.end(),conn);
+  if (it == table_waiting.end())
+    return;
+
+  table_waiting.erase(it);
+  if (table_waiting.empty())
+    dht.retire();
+}
+
 void Server::create_mrs(IBConn* conn_) {
 
   if (conn_ == NULL || mr_init == true) //Can't reserve yet, or already done
     return;
 
-  struct ibv_mr* dht_table_mr = manager->create_mr((void*)&(this->dht.buckets_[0]),
-                                   this->dht.buckets_.size()*sizeof(DHT<KEY_TYPE,VAL_TYPE>::dht_block),
+  dht_table_mr = manager->create_mr((void*)&(this->dht.buckets_[0]),
+                                   this->dht.buckets_.size()*sizeof(StoreDHT::dht_block),
                                    IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ,
                                    MR_SCOPE_GLOBAL,
                                    conn_);
   manager->set_mr(MR_LOC_LOCAL,MR_SCOPE_GLOBAL,dht_table_mr,MR_TYPE_DHT_TABLE,NULL);
 
-  struct ibv_mr* dht_extents_mr = manager->create_mr(this->dht.memregion,
-                                   this->dht.ext_size_,
-                                   IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ,
-                                   MR_SCOPE_GLOBAL,
-                                   conn_);
-  manager->set_mr(MR_LOC_LOCAL,MR_SCOPE_GLOBAL,dht_extents_mr,MR_TYPE_DHT_EXTENTS,NULL);
+#if KEY_VAL_PAIRTYPE==KVPT_CHARP_CHARP
+  for(int i=0; i<this->dht.ext_regions_.size(); i++) {
+    struct ibv_mr* dht_extents_mr = manager->create_mr(extents_region_base(this->dht.memregion,i),
+                                     this->dht.ext_regions_[i],
+                                     IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ,
+                                     MR_SCOPE_GLOBAL,
+                                     conn_);
+    manager->set_mr(MR_LOC_LOCAL,MR_SCOPE_GLOBAL,dht_extents_mr,MR_TYPE_DHT_EXTENTS+i,NULL);
+  }
+#endif
 
   mr_init = true;
 }
@@ -183,10 +319,12 @@ int Server::setup(void) {
   // IB setup
   clients.clear();
 
-  // Use the same resize hooks for the table and the extents
-  dht.set_resize_hooks(Server::hook_pre_resize,(void*)this,Server::hook_post_resize,(void*)this);
+  // The table resizes in the background and clients switch over on
+  // their own; the extents grow by regions announced to clients
+  dht.set_resize_hooks(NULL,NULL,Server::hook_table_flip,(void*)this);
+  dht.set_retire_hook(Server::hook_table_retire,(void*)this);
 #if KEY_VAL_PAIRTYPE==KVPT_CHARP_CHARP
-  dht.set_resize_extents_hooks(Server::hook_pre_resize,(void*)this,Server::hook_post_resize,(void*)this);
+  dht.set_extents_hook(Server::hook_extents_region,(void*)this);
 #endif
 
   // This triggers just the resize hooks (no actual resize) and
@@ -196,6 +334,34 @@ int Server::setup(void) {
   return 0;
 }
 
+/**
+ * Pre-sizes the DHT for an expected load, so that it does not double
+ * its way up while being filled. Call before ready() or at any time
+ * after, which is what MSG_DHT_CAPACITY does. Growing the table or the
+ * extents is invisible to connected clients.
+ */
+void Server::reserve(size_t entries, size_t kv_bytes) {
+  manager->log(VERB_INFO,"Reserving room for %zu entries, %zu bytes\n",entries,kv_bytes);
+  dht.reserve(entries,kv_bytes);
+}
+
+/**
+ * Handle clients on n threads, each with its own CQ. Call before
+ * ready().
+ */
+void Server::set_workers(int n) {
+  if (n < 1)
+    n = 1;
+  if (n > SERVER_WORKERS_MAX)
+    n = SERVER_WORKERS_MAX;
+
+  workers.resize(n);
+  for(int i = 0; i < n; i++) {
+    workers[i].server = this;
+    workers[i].index = i;
+  }
+}
+
 int Server::ready(unsigned short port) {
 
   // Launch on port SERVER_PORT
@@ -203,12 +369,19 @@ int Server::ready(unsigned short port) {
   addr.sin_family = AF_INET;
   addr.sin_port = htons(port);
 
-  TEST_NZ(rdma_create_id(manager->get_ec(), &listener, this, RDMA_PS_TCP));
-  TEST_NZ(rdma_bind_addr(listener, (struct sockaddr *)&addr));
-  TEST_NZ(rdma_listen(listener, 10)); /* backlog=10 is arbitrary */
+  TEST_NZ(manager->transport()->create_id(manager->get_ec(), &listener, this));
+  TEST_NZ(manager->transport()->bind_addr(listener, (struct sockaddr *)&addr));
+  TEST_NZ(manager->transport()->listen(listener, 10)); /* backlog=10 is arbitrary */
 
-  port = ntohs(rdma_get_src_port(listener));
-  manager->log(VERB_VITAL,"server: listening on port %d.\n", port);
+  port = ntohs(manager->transport()->get_src_port(listener));
+  manager->log(VERB_VITAL,"server: listening on port %d with %zu workers.\n", port, workers.size());
+
+  // This thread is worker 0. A worker's clients share its receive
+  // buffers, so requests, not connections, decide how many are used.
+  manager->set_cq_count(workers.size());
+  manager->set_srq(SERVER_SRQ_BUFS, MSG_BUF_SIZE);
+  for(int i = 1; i < workers.size(); i++)
+    TEST_NZ(pthread_create(&workers[i].thread, NULL, Server::worker_main, (void*)&workers[i]));
 
   is_ready = true;
 
@@ -219,7 +392,11 @@ int Server::ready(unsigned short port) {
 
   manager->log(VERB_ERROR,"%s terminating because rgce returned %d.\n","server",errno);
 
-  rdma_destroy_id(listener);
+  stopping = true;
+  for(int i = 1; i < workers.size(); i++)
+    pthread_join(workers[i].thread, NULL);
+
+  manager->transport()->destroy_id(listener);
 
   if (logging)
     set_logging(false,NULL);
@@ -228,20 +405,81 @@ int Server::ready(unsigned short port) {
 }
 
 int Server::do_event_loop() {
-  struct rdma_cm_event *event = NULL;
   int rval;
 
-  if (rval = manager->poll_cq(0))
+  poll_worker(0);
+
+  // Connection events take the write side themselves; see on_event()
+  if (rval = manager->poll_events())
     return rval;
 
-dead_client_cleanup:
-  if (resizing)      // if resizing, then need to be careful.
-    return 0;
+  // Idle passes copy part of a table being resized
+  pthread_rwlock_rdlock(&table_lock);
+  bool migrating = dht.migrating();
+  pthread_rwlock_unlock(&table_lock);
+
+  if (migrating) {
+    pthread_rwlock_wrlock(&table_lock);
+    dht.migrate_step(MIGRATE_STEP_ROWS);
+    pthread_rwlock_unlock(&table_lock);
+  }
+  return 0;
+}
+
+void* Server::worker_main(void* arg) {
+  struct server_worker* worker = (struct server_worker*)arg;
+
+  // A worker with no clients leaves the CPU to those with some
+  while (!worker->server->stopping) {
+    if (worker->server->poll_worker(worker->index) < 0)
+      usleep(WORKER_IDLE_US);
+  }
+  return NULL;
+}
 
+/**
+ * One pass over worker w's CQ: handles a batch of completions, then
+ * destroys those of its connections that have finished. Only worker w
+ * destroys its connections, so none can go away between polling a
+ * completion and handling it. Returns the number of completions
+ * handled, or -1 if the worker has no clients.
+ */
+int Server::poll_worker(int w) {
+  struct ibv_wc wcs[CQ_POLL_BATCH];
+  bool finished = false;
+  int owned = 0;
+  int n = manager->poll_cq_batch(w, wcs, CQ_POLL_BATCH);
+
+  pthread_rwlock_rdlock(&table_lock);
+  for(int i = 0; i < n; i++)
+    manager->complete(&wcs[i]);
+
+  for(int i = 0; i < clients.size(); i++) {
+    if (clients[i]->cq_index() != w)
+      continue;
+    owned++;
+    if (CONN_FINIS == clients[i]->is_connected() && 0 == clients[i]->refcount)
+      finished = true;
+  }
+  pthread_rwlock_unlock(&table_lock);
+
+  if (finished) {
+    pthread_rwlock_wrlock(&table_lock);
+    reap(w);
+    pthread_rwlock_unlock(&table_lock);
+  }
+  return (owned == 0 && n == 0) ? -1 : n;
+}
+
+/**
+ * Destroy worker w's finished connections. Holds the write side.
+ */
+void Server::reap(int w) {
   std::vector<IBConn*>::iterator it = clients.begin();
   for(; it != clients.end(); it++) {
-    if (CONN_FINIS == (*it)->is_connected() && 0 == (*it)->refcount) {
+    if ((*it)->cq_index() == w && CONN_FINIS == (*it)->is_connected() && 0 == (*it)->refcount) {
       manager->log(VERB_INFO,"Destroying finished connection %p\n",(*it));
+      table_released(*it);
       (*it)->destroy_connection();
       clients.erase(it);
       it--;    // counteract the coming it++;
@@ -249,24 +487,50 @@ dead_client_cleanup:
       continue;
     }
   }
-  return 0;
+}
+
+/**
+ * Completions are handled under the read side of table_lock, which
+ * lets a worker touch only its own clients and read the table. A
+ * handler that must do more trades it for the write side, and back
+ * once done; its own connection is between updates at that point.
+ */
+void Server::begin_write(void) {
+  pthread_rwlock_unlock(&table_lock);
+  pthread_rwlock_wrlock(&table_lock);
+}
+
+void Server::end_write(void) {
+  pthread_rwlock_unlock(&table_lock);
+  pthread_rwlock_rdlock(&table_lock);
 }
 
 int Server::on_connect_request(struct rdma_cm_id *id) {
   struct rdma_conn_param cm_params;
 
-  if (resizing || !is_ready) {
+  if (!is_ready) {
     manager->log(VERB_INFO,"server: received connection request, rejecting\n");
     const char* action = "retry";
 
-    IBConn::reject(id,action);
+    IBConn::reject(manager,id,action);
 
     return 0;
   }
 
-  IBConn* thisconn = manager->new_conn(MSG_BUF_SIZE);
+  // The worker with the fewest clients takes it
+  std::vector<size_t> load(workers.size(),0);
+  int worker = 0;
+  for(int i=0; i<clients.size(); i++)
+    load[clients[i]->cq_index()]++;
+  for(int i=1; i<workers.size(); i++) {
+    if (load[i] < load[worker])
+      worker = i;
+  }
+
+  IBConn* thisconn = manager->new_conn(MSG_BUF_SIZE,worker);
 
-  manager->log(VERB_INFO,"server: received connection request, accepting as %p [had %zu clients]\n",thisconn,clients.size());
+  manager->log(VERB_INFO,"server: received connection request, accepting as %p on worker %d [had %zu clients]\n",
+               thisconn,worker,clients.size());
 
   id->context = thisconn;
   if (thisconn->build_connection(id)) {
@@ -281,7 +545,7 @@ int Server::on_connect_request(struct rdma_cm_id *id) {
   create_mrs(thisconn);
 
   clients.push_back(thisconn);
-  if (rdma_accept(id, &cm_params)) {
+  if (manager->transport()->accept(id, &cm_params)) {
     manager->log(VERB_ERROR,"server: client disconnected before receiving accept; destroying connection\n");
     thisconn->disconnect();
     thisconn->disconnect();
@@ -292,16 +556,15 @@ int Server::on_connect_request(struct rdma_cm_id *id) {
 
 void Server::hook_ibv_recv(int type, struct message* msg_, size_t len, IBConn* conn, void* context) {
   Server* myself = (Server*)context;
-  unsigned int startepoch = myself->epoch;
 
   struct dht_message* msg = (struct dht_message*)msg_;
 
-  // If resizing, this is a trailing message that arrived before we could tear down the connection
-  // to the client(s). We shall just discard it silently.
-  if (myself->resizing) {
-    myself->manager->log(VERB_INFO,"Discarding ibv packet that arrived during resize\n");
-    return;
-  }
+  // Server-mediated reads share the table with other workers; all
+  // else may write to it or reach other workers' clients through the
+  // resize and extents hooks
+  bool write = (type != MSG_DHT_GET && type != MSG_DHT_CONTAINS);
+  if (write)
+    myself->begin_write();
 
   if (type == MSG_DHT_PUT) {
     char * kptr = sizeof(uint64_t)+(char*)(&(msg->data.put.body));
@@ -311,33 +574,51 @@ void Server::hook_ibv_recv(int type, struct message* msg_, size_t len, IBConn* c
     myself->dht.update(kptr, msg->data.put.key_len, vptr, msg->data.put.val_len,
                        *(uint64_t*)(&(msg->data.put.body)), true);
 
-    if (startepoch == myself->epoch) {
-      conn->send_message_ext(MSG_DHT_PUT_DONE,(char*)(&(msg->data.req)),sizeof(struct kv_req));
+    conn->send_message_ext(MSG_DHT_PUT_DONE,(char*)(&(msg->data.req)),sizeof(struct kv_req));
+
+    if (myself->logging)
+      myself->log_put(kptr, msg->data.put.key_len, vptr, msg->data.put.val_len);
+
+  } else if (type == MSG_DHT_PUT_BATCH) {
+    // Bulk load: the whole batch is applied before any of its rows
+    // are guarded, then the reply confirms all of them at once. The
+    // table grows first if it must, since no client can switch tables
+    // before the batch is done. The sender's earlier reads completed
+    // before this message arrived, and it reads no table until the
+    // reply, so it need not acknowledge tables replaced meanwhile.
+    size_t count = msg->data.batch.count;
+    char* rec = &(msg->data.batch.body);
+
+    myself->batch_conn = conn;
+    myself->table_released(conn);
+    myself->dht.make_room(count);
+    myself->dht.begin_bulk();
+    for(size_t i = 0; i < count; i++) {
+      struct dht_batch_rec* hdr = (struct dht_batch_rec*)rec;
+      char * kptr = rec+sizeof(struct dht_batch_rec);
+      char * vptr = kptr+hdr->key_len;
+      myself->dht.update(kptr, hdr->key_len, vptr, hdr->val_len, hdr->crc, true);
+
+      if (myself->logging)
+        myself->log_put(kptr, hdr->key_len, vptr, hdr->val_len);
+      rec = vptr+hdr->val_len;
     }
+    myself->dht.commit_bulk();
+    myself->batch_conn = NULL;
 
-    if (myself->logging) {
-      int key_len = msg->data.put.key_len;
-      int val_len = msg->data.put.val_len;
+    conn->send_message_ext(MSG_DHT_PUT_BATCH_DONE,(char*)&count,sizeof(count));
 
-      // Write the log header
-      myself->log_buf[myself->log_offset] = 'P';
-      memcpy(myself->log_buf+myself->log_offset+sizeof(char),            &key_len,sizeof(int));
-      memcpy(myself->log_buf+myself->log_offset+sizeof(char)+sizeof(int),&val_len,sizeof(int));
-      myself->log_offset += sizeof(char)+sizeof(int)+sizeof(int);
+    // Migration keeps pace as it would with single puts
+    myself->dht.migrate_step(count*MIGRATE_STEP_ROWS);
 
-      // Write the log body
-      memcpy(myself->log_buf+myself->log_offset, kptr, key_len);
-      memcpy(myself->log_buf+myself->log_offset+key_len, vptr, val_len);
-      myself->log_offset += key_len+val_len;
+  } else if (type == MSG_DHT_CAPACITY) {
+    myself->reserve(msg->data.capacity.entries, msg->data.capacity.kv_bytes);
+    conn->send_message_ext(MSG_DHT_CAPACITY_DONE,(char*)&(msg->data.capacity),sizeof(struct dht_capacity));
 
-      myself->log_flush();
-    }
   } else if (type == MSG_DHT_DELETE) {
     myself->dht.remove((char*)(&(msg->data.put.body)), msg->data.put.key_len);
 
-    if (startepoch == myself->epoch) {
-      conn->send_message_ext(MSG_DHT_DELETE_DONE,(char*)(&(msg->data.req)),sizeof(struct kv_req));
-    }
+    conn->send_message_ext(MSG_DHT_DELETE_DONE,(char*)(&(msg->data.req)),sizeof(struct kv_req));
 
     if (myself->logging) {
       int key_len = msg->data.put.key_len;
@@ -357,14 +638,35 @@ void Server::hook_ibv_recv(int type, struct message* msg_, size_t len, IBConn* c
     KEY_TYPE key = (KEY_TYPE)&(msg->data.put.body);
     size_t key_len = msg->data.put.key_len;
 
+    int rval = 0, msg_len;
+    struct dht_message* outmsg = (struct dht_message*)conn->get_send_buf();
+
+#if DHT_LAYOUT==DHT_LAYOUT_INLINE || DHT_LAYOUT==DHT_LAYOUT_BUCKET
+    const char* value;
+    size_t val_len;
+
+    if (myself->dht.get(key,key_len,value,val_len)) {
+      rval = (type == MSG_DHT_CONTAINS)?1:POST_GET_FOUND;
+      msg_len = 0;
+      if (type == MSG_DHT_GET) {
+        outmsg = (struct dht_message*)conn->get_send_buf(sizeof(size_t)+val_len);
+        memcpy((char*)&(outmsg->data.valresp), &val_len, sizeof(size_t));
+        memcpy((char*)(&(outmsg->data.valresp)+sizeof(size_t)),value,val_len);
+        msg_len = val_len+sizeof(size_t);
+      }
+    } else {
+      rval = (type == MSG_DHT_CONTAINS)?0:POST_GET_MISSING;
+      msg_len = 0;
+    }
+#else
     size_t hash_idx = 0;
-    int rval = 0, result, msg_len;
+    int result;
     VAL_TYPE value = 0;
-    struct dht_message* outmsg = (struct dht_message*)conn->get_send_buf();
+    key_hash h = myself->dhtclient->hash_key(key,key_len);
 
 re_server_read:
-    void* addr = myself->dhtclient->pre_get(key,key_len,hash_idx);
-    DHT<KEY_TYPE,VAL_TYPE>::dht_block* dhtb = (DHT<KEY_TYPE,VAL_TYPE>::dht_block*)addr;
+    void* addr = myself->dhtclient->pre_get(h,hash_idx);
+    StoreDHT::dht_block* dhtb = (StoreDHT::dht_block*)addr;
 
     // Figure out if this is the right thing, or what.
     if (type == MSG_DHT_GET)
@@ -387,31 +689,34 @@ re_server_read:
 
       if (result == POST_GET_FOUND) {
 
-        if (type == MSG_DHT_GET) {
-          if (POST_GET_COLLISION == myself->dhtclient->post_get_extents(dhtb,key,key_len,true)) {
-            if (hash_idx == CUCKOO_D-1) {
-              rval = POST_GET_MISSING;
-              *(char*)&(msg->data.put.body) = '\0';
-              msg_len = 0;
-            } else {
-              hash_idx++;
-              goto re_server_read;
-            }
+        // The row may hold a different key that hashed here; keep probing
+        if (POST_GET_COLLISION == myself->dhtclient->post_contains_extents(dhtb,key,key_len,true)) {
+          if (hash_idx == CUCKOO_D-1) {
+            rval = (type == MSG_DHT_CONTAINS)?0:POST_GET_MISSING;
+            *(char*)&(msg->data.put.body) = '\0';
+            msg_len = 0;
           } else {
-            rval = POST_GET_FOUND;
-            msg_len = dhtb->d.val_len;
+            hash_idx++;
+            goto re_server_read;
+          }
+        } else if (type == MSG_DHT_CONTAINS) {
+          rval = 1;
+          msg_len = 0;
+        } else {
+          rval = POST_GET_FOUND;
+          msg_len = dhtb->d.val_len;
 /*
 			myself->manager->log(VERB_ERROR,"target %p src %p val %zu\n",(char*)&(outmsg->data.valresp),dhtb->d.value,msg_len);
-            if (msg_len > MSG_BUF_SIZE-sizeof(outmsg->type)) {
-              myself->manager->log(VERB_ERROR,"Can't return K-V response with key '%s' and vallen=%zu\n",key,msg_len);
-              myself->manager->log(VERB_ERROR,"Values is '%s'\n",value);
-              die("");
-            } else {
+          if (msg_len > MSG_BUF_SIZE-sizeof(outmsg->type)) {
+            myself->manager->log(VERB_ERROR,"Can't return K-V response with key '%s' and vallen=%zu\n",key,msg_len);
+            myself->manager->log(VERB_ERROR,"Values is '%s'\n",value);
+            die("");
+          } else {
 */
-            memcpy((char*)&(outmsg->data.valresp), &(dhtb->d.val_len), sizeof(size_t));
-            memcpy((char*)(&(outmsg->data.valresp)+sizeof(size_t)),dhtb->d.value,msg_len);
-            msg_len += sizeof(size_t);
-          }
+          outmsg = (struct dht_message*)conn->get_send_buf(sizeof(size_t)+msg_len);
+          memcpy((char*)&(outmsg->data.valresp), &(dhtb->d.val_len), sizeof(size_t));
+          memcpy((char*)(&(outmsg->data.valresp)+sizeof(size_t)),dhtb->d.value,msg_len);
+          msg_len += sizeof(size_t);
         }
 
       } else { //LOCKED - this should be IMPOSSIBLE!
@@ -419,25 +724,36 @@ re_server_read:
         diewithcode("Key locked. Key may not be locked when the server reads it!",result);
       }
     }
+#endif
 
 
     // Send response to client
-    if (startepoch == myself->epoch) {
-      if (type == MSG_DHT_GET) {
-        conn->send_message_ext((rval == POST_GET_MISSING)?MSG_DHT_GET_DONE_MISSING:MSG_DHT_GET_DONE,
-                               (char*)(&(outmsg->data)),msg_len);
-      } else {
-        outmsg->data.statusval = (char)rval;
+    if (type == MSG_DHT_GET) {
+      conn->send_message_ext((rval == POST_GET_MISSING)?MSG_DHT_GET_DONE_MISSING:MSG_DHT_GET_DONE,
+                             (char*)(&(outmsg->data)),msg_len);
+    } else {
+      outmsg->data.statusval = (char)rval;
 
-        conn->send_message_ext(MSG_DHT_CONTAINS_DONE,(char*)(&(outmsg->data)),
-                               sizeof(outmsg->data.statusval));
-      }
+      conn->send_message_ext(MSG_DHT_CONTAINS_DONE,(char*)(&(outmsg->data)),
+                             sizeof(outmsg->data.statusval));
     }
 
+  } else if (type == MSG_DHT_TABLE_ACK) {
+    if (msg->data.table.gen == myself->table_gen)
+      myself->table_released(conn);
+
   } else {
     myself->manager->log(VERB_ERROR,"Warning: Unknown verb message type %d\n",type);
 
   }
+
+  // Writes also pay for a table resize in small steps, so it
+  // completes even when the event loop never goes idle
+  if (type == MSG_DHT_PUT || type == MSG_DHT_DELETE)
+    myself->dht.migrate_step(MIGRATE_STEP_ROWS);
+
+  if (write)
+    myself->end_write();
 }
 
 int Server::on_connection(struct rdma_cm_id *id)
@@ -476,6 +792,9 @@ int Server::on_event(struct rdma_cm_event *event, void* ec_context, void* event_
   int r = 0;
   Server* server = (Server*)ec_context;
 
+  // Setup and teardown reach into the workers' connections
+  pthread_rwlock_wrlock(&server->table_lock);
+
   if (event->event == RDMA_CM_EVENT_CONNECT_REQUEST) {
     r = server->on_connect_request(event->id);
   } else if (event->event == RDMA_CM_EVENT_ESTABLISHED) {
@@ -510,6 +829,7 @@ int Server::on_event(struct rdma_cm_event *event, void* ec_context, void* event_
     diewithcode("server: on_event: unknown event.",event->event);
   }
 
+  pthread_rwlock_unlock(&server->table_lock);
   return r;
 }
 
@@ -2,29 +2,62 @@
 #define STORE_SERVER_H
 
 #include <vector>
+#include <pthread.h>
 #include "ib.h"
 #include "ibman.h"
 #include "dht.h"
+#include "dht-inline.h"
+#include "dht-bucket.h"
 #include "table_types.h"
 
+#if DHT_LAYOUT==DHT_LAYOUT_BUCKET
+typedef BucketDHT<KEY_TYPE, VAL_TYPE> StoreDHT;
+typedef BucketDHTClient<KEY_TYPE, VAL_TYPE> StoreDHTClient;
+#elif DHT_LAYOUT==DHT_LAYOUT_INLINE
+typedef InlineDHT<KEY_TYPE, VAL_TYPE> StoreDHT;
+typedef InlineDHTClient<KEY_TYPE, VAL_TYPE> StoreDHTClient;
+#else
+typedef DHT<KEY_TYPE, VAL_TYPE> StoreDHT;
+typedef DHTClient<KEY_TYPE, VAL_TYPE> StoreDHTClient;
+#endif
+
 #include <fcntl.h>
 #include <errno.h>
 
 #define SERVER_PORT 36001
+#define SERVER_WORKERS_MAX 64
+#define WORKER_IDLE_US 1000       // nap of a worker with no clients
+#define SERVER_SRQ_BUFS 512       // shared receive buffers per worker
 #define LOG_BUF_SIZE (1<<25)
 #define LOG_BUF_FLUSH (1<<18)
 
+class Server;
+
+struct server_worker {
+  Server* server;
+  int index;          // also the index of the CQ it polls
+  pthread_t thread;
+};
+
 class Server {
 private:
   IBConnManager* manager;
   std::vector<IBConn*> clients;
-  bool resizing;
+
+  // Workers. Each polls its own CQ, shared by the clients assigned to
+  // it, and handles their completions under the read side of
+  // table_lock: server-mediated reads run in parallel, while writes,
+  // and anything else that may touch other workers' clients, upgrade
+  // to the write side (see begin_write()). Worker 0 is the thread in
+  // ready(), which also handles connection events.
+  std::vector<struct server_worker> workers;
+  pthread_rwlock_t table_lock;
+  volatile bool stopping;
   struct sockaddr_in addr;
   struct rdma_cm_id *listener;
   uint16_t port;
-  unsigned int epoch;
   bool is_ready;                              // set once ready for clients
-  DHTClient<KEY_TYPE, VAL_TYPE>* dhtclient;    // used for server-mediated reads
+  StoreDHTClient* dhtclient;    // used for server-mediated reads
 
   // Logging
   bool logging;
@@ -39,38 +72,49 @@ private:
   struct ibv_mr *recv_buf_mr;
 
   struct ibv_mr *dht_table_mr;
-#if KEY_VAL_PAIRTYPE==KVPT_CHARP_CHARP
-  struct ibv_mr *dht_ext_mr;
-#endif
+  struct ibv_mr *retired_table_mr;            // previous table, until every client switched
+  std::vector<IBConn*> table_waiting;         // clients yet to acknowledge the table
+  unsigned int table_gen;
+  IBConn* batch_conn;                         // sender of the MSG_DHT_PUT_BATCH being applied
 
   void create_mrs(IBConn* conn);
   bool mr_init;
 
   // Asynchronous
   int do_event_loop(void);
+  int poll_worker(int w);
+  void reap(int w);
+  void begin_write(void);
+  void end_write(void);
+  static void* worker_main(void* arg);
   int on_connect_request(struct rdma_cm_id *id);
   int on_connection(struct rdma_cm_id *id);
   int on_disconnect(struct rdma_cm_id *id);
+  void table_released(IBConn* conn);
+  void log_put(const char* key, int key_len, const char* value, int val_len);
 public:
 
   // Synchronous
   Server();
   void verbosity(enum ibman_verb verb);
   int setup(void);
+  void set_workers(int n);
   int ready(unsigned short port = SERVER_PORT);
+  void reserve(size_t entries, size_t kv_bytes);
 
   // Logging
   void set_logging(bool state, char* fname);
   void log_flush(void);
 
   // Hooks
-  static int hook_pre_resize(size_t oldsize, std::vector<DHT<KEY_TYPE, VAL_TYPE>::dht_block>*, void* context);
-  static int hook_post_resize(size_t newsize, std::vector<DHT<KEY_TYPE, VAL_TYPE>::dht_block>*, void* context);
+  static int hook_table_flip(size_t newsize, StoreDHT::slot_vector*, void* context);
+  static int hook_table_retire(size_t oldsize, StoreDHT::slot_vector*, void* context);
+  static int hook_extents_region(int region, void* base, size_t size, void* context);
   static void hook_ibv_recv(int type, struct message* msg, size_t len, IBConn* conn, void* context);
   static int on_event(struct rdma_cm_event *event, void* ec_context, void* event_context);
 
   // Data
-  DHT<KEY_TYPE, VAL_TYPE> dht;
+  StoreDHT dht;
 
 };
 #endif // STORE_SERVER_H
@@ -19,4 +19,31 @@
 
 #endif
 
+// Slot layout of the server-side table shards
+#define DHT_LAYOUT_PACKED 0   // DHT: keys and values always in extents
+#define DHT_LAYOUT_INLINE 1   // InlineDHT: cache-line slots, small pairs inline
+#define DHT_LAYOUT_BUCKET 2   // BucketDHT: two candidate buckets of fingerprinted ways
+
+#define DHT_LAYOUT DHT_LAYOUT_PACKED
+//#define DHT_LAYOUT DHT_LAYOUT_INLINE
+//#define DHT_LAYOUT DHT_LAYOUT_BUCKET
+
+// Checksum guarding rows and extents (see integrity.h); clients and
+// servers must be built with the same one
+#define CHECKSUM_CRC64  0     // table-driven CRC-64, a byte at a time
+#define CHECKSUM_CRC32C 1     // CRC-32C, SSE4.2 crc32 when the CPU has it
+#define CHECKSUM_XXH64  2     // xxHash64
+
+#define DHT_CHECKSUM CHECKSUM_CRC32C
+//#define DHT_CHECKSUM CHECKSUM_CRC64
+//#define DHT_CHECKSUM CHECKSUM_XXH64
+
+// How clients reading a row or its extents catch a write in progress
+// (see dht.h); clients and servers must agree on this too
+#define CONSISTENCY_CHECKSUM 0  // readers recompute the checksums
+#define CONSISTENCY_SEQLOCK  1  // readers compare version words at both ends
+
+#define DHT_CONSISTENCY CONSISTENCY_CHECKSUM
+//#define DHT_CONSISTENCY CONSISTENCY_SEQLOCK
+
 #endif // TABLE_TYPES_H
@@ -0,0 +1,978 @@
+/***********************************************
+ *                                             *
+ * -__ /\\     ,,         /\\                  *
+ *   ||  \\  ' ||   _    ||                    *
+ *  /||__|| \\ ||  < \, =||=                   *
+ *  \||__|| || ||  /-||  ||                    *
+ *   ||  |, || || (( ||  ||                    *
+ * _-||-_/  \\ \\  \/\\  \\,                   *
+ *   ||                                        *
+ *                                             *
+ *   Pilaf Infiniband DHT                      *
+ *   (c) 2012-2013 Christopher Mitchell et al. *
+ *   New York University, Courant Institute    *
+ *   Networking and Wide-Area Systems Group    *
+ *   All rights reserved.                      *
+ *                                             *
+ *   transport-shm.cc: Shared-memory loopback  *
+ *                     transport.              *
+ ***********************************************/
+
+#include "transport-shm.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#define SHM_FIRST_EPHEMERAL_PORT 49152
+
+/**
+ * Abstract unix socket address standing in for a port.
+ */
+static socklen_t shm_sockaddr(uint16_t port, struct sockaddr_un* sun) {
+  memset(sun, 0, sizeof(*sun));
+  sun->sun_family = AF_UNIX;
+  snprintf(sun->sun_path+1, sizeof(sun->sun_path)-1, "pilaf-shm-%u", port);
+  return offsetof(struct sockaddr_un, sun_path) + 1 + strlen(sun->sun_path+1);
+}
+
+static uint16_t shm_port(struct sockaddr* addr) {
+  if (addr->sa_family == AF_INET6)
+    return ntohs(((struct sockaddr_in6*)addr)->sin6_port);
+  return ntohs(((struct sockaddr_in*)addr)->sin_port);
+}
+
+static int write_full(int fd, const void* buf, size_t len) {
+  const char* p = (const char*)buf;
+  while (len) {
+    ssize_t n = write(fd, p, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return -1;
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+// The handshake is written in one go right after connect/accept, so
+// waiting for the rest of it never takes long.
+static int read_full(int fd, void* buf, size_t len) {
+  char* p = (char*)buf;
+  while (len) {
+    ssize_t n = read(fd, p, len);
+    if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+      struct pollfd pfd = { fd, POLLIN, 0 };
+      poll(&pfd, 1, 100);
+      continue;
+    }
+    if (n <= 0)
+      return -1;
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static enum ibv_wc_opcode wc_opcode(int wr_opcode) {
+  switch (wr_opcode) {
+    case IBV_WR_RDMA_READ:  return IBV_WC_RDMA_READ;
+    case IBV_WR_RDMA_WRITE: return IBV_WC_RDMA_WRITE;
+    default:                return IBV_WC_SEND;
+  }
+}
+
+ShmTransport::ShmTransport() {
+  TransportLock::init(&lock_);
+  pd_ = (struct ibv_pd*)calloc(1, sizeof(struct ibv_pd));
+  next_key_ = 1;
+  next_qp_num_ = 1;
+  next_seg_ = 0;
+  last_acked_ = NULL;
+  warned_cma_ = false;
+}
+
+ShmTransport::~ShmTransport() {
+  while (!ids_.empty())
+    destroy_id(&ids_.back()->id);
+  for(std::set<struct ibv_mr*>::iterator it = mrs_.begin(); it != mrs_.end(); it++)
+    free(*it);
+  delete last_acked_;
+  free(pd_);
+}
+
+/*
+ * Connection management
+ */
+
+struct rdma_event_channel* ShmTransport::create_event_channel(void) {
+  TransportLock hold(&lock_);
+  struct rdma_event_channel* ec = (struct rdma_event_channel*)calloc(1, sizeof(struct rdma_event_channel));
+  if (ec)
+    ec->fd = -1;
+  return ec;
+}
+
+int ShmTransport::create_id(struct rdma_event_channel* channel, struct rdma_cm_id** id, void* context) {
+  TransportLock hold(&lock_);
+  struct shm_id* s = new shm_id();
+
+  memset(&s->id, 0, sizeof(s->id));
+  s->id.channel = channel;
+  s->id.context = context;
+  s->state = SHM_ID_IDLE;
+  s->fd = -1;
+  s->port = 0;
+  s->peer_pid = 0;
+  s->side = 0;
+  s->seg = NULL;
+  s->seg_name[0] = '\0';
+  s->seg_owner = false;
+  s->est_pending = false;
+  s->qp = NULL;
+
+  ids_.push_back(s);
+  *id = &s->id;
+  return 0;
+}
+
+int ShmTransport::destroy_id(struct rdma_cm_id* id) {
+  TransportLock hold(&lock_);
+  struct shm_id* s = (struct shm_id*)id;
+
+  if (s->qp)
+    destroy_qp(id);
+  if (s->fd >= 0)
+    close(s->fd);
+  release_segment(s);
+
+  // Events not yet handed out would point at a dead id
+  for(std::deque<struct shm_event*>::iterator it = events_.begin(); it != events_.end(); ) {
+    if ((*it)->event.id == id || (*it)->event.listen_id == id) {
+      delete *it;
+      it = events_.erase(it);
+    } else
+      it++;
+  }
+
+  ids_.erase(std::remove(ids_.begin(), ids_.end(), s), ids_.end());
+  delete s;
+  return 0;
+}
+
+int ShmTransport::bind_addr(struct rdma_cm_id* id, struct sockaddr* addr) {
+  TransportLock hold(&lock_);
+  struct shm_id* s = (struct shm_id*)id;
+  struct sockaddr_un sun;
+  uint16_t port = shm_port(addr);
+  bool any = (port == 0);
+
+  if (s->state != SHM_ID_IDLE) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (0 > (s->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)))
+    return -1;
+
+  for(port = any ? SHM_FIRST_EPHEMERAL_PORT : port; ; port++) {
+    socklen_t len = shm_sockaddr(port, &sun);
+    if (0 == bind(s->fd, (struct sockaddr*)&sun, len))
+      break;
+    if (!any || errno != EADDRINUSE || port == 0xffff) {
+      close(s->fd);
+      s->fd = -1;
+      return -1;
+    }
+  }
+
+  s->port = port;
+  s->state = SHM_ID_BOUND;
+  return 0;
+}
+
+int ShmTransport::listen(struct rdma_cm_id* id, int backlog) {
+  TransportLock hold(&lock_);
+  struct shm_id* s = (struct shm_id*)id;
+
+  if (s->state != SHM_ID_BOUND) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (::listen(s->fd, backlog))
+    return -1;
+
+#ifdef PR_SET_PTRACER
+  // Under Yama, clients may only read our memory if we say so
+  prctl(PR_SET_PTRACER, PR_SET_PTRACER_ANY, 0, 0, 0);
+#endif
+
+  s->state = SHM_ID_LISTENING;
+  return 0;
+}
+
+uint16_t ShmTransport::get_src_port(struct rdma_cm_id* id) {
+  TransportLock hold(&lock_);
+  return htons(((struct shm_id*)id)->port);
+}
+
+/**
+ * Peers are always local, so resolution only needs the port.
+ */
+int ShmTransport::resolve_addr(struct rdma_cm_id* id, struct sockaddr* src, struct sockaddr* dst, int timeout_ms) {
+  TransportLock hold(&lock_);
+  struct shm_id* s = (struct shm_id*)id;
+
+  s->port = shm_port(dst);
+  queue_event(s, RDMA_CM_EVENT_ADDR_RESOLVED);
+  return 0;
+}
+
+int ShmTransport::resolve_route(struct rdma_cm_id* id, int timeout_ms) {
+  TransportLock hold(&lock_);
+  queue_event((struct shm_id*)id, RDMA_CM_EVENT_ROUTE_RESOLVED);
+  return 0;
+}
+
+/**
+ * Create the segment holding both rings, then offer it to the
+ * listener. A missing listener is reported as a rejection, as rdma_cm
+ * does.
+ */
+int ShmTransport::connect(struct rdma_cm_id* id, struct rdma_conn_param* params) {
+  TransportLock hold(&lock_);
+  struct shm_id* s = (struct shm_id*)id;
+  struct shm_handshake hello;
+  struct sockaddr_un sun;
+  int segfd;
+
+  if (s->state != SHM_ID_IDLE || s->qp == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  snprintf(s->seg_name, SHM_NAME_LEN, "/pilaf-shm-%d-%u", (int)getpid(), next_seg_++);
+  if (0 > (segfd = shm_open(s->seg_name, O_CREAT | O_EXCL | O_RDWR, 0600)))
+    return -1;
+  s->seg_owner = true;
+  if (ftruncate(segfd, sizeof(struct shm_segment)) ||
+      MAP_FAILED == (s->seg = (struct shm_segment*)mmap(NULL, sizeof(struct shm_segment),
+                                                         PROT_READ | PROT_WRITE, MAP_SHARED, segfd, 0)))
+  {
+    s->seg = NULL;
+    close(segfd);
+    release_segment(s);
+    return -1;
+  }
+  close(segfd);
+  s->seg->magic = SHM_MAGIC;
+  s->side = 0;
+
+  if (0 > (s->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0))) {
+    release_segment(s);
+    return -1;
+  }
+
+  socklen_t len = shm_sockaddr(s->port, &sun);
+  if (::connect(s->fd, (struct sockaddr*)&sun, len)) {
+    close(s->fd);
+    s->fd = -1;
+    release_segment(s);
+    queue_event(s, RDMA_CM_EVENT_REJECTED);
+    return 0;
+  }
+
+  memset(&hello, 0, sizeof(hello));
+  hello.magic = SHM_MAGIC;
+  hello.pid = getpid();
+  strncpy(hello.seg_name, s->seg_name, SHM_NAME_LEN);
+  if (params && params->private_data_len) {
+    hello.private_data_len = std::min((int)params->private_data_len, SHM_PRIV_LEN);
+    memcpy(hello.private_data, params->private_data, hello.private_data_len);
+  }
+  if (write_full(s->fd, &hello, sizeof(hello))) {
+    close(s->fd);
+    s->fd = -1;
+    release_segment(s);
+    queue_event(s, RDMA_CM_EVENT_REJECTED);
+    return 0;
+  }
+
+  fcntl(s->fd, F_SETFL, fcntl(s->fd, F_GETFL) | O_NONBLOCK);
+  s->state = SHM_ID_CONNECTING;
+  return 0;
+}
+
+int ShmTransport::accept(struct rdma_cm_id* id, struct rdma_conn_param* params) {
+  TransportLock hold(&lock_);
+  struct shm_id* s = (struct shm_id*)id;
+  struct shm_handshake reply;
+  int segfd;
+
+  if (s->state != SHM_ID_REQUESTED || s->qp == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (0 > (segfd = shm_open(s->seg_name, O_RDWR, 0600)))
+    return -1;
+  s->seg = (struct shm_segment*)mmap(NULL, sizeof(struct shm_segment), PROT_READ | PROT_WRITE,
+                                     MAP_SHARED, segfd, 0);
+  close(segfd);
+  if (s->seg == MAP_FAILED || s->seg->magic != SHM_MAGIC) {
+    if (s->seg != MAP_FAILED)
+      munmap(s->seg, sizeof(struct shm_segment));
+    s->seg = NULL;
+    errno = EPROTO;
+    return -1;
+  }
+  s->side = 1;
+
+  memset(&reply, 0, sizeof(reply));
+  reply.magic = SHM_MAGIC;
+  reply.accepted = 1;
+  reply.pid = getpid();
+  if (write_full(s->fd, &reply, sizeof(reply))) {
+    release_segment(s);
+    return -1;
+  }
+
+  fcntl(s->fd, F_SETFL, fcntl(s->fd, F_GETFL) | O_NONBLOCK);
+  s->state = SHM_ID_CONNECTED;
+  s->est_pending = true;
+  queue_event(s, RDMA_CM_EVENT_ESTABLISHED);
+  return 0;
+}
+
+int ShmTransport::reject(struct rdma_cm_id* id, const void* private_data, uint8_t private_data_len) {
+  TransportLock hold(&lock_);
+  struct shm_id* s = (struct shm_id*)id;
+  struct shm_handshake reply;
+
+  if (s->state != SHM_ID_REQUESTED) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  memset(&reply, 0, sizeof(reply));
+  reply.magic = SHM_MAGIC;
+  reply.accepted = 0;
+  reply.pid = getpid();
+  reply.private_data_len = std::min((int)private_data_len, SHM_PRIV_LEN);
+  if (private_data)
+    memcpy(reply.private_data, private_data, reply.private_data_len);
+  write_full(s->fd, &reply, sizeof(reply));
+
+  close(s->fd);
+  s->fd = -1;
+  s->state = SHM_ID_IDLE;
+  return 0;
+}
+
+/**
+ * Like rdma_disconnect(), both ends get RDMA_CM_EVENT_DISCONNECTED.
+ */
+int ShmTransport::disconnect(struct rdma_cm_id* id) {
+  TransportLock hold(&lock_);
+  struct shm_id* s = (struct shm_id*)id;
+
+  if (s->state != SHM_ID_CONNECTED) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  shutdown(s->fd, SHUT_RDWR);
+  on_peer_closed(s);
+  return 0;
+}
+
+int ShmTransport::get_cm_event(struct rdma_event_channel* channel, struct rdma_cm_event** event) {
+  TransportLock hold(&lock_);
+  if (events_.empty())
+    poll_sockets();
+
+  if (events_.empty()) {
+    errno = EAGAIN;
+    return -1;
+  }
+
+  *event = &events_.front()->event;
+  events_.pop_front();
+
+  // Messages that arrived ahead of the event are delivered now
+  struct shm_id* s = (struct shm_id*)(*event)->id;
+  if ((*event)->event == RDMA_CM_EVENT_ESTABLISHED && s->est_pending) {
+    s->est_pending = false;
+    if (s->qp)
+      progress_recv(s->qp);
+  }
+  return 0;
+}
+
+/**
+ * IBConnManager copies the event and acks it before running the
+ * handlers, which still read the private data it points to, so an
+ * event is only freed when the next one is acked.
+ */
+int ShmTransport::ack_cm_event(struct rdma_cm_event* event) {
+  TransportLock hold(&lock_);
+  delete last_acked_;
+  last_acked_ = (struct shm_event*)event;
+  return 0;
+}
+
+void ShmTransport::queue_event(struct shm_id* id, enum rdma_cm_event_type type, struct shm_id* listen_id,
+                               const void* private_data, uint8_t private_data_len) {
+  struct shm_event* e = new shm_event();
+
+  memset(e, 0, sizeof(*e));
+  e->event.id = &id->id;
+  e->event.listen_id = listen_id ? &listen_id->id : NULL;
+  e->event.event = type;
+  if (private_data_len) {
+    memcpy(e->private_data, private_data, private_data_len);
+    e->event.param.conn.private_data = e->private_data;
+    e->event.param.conn.private_data_len = private_data_len;
+  }
+  events_.push_back(e);
+}
+
+/**
+ * One poll() over every socket that can produce an event: listeners
+ * with pending connections, connectors awaiting a reply, and
+ * connections whose peer may have gone away.
+ */
+void ShmTransport::poll_sockets(void) {
+  std::vector<struct pollfd> pfds;
+  std::vector<struct shm_id*> polled;
+
+  for(size_t i = 0; i < ids_.size(); i++) {
+    struct shm_id* s = ids_[i];
+    if (s->fd < 0 || (s->state != SHM_ID_LISTENING && s->state != SHM_ID_CONNECTING &&
+                      s->state != SHM_ID_CONNECTED))
+      continue;
+    struct pollfd pfd = { s->fd, POLLIN, 0 };
+    pfds.push_back(pfd);
+    polled.push_back(s);
+  }
+
+  if (pfds.empty() || 0 >= poll(&pfds[0], pfds.size(), 0))
+    return;
+
+  for(size_t i = 0; i < pfds.size(); i++) {
+    if (!pfds[i].revents)
+      continue;
+    struct shm_id* s = polled[i];
+
+    if (s->state == SHM_ID_LISTENING) {
+      on_listen_ready(s);
+    } else if (s->state == SHM_ID_CONNECTING) {
+      on_reply_ready(s);
+    } else {
+      // Nothing but the close is ever sent after the handshake
+      char c;
+      ssize_t n = recv(s->fd, &c, 1, MSG_DONTWAIT);
+      if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR))
+        on_peer_closed(s);
+    }
+  }
+}
+
+void ShmTransport::on_listen_ready(struct shm_id* ls) {
+  struct shm_handshake hello;
+  int fd;
+
+  while (0 <= (fd = accept4(ls->fd, NULL, NULL, SOCK_CLOEXEC))) {
+    if (read_full(fd, &hello, sizeof(hello)) || hello.magic != SHM_MAGIC) {
+      close(fd);
+      continue;
+    }
+
+    struct rdma_cm_id* id;
+    create_id(ls->id.channel, &id, ls->id.context);
+    struct shm_id* s = (struct shm_id*)id;
+    s->state = SHM_ID_REQUESTED;
+    s->fd = fd;
+    s->port = ls->port;
+    s->peer_pid = hello.pid;
+    memcpy(s->seg_name, hello.seg_name, SHM_NAME_LEN);
+    s->seg_name[SHM_NAME_LEN-1] = '\0';
+
+    queue_event(s, RDMA_CM_EVENT_CONNECT_REQUEST, ls, hello.private_data,
+                std::min((int)hello.private_data_len, SHM_PRIV_LEN));
+  }
+}
+
+void ShmTransport::on_reply_ready(struct shm_id* s) {
+  struct shm_handshake reply;
+
+  memset(&reply, 0, sizeof(reply));
+  if (read_full(s->fd, &reply, sizeof(reply)) || reply.magic != SHM_MAGIC || !reply.accepted) {
+    bool answered = (reply.magic == SHM_MAGIC);
+    close(s->fd);
+    s->fd = -1;
+    release_segment(s);
+    s->state = SHM_ID_IDLE;
+    if (answered)
+      queue_event(s, RDMA_CM_EVENT_REJECTED, NULL, reply.private_data,
+                  std::min((int)reply.private_data_len, SHM_PRIV_LEN));
+    else
+      queue_event(s, RDMA_CM_EVENT_REJECTED);
+    return;
+  }
+
+  // Both ends have it mapped now
+  shm_unlink(s->seg_name);
+  s->seg_owner = false;
+
+  s->peer_pid = reply.pid;
+  s->state = SHM_ID_CONNECTED;
+  s->est_pending = true;
+  queue_event(s, RDMA_CM_EVENT_ESTABLISHED);
+}
+
+void ShmTransport::on_peer_closed(struct shm_id* s) {
+  s->state = SHM_ID_DISCONNECTED;
+  if (s->qp)
+    flush(s->qp);
+  queue_event(s, RDMA_CM_EVENT_DISCONNECTED);
+}
+
+void ShmTransport::release_segment(struct shm_id* s) {
+  if (s->seg) {
+    munmap(s->seg, sizeof(struct shm_segment));
+    s->seg = NULL;
+  }
+  if (s->seg_owner) {
+    shm_unlink(s->seg_name);
+    s->seg_owner = false;
+  }
+}
+
+/*
+ * Queues and memory
+ */
+
+struct ibv_cq* ShmTransport::create_cq(struct ibv_context* ctx, int cqe) {
+  TransportLock hold(&lock_);
+  struct shm_cq* c = new shm_cq();
+
+  memset(&c->cq, 0, sizeof(c->cq));
+  c->cq.context = ctx;
+  c->cq.cqe = cqe;
+  return &c->cq;
+}
+
+int ShmTransport::req_notify_cq(struct ibv_cq* cq) {
+  TransportLock hold(&lock_);
+  return 0;
+}
+
+int ShmTransport::destroy_cq(struct ibv_cq* cq) {
+  TransportLock hold(&lock_);
+  for(size_t i = 0; i < qps_.size(); i++) {
+    if (qps_[i]->qp.send_cq == cq || qps_[i]->qp.recv_cq == cq) {
+      errno = EBUSY;
+      return EBUSY;
+    }
+  }
+  delete (struct shm_cq*)cq;
+  return 0;
+}
+
+int ShmTransport::create_qp(struct rdma_cm_id* id, struct ibv_pd* pd, struct ibv_qp_init_attr* attr) {
+  TransportLock hold(&lock_);
+  struct shm_id* s = (struct shm_id*)id;
+  struct shm_qp* q;
+
+  if (s->qp) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  q = new shm_qp();
+  memset(&q->qp, 0, sizeof(q->qp));
+  q->qp.pd = pd ? pd : pd_;
+  q->qp.send_cq = attr->send_cq;
+  q->qp.recv_cq = attr->recv_cq;
+  q->qp.qp_context = attr->qp_context;
+  q->qp.qp_num = next_qp_num_++;
+  q->qp.qp_type = attr->qp_type;
+  q->qp.state = IBV_QPS_RTS;
+  q->qp.srq = attr->srq;
+  q->id = s;
+  q->sig_all = attr->sq_sig_all;
+  q->srq = (struct shm_srq*)attr->srq;
+
+  s->qp = q;
+  id->qp = &q->qp;
+  id->pd = q->qp.pd;
+  qps_.push_back(q);
+  return 0;
+}
+
+/**
+ * Completions of the QP still sitting in its CQs go with it, as with
+ * verbs providers, so they are never handed out for a dead connection.
+ */
+void ShmTransport::destroy_qp(struct rdma_cm_id* id) {
+  TransportLock hold(&lock_);
+  struct shm_id* s = (struct shm_id*)id;
+  struct shm_qp* q = s->qp;
+
+  if (q == NULL)
+    return;
+
+  struct ibv_cq* cqs[2] = { q->qp.send_cq, q->qp.recv_cq };
+  for(int i = 0; i < 2; i++) {
+    if (cqs[i] == NULL || (i == 1 && cqs[1] == cqs[0]))
+      continue;
+    std::deque<struct ibv_wc>& wcs = ((struct shm_cq*)cqs[i])->wcs;
+    for(std::deque<struct ibv_wc>::iterator it = wcs.begin(); it != wcs.end(); ) {
+      if (it->qp_num == q->qp.qp_num)
+        it = wcs.erase(it);
+      else
+        it++;
+    }
+  }
+
+  // A receive claimed from the SRQ but not filled goes back to it
+  if (q->srq) {
+    for(; !q->rq.empty(); q->rq.pop_back()) {
+      q->rq.back().done = 0;
+      q->srq->rq.push_front(q->rq.back());
+    }
+  }
+
+  qps_.erase(std::remove(qps_.begin(), qps_.end(), q), qps_.end());
+  delete q;
+  s->qp = NULL;
+  id->qp = NULL;
+}
+
+struct ibv_srq* ShmTransport::create_srq(struct ibv_pd* pd, int max_wr) {
+  TransportLock hold(&lock_);
+  struct shm_srq* r = new shm_srq();
+
+  memset(&r->srq, 0, sizeof(r->srq));
+  r->srq.pd = pd ? pd : pd_;
+  return &r->srq;
+}
+
+int ShmTransport::destroy_srq(struct ibv_srq* srq) {
+  TransportLock hold(&lock_);
+  for(size_t i = 0; i < qps_.size(); i++) {
+    if (qps_[i]->srq == (struct shm_srq*)srq) {
+      errno = EBUSY;
+      return EBUSY;
+    }
+  }
+  delete (struct shm_srq*)srq;
+  return 0;
+}
+
+/**
+ * Regions need no pinning or translation; the MR only describes the
+ * range for bounds checks and the MR exchange.
+ */
+struct ibv_mr* ShmTransport::reg_mr(struct ibv_pd* pd, void* addr, size_t length, int access) {
+  TransportLock hold(&lock_);
+  struct ibv_mr* mr = (struct ibv_mr*)calloc(1, sizeof(struct ibv_mr));
+
+  if (mr == NULL)
+    return NULL;
+  mr->pd = pd;
+  mr->addr = addr;
+  mr->length = length;
+  mr->handle = next_key_;
+  mr->lkey = mr->rkey = next_key_++;
+  mrs_.insert(mr);
+  return mr;
+}
+
+// Copies of an MR (as kept by IBConnManager::set_mr) are ignored
+int ShmTransport::dereg_mr(struct ibv_mr* mr) {
+  TransportLock hold(&lock_);
+  if (mrs_.erase(mr))
+    free(mr);
+  return 0;
+}
+
+/*
+ * Data path
+ */
+
+int ShmTransport::post_send(struct ibv_qp* qp, struct ibv_send_wr* wr, struct ibv_send_wr** bad_wr) {
+  TransportLock hold(&lock_);
+  struct shm_qp* q = (struct shm_qp*)qp;
+
+  for(; wr != NULL; wr = wr->next) {
+    if (wr->num_sge > 1) {
+      *bad_wr = wr;
+      errno = EINVAL;
+      return EINVAL;
+    }
+
+    struct shm_wr w;
+    w.wr_id = wr->wr_id;
+    w.opcode = wr->opcode;
+    w.signaled = q->sig_all || (wr->send_flags & IBV_SEND_SIGNALED);
+    w.local_addr = wr->num_sge ? wr->sg_list[0].addr : 0;
+    w.length = wr->num_sge ? wr->sg_list[0].length : 0;
+    w.remote_addr = wr->wr.rdma.remote_addr;
+    w.done = 0;
+    if (wr->opcode == IBV_WR_SEND && (wr->send_flags & IBV_SEND_INLINE))
+      w.inline_data.assign((const char*)w.local_addr, w.length);
+    q->sq.push_back(w);
+  }
+
+  progress_send(q);
+  return 0;
+}
+
+int ShmTransport::post_recv(struct ibv_qp* qp, struct ibv_recv_wr* wr, struct ibv_recv_wr** bad_wr) {
+  TransportLock hold(&lock_);
+  struct shm_qp* q = (struct shm_qp*)qp;
+
+  for(; wr != NULL; wr = wr->next) {
+    if (wr->num_sge != 1) {
+      *bad_wr = wr;
+      errno = EINVAL;
+      return EINVAL;
+    }
+
+    post_wr(q->rq, wr);
+  }
+
+  progress_recv(q);
+  return 0;
+}
+
+int ShmTransport::post_srq_recv(struct ibv_srq* srq, struct ibv_recv_wr* wr, struct ibv_recv_wr** bad_wr) {
+  TransportLock hold(&lock_);
+  struct shm_srq* r = (struct shm_srq*)srq;
+
+  for(; wr != NULL; wr = wr->next) {
+    if (wr->num_sge != 1) {
+      *bad_wr = wr;
+      errno = EINVAL;
+      return EINVAL;
+    }
+    post_wr(r->rq, wr);
+  }
+
+  // Messages may be waiting for exactly these receives
+  for(size_t i = 0; i < qps_.size(); i++) {
+    if (qps_[i]->srq == r)
+      progress_recv(qps_[i]);
+  }
+  return 0;
+}
+
+void ShmTransport::post_wr(std::deque<struct shm_wr>& rq, struct ibv_recv_wr* wr) {
+  struct shm_wr w;
+  w.wr_id = wr->wr_id;
+  w.opcode = 0;
+  w.signaled = true;
+  w.local_addr = wr->sg_list[0].addr;
+  w.length = wr->sg_list[0].length;
+  w.remote_addr = 0;
+  w.done = 0;
+  rq.push_back(w);
+}
+
+/**
+ * Polling a CQ is what moves its QPs along: sends blocked on a full
+ * ring resume and arrived messages fill posted receives.
+ */
+int ShmTransport::poll_cq(struct ibv_cq* cq, int n, struct ibv_wc* wc) {
+  struct shm_cq* c = (struct shm_cq*)cq;
+  int got = 0;
+
+  {
+    TransportLock hold(&lock_);
+
+    for(size_t i = 0; i < qps_.size(); i++) {
+      if (qps_[i]->qp.send_cq == cq || qps_[i]->qp.recv_cq == cq)
+        progress(qps_[i]);
+    }
+
+    while (got < n && !c->wcs.empty()) {
+      wc[got++] = c->wcs.front();
+      c->wcs.pop_front();
+    }
+  }
+
+  // Both ends busy-poll; with fewer cores than processes an idle poller
+  // would otherwise hold the CPU its peer needs for a whole time slice.
+  if (got == 0)
+    sched_yield();
+  return got;
+}
+
+void ShmTransport::progress(struct shm_qp* q) {
+  progress_send(q);
+  progress_recv(q);
+}
+
+/**
+ * Execute the send queue in order. A send stays at the head until all
+ * of its fragments are in the ring, holding back everything behind it
+ * just as an RC QP would.
+ */
+void ShmTransport::progress_send(struct shm_qp* q) {
+  struct shm_id* s = q->id;
+
+  if (s->state == SHM_ID_DISCONNECTED) {
+    flush(q);
+    return;
+  }
+  if (s->state != SHM_ID_CONNECTED)
+    return;
+
+  struct shm_ring* ring = &s->seg->ring[s->side];
+
+  while (!q->sq.empty()) {
+    struct shm_wr& w = q->sq.front();
+    enum ibv_wc_status status = IBV_WC_SUCCESS;
+
+    if (w.opcode == IBV_WR_SEND) {
+      const char* src = w.inline_data.empty() ? (const char*)w.local_addr : w.inline_data.data();
+      do {
+        uint64_t head = ring->head;
+        if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == SHM_RING_SLOTS)
+          return;   // full; resumes on the next poll
+
+        struct shm_slot* slot = &ring->slots[head % SHM_RING_SLOTS];
+        uint32_t chunk = std::min((uint32_t)sizeof(slot->data), w.length - w.done);
+        memcpy(slot->data, src + w.done, chunk);
+        slot->len = chunk;
+        slot->last = (w.done + chunk == w.length);
+        w.done += chunk;
+        __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+      } while (w.done < w.length);
+
+    } else if (w.opcode == IBV_WR_RDMA_READ || w.opcode == IBV_WR_RDMA_WRITE) {
+      if (!copy_remote(q, w))
+        status = IBV_WC_REM_ACCESS_ERR;
+
+    } else {
+      status = IBV_WC_LOC_QP_OP_ERR;
+    }
+
+    // Errors complete whether signaled or not
+    if (w.signaled || status != IBV_WC_SUCCESS)
+      complete(q->qp.send_cq, q, w.wr_id, wc_opcode(w.opcode), status, w.length);
+    q->sq.pop_front();
+  }
+}
+
+/**
+ * Reassemble arrived fragments into posted receives. With no receive
+ * posted, messages wait in the ring. With an SRQ, a message claims a
+ * receive from it when its first fragment is read.
+ */
+void ShmTransport::progress_recv(struct shm_qp* q) {
+  struct shm_id* s = q->id;
+
+  if (s->state != SHM_ID_CONNECTED || s->est_pending)
+    return;
+
+  struct shm_ring* ring = &s->seg->ring[1 - s->side];
+
+  for(;;) {
+    uint64_t tail = ring->tail;
+    if (tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE))
+      return;
+
+    if (q->rq.empty()) {
+      if (q->srq == NULL || q->srq->rq.empty())
+        return;
+      q->rq.push_back(q->srq->rq.front());
+      q->srq->rq.pop_front();
+    }
+
+    struct shm_slot* slot = &ring->slots[tail % SHM_RING_SLOTS];
+    struct shm_wr& w = q->rq.front();
+    bool last = slot->last;
+
+    if (w.done + slot->len > w.length) {
+      __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+      complete(q->qp.recv_cq, q, w.wr_id, IBV_WC_RECV, IBV_WC_LOC_LEN_ERR, w.done);
+      q->rq.pop_front();
+      continue;
+    }
+
+    memcpy((char*)w.local_addr + w.done, slot->data, slot->len);
+    w.done += slot->len;
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+
+    if (last) {
+      complete(q->qp.recv_cq, q, w.wr_id, IBV_WC_RECV, IBV_WC_SUCCESS, w.done);
+      q->rq.pop_front();
+    }
+  }
+}
+
+/**
+ * One-sided access to the peer's memory. Like an RDMA read, this may
+ * observe a row mid-update; the guards and CRCs catch that as usual.
+ */
+bool ShmTransport::copy_remote(struct shm_qp* q, struct shm_wr& w) {
+  struct iovec local = { (void*)w.local_addr, w.length };
+  struct iovec remote = { (void*)w.remote_addr, w.length };
+  ssize_t n;
+
+  if (w.opcode == IBV_WR_RDMA_READ)
+    n = process_vm_readv(q->id->peer_pid, &local, 1, &remote, 1, 0);
+  else
+    n = process_vm_writev(q->id->peer_pid, &local, 1, &remote, 1, 0);
+
+  if (n == (ssize_t)w.length)
+    return true;
+
+  if (!warned_cma_) {
+    fprintf(stderr, "shm transport: access to memory of pid %d failed (%s); "
+                    "is ptrace access between the processes allowed?\n",
+                    (int)q->id->peer_pid, (n < 0) ? strerror(errno) : "short copy");
+    warned_cma_ = true;
+  }
+  return false;
+}
+
+/**
+ * Fail everything still on the send queue, as a QP in the error state
+ * does. Receives are dropped with the QP.
+ */
+void ShmTransport::flush(struct shm_qp* q) {
+  while (!q->sq.empty()) {
+    struct shm_wr& w = q->sq.front();
+    complete(q->qp.send_cq, q, w.wr_id, wc_opcode(w.opcode), IBV_WC_WR_FLUSH_ERR, 0);
+    q->sq.pop_front();
+  }
+}
+
+void ShmTransport::complete(struct ibv_cq* cq, struct shm_qp* q, uint64_t wr_id, enum ibv_wc_opcode opcode,
+                            enum ibv_wc_status status, uint32_t byte_len) {
+  struct ibv_wc wc;
+
+  memset(&wc, 0, sizeof(wc));
+  wc.wr_id = wr_id;
+  wc.status = status;
+  wc.opcode = opcode;
+  wc.byte_len = byte_len;
+  wc.qp_num = q->qp.qp_num;
+  ((struct shm_cq*)cq)->wcs.push_back(wc);
+}
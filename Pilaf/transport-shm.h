@@ -0,0 +1,199 @@
+#ifndef TRANSPORT_SHM_H
+#define TRANSPORT_SHM_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <deque>
+#include <vector>
+#include <set>
+#include <string>
+#include "transport.h"
+
+/**
+ * Shared-memory loopback transport, for running servers and clients on
+ * one machine without an HCA (PILAF_TRANSPORT=shm).
+ *
+ * - Connection setup goes over an abstract unix socket named after the
+ *   port; the socket stays open so either side sees the other go away.
+ * - Two-sided messages go through a pair of lock-free single-producer,
+ *   single-consumer rings in a POSIX shared memory segment created by
+ *   the connecting side. Messages larger than a ring slot are streamed
+ *   in fragments into the receiver's posted buffer.
+ * - One-sided reads and writes of the peer's registered regions use
+ *   cross memory attach (process_vm_readv/writev): the table moves on
+ *   resize and the extents grow region by region, so neither can be
+ *   placed in one fixed shared mapping, but the copy still happens
+ *   entirely in the reader, without the server's involvement.
+ *
+ * Work requests complete in order per QP, honoring IBV_SEND_SIGNALED
+ * and sq_sig_all, so the completion rules IBConn relies on hold.
+ */
+
+#define SHM_MAGIC 0x50494c41      // "PILA"
+#define SHM_SLOT_SIZE 8192
+#define SHM_RING_SLOTS 256        // 2 MB in each direction
+#define SHM_NAME_LEN 64
+#define SHM_PRIV_LEN 56
+
+struct shm_slot {
+  uint32_t len;
+  uint32_t last;      // final fragment of a message
+  char data[SHM_SLOT_SIZE - 8];
+};
+
+/**
+ * head is only written by the producer and tail only by the consumer;
+ * each publishes with a release store and reads the other's index with
+ * an acquire load.
+ */
+struct shm_ring {
+  volatile uint64_t head __attribute__((aligned(64)));
+  volatile uint64_t tail __attribute__((aligned(64)));
+  struct shm_slot slots[SHM_RING_SLOTS] __attribute__((aligned(64)));
+};
+
+struct shm_segment {
+  uint32_t magic;
+  struct shm_ring ring[2];    // [0] connector to acceptor, [1] back
+};
+
+// Exchanged once in each direction over the unix socket
+struct shm_handshake {
+  uint32_t magic;
+  int32_t accepted;           // reply only
+  pid_t pid;
+  char seg_name[SHM_NAME_LEN];
+  uint8_t private_data_len;
+  char private_data[SHM_PRIV_LEN];
+};
+
+enum shm_id_state {
+  SHM_ID_IDLE,
+  SHM_ID_BOUND,
+  SHM_ID_LISTENING,
+  SHM_ID_CONNECTING,
+  SHM_ID_REQUESTED,     // accepted socket, waiting for accept()/reject()
+  SHM_ID_CONNECTED,
+  SHM_ID_DISCONNECTED
+};
+
+struct shm_qp;
+
+struct shm_id {
+  struct rdma_cm_id id;       // first, so an rdma_cm_id* is a shm_id*
+  enum shm_id_state state;
+  int fd;
+  uint16_t port;
+  pid_t peer_pid;
+  int side;                   // ring this side produces into
+  struct shm_segment* seg;
+  char seg_name[SHM_NAME_LEN];
+  bool seg_owner;             // created the segment and has yet to unlink it
+  bool est_pending;           // ESTABLISHED not handed out yet; as with verbs, nothing is received before
+  struct shm_qp* qp;
+};
+
+struct shm_wr {
+  uint64_t wr_id;
+  int opcode;
+  bool signaled;
+  uintptr_t local_addr;
+  uint32_t length;
+  uint64_t remote_addr;
+  uint32_t done;              // bytes sent or received so far
+  std::string inline_data;    // IBV_SEND_INLINE payload, copied at post time
+};
+
+struct shm_cq {
+  struct ibv_cq cq;           // first, so an ibv_cq* is a shm_cq*
+  std::deque<struct ibv_wc> wcs;
+};
+
+struct shm_srq {
+  struct ibv_srq srq;         // first, so an ibv_srq* is a shm_srq*
+  std::deque<struct shm_wr> rq;
+};
+
+struct shm_qp {
+  struct ibv_qp qp;           // first, so an ibv_qp* is a shm_qp*
+  struct shm_id* id;
+  bool sig_all;
+  struct shm_srq* srq;        // receives come from here, if set
+  std::deque<struct shm_wr> sq;
+  std::deque<struct shm_wr> rq; // with an SRQ, the one being filled
+};
+
+struct shm_event {
+  struct rdma_cm_event event; // first, so acking can free it
+  char private_data[SHM_PRIV_LEN];
+};
+
+class ShmTransport : public Transport {
+public:
+  ShmTransport();
+  ~ShmTransport();
+  enum transport_type type(void) { return TRANSPORT_SHM; }
+  const char* name(void) { return "shm"; }
+
+  struct rdma_event_channel* create_event_channel(void);
+  int create_id(struct rdma_event_channel* channel, struct rdma_cm_id** id, void* context);
+  int destroy_id(struct rdma_cm_id* id);
+  int bind_addr(struct rdma_cm_id* id, struct sockaddr* addr);
+  int listen(struct rdma_cm_id* id, int backlog);
+  uint16_t get_src_port(struct rdma_cm_id* id);
+  int resolve_addr(struct rdma_cm_id* id, struct sockaddr* src, struct sockaddr* dst, int timeout_ms);
+  int resolve_route(struct rdma_cm_id* id, int timeout_ms);
+  int connect(struct rdma_cm_id* id, struct rdma_conn_param* params);
+  int accept(struct rdma_cm_id* id, struct rdma_conn_param* params);
+  int reject(struct rdma_cm_id* id, const void* private_data, uint8_t private_data_len);
+  int disconnect(struct rdma_cm_id* id);
+  int get_cm_event(struct rdma_event_channel* channel, struct rdma_cm_event** event);
+  int ack_cm_event(struct rdma_cm_event* event);
+
+  struct ibv_cq* create_cq(struct ibv_context* ctx, int cqe);
+  int req_notify_cq(struct ibv_cq* cq);
+  int destroy_cq(struct ibv_cq* cq);
+  int create_qp(struct rdma_cm_id* id, struct ibv_pd* pd, struct ibv_qp_init_attr* attr);
+  void destroy_qp(struct rdma_cm_id* id);
+  struct ibv_srq* create_srq(struct ibv_pd* pd, int max_wr);
+  int destroy_srq(struct ibv_srq* srq);
+  struct ibv_mr* reg_mr(struct ibv_pd* pd, void* addr, size_t length, int access);
+  int dereg_mr(struct ibv_mr* mr);
+
+  int post_send(struct ibv_qp* qp, struct ibv_send_wr* wr, struct ibv_send_wr** bad_wr);
+  int post_recv(struct ibv_qp* qp, struct ibv_recv_wr* wr, struct ibv_recv_wr** bad_wr);
+  int post_srq_recv(struct ibv_srq* srq, struct ibv_recv_wr* wr, struct ibv_recv_wr** bad_wr);
+  int poll_cq(struct ibv_cq* cq, int n, struct ibv_wc* wc);
+
+private:
+  pthread_mutex_t lock_;     // see TransportLock
+  struct ibv_pd* pd_;
+  std::vector<struct shm_id*> ids_;
+  std::vector<struct shm_qp*> qps_;
+  std::set<struct ibv_mr*> mrs_;
+  std::deque<struct shm_event*> events_;
+  struct shm_event* last_acked_;
+  uint32_t next_key_;
+  uint32_t next_qp_num_;
+  unsigned int next_seg_;
+  bool warned_cma_;
+
+  void queue_event(struct shm_id* id, enum rdma_cm_event_type type, struct shm_id* listen_id = NULL,
+                   const void* private_data = NULL, uint8_t private_data_len = 0);
+  void poll_sockets(void);
+  void on_listen_ready(struct shm_id* id);
+  void on_reply_ready(struct shm_id* id);
+  void on_peer_closed(struct shm_id* id);
+  void release_segment(struct shm_id* id);
+
+  void progress(struct shm_qp* q);
+  void progress_send(struct shm_qp* q);
+  void progress_recv(struct shm_qp* q);
+  void post_wr(std::deque<struct shm_wr>& rq, struct ibv_recv_wr* wr);
+  bool copy_remote(struct shm_qp* q, struct shm_wr& w);
+  void flush(struct shm_qp* q);
+  void complete(struct ibv_cq* cq, struct shm_qp* q, uint64_t wr_id, enum ibv_wc_opcode opcode,
+                enum ibv_wc_status status, uint32_t byte_len);
+};
+
+#endif // TRANSPORT_SHM_H
@@ -0,0 +1,1131 @@
+/***********************************************
+ *                                             *
+ * -__ /\\     ,,         /\\                  *
+ *   ||  \\  ' ||   _    ||                    *
+ *  /||__|| \\ ||  < \, =||=                   *
+ *  \||__|| || ||  /-||  ||                    *
+ *   ||  |, || || (( ||  ||                    *
+ * _-||-_/  \\ \\  \/\\  \\,                   *
+ *   ||                                        *
+ *                                             *
+ *   Pilaf Infiniband DHT                      *
+ *   (c) 2012-2013 Christopher Mitchell et al. *
+ *   New York University, Courant Institute    *
+ *   Networking and Wide-Area Systems Group    *
+ *   All rights reserved.                      *
+ *                                             *
+ *   transport-tcp.cc: TCP/epoll transport for *
+ *                     nodes without an HCA.   *
+ ***********************************************/
+
+#include "transport-tcp.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+
+static socklen_t tcp_addr_len(const struct sockaddr* addr) {
+  return (addr->sa_family == AF_INET6) ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+}
+
+static void tcp_nodelay(int fd) {
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+// Handshakes are one small message each way, so a peer that takes
+// longer than TCP_HANDSHAKE_TIMEOUT_MS to deliver one is given up on.
+static int write_full(int fd, const void* buf, size_t len) {
+  const char* p = (const char*)buf;
+  while (len) {
+    ssize_t n = write(fd, p, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 && errno == EAGAIN) {
+      struct pollfd pfd = { fd, POLLOUT, 0 };
+      if (0 >= poll(&pfd, 1, TCP_HANDSHAKE_TIMEOUT_MS))
+        return -1;
+      continue;
+    }
+    if (n <= 0)
+      return -1;
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static int read_full(int fd, void* buf, size_t len) {
+  char* p = (char*)buf;
+  while (len) {
+    ssize_t n = read(fd, p, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 && errno == EAGAIN) {
+      struct pollfd pfd = { fd, POLLIN, 0 };
+      if (0 >= poll(&pfd, 1, TCP_HANDSHAKE_TIMEOUT_MS))
+        return -1;
+      continue;
+    }
+    if (n <= 0)
+      return -1;
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static enum ibv_wc_opcode wc_opcode(int wr_opcode) {
+  switch (wr_opcode) {
+    case IBV_WR_RDMA_READ:  return IBV_WC_RDMA_READ;
+    case IBV_WR_RDMA_WRITE: return IBV_WC_RDMA_WRITE;
+    default:                return IBV_WC_SEND;
+  }
+}
+
+TcpTransport::TcpTransport() {
+  if (0 > (epfd_ = epoll_create1(EPOLL_CLOEXEC))) {
+    perror("epoll_create1");
+    exit(-1);
+  }
+  TransportLock::init(&lock_);
+  pd_ = (struct ibv_pd*)calloc(1, sizeof(struct ibv_pd));
+  next_key_ = 1;
+  next_qp_num_ = 1;
+  last_acked_ = NULL;
+}
+
+TcpTransport::~TcpTransport() {
+  while (!ids_.empty())
+    destroy_id(&ids_.back()->id);
+  for(std::set<struct ibv_mr*>::iterator it = mrs_.begin(); it != mrs_.end(); it++)
+    free(*it);
+  delete last_acked_;
+  free(pd_);
+  close(epfd_);
+}
+
+/*
+ * Connection management
+ */
+
+struct rdma_event_channel* TcpTransport::create_event_channel(void) {
+  TransportLock hold(&lock_);
+  struct rdma_event_channel* ec = (struct rdma_event_channel*)calloc(1, sizeof(struct rdma_event_channel));
+  if (ec)
+    ec->fd = -1;
+  return ec;
+}
+
+int TcpTransport::create_id(struct rdma_event_channel* channel, struct rdma_cm_id** id, void* context) {
+  TransportLock hold(&lock_);
+  struct tcp_id* s = new tcp_id();
+
+  memset(&s->id, 0, sizeof(s->id));
+  s->id.channel = channel;
+  s->id.context = context;
+  s->state = TCP_ID_IDLE;
+  s->fd = -1;
+  s->epoll_events = 0;
+  s->dst_len = 0;
+  s->qp = NULL;
+  memset(&s->hello, 0, sizeof(s->hello));
+  s->est_pending = false;
+
+  s->in_start = s->in_end = 0;
+  s->in_hdr_done = 0;
+  s->in_payload = false;
+  s->in_done = 0;
+  s->in_dest = NULL;
+  s->in_status = IBV_WC_SUCCESS;
+
+  ids_.push_back(s);
+  *id = &s->id;
+  return 0;
+}
+
+int TcpTransport::destroy_id(struct rdma_cm_id* id) {
+  TransportLock hold(&lock_);
+  struct tcp_id* s = (struct tcp_id*)id;
+
+  if (s->qp)
+    destroy_qp(id);
+  if (s->fd >= 0) {
+    watch(s, 0);
+    close(s->fd);
+  }
+
+  // Events not yet handed out would point at a dead id
+  for(std::deque<struct tcp_event*>::iterator it = events_.begin(); it != events_.end(); ) {
+    if ((*it)->event.id == id || (*it)->event.listen_id == id) {
+      delete *it;
+      it = events_.erase(it);
+    } else
+      it++;
+  }
+
+  ids_.erase(std::remove(ids_.begin(), ids_.end(), s), ids_.end());
+  delete s;
+  return 0;
+}
+
+int TcpTransport::bind_addr(struct rdma_cm_id* id, struct sockaddr* addr) {
+  TransportLock hold(&lock_);
+  struct tcp_id* s = (struct tcp_id*)id;
+  int one = 1;
+
+  if (s->state != TCP_ID_IDLE) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (0 > (s->fd = socket(addr->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)))
+    return -1;
+  setsockopt(s->fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+  if (bind(s->fd, addr, tcp_addr_len(addr))) {
+    close(s->fd);
+    s->fd = -1;
+    return -1;
+  }
+  s->state = TCP_ID_BOUND;
+  return 0;
+}
+
+int TcpTransport::listen(struct rdma_cm_id* id, int backlog) {
+  TransportLock hold(&lock_);
+  struct tcp_id* s = (struct tcp_id*)id;
+
+  if (s->state != TCP_ID_BOUND) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (::listen(s->fd, backlog))
+    return -1;
+
+  watch(s, EPOLLIN);
+  s->state = TCP_ID_LISTENING;
+  return 0;
+}
+
+uint16_t TcpTransport::get_src_port(struct rdma_cm_id* id) {
+  TransportLock hold(&lock_);
+  struct sockaddr_storage ss;
+  socklen_t len = sizeof(ss);
+
+  if (getsockname(((struct tcp_id*)id)->fd, (struct sockaddr*)&ss, &len))
+    return 0;
+  if (ss.ss_family == AF_INET6)
+    return ((struct sockaddr_in6*)&ss)->sin6_port;
+  return ((struct sockaddr_in*)&ss)->sin_port;
+}
+
+/**
+ * The caller already resolved the host name; the address is kept for
+ * connect().
+ */
+int TcpTransport::resolve_addr(struct rdma_cm_id* id, struct sockaddr* src, struct sockaddr* dst, int timeout_ms) {
+  TransportLock hold(&lock_);
+  struct tcp_id* s = (struct tcp_id*)id;
+
+  s->dst_len = tcp_addr_len(dst);
+  memcpy(&s->dst, dst, s->dst_len);
+  queue_event(s, RDMA_CM_EVENT_ADDR_RESOLVED);
+  return 0;
+}
+
+int TcpTransport::resolve_route(struct rdma_cm_id* id, int timeout_ms) {
+  TransportLock hold(&lock_);
+  queue_event((struct tcp_id*)id, RDMA_CM_EVENT_ROUTE_RESOLVED);
+  return 0;
+}
+
+/**
+ * Start a non-blocking connect; the hello goes out once it completes
+ * (on_connect_done()). A refused connection is reported as a
+ * rejection, as rdma_cm does.
+ */
+int TcpTransport::connect(struct rdma_cm_id* id, struct rdma_conn_param* params) {
+  TransportLock hold(&lock_);
+  struct tcp_id* s = (struct tcp_id*)id;
+
+  if (s->state != TCP_ID_IDLE || s->qp == NULL || s->dst_len == 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  memset(&s->hello, 0, sizeof(s->hello));
+  s->hello.magic = TCP_MAGIC;
+  if (params && params->private_data_len) {
+    s->hello.private_data_len = std::min((int)params->private_data_len, TCP_PRIV_LEN);
+    memcpy(s->hello.private_data, params->private_data, s->hello.private_data_len);
+  }
+
+  if (0 > (s->fd = socket(s->dst.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)))
+    return -1;
+  tcp_nodelay(s->fd);
+
+  if (::connect(s->fd, (struct sockaddr*)&s->dst, s->dst_len) && errno != EINPROGRESS) {
+    close(s->fd);
+    s->fd = -1;
+    queue_event(s, RDMA_CM_EVENT_REJECTED);
+    return 0;
+  }
+
+  watch(s, EPOLLOUT);
+  s->state = TCP_ID_CONNECTING;
+  return 0;
+}
+
+int TcpTransport::accept(struct rdma_cm_id* id, struct rdma_conn_param* params) {
+  TransportLock hold(&lock_);
+  struct tcp_id* s = (struct tcp_id*)id;
+  struct tcp_handshake reply;
+
+  if (s->state != TCP_ID_REQUESTED || s->qp == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  memset(&reply, 0, sizeof(reply));
+  reply.magic = TCP_MAGIC;
+  reply.accepted = 1;
+  if (write_full(s->fd, &reply, sizeof(reply)))
+    return -1;
+
+  s->state = TCP_ID_CONNECTED;
+  s->est_pending = true;
+  watch(s, EPOLLIN);
+  queue_event(s, RDMA_CM_EVENT_ESTABLISHED);
+  return 0;
+}
+
+int TcpTransport::reject(struct rdma_cm_id* id, const void* private_data, uint8_t private_data_len) {
+  TransportLock hold(&lock_);
+  struct tcp_id* s = (struct tcp_id*)id;
+  struct tcp_handshake reply;
+
+  if (s->state != TCP_ID_REQUESTED) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  memset(&reply, 0, sizeof(reply));
+  reply.magic = TCP_MAGIC;
+  reply.accepted = 0;
+  reply.private_data_len = std::min((int)private_data_len, TCP_PRIV_LEN);
+  if (private_data)
+    memcpy(reply.private_data, private_data, reply.private_data_len);
+  write_full(s->fd, &reply, sizeof(reply));
+
+  close(s->fd);
+  s->fd = -1;
+  s->state = TCP_ID_IDLE;
+  return 0;
+}
+
+/**
+ * Like rdma_disconnect(), both ends get RDMA_CM_EVENT_DISCONNECTED.
+ */
+int TcpTransport::disconnect(struct rdma_cm_id* id) {
+  TransportLock hold(&lock_);
+  struct tcp_id* s = (struct tcp_id*)id;
+
+  if (s->state != TCP_ID_CONNECTED) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  shutdown(s->fd, SHUT_RDWR);
+  on_peer_closed(s);
+  return 0;
+}
+
+int TcpTransport::get_cm_event(struct rdma_event_channel* channel, struct rdma_cm_event** event) {
+  TransportLock hold(&lock_);
+  if (events_.empty())
+    poll_sockets();
+
+  if (events_.empty()) {
+    errno = EAGAIN;
+    return -1;
+  }
+
+  *event = &events_.front()->event;
+  events_.pop_front();
+
+  // Frames that arrived ahead of the event are read now
+  struct tcp_id* s = (struct tcp_id*)(*event)->id;
+  if ((*event)->event == RDMA_CM_EVENT_ESTABLISHED && s->est_pending) {
+    s->est_pending = false;
+    if (s->state == TCP_ID_CONNECTED && s->qp)
+      read_in(s);
+  }
+  return 0;
+}
+
+/**
+ * IBConnManager copies the event and acks it before running the
+ * handlers, which still read the private data it points to, so an
+ * event is only freed when the next one is acked.
+ */
+int TcpTransport::ack_cm_event(struct rdma_cm_event* event) {
+  TransportLock hold(&lock_);
+  delete last_acked_;
+  last_acked_ = (struct tcp_event*)event;
+  return 0;
+}
+
+void TcpTransport::queue_event(struct tcp_id* id, enum rdma_cm_event_type type, struct tcp_id* listen_id,
+                               const void* private_data, uint8_t private_data_len) {
+  struct tcp_event* e = new tcp_event();
+
+  memset(e, 0, sizeof(*e));
+  e->event.id = &id->id;
+  e->event.listen_id = listen_id ? &listen_id->id : NULL;
+  e->event.event = type;
+  if (private_data_len) {
+    memcpy(e->private_data, private_data, private_data_len);
+    e->event.param.conn.private_data = e->private_data;
+    e->event.param.conn.private_data_len = private_data_len;
+  }
+  events_.push_back(e);
+}
+
+/**
+ * Set the epoll interest of a socket; 0 removes it.
+ */
+void TcpTransport::watch(struct tcp_id* s, uint32_t events) {
+  struct epoll_event ev;
+
+  if (s->epoll_events == events)
+    return;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = events;
+  ev.data.ptr = s;
+  if (events == 0)
+    epoll_ctl(epfd_, EPOLL_CTL_DEL, s->fd, &ev);
+  else
+    epoll_ctl(epfd_, s->epoll_events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, s->fd, &ev);
+  s->epoll_events = events;
+}
+
+/**
+ * One pass of the event loop, without blocking: accept and finish
+ * connections, read and dispatch arrived frames, and resume output
+ * that filled the socket buffer.
+ */
+void TcpTransport::poll_sockets(void) {
+  struct epoll_event evs[TCP_EPOLL_EVENTS];
+  int n = epoll_wait(epfd_, evs, TCP_EPOLL_EVENTS, 0);
+
+  for(int i = 0; i < n; i++) {
+    struct tcp_id* s = (struct tcp_id*)evs[i].data.ptr;
+
+    switch (s->state) {
+      case TCP_ID_LISTENING:
+        on_listen_ready(s);
+        break;
+      case TCP_ID_CONNECTING:
+        on_connect_done(s);
+        break;
+      case TCP_ID_HELLO_SENT:
+        on_reply_ready(s);
+        break;
+      case TCP_ID_CONNECTED:
+        if (evs[i].events & EPOLLOUT)
+          flush_out(s);
+        if (evs[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+          read_in(s);
+        break;
+      default:
+        break;
+    }
+  }
+}
+
+void TcpTransport::on_listen_ready(struct tcp_id* ls) {
+  struct tcp_handshake hello;
+  int fd;
+
+  while (0 <= (fd = accept4(ls->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC))) {
+    if (read_full(fd, &hello, sizeof(hello)) || hello.magic != TCP_MAGIC) {
+      close(fd);
+      continue;
+    }
+    tcp_nodelay(fd);
+
+    struct rdma_cm_id* id;
+    create_id(ls->id.channel, &id, ls->id.context);
+    struct tcp_id* s = (struct tcp_id*)id;
+    s->state = TCP_ID_REQUESTED;
+    s->fd = fd;
+
+    queue_event(s, RDMA_CM_EVENT_CONNECT_REQUEST, ls, hello.private_data,
+                std::min((int)hello.private_data_len, TCP_PRIV_LEN));
+  }
+}
+
+void TcpTransport::on_connect_done(struct tcp_id* s) {
+  int err = 0;
+  socklen_t len = sizeof(err);
+
+  if (getsockopt(s->fd, SOL_SOCKET, SO_ERROR, &err, &len) || err ||
+      write_full(s->fd, &s->hello, sizeof(s->hello)))
+  {
+    watch(s, 0);
+    close(s->fd);
+    s->fd = -1;
+    s->state = TCP_ID_IDLE;
+    queue_event(s, RDMA_CM_EVENT_REJECTED);
+    return;
+  }
+
+  watch(s, EPOLLIN);
+  s->state = TCP_ID_HELLO_SENT;
+}
+
+void TcpTransport::on_reply_ready(struct tcp_id* s) {
+  struct tcp_handshake reply;
+
+  memset(&reply, 0, sizeof(reply));
+  if (read_full(s->fd, &reply, sizeof(reply)) || reply.magic != TCP_MAGIC || !reply.accepted) {
+    bool answered = (reply.magic == TCP_MAGIC);
+    watch(s, 0);
+    close(s->fd);
+    s->fd = -1;
+    s->state = TCP_ID_IDLE;
+    if (answered)
+      queue_event(s, RDMA_CM_EVENT_REJECTED, NULL, reply.private_data,
+                  std::min((int)reply.private_data_len, TCP_PRIV_LEN));
+    else
+      queue_event(s, RDMA_CM_EVENT_REJECTED);
+    return;
+  }
+
+  s->state = TCP_ID_CONNECTED;
+  s->est_pending = true;
+  queue_event(s, RDMA_CM_EVENT_ESTABLISHED);
+  flush_out(s);
+}
+
+void TcpTransport::on_peer_closed(struct tcp_id* s) {
+  if (s->state == TCP_ID_DISCONNECTED)
+    return;
+
+  s->state = TCP_ID_DISCONNECTED;
+  watch(s, 0);
+  s->out.clear();
+  if (s->qp)
+    flush(s->qp);
+  queue_event(s, RDMA_CM_EVENT_DISCONNECTED);
+}
+
+/*
+ * Queues and memory
+ */
+
+struct ibv_cq* TcpTransport::create_cq(struct ibv_context* ctx, int cqe) {
+  TransportLock hold(&lock_);
+  struct tcp_cq* c = new tcp_cq();
+
+  memset(&c->cq, 0, sizeof(c->cq));
+  c->cq.context = ctx;
+  c->cq.cqe = cqe;
+  return &c->cq;
+}
+
+int TcpTransport::req_notify_cq(struct ibv_cq* cq) {
+  TransportLock hold(&lock_);
+  return 0;
+}
+
+int TcpTransport::destroy_cq(struct ibv_cq* cq) {
+  TransportLock hold(&lock_);
+  for(size_t i = 0; i < ids_.size(); i++) {
+    struct tcp_qp* q = ids_[i]->qp;
+    if (q && (q->qp.send_cq == cq || q->qp.recv_cq == cq)) {
+      errno = EBUSY;
+      return EBUSY;
+    }
+  }
+  delete (struct tcp_cq*)cq;
+  return 0;
+}
+
+int TcpTransport::create_qp(struct rdma_cm_id* id, struct ibv_pd* pd, struct ibv_qp_init_attr* attr) {
+  TransportLock hold(&lock_);
+  struct tcp_id* s = (struct tcp_id*)id;
+  struct tcp_qp* q;
+
+  if (s->qp) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  q = new tcp_qp();
+  memset(&q->qp, 0, sizeof(q->qp));
+  q->qp.pd = pd ? pd : pd_;
+  q->qp.send_cq = attr->send_cq;
+  q->qp.recv_cq = attr->recv_cq;
+  q->qp.qp_context = attr->qp_context;
+  q->qp.qp_num = next_qp_num_++;
+  q->qp.qp_type = attr->qp_type;
+  q->qp.state = IBV_QPS_RTS;
+  q->qp.srq = attr->srq;
+  q->id = s;
+  q->sig_all = attr->sq_sig_all;
+  q->srq = (struct tcp_srq*)attr->srq;
+  q->next_tag = 1;
+
+  s->qp = q;
+  s->in.resize(TCP_IN_BUF_SIZE);
+  id->qp = &q->qp;
+  id->pd = q->qp.pd;
+  return 0;
+}
+
+/**
+ * Completions of the QP still sitting in its CQs go with it, as with
+ * verbs providers, so they are never handed out for a dead connection.
+ * So do its unsent frames, which point into its work requests.
+ */
+void TcpTransport::destroy_qp(struct rdma_cm_id* id) {
+  TransportLock hold(&lock_);
+  struct tcp_id* s = (struct tcp_id*)id;
+  struct tcp_qp* q = s->qp;
+
+  if (q == NULL)
+    return;
+
+  struct ibv_cq* cqs[2] = { q->qp.send_cq, q->qp.recv_cq };
+  for(int i = 0; i < 2; i++) {
+    if (cqs[i] == NULL || (i == 1 && cqs[1] == cqs[0]))
+      continue;
+    std::deque<struct ibv_wc>& wcs = ((struct tcp_cq*)cqs[i])->wcs;
+    for(std::deque<struct ibv_wc>::iterator it = wcs.begin(); it != wcs.end(); ) {
+      if (it->qp_num == q->qp.qp_num)
+        it = wcs.erase(it);
+      else
+        it++;
+    }
+  }
+
+  // A receive claimed from the SRQ but not filled goes back to it
+  if (q->srq) {
+    for(; !q->rq.empty(); q->rq.pop_back())
+      q->srq->rq.push_front(q->rq.back());
+  }
+
+  s->out.clear();
+  delete q;
+  s->qp = NULL;
+  id->qp = NULL;
+}
+
+struct ibv_srq* TcpTransport::create_srq(struct ibv_pd* pd, int max_wr) {
+  TransportLock hold(&lock_);
+  struct tcp_srq* r = new tcp_srq();
+
+  memset(&r->srq, 0, sizeof(r->srq));
+  r->srq.pd = pd ? pd : pd_;
+  return &r->srq;
+}
+
+int TcpTransport::destroy_srq(struct ibv_srq* srq) {
+  TransportLock hold(&lock_);
+  for(size_t i = 0; i < ids_.size(); i++) {
+    if (ids_[i]->qp && ids_[i]->qp->srq == (struct tcp_srq*)srq) {
+      errno = EBUSY;
+      return EBUSY;
+    }
+  }
+  delete (struct tcp_srq*)srq;
+  return 0;
+}
+
+/**
+ * Regions need no pinning or translation; the MR describes the range
+ * the peer may read and write.
+ */
+struct ibv_mr* TcpTransport::reg_mr(struct ibv_pd* pd, void* addr, size_t length, int access) {
+  TransportLock hold(&lock_);
+  struct ibv_mr* mr = (struct ibv_mr*)calloc(1, sizeof(struct ibv_mr));
+
+  if (mr == NULL)
+    return NULL;
+  mr->pd = pd;
+  mr->addr = addr;
+  mr->length = length;
+  mr->handle = next_key_;
+  mr->lkey = mr->rkey = next_key_++;
+  mrs_.insert(mr);
+  return mr;
+}
+
+// Copies of an MR (as kept by IBConnManager::set_mr) are ignored
+int TcpTransport::dereg_mr(struct ibv_mr* mr) {
+  TransportLock hold(&lock_);
+  if (mrs_.erase(mr))
+    free(mr);
+  return 0;
+}
+
+bool TcpTransport::local_region(uint64_t addr, uint32_t len) {
+  for(std::set<struct ibv_mr*>::iterator it = mrs_.begin(); it != mrs_.end(); it++) {
+    uint64_t start = (uintptr_t)(*it)->addr;
+    if (addr >= start && addr - start <= (*it)->length && len <= (*it)->length - (addr - start))
+      return true;
+  }
+  return false;
+}
+
+/*
+ * Data path
+ */
+
+struct tcp_out& TcpTransport::queue_out(struct tcp_id* s, uint32_t type, uint32_t len, uint64_t addr,
+                                        uint64_t tag, const char* data, struct tcp_wr* wr) {
+  s->out.push_back(tcp_out());
+  struct tcp_out& o = s->out.back();
+
+  memset(&o.hdr, 0, sizeof(o.hdr));
+  o.hdr.type = type;
+  o.hdr.len = len;
+  o.hdr.addr = addr;
+  o.hdr.tag = tag;
+  o.data = data;
+  o.done = 0;
+  o.wr = wr;
+  return o;
+}
+
+/**
+ * Turn each work request into a frame behind whatever is already
+ * queued, then write out as much as the socket takes.
+ */
+int TcpTransport::post_send(struct ibv_qp* qp, struct ibv_send_wr* wr, struct ibv_send_wr** bad_wr) {
+  TransportLock hold(&lock_);
+  struct tcp_qp* q = (struct tcp_qp*)qp;
+  struct tcp_id* s = q->id;
+
+  for(; wr != NULL; wr = wr->next) {
+    if (wr->num_sge > 1 || (wr->opcode != IBV_WR_SEND && wr->opcode != IBV_WR_RDMA_READ &&
+                            wr->opcode != IBV_WR_RDMA_WRITE))
+    {
+      *bad_wr = wr;
+      errno = EINVAL;
+      return EINVAL;
+    }
+
+    q->sq.push_back(tcp_wr());
+    struct tcp_wr& w = q->sq.back();
+    w.wr_id = wr->wr_id;
+    w.opcode = wr->opcode;
+    w.signaled = q->sig_all || (wr->send_flags & IBV_SEND_SIGNALED);
+    w.local_addr = wr->num_sge ? wr->sg_list[0].addr : 0;
+    w.length = wr->num_sge ? wr->sg_list[0].length : 0;
+    w.remote_addr = wr->wr.rdma.remote_addr;
+    w.tag = q->next_tag++;
+    w.finished = false;
+    w.status = IBV_WC_SUCCESS;
+
+    if (s->state == TCP_ID_DISCONNECTED)
+      continue;
+
+    if (w.opcode == IBV_WR_SEND) {
+      if (wr->send_flags & IBV_SEND_INLINE)
+        w.inline_data.assign((const char*)w.local_addr, w.length);
+      queue_out(s, TCP_FRAME_SEND, w.length, 0, w.tag,
+                w.inline_data.empty() ? (const char*)w.local_addr : w.inline_data.data(), &w);
+    } else if (w.opcode == IBV_WR_RDMA_READ) {
+      queue_out(s, TCP_FRAME_READ, 0, w.remote_addr, w.tag, NULL, NULL).hdr.read_len = w.length;
+    } else {
+      queue_out(s, TCP_FRAME_WRITE, w.length, w.remote_addr, w.tag, (const char*)w.local_addr, NULL);
+    }
+  }
+
+  if (s->state == TCP_ID_DISCONNECTED)
+    flush(q);
+  else
+    flush_out(s);
+  return 0;
+}
+
+int TcpTransport::post_recv(struct ibv_qp* qp, struct ibv_recv_wr* wr, struct ibv_recv_wr** bad_wr) {
+  TransportLock hold(&lock_);
+  struct tcp_qp* q = (struct tcp_qp*)qp;
+
+  for(; wr != NULL; wr = wr->next) {
+    if (wr->num_sge != 1) {
+      *bad_wr = wr;
+      errno = EINVAL;
+      return EINVAL;
+    }
+
+    post_wr(q->rq, wr);
+  }
+
+  // A frame may be waiting for exactly this receive
+  if (q->id->state == TCP_ID_CONNECTED)
+    read_in(q->id);
+  return 0;
+}
+
+int TcpTransport::post_srq_recv(struct ibv_srq* srq, struct ibv_recv_wr* wr, struct ibv_recv_wr** bad_wr) {
+  TransportLock hold(&lock_);
+  struct tcp_srq* r = (struct tcp_srq*)srq;
+
+  for(; wr != NULL; wr = wr->next) {
+    if (wr->num_sge != 1) {
+      *bad_wr = wr;
+      errno = EINVAL;
+      return EINVAL;
+    }
+    post_wr(r->rq, wr);
+  }
+
+  for(size_t i = 0; i < ids_.size(); i++) {
+    struct tcp_id* s = ids_[i];
+    if (s->state == TCP_ID_CONNECTED && s->qp && s->qp->srq == r)
+      read_in(s);
+  }
+  return 0;
+}
+
+void TcpTransport::post_wr(std::deque<struct tcp_wr>& rq, struct ibv_recv_wr* wr) {
+  rq.push_back(tcp_wr());
+  struct tcp_wr& w = rq.back();
+  w.wr_id = wr->wr_id;
+  w.opcode = 0;
+  w.signaled = true;
+  w.local_addr = wr->sg_list[0].addr;
+  w.length = wr->sg_list[0].length;
+  w.remote_addr = 0;
+  w.tag = 0;
+  w.finished = false;
+  w.status = IBV_WC_SUCCESS;
+}
+
+/**
+ * Polling a CQ runs the event loop whenever the CQ has nothing to hand
+ * out.
+ */
+int TcpTransport::poll_cq(struct ibv_cq* cq, int n, struct ibv_wc* wc) {
+  struct tcp_cq* c = (struct tcp_cq*)cq;
+  int got = 0;
+
+  {
+    TransportLock hold(&lock_);
+
+    if (c->wcs.empty())
+      poll_sockets();
+
+    while (got < n && !c->wcs.empty()) {
+      wc[got++] = c->wcs.front();
+      c->wcs.pop_front();
+    }
+  }
+
+  // Both ends busy-poll; on a host with fewer cores than processes the
+  // peer (and the loopback path into it) needs this CPU to answer.
+  if (got == 0)
+    sched_yield();
+  return got;
+}
+
+/**
+ * Write queued frames with as few writev() calls as the socket allows.
+ * Sends complete once written, as they do once on the wire with
+ * verbs; reads and writes wait for the peer's answer.
+ */
+void TcpTransport::flush_out(struct tcp_id* s) {
+  bool blocked = false;
+
+  while (s->state == TCP_ID_CONNECTED && !s->out.empty() && !blocked) {
+    struct iovec iov[TCP_MAX_IOV];
+    int n = 0;
+
+    for(std::deque<struct tcp_out>::iterator it = s->out.begin();
+        it != s->out.end() && n + 2 <= TCP_MAX_IOV; it++)
+    {
+      if (it->done < sizeof(it->hdr)) {
+        iov[n].iov_base = (char*)&it->hdr + it->done;
+        iov[n++].iov_len = sizeof(it->hdr) - it->done;
+      }
+      size_t sent = (it->done > sizeof(it->hdr)) ? it->done - sizeof(it->hdr) : 0;
+      if (it->hdr.len > sent) {
+        iov[n].iov_base = (char*)it->data + sent;
+        iov[n++].iov_len = it->hdr.len - sent;
+      }
+    }
+
+    ssize_t written = writev(s->fd, iov, n);
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN) {
+        blocked = true;
+        continue;
+      }
+      on_peer_closed(s);
+      return;
+    }
+
+    size_t left = written;
+    while (!s->out.empty()) {
+      struct tcp_out& o = s->out.front();
+      size_t total = sizeof(o.hdr) + o.hdr.len;
+      size_t take = std::min(left, total - o.done);
+
+      o.done += take;
+      left -= take;
+      if (o.done < total)
+        break;
+      if (o.wr)
+        o.wr->finished = true;
+      s->out.pop_front();
+    }
+  }
+
+  // A full socket buffer resumes from poll_sockets()
+  if (s->state == TCP_ID_CONNECTED)
+    watch(s, blocked ? (EPOLLIN | EPOLLOUT) : EPOLLIN);
+  if (s->qp)
+    retire(s->qp);
+}
+
+/**
+ * Read whatever has arrived and dispatch complete frames. Large
+ * payloads bypass the staging buffer and land where they belong.
+ */
+void TcpTransport::read_in(struct tcp_id* s) {
+  if (s->est_pending)
+    return;
+
+  for(;;) {
+    parse_in(s);
+    if (s->state != TCP_ID_CONNECTED || s->qp == NULL)
+      break;
+
+    if (s->in_start == s->in_end) {
+      s->in_start = s->in_end = 0;
+    } else if (s->in_start > 0) {
+      memmove(&s->in[0], &s->in[s->in_start], s->in_end - s->in_start);
+      s->in_end -= s->in_start;
+      s->in_start = 0;
+    }
+    if (s->in_end == s->in.size())
+      break;    // waiting on a posted receive
+
+    char* dest = &s->in[s->in_end];
+    size_t room = s->in.size() - s->in_end;
+    bool direct = (s->in_payload && s->in_dest != NULL && s->in_end == 0 &&
+                   s->in_hdr.len - s->in_done >= TCP_IN_BUF_SIZE);
+    if (direct) {
+      dest = s->in_dest + s->in_done;
+      room = s->in_hdr.len - s->in_done;
+    }
+
+    ssize_t n = read(s->fd, dest, room);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 && errno == EAGAIN)
+      break;
+    if (n <= 0) {
+      on_peer_closed(s);
+      return;
+    }
+
+    if (direct)
+      s->in_done += n;
+    else
+      s->in_end += n;
+  }
+
+  // Answers to the peer's reads and writes
+  flush_out(s);
+}
+
+void TcpTransport::parse_in(struct tcp_id* s) {
+  while (s->state == TCP_ID_CONNECTED && s->qp != NULL) {
+    if (!s->in_payload) {
+      if (s->in_hdr_done < sizeof(s->in_hdr)) {
+        size_t n = std::min(s->in_end - s->in_start, sizeof(s->in_hdr) - s->in_hdr_done);
+        memcpy((char*)&s->in_hdr + s->in_hdr_done, &s->in[s->in_start], n);
+        s->in_hdr_done += n;
+        s->in_start += n;
+        if (s->in_hdr_done < sizeof(s->in_hdr))
+          return;
+      }
+      if (!begin_frame(s))
+        return;
+      s->in_payload = true;
+      s->in_done = 0;
+    }
+
+    size_t n = std::min(s->in_end - s->in_start, (size_t)(s->in_hdr.len - s->in_done));
+    if (n && s->in_dest)
+      memcpy(s->in_dest + s->in_done, &s->in[s->in_start], n);
+    s->in_done += n;
+    s->in_start += n;
+    if (s->in_done < s->in_hdr.len)
+      return;
+
+    end_frame(s);
+    s->in_payload = false;
+    s->in_hdr_done = 0;
+  }
+}
+
+/**
+ * Decide where the payload of the frame just parsed goes. Returns
+ * false, leaving the frame for later, if it is a send and no receive
+ * is posted.
+ */
+bool TcpTransport::begin_frame(struct tcp_id* s) {
+  struct tcp_qp* q = s->qp;
+  struct tcp_frame& h = s->in_hdr;
+  struct tcp_wr* w;
+
+  s->in_dest = NULL;
+  s->in_status = IBV_WC_SUCCESS;
+
+  switch (h.type) {
+    case TCP_FRAME_SEND:
+      if (q->rq.empty()) {
+        if (q->srq == NULL || q->srq->rq.empty())
+          return false;
+        q->rq.push_back(q->srq->rq.front());
+        q->srq->rq.pop_front();
+      }
+      if (h.len > q->rq.front().length)
+        s->in_status = IBV_WC_LOC_LEN_ERR;
+      else
+        s->in_dest = (char*)q->rq.front().local_addr;
+      return true;
+
+    case TCP_FRAME_READ:
+      // Copied now: the region may be freed before the answer is written
+      if (local_region(h.addr, h.read_len)) {
+        struct tcp_out& o = queue_out(s, TCP_FRAME_READ_RESP, h.read_len, 0, h.tag, NULL, NULL);
+        o.owned.assign((const char*)(uintptr_t)h.addr, h.read_len);
+        o.data = o.owned.data();
+      } else {
+        queue_out(s, TCP_FRAME_READ_RESP, 0, 0, h.tag, NULL, NULL).hdr.status = IBV_WC_REM_ACCESS_ERR;
+      }
+      return true;
+
+    case TCP_FRAME_WRITE:
+      if (local_region(h.addr, h.len))
+        s->in_dest = (char*)(uintptr_t)h.addr;
+      else
+        s->in_status = IBV_WC_REM_ACCESS_ERR;
+      return true;
+
+    case TCP_FRAME_READ_RESP:
+      if (NULL == (w = find_wr(q, h.tag)))
+        return true;
+      if (h.status != IBV_WC_SUCCESS)
+        s->in_status = (enum ibv_wc_status)h.status;
+      else if (h.len > w->length)
+        s->in_status = IBV_WC_LOC_LEN_ERR;
+      else
+        s->in_dest = (char*)w->local_addr;
+      return true;
+
+    case TCP_FRAME_WRITE_ACK:
+      s->in_status = (enum ibv_wc_status)h.status;
+      return true;
+
+    default:
+      fprintf(stderr, "tcp transport: bad frame type %u, dropping connection\n", h.type);
+      shutdown(s->fd, SHUT_RDWR);
+      on_peer_closed(s);
+      return false;
+  }
+}
+
+void TcpTransport::end_frame(struct tcp_id* s) {
+  struct tcp_qp* q = s->qp;
+  struct tcp_frame& h = s->in_hdr;
+  struct tcp_wr* w;
+
+  switch (h.type) {
+    case TCP_FRAME_SEND:
+      complete(q->qp.recv_cq, q, q->rq.front().wr_id, IBV_WC_RECV, s->in_status,
+               (s->in_status == IBV_WC_SUCCESS) ? h.len : 0);
+      q->rq.pop_front();
+      break;
+
+    case TCP_FRAME_WRITE:
+      queue_out(s, TCP_FRAME_WRITE_ACK, 0, 0, h.tag, NULL, NULL).hdr.status = s->in_status;
+      break;
+
+    case TCP_FRAME_READ_RESP:
+    case TCP_FRAME_WRITE_ACK:
+      if (NULL != (w = find_wr(q, h.tag))) {
+        w->status = s->in_status;
+        w->finished = true;
+        retire(q);
+      }
+      break;
+  }
+}
+
+struct tcp_wr* TcpTransport::find_wr(struct tcp_qp* q, uint64_t tag) {
+  for(std::deque<struct tcp_wr>::iterator it = q->sq.begin(); it != q->sq.end(); it++) {
+    if (it->tag == tag)
+      return &*it;
+  }
+  return NULL;
+}
+
+/**
+ * Complete finished work requests from the head of the send queue, so
+ * completions come out in posting order whatever order the answers
+ * arrive in.
+ */
+void TcpTransport::retire(struct tcp_qp* q) {
+  while (!q->sq.empty() && q->sq.front().finished) {
+    struct tcp_wr& w = q->sq.front();
+    // Errors complete whether signaled or not
+    if (w.signaled || w.status != IBV_WC_SUCCESS)
+      complete(q->qp.send_cq, q, w.wr_id, wc_opcode(w.opcode), w.status, w.length);
+    q->sq.pop_front();
+  }
+}
+
+/**
+ * Fail everything still on the send queue, as a QP in the error state
+ * does. Receives are dropped with the QP.
+ */
+void TcpTransport::flush(struct tcp_qp* q) {
+  while (!q->sq.empty()) {
+    struct tcp_wr& w = q->sq.front();
+    complete(q->qp.send_cq, q, w.wr_id, wc_opcode(w.opcode), IBV_WC_WR_FLUSH_ERR, 0);
+    q->sq.pop_front();
+  }
+}
+
+void TcpTransport::complete(struct ibv_cq* cq, struct tcp_qp* q, uint64_t wr_id, enum ibv_wc_opcode opcode,
+                            enum ibv_wc_status status, uint32_t byte_len) {
+  struct ibv_wc wc;
+
+  memset(&wc, 0, sizeof(wc));
+  wc.wr_id = wr_id;
+  wc.status = status;
+  wc.opcode = opcode;
+  wc.byte_len = byte_len;
+  wc.qp_num = q->qp.qp_num;
+  ((struct tcp_cq*)cq)->wcs.push_back(wc);
+}
@@ -0,0 +1,224 @@
+#ifndef TRANSPORT_TCP_H
+#define TRANSPORT_TCP_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+#include <deque>
+#include <vector>
+#include <set>
+#include <string>
+#include "transport.h"
+
+/**
+ * TCP transport, for nodes without an HCA (PILAF_TRANSPORT=tcp). The
+ * same MSG_DHT_* messages travel as frames on one socket per
+ * connection, driven by a non-blocking epoll loop that runs whenever
+ * the CQ or the event channel is polled.
+ *
+ * - Sends go out with writev() straight from the registered buffers,
+ *   as many queued frames per call as fit, so pipelined requests from
+ *   a client (and the server's replies to them) share system calls.
+ * - Arrived frames are parsed out of one large read() and fill posted
+ *   receives in order; with no receive posted, the stream waits.
+ * - One-sided reads and writes become request frames that the peer's
+ *   transport serves from its registered regions during its own poll,
+ *   so the read modes still work, but every RDMA round trip becomes a
+ *   TCP round trip through the server. Clients therefore default to
+ *   server-mediated reads (READ_MODE_SERVER) on this transport.
+ *
+ * Work requests complete in order per QP, honoring IBV_SEND_SIGNALED
+ * and sq_sig_all, so the completion rules IBConn relies on hold.
+ * Frames are in host byte order, as are the messages they carry.
+ */
+
+#define TCP_MAGIC 0x50494c54      // "PILT"
+#define TCP_PRIV_LEN 56
+#define TCP_IN_BUF_SIZE 65536
+#define TCP_MAX_IOV 64
+#define TCP_EPOLL_EVENTS 64
+#define TCP_HANDSHAKE_TIMEOUT_MS 1000
+
+enum tcp_frame_type {
+  TCP_FRAME_SEND = 1,
+  TCP_FRAME_READ,           // request for read_len bytes at addr
+  TCP_FRAME_READ_RESP,      // the bytes, or an error status
+  TCP_FRAME_WRITE,          // len bytes for addr
+  TCP_FRAME_WRITE_ACK
+};
+
+// Precedes every message on the stream
+struct tcp_frame {
+  uint32_t type;
+  uint32_t len;             // payload bytes following the header
+  uint64_t addr;            // READ and WRITE: address in the receiver
+  uint64_t tag;             // matches a response to its request
+  uint32_t read_len;        // READ: bytes wanted
+  uint32_t status;          // responses: an ibv_wc_status
+};
+
+// Exchanged once in each direction when connecting
+struct tcp_handshake {
+  uint32_t magic;
+  int32_t accepted;         // reply only
+  uint8_t private_data_len;
+  char private_data[TCP_PRIV_LEN];
+};
+
+enum tcp_id_state {
+  TCP_ID_IDLE,
+  TCP_ID_BOUND,
+  TCP_ID_LISTENING,
+  TCP_ID_CONNECTING,        // non-blocking connect() in progress
+  TCP_ID_HELLO_SENT,        // waiting for accept()/reject() from the peer
+  TCP_ID_REQUESTED,         // accepted socket, waiting for accept()/reject()
+  TCP_ID_CONNECTED,
+  TCP_ID_DISCONNECTED
+};
+
+struct tcp_qp;
+struct tcp_wr;
+
+// One frame waiting for the socket
+struct tcp_out {
+  struct tcp_frame hdr;
+  const char* data;         // payload, owned by the WR or by this entry
+  std::string owned;        // payload copy for responses
+  size_t done;              // header and payload bytes written so far
+  struct tcp_wr* wr;        // send WR this frame carries, if any
+};
+
+struct tcp_id {
+  struct rdma_cm_id id;     // first, so an rdma_cm_id* is a tcp_id*
+  enum tcp_id_state state;
+  int fd;
+  uint32_t epoll_events;    // currently registered, 0 if none
+  struct sockaddr_storage dst;
+  socklen_t dst_len;
+  struct tcp_qp* qp;
+  struct tcp_handshake hello; // sent once connect() completes
+  bool est_pending; // ESTABLISHED not handed out yet; as with verbs, nothing is received before
+
+  std::deque<struct tcp_out> out;
+
+  std::vector<char> in;     // bytes read but not yet parsed
+  size_t in_start, in_end;
+  struct tcp_frame in_hdr;
+  size_t in_hdr_done;       // header bytes of the current frame
+  bool in_payload;          // header complete, payload under way
+  uint32_t in_done;         // payload bytes of the current frame
+  char* in_dest;            // where the payload goes, NULL to discard
+  enum ibv_wc_status in_status;
+};
+
+struct tcp_wr {
+  uint64_t wr_id;
+  int opcode;
+  bool signaled;
+  uintptr_t local_addr;
+  uint32_t length;
+  uint64_t remote_addr;
+  uint64_t tag;
+  bool finished;            // sent, or answered for READ and WRITE
+  enum ibv_wc_status status;
+  std::string inline_data;  // IBV_SEND_INLINE payload, copied at post time
+};
+
+struct tcp_cq {
+  struct ibv_cq cq;         // first, so an ibv_cq* is a tcp_cq*
+  std::deque<struct ibv_wc> wcs;
+};
+
+struct tcp_srq {
+  struct ibv_srq srq;       // first, so an ibv_srq* is a tcp_srq*
+  std::deque<struct tcp_wr> rq;
+};
+
+struct tcp_qp {
+  struct ibv_qp qp;         // first, so an ibv_qp* is a tcp_qp*
+  struct tcp_id* id;
+  bool sig_all;
+  struct tcp_srq* srq;      // receives come from here, if set
+  uint64_t next_tag;
+  std::deque<struct tcp_wr> sq;
+  std::deque<struct tcp_wr> rq; // with an SRQ, the one being filled
+};
+
+struct tcp_event {
+  struct rdma_cm_event event; // first, so acking can free it
+  char private_data[TCP_PRIV_LEN];
+};
+
+class TcpTransport : public Transport {
+public:
+  TcpTransport();
+  ~TcpTransport();
+  enum transport_type type(void) { return TRANSPORT_TCP; }
+  const char* name(void) { return "tcp"; }
+
+  struct rdma_event_channel* create_event_channel(void);
+  int create_id(struct rdma_event_channel* channel, struct rdma_cm_id** id, void* context);
+  int destroy_id(struct rdma_cm_id* id);
+  int bind_addr(struct rdma_cm_id* id, struct sockaddr* addr);
+  int listen(struct rdma_cm_id* id, int backlog);
+  uint16_t get_src_port(struct rdma_cm_id* id);
+  int resolve_addr(struct rdma_cm_id* id, struct sockaddr* src, struct sockaddr* dst, int timeout_ms);
+  int resolve_route(struct rdma_cm_id* id, int timeout_ms);
+  int connect(struct rdma_cm_id* id, struct rdma_conn_param* params);
+  int accept(struct rdma_cm_id* id, struct rdma_conn_param* params);
+  int reject(struct rdma_cm_id* id, const void* private_data, uint8_t private_data_len);
+  int disconnect(struct rdma_cm_id* id);
+  int get_cm_event(struct rdma_event_channel* channel, struct rdma_cm_event** event);
+  int ack_cm_event(struct rdma_cm_event* event);
+
+  struct ibv_cq* create_cq(struct ibv_context* ctx, int cqe);
+  int req_notify_cq(struct ibv_cq* cq);
+  int destroy_cq(struct ibv_cq* cq);
+  int create_qp(struct rdma_cm_id* id, struct ibv_pd* pd, struct ibv_qp_init_attr* attr);
+  void destroy_qp(struct rdma_cm_id* id);
+  struct ibv_srq* create_srq(struct ibv_pd* pd, int max_wr);
+  int destroy_srq(struct ibv_srq* srq);
+  struct ibv_mr* reg_mr(struct ibv_pd* pd, void* addr, size_t length, int access);
+  int dereg_mr(struct ibv_mr* mr);
+
+  int post_send(struct ibv_qp* qp, struct ibv_send_wr* wr, struct ibv_send_wr** bad_wr);
+  int post_recv(struct ibv_qp* qp, struct ibv_recv_wr* wr, struct ibv_recv_wr** bad_wr);
+  int post_srq_recv(struct ibv_srq* srq, struct ibv_recv_wr* wr, struct ibv_recv_wr** bad_wr);
+  int poll_cq(struct ibv_cq* cq, int n, struct ibv_wc* wc);
+
+private:
+  pthread_mutex_t lock_;     // see TransportLock
+  int epfd_;
+  struct ibv_pd* pd_;
+  std::vector<struct tcp_id*> ids_;
+  std::set<struct ibv_mr*> mrs_;
+  std::deque<struct tcp_event*> events_;
+  struct tcp_event* last_acked_;
+  uint32_t next_key_;
+  uint32_t next_qp_num_;
+
+  void queue_event(struct tcp_id* id, enum rdma_cm_event_type type, struct tcp_id* listen_id = NULL,
+                   const void* private_data = NULL, uint8_t private_data_len = 0);
+  void watch(struct tcp_id* id, uint32_t events);
+  void poll_sockets(void);
+  void on_listen_ready(struct tcp_id* id);
+  void on_connect_done(struct tcp_id* id);
+  void on_reply_ready(struct tcp_id* id);
+  void on_peer_closed(struct tcp_id* id);
+
+  void flush_out(struct tcp_id* id);
+  void read_in(struct tcp_id* id);
+  void parse_in(struct tcp_id* id);
+  bool begin_frame(struct tcp_id* id);
+  void end_frame(struct tcp_id* id);
+  struct tcp_wr* find_wr(struct tcp_qp* q, uint64_t tag);
+  bool local_region(uint64_t addr, uint32_t len);
+  struct tcp_out& queue_out(struct tcp_id* id, uint32_t type, uint32_t len, uint64_t addr, uint64_t tag,
+                            const char* data, struct tcp_wr* wr);
+  void retire(struct tcp_qp* q);
+  void post_wr(std::deque<struct tcp_wr>& rq, struct ibv_recv_wr* wr);
+  void flush(struct tcp_qp* q);
+  void complete(struct ibv_cq* cq, struct tcp_qp* q, uint64_t wr_id, enum ibv_wc_opcode opcode,
+                enum ibv_wc_status status, uint32_t byte_len);
+};
+
+#endif // TRANSPORT_TCP_H
@@ -0,0 +1,178 @@
+/***********************************************
+ *                                             *
+ * -__ /\\     ,,         /\\                  *
+ *   ||  \\  ' ||   _    ||                    *
+ *  /||__|| \\ ||  < \, =||=                   *
+ *  \||__|| || ||  /-||  ||                    *
+ *   ||  |, || || (( ||  ||                    *
+ * _-||-_/  \\ \\  \/\\  \\,                   *
+ *   ||                                        *
+ *                                             *
+ *   Pilaf Infiniband DHT                      *
+ *   (c) 2012-2013 Christopher Mitchell et al. *
+ *   New York University, Courant Institute    *
+ *   Networking and Wide-Area Systems Group    *
+ *   All rights reserved.                      *
+ *                                             *
+ *   transport.cc: rdma_cm/verbs transport and *
+ *                 transport selection.        *
+ ***********************************************/
+
+#include "transport.h"
+#include "transport-shm.h"
+#include "transport-tcp.h"
+#include "ib.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct rdma_event_channel* VerbsTransport::create_event_channel(void) {
+  struct rdma_event_channel* ec;
+
+  if (NULL == (ec = rdma_create_event_channel()))
+    return NULL;
+
+  // IBConnManager::poll_cq() must not block on the event channel
+  int flags = fcntl(ec->fd, F_GETFL);
+  if (fcntl(ec->fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+    rdma_destroy_event_channel(ec);
+    return NULL;
+  }
+  return ec;
+}
+
+int VerbsTransport::create_id(struct rdma_event_channel* channel, struct rdma_cm_id** id, void* context) {
+  return rdma_create_id(channel, id, context, RDMA_PS_TCP);
+}
+
+int VerbsTransport::destroy_id(struct rdma_cm_id* id) {
+  return rdma_destroy_id(id);
+}
+
+int VerbsTransport::bind_addr(struct rdma_cm_id* id, struct sockaddr* addr) {
+  return rdma_bind_addr(id, addr);
+}
+
+int VerbsTransport::listen(struct rdma_cm_id* id, int backlog) {
+  return rdma_listen(id, backlog);
+}
+
+uint16_t VerbsTransport::get_src_port(struct rdma_cm_id* id) {
+  return rdma_get_src_port(id);
+}
+
+int VerbsTransport::resolve_addr(struct rdma_cm_id* id, struct sockaddr* src, struct sockaddr* dst, int timeout_ms) {
+  return rdma_resolve_addr(id, src, dst, timeout_ms);
+}
+
+int VerbsTransport::resolve_route(struct rdma_cm_id* id, int timeout_ms) {
+  return rdma_resolve_route(id, timeout_ms);
+}
+
+int VerbsTransport::connect(struct rdma_cm_id* id, struct rdma_conn_param* params) {
+  return rdma_connect(id, params);
+}
+
+int VerbsTransport::accept(struct rdma_cm_id* id, struct rdma_conn_param* params) {
+  return rdma_accept(id, params);
+}
+
+int VerbsTransport::reject(struct rdma_cm_id* id, const void* private_data, uint8_t private_data_len) {
+  return rdma_reject(id, private_data, private_data_len);
+}
+
+int VerbsTransport::disconnect(struct rdma_cm_id* id) {
+  return rdma_disconnect(id);
+}
+
+int VerbsTransport::get_cm_event(struct rdma_event_channel* channel, struct rdma_cm_event** event) {
+  return rdma_get_cm_event(channel, event);
+}
+
+int VerbsTransport::ack_cm_event(struct rdma_cm_event* event) {
+  return rdma_ack_cm_event(event);
+}
+
+struct ibv_cq* VerbsTransport::create_cq(struct ibv_context* ctx, int cqe) {
+  return ibv_create_cq(ctx, cqe, NULL, NULL, 0);
+}
+
+int VerbsTransport::req_notify_cq(struct ibv_cq* cq) {
+  return ibv_req_notify_cq(cq, 0);
+}
+
+int VerbsTransport::destroy_cq(struct ibv_cq* cq) {
+  return ibv_destroy_cq(cq);
+}
+
+int VerbsTransport::create_qp(struct rdma_cm_id* id, struct ibv_pd* pd, struct ibv_qp_init_attr* attr) {
+  return rdma_create_qp(id, pd, attr);
+}
+
+void VerbsTransport::destroy_qp(struct rdma_cm_id* id) {
+  rdma_destroy_qp(id);
+}
+
+struct ibv_srq* VerbsTransport::create_srq(struct ibv_pd* pd, int max_wr) {
+  struct ibv_srq_init_attr attr;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.attr.max_wr = max_wr;
+  attr.attr.max_sge = 1;
+  return ibv_create_srq(pd, &attr);
+}
+
+int VerbsTransport::destroy_srq(struct ibv_srq* srq) {
+  return ibv_destroy_srq(srq);
+}
+
+struct ibv_mr* VerbsTransport::reg_mr(struct ibv_pd* pd, void* addr, size_t length, int access) {
+  return ibv_reg_mr(pd, addr, length, access);
+}
+
+int VerbsTransport::dereg_mr(struct ibv_mr* mr) {
+  return ibv_dereg_mr(mr);
+}
+
+int VerbsTransport::post_send(struct ibv_qp* qp, struct ibv_send_wr* wr, struct ibv_send_wr** bad_wr) {
+  return ibv_post_send(qp, wr, bad_wr);
+}
+
+int VerbsTransport::post_recv(struct ibv_qp* qp, struct ibv_recv_wr* wr, struct ibv_recv_wr** bad_wr) {
+  return ibv_post_recv(qp, wr, bad_wr);
+}
+
+int VerbsTransport::post_srq_recv(struct ibv_srq* srq, struct ibv_recv_wr* wr, struct ibv_recv_wr** bad_wr) {
+  return ibv_post_srq_recv(srq, wr, bad_wr);
+}
+
+int VerbsTransport::poll_cq(struct ibv_cq* cq, int n, struct ibv_wc* wc) {
+  return ibv_poll_cq(cq, n, wc);
+}
+
+void TransportLock::init(pthread_mutex_t* lock) {
+  pthread_mutexattr_t attr;
+
+  // The emulated transports call their own entry points
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(lock, &attr);
+  pthread_mutexattr_destroy(&attr);
+}
+
+Transport* transport_create(const char* name) {
+  if (name == NULL)
+    name = getenv("PILAF_TRANSPORT");
+
+  if (name == NULL || !strcmp(name, "verbs"))
+    return new VerbsTransport();
+  if (!strcmp(name, "shm"))
+    return new ShmTransport();
+  if (!strcmp(name, "tcp"))
+    return new TcpTransport();
+
+  fprintf(stderr, "Unknown transport '%s' (expected verbs, shm or tcp)\n", name);
+  die("");
+  return NULL;
+}
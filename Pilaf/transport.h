@@ -0,0 +1,128 @@
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <rdma/rdma_cma.h>
+#include <pthread.h>
+
+enum transport_type {
+  TRANSPORT_VERBS,    // rdma_cm and an InfiniBand HCA
+  TRANSPORT_SHM,      // processes on one machine, see transport-shm.h
+  TRANSPORT_TCP       // sockets, see transport-tcp.h
+};
+
+/**
+ * What IBConn and IBConnManager need from the network, in the shape of
+ * the rdma_cm and verbs calls they were written against: the backends
+ * trade the same rdma_cm_id, ibv_qp, ibv_mr, work request and work
+ * completion structures, so the connection logic above them (MR
+ * exchange, hooks, batching and selective signaling) is shared.
+ *
+ * Handles (ids, QPs, CQs, MRs) must only ever be passed back to the
+ * transport that created them.
+ */
+class Transport {
+public:
+  virtual ~Transport() {}
+  virtual enum transport_type type(void) = 0;
+  virtual const char* name(void) = 0;
+
+  // Connection management
+  virtual struct rdma_event_channel* create_event_channel(void) = 0;
+  virtual int create_id(struct rdma_event_channel* channel, struct rdma_cm_id** id, void* context) = 0;
+  virtual int destroy_id(struct rdma_cm_id* id) = 0;
+  virtual int bind_addr(struct rdma_cm_id* id, struct sockaddr* addr) = 0;
+  virtual int listen(struct rdma_cm_id* id, int backlog) = 0;
+  virtual uint16_t get_src_port(struct rdma_cm_id* id) = 0;
+  virtual int resolve_addr(struct rdma_cm_id* id, struct sockaddr* src, struct sockaddr* dst, int timeout_ms) = 0;
+  virtual int resolve_route(struct rdma_cm_id* id, int timeout_ms) = 0;
+  virtual int connect(struct rdma_cm_id* id, struct rdma_conn_param* params) = 0;
+  virtual int accept(struct rdma_cm_id* id, struct rdma_conn_param* params) = 0;
+  virtual int reject(struct rdma_cm_id* id, const void* private_data, uint8_t private_data_len) = 0;
+  virtual int disconnect(struct rdma_cm_id* id) = 0;
+
+  // Non-blocking: returns -1 with errno EAGAIN when no event is waiting
+  virtual int get_cm_event(struct rdma_event_channel* channel, struct rdma_cm_event** event) = 0;
+  virtual int ack_cm_event(struct rdma_cm_event* event) = 0;
+
+  // Queues and memory
+  virtual struct ibv_cq* create_cq(struct ibv_context* ctx, int cqe) = 0;
+  virtual int req_notify_cq(struct ibv_cq* cq) = 0;
+  virtual int destroy_cq(struct ibv_cq* cq) = 0;
+  virtual int create_qp(struct rdma_cm_id* id, struct ibv_pd* pd, struct ibv_qp_init_attr* attr) = 0;
+  virtual void destroy_qp(struct rdma_cm_id* id) = 0;
+  // Receives posted to a shared receive queue feed every QP created
+  // with it (attr->srq); a QP's own receive queue is then unused
+  virtual struct ibv_srq* create_srq(struct ibv_pd* pd, int max_wr) = 0;
+  virtual int destroy_srq(struct ibv_srq* srq) = 0;
+  virtual struct ibv_mr* reg_mr(struct ibv_pd* pd, void* addr, size_t length, int access) = 0;
+  virtual int dereg_mr(struct ibv_mr* mr) = 0;
+
+  // Data path
+  virtual int post_send(struct ibv_qp* qp, struct ibv_send_wr* wr, struct ibv_send_wr** bad_wr) = 0;
+  virtual int post_recv(struct ibv_qp* qp, struct ibv_recv_wr* wr, struct ibv_recv_wr** bad_wr) = 0;
+  virtual int post_srq_recv(struct ibv_srq* srq, struct ibv_recv_wr* wr, struct ibv_recv_wr** bad_wr) = 0;
+  virtual int poll_cq(struct ibv_cq* cq, int n, struct ibv_wc* wc) = 0;
+};
+
+/**
+ * Holds a transport's lock for a scope. Verbs calls are safe from any
+ * thread; the emulated transports only make progress inside their own
+ * calls, so taking one recursive lock at the top of each makes them
+ * just as safe to share between threads polling different CQs.
+ */
+class TransportLock {
+public:
+  TransportLock(pthread_mutex_t* lock) : lock_(lock) { pthread_mutex_lock(lock_); }
+  ~TransportLock() { pthread_mutex_unlock(lock_); }
+  static void init(pthread_mutex_t* lock);
+private:
+  pthread_mutex_t* lock_;
+};
+
+/**
+ * Plain rdma_cm and verbs.
+ */
+class VerbsTransport : public Transport {
+public:
+  enum transport_type type(void) { return TRANSPORT_VERBS; }
+  const char* name(void) { return "verbs"; }
+
+  struct rdma_event_channel* create_event_channel(void);
+  int create_id(struct rdma_event_channel* channel, struct rdma_cm_id** id, void* context);
+  int destroy_id(struct rdma_cm_id* id);
+  int bind_addr(struct rdma_cm_id* id, struct sockaddr* addr);
+  int listen(struct rdma_cm_id* id, int backlog);
+  uint16_t get_src_port(struct rdma_cm_id* id);
+  int resolve_addr(struct rdma_cm_id* id, struct sockaddr* src, struct sockaddr* dst, int timeout_ms);
+  int resolve_route(struct rdma_cm_id* id, int timeout_ms);
+  int connect(struct rdma_cm_id* id, struct rdma_conn_param* params);
+  int accept(struct rdma_cm_id* id, struct rdma_conn_param* params);
+  int reject(struct rdma_cm_id* id, const void* private_data, uint8_t private_data_len);
+  int disconnect(struct rdma_cm_id* id);
+  int get_cm_event(struct rdma_event_channel* channel, struct rdma_cm_event** event);
+  int ack_cm_event(struct rdma_cm_event* event);
+
+  struct ibv_cq* create_cq(struct ibv_context* ctx, int cqe);
+  int req_notify_cq(struct ibv_cq* cq);
+  int destroy_cq(struct ibv_cq* cq);
+  int create_qp(struct rdma_cm_id* id, struct ibv_pd* pd, struct ibv_qp_init_attr* attr);
+  void destroy_qp(struct rdma_cm_id* id);
+  struct ibv_srq* create_srq(struct ibv_pd* pd, int max_wr);
+  int destroy_srq(struct ibv_srq* srq);
+  struct ibv_mr* reg_mr(struct ibv_pd* pd, void* addr, size_t length, int access);
+  int dereg_mr(struct ibv_mr* mr);
+
+  int post_send(struct ibv_qp* qp, struct ibv_send_wr* wr, struct ibv_send_wr** bad_wr);
+  int post_recv(struct ibv_qp* qp, struct ibv_recv_wr* wr, struct ibv_recv_wr** bad_wr);
+  int post_srq_recv(struct ibv_srq* srq, struct ibv_recv_wr* wr, struct ibv_recv_wr** bad_wr);
+  int poll_cq(struct ibv_cq* cq, int n, struct ibv_wc* wc);
+};
+
+/**
+ * Build the transport named by name ("verbs", "shm" or "tcp"), or by the
+ * PILAF_TRANSPORT environment variable if name is NULL. Verbs is the
+ * default.
+ */
+Transport* transport_create(const char* name);
+
+#endif // TRANSPORT_H
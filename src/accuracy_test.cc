@@ -48,9 +48,6 @@ uint64_t gettime(){
 int main(int argc, char* argv[]){  
   ID image_id;
   BinaryCode code;
-  uint64_t n_main_reads, n_sub_reads, n_local_reads;
-  uint64_t n_main_reads_total = 0, n_sub_reads_total = 0, n_local_reads_total = 0;
-  uint32_t radius, radius_total;
 
   setup(argc, argv); 
 
@@ -75,13 +72,15 @@ int main(int argc, char* argv[]){
       coord->synchronize();
       
       uint64_t start = gettime();
-      result_app = worker.find(code, 16, k, true);
+      worker.find(code, 16, k, true);
+      result_app = worker.get_knn();
       time_app += gettime() - start;
       
       coord->synchronize();
       
       start = gettime();
-      result_exact = worker.find(code, 16, k, false);
+      worker.find(code, 16, k, false);
+      result_exact = worker.get_knn();
       time_ex += gettime() - start;
       coord->synchronize();
       
@@ -169,7 +168,7 @@ void setup(int argc, char* argv[]){
   coord = new mpi_coordinator;
   
   if(strcmp(argv[6], "pilaf") == 0)
-    proxy_clt = new PilafProxy<protobuf::Message, protobuf::Message>;
+    proxy_clt = new PilafProxy<protobuf::Message, protobuf::Message>(read_mode);
   else if(strcmp(argv[6], "memcached") == 0)
     proxy_clt = new MemcachedProxy<protobuf::Message, protobuf::Message>;
   else if(strcmp(argv[6], "redis") == 0)
@@ -177,7 +176,7 @@ void setup(int argc, char* argv[]){
   else
     mpi_coordinator::die("Unrecognized server type.");
   {
-  timer t("connect");
+  TIMED_SCOPE("connect");
   proxy_clt->init(config_path);
   }
 } 
@@ -12,6 +12,7 @@ static struct option long_options[] = {
   {"read_mode",       required_argument,  0,  'r'},
   {"ntables",         required_argument,  0,  'n'},
   {"binary_file",     required_argument,  0,  'f'},
+  {"metrics",         required_argument,  0,  'm'},
   {"help",            no_argument,        0,  'h'},
   {0,                 0,                  0,  0}
 };
@@ -24,9 +25,10 @@ const char* server = DEFAULT_SERVER;
 const char* binary_file = BINARY_CODE_FILE;
 int binary_bits = N_BINARY_BITS;
 int n_tables = DEFAULT_N_TABLES;
-int read_mode  = 0;
+int read_mode  = -1;
 int image_total = DEFAULT_IMAGE_TOTAL;
 int knn = DEFAULT_KNN;
+const char* metrics_path = 0;
 
 
 void usage(){
@@ -36,9 +38,11 @@ void usage(){
   printf("--binary_bits -b : How many bits of each binary code.\n");
   printf("--ntables -n : How many sub-tables we use.\n");
   printf("--binary_file -f : The path of the binary file. \n");
+  printf("--metrics -m : Record per-operation backend metrics and write them to this JSON file.\n");
   printf("-i : The number of images the server has.\n");
   printf("-k : Find k nearest neighbors.\n");
-  printf("-r : The read mode. 0 means RDMA_READ, 1 means verb message read. Only works when use Pilaf proxy.\n");
+  printf("-r : The read mode. 0 means RDMA_READ, 1 means verb message read, 2 means parallel RDMA_READ, 3 means adaptive.\n");
+  printf("     Defaults to the Pilaf client's choice for its transport. Only works when use Pilaf proxy.\n");
   printf("--help -h : help information.\n");
   exit(-1);
 }
@@ -47,7 +51,7 @@ void configure(int argc, char* argv[]){
   int opt_index = 0;
   int opt;
   
-  while((opt = getopt_long(argc, argv, "c:b:r:n:s:i:k:f:h", long_options, &opt_index)) != -1){
+  while((opt = getopt_long(argc, argv, "c:b:r:n:s:i:k:f:m:h", long_options, &opt_index)) != -1){
     switch(opt){
       case 0:
         fprintf(stderr, "get_opt bug?\n");
@@ -84,6 +88,10 @@ void configure(int argc, char* argv[]){
       case 'f':
         binary_file = optarg;
         break;
+
+      case 'm':
+        metrics_path = optarg;
+        break;
       
       case 'h':
         usage();
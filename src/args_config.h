@@ -10,6 +10,7 @@ extern int n_tables;
 extern int read_mode;
 extern int image_total;
 extern int knn;
+extern const char* metrics_path;
 
 void configure(int argc, char* argv[]);
 
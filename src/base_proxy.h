@@ -15,6 +15,8 @@
 template<class K, class V>
 class BaseProxy{
   public:
+    virtual ~BaseProxy() {}
+
     virtual int get(const K& key, V& value) = 0;
 
     virtual int put(const K& key, const V& value) = 0;
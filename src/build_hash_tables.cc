@@ -12,6 +12,7 @@
 #include "memcached_proxy.h"
 #include "redis_proxy.h"
 #include "pilaf_proxy.h"
+#include "metrics_proxy.h"
 #include "args_config.h"
 #include "mpi_coordinator.h"
 #include "image_search_constants.h"
@@ -84,14 +85,24 @@ int main (int argc, char *argv[]) {
   if(strcmp(server, "memcached") == 0)
     proxy_clt = new MemcachedProxy<protobuf::Message, protobuf::Message>;
   else if(strcmp(server, "pilaf") == 0)
-    proxy_clt = new PilafProxy<protobuf::Message, protobuf::Message>;
+    proxy_clt = new PilafProxy<protobuf::Message, protobuf::Message>((read_modes)read_mode);
   else  
     proxy_clt = new RedisProxy<protobuf::Message, protobuf::Message>;
+
+  MetricsProxy<protobuf::Message, protobuf::Message> *metrics_proxy = 0;
+  if(metrics_path)
+    proxy_clt = metrics_proxy = new MetricsProxy<protobuf::Message, protobuf::Message>(proxy_clt, server);
   
   proxy_clt->init(config_path);
   substr_len = binary_bits / n_tables / 8;
 
   load_binarycode(binary_file);
+
+  if(metrics_proxy){
+    FILE *f = coord->open_output(metrics_path);
+    metrics_proxy->report(coord, f);
+    coord->close_output(f);
+  }
   
   proxy_clt->close();
   mpi_coordinator::finalize();
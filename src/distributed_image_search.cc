@@ -9,6 +9,7 @@
 #include "pilaf_proxy.h"
 #include "memcached_proxy.h"
 #include "redis_proxy.h"
+#include "metrics_proxy.h"
 #include <iostream>
 #include "search_worker.h"
 #include "timer.h"
@@ -26,25 +27,36 @@ static int binary_bits;
 static bool approximate_knn;
 static int query_image_id = -1;
 static char* query_file = 0;
+static int cache_mb = 0;
+static char* metrics_path = 0;
+static char* trace_path = 0;
+static MetricsProxy<protobuf::Message, protobuf::Message>* metrics_proxy = 0;
+
+//Events kept per rank when tracing, older ones are overwritten.
+#define TRACE_CAPACITY (1 << 20)
 
 //How many rdma accesses performs
 extern uint64_t pilaf_n_rdma_read;
 
 void cleanup();
 void setup(int argc, char* argv[]);
+void dump_metrics();
 
 int main(int argc, char* argv[]){
   ID image_id;
   BinaryCode code;
-  uint64_t n_main_reads, n_sub_reads, n_local_reads;
-  uint64_t n_main_reads_total = 0, n_sub_reads_total = 0, n_local_reads_total = 0;
-  uint32_t radius, radius_total;
+  search_stat_st stat_total;
 
   setup(argc, argv);
 
   SearchWorker worker(coord, proxy_clt, image_count);
   assert(query_image_id != -1 && query_image_id < image_count);
 
+  if(cache_mb > 0)
+    worker.enable_cache((size_t)cache_mb << 20);
+  if(trace_path)
+    worker.enable_tracing(TRACE_CAPACITY);
+
   if(query_file){
     FILE* f = fopen(query_file, "r");
     if(f == 0){
@@ -56,26 +68,24 @@ int main(int argc, char* argv[]){
     char code[17];
     code[16] = '\0';
 
+    //Reduced after the timed loop so no collectives run between queries.
+    std::vector<search_stat_st> stats;
+    stats.reserve(200);
+
   {
-    timer tss("while");
+    TIMED_SCOPE("queries");
 
     while(fread(code, 16, 1, f) != 0){
 
-      list<SearchWorker::search_result_st> result = worker.find(code, 16, k, approximate_knn);
-      worker.get_stat(n_main_reads, n_sub_reads, n_local_reads, radius);
-      n_main_reads_total += n_main_reads;
-      n_local_reads_total += n_local_reads;
-      n_sub_reads_total += n_sub_reads;
-      radius_total += radius;
+      stats.push_back(worker.find(code, 16, k, approximate_knn));
     /*
       if(coord->is_master()){
 
+        list<SearchWorker::search_result_st> result = worker.get_knn();
         list<SearchWorker::search_result_st>::iterator iter = result.begin();
         //for(; iter != result.end(); ++iter)
         //  std::cout<<iter->image_id<<" : "<<iter->dist<<endl;
-        std::cout<<coord->get_rank()<<"  n_main_reads : "<<n_main_reads;
-        std::cout<<" , n_sub_reads : "<<n_sub_reads<<", ";
-        std::cout<<"n_local_reads : "<<n_local_reads<<", radius : "<<radius<<", ";
+        stat.print(stdout);
         std::cout<<"rdma : "<<pilaf_n_rdma_read<<std::endl;
       }
       */
@@ -84,12 +94,18 @@ int main(int argc, char* argv[]){
         break;
     }
   }
+    stat_total.reduce_queries(stats, coord);
+
     if(coord->is_master()){
       std::cout<<"Averate result : "<<std::endl;
-      std::cout<<coord->get_rank()<<"  n_main_reads : "<<n_main_reads_total / n_query;
-      std::cout<<" , n_sub_reads : "<<n_sub_reads_total / n_query<<", ";
-      std::cout<<"n_local_reads : "<<n_local_reads_total / n_query<<", radius : "<<radius_total / n_query<<", ";
+      stat_total.print(stdout);
       std::cout<<"rdma : "<<pilaf_n_rdma_read / n_query<<std::endl;
+
+      QueryCache* cache = worker.get_cache();
+      if(cache)
+        std::cout<<"cache hits : "<<cache->hits()<<", misses : "<<cache->misses()
+          <<", seeded : "<<cache->seeds()<<", entries : "<<cache->entries()
+          <<", bytes : "<<cache->bytes()<<std::endl;
     }
   }
   else{
@@ -100,24 +116,32 @@ int main(int argc, char* argv[]){
     std::string query_code = code.code();
     list<SearchWorker::search_result_st> result;
 
-    result = worker.find(query_code.c_str(), 16, k, approximate_knn);
-    worker.get_stat(n_main_reads, n_sub_reads, n_local_reads, radius);
+    search_stat_st stat = worker.find(query_code.c_str(), 16, k, approximate_knn);
+    stat.reduce(coord);
+    result = worker.get_knn();
 
     if(coord->is_master()){
       list<SearchWorker::search_result_st>::iterator iter = result.begin();
         for(; iter != result.end(); ++iter)
           std::cout<<iter->image_id<<" : "<<iter->dist<<endl;
 
-      std::cout<<coord->get_rank()<<"  n_main_reads : "<<n_main_reads<<" , n_sub_reads : "<<n_sub_reads<<", ";
-      std::cout<<"n_local_reads : "<<n_local_reads<<", radius : "<<radius<<", ";
+      stat.print(stdout);
       std::cout<<"rdma : "<<pilaf_n_rdma_read<<std::endl;
     }
     */
     mpi_coordinator::die("The version without main table doesn't support query by id.\n");
   }
 
-  //if(coord->is_master())
-  timer::show_all_timings();
+  timer::show_all_timings(coord);
+
+  if(metrics_proxy)
+    dump_metrics();
+
+  if(trace_path){
+    FILE* f = coord->open_output(trace_path);
+    worker.dump_trace(f);
+    coord->close_output(f);
+  }
 
   cleanup();
   return 0;
@@ -137,6 +161,13 @@ void cleanup(){
   mpi_coordinator::finalize();
 }
 
+//Reduce backend metrics across ranks and write them as JSON from the master.
+void dump_metrics(){
+  FILE* f = coord->open_output(metrics_path);
+  metrics_proxy->report(coord, f);
+  coord->close_output(f);
+}
+
 //Set up code. The arguments should be passed by bootstrap script(run_distributed_search.py)
 void setup(int argc, char* argv[]){
   if(argc < 10)
@@ -151,22 +182,31 @@ void setup(int argc, char* argv[]){
   approximate_knn = atoi(argv[8]);
   query_image_id = atoi(argv[9]);
 
-  if(argc == 11)
+  if(argc >= 11)
     query_file = argv[10];
+  if(argc >= 12)
+    cache_mb = atoi(argv[11]);
+  if(argc >= 13 && strcmp(argv[12], "none") != 0)
+    metrics_path = argv[12];
+  if(argc >= 14 && strcmp(argv[13], "none") != 0)
+    trace_path = argv[13];
 
   mpi_coordinator::init(argc, argv);
   coord = new mpi_coordinator;
 
   if(strcmp(argv[6], "pilaf") == 0)
-    proxy_clt = new PilafProxy<protobuf::Message, protobuf::Message>;
+    proxy_clt = new PilafProxy<protobuf::Message, protobuf::Message>(read_mode);
   else if(strcmp(argv[6], "memcached") == 0)
     proxy_clt = new MemcachedProxy<protobuf::Message, protobuf::Message>;
   else if(strcmp(argv[6], "redis") == 0)
     proxy_clt = new RedisProxy<protobuf::Message, protobuf::Message>;
   else
     mpi_coordinator::die("Unrecognized server type.");
+
+  if(metrics_path)
+    proxy_clt = metrics_proxy = new MetricsProxy<protobuf::Message, protobuf::Message>(proxy_clt, argv[6]);
   {
-  timer t("connect");
+  TIMED_SCOPE("connect");
   proxy_clt->init(config_path);
   }
 }
@@ -0,0 +1,90 @@
+#include "latency_histogram.h"
+#include "mpi_coordinator.h"
+#include <time.h>
+
+#define CALIBRATE_NS 10000000 //10 ms
+
+static uint64_t monotonic_ns(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static double calibrate_tsc(){
+  uint64_t start_ns = monotonic_ns();
+  uint64_t start_tsc = read_tsc();
+  uint64_t end_ns;
+
+  do{
+    end_ns = monotonic_ns();
+  }while(end_ns - start_ns < CALIBRATE_NS);
+
+  return (double)(read_tsc() - start_tsc) / (end_ns - start_ns);
+}
+
+double tsc_ticks_per_ns(){
+  static double ticks_per_ns = calibrate_tsc();
+  return ticks_per_ns;
+}
+
+void LatencyHistogram::merge(const LatencyHistogram &h){
+  for(int i = 0; i < HIST_BUCKETS; i++)
+    buckets_[i] += h.buckets_[i];
+  count_ += h.count_;
+  sum_ += h.sum_;
+  if(h.count_ && h.min_ < min_) min_ = h.min_;
+  if(h.max_ > max_) max_ = h.max_;
+}
+
+uint64_t LatencyHistogram::percentile(double p) const{
+  if(count_ == 0)
+    return 0;
+
+  uint64_t rank = (uint64_t)(p / 100 * count_);
+  if(rank >= count_)
+    rank = count_ - 1;
+
+  uint64_t seen = 0;
+  for(int i = 0; i < HIST_BUCKETS; i++){
+    seen += buckets_[i];
+    if(seen > rank)
+      return bucket_low(i);
+  }
+  return max_;
+}
+
+void LatencyHistogram::dump_json(FILE *f) const{
+  fprintf(f, "{\"count\": %llu, \"mean_ns\": %.1f, \"min_ns\": %llu, \"max_ns\": %llu, "
+      "\"p50_ns\": %llu, \"p90_ns\": %llu, \"p99_ns\": %llu, \"p999_ns\": %llu, \"buckets\": [",
+      (unsigned long long)count_, mean(), (unsigned long long)min(), (unsigned long long)max_,
+      (unsigned long long)percentile(50), (unsigned long long)percentile(90),
+      (unsigned long long)percentile(99), (unsigned long long)percentile(99.9));
+
+  bool first = true;
+  for(int i = 0; i < HIST_BUCKETS; i++){
+    if(buckets_[i] == 0)
+      continue;
+    fprintf(f, "%s[%llu, %llu]", first ? "" : ", ",
+        (unsigned long long)bucket_low(i), (unsigned long long)buckets_[i]);
+    first = false;
+  }
+  fprintf(f, "]}");
+}
+
+void reduce_histogram(mpi_coordinator *coord, LatencyHistogram &h){
+  uint64_t buckets[HIST_BUCKETS];
+  uint64_t summary[2] = {h.count(), h.sum()};
+  uint64_t summary_total[2];
+  uint64_t lo = h.count() ? h.min() : UINT64_MAX, lo_total;
+  uint64_t hi = h.max(), hi_total;
+
+  coord->reduce(h.buckets(), buckets, HIST_BUCKETS);
+  coord->reduce(summary, summary_total, 2);
+  coord->reduce(&lo, &lo_total, 1, MPI_MIN);
+  coord->reduce(&hi, &hi_total, 1, MPI_MAX);
+
+  if(coord->is_master()){
+    memcpy(h.buckets(), buckets, sizeof(buckets));
+    h.set_summary(summary_total[0], summary_total[1], lo_total, hi_total);
+  }
+}
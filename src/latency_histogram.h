@@ -0,0 +1,99 @@
+// Low-overhead latency recording: TSC timestamps and a log-linear histogram.
+// Values below 2^HIST_SUB_BITS ns get one bucket each; above that every power
+// of two is split into 2^HIST_SUB_BITS linear buckets (~12% resolution).
+
+#ifndef LATENCY_HISTOGRAM_H
+#define LATENCY_HISTOGRAM_H
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+class mpi_coordinator;
+
+#define HIST_SUB_BITS 3
+#define HIST_MAX_BITS 40   //~18 minutes in ns, larger values land in the last bucket
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+inline uint64_t read_tsc(){
+  uint32_t lo, hi;
+  __asm__ volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+  return ((uint64_t)hi << 32) | lo;
+}
+
+//TSC ticks per nanosecond, calibrated against CLOCK_MONOTONIC_RAW on first use.
+double tsc_ticks_per_ns();
+
+inline uint64_t tsc_to_ns(uint64_t ticks){
+  return (uint64_t)(ticks / tsc_ticks_per_ns());
+}
+
+class LatencyHistogram{
+  public:
+    LatencyHistogram() { reset(); }
+
+    void reset(){
+      memset(buckets_, 0, sizeof(buckets_));
+      count_ = 0;
+      sum_ = 0;
+      min_ = UINT64_MAX;
+      max_ = 0;
+    }
+
+    void record(uint64_t ns){
+      buckets_[bucket_of(ns)]++;
+      count_++;
+      sum_ += ns;
+      if(ns < min_) min_ = ns;
+      if(ns > max_) max_ = ns;
+    }
+
+    void merge(const LatencyHistogram &h);
+
+    uint64_t count() const { return count_; }
+    uint64_t sum() const { return sum_; }
+    uint64_t min() const { return count_ ? min_ : 0; }
+    uint64_t max() const { return max_; }
+    double mean() const { return count_ ? (double)sum_ / count_ : 0; }
+
+    //Lower bound of the bucket holding the p-th percentile, p in [0, 100].
+    uint64_t percentile(double p) const;
+
+    //Write a JSON object with summary, percentiles and the non-empty buckets.
+    void dump_json(FILE *f) const;
+
+    //Raw access, e.g. for reducing histograms across ranks.
+    uint64_t* buckets() { return buckets_; }
+    const uint64_t* buckets() const { return buckets_; }
+    void set_summary(uint64_t count, uint64_t sum, uint64_t min, uint64_t max){
+      count_ = count; sum_ = sum; min_ = min; max_ = max;
+    }
+
+    static int bucket_of(uint64_t ns){
+      if(ns < (1 << HIST_SUB_BITS))
+        return ns;
+      int msb = 63 - __builtin_clzll(ns);
+      if(msb >= HIST_MAX_BITS)
+        return HIST_BUCKETS - 1;
+      int shift = msb - HIST_SUB_BITS;
+      return ((shift + 1) << HIST_SUB_BITS) + (int)((ns >> shift) - (1 << HIST_SUB_BITS));
+    }
+
+    static uint64_t bucket_low(int idx){
+      if(idx < (1 << HIST_SUB_BITS))
+        return idx;
+      int shift = (idx >> HIST_SUB_BITS) - 1;
+      return ((uint64_t)(1 << HIST_SUB_BITS) + (idx & ((1 << HIST_SUB_BITS) - 1))) << shift;
+    }
+
+  protected:
+    uint64_t buckets_[HIST_BUCKETS];
+    uint64_t count_;
+    uint64_t sum_;
+    uint64_t min_;
+    uint64_t max_;
+};
+
+//Sum the histograms of all ranks into h at MASTER. Must be called on every rank.
+void reduce_histogram(mpi_coordinator *coord, LatencyHistogram &h);
+
+#endif
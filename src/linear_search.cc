@@ -96,7 +96,7 @@ int main (int argc, char *argv[]) {
   if(strcmp(server, "memcached") == 0)
     proxy_clt = new MemcachedProxy<protobuf::Message, protobuf::Message>;
   else if(strcmp(server, "pilaf") == 0)
-    proxy_clt = new PilafProxy<protobuf::Message, protobuf::Message>;
+    proxy_clt = new PilafProxy<protobuf::Message, protobuf::Message>((read_modes)read_mode);
   else
     proxy_clt = new RedisProxy<protobuf::Message, protobuf::Message>;
 
@@ -0,0 +1,176 @@
+/* Instrumentation decorator for key-value store proxies.
+ * Wraps any BaseProxy and records per-operation latency histograms,
+ * bytes sent and received, and the return codes of every call, so the
+ * backends can be compared on the same workload.
+ */
+
+#ifndef METRICS_PROXY
+#define METRICS_PROXY
+#include "base_proxy.h"
+#include "latency_histogram.h"
+#include "mpi_coordinator.h"
+#include <stdio.h>
+#include <string>
+
+enum proxy_metric_ops{
+  METRIC_GET,
+  METRIC_PUT,
+  METRIC_CONTAIN,
+  N_METRIC_OPS
+};
+
+//Return codes 0..N_METRIC_CODES-1 are counted individually, the rest together.
+#define N_METRIC_CODES 4
+
+struct proxy_op_metrics{
+  LatencyHistogram latency;
+  uint64_t bytes_in;
+  uint64_t bytes_out;
+  uint64_t codes[N_METRIC_CODES + 1];
+};
+
+template<class K, class V>
+class MetricsProxy:public BaseProxy<K, V>{
+  private:
+    //Disable copy constructor.
+    MetricsProxy(const MetricsProxy &m);
+
+  protected:
+    BaseProxy<K, V> *inner_;
+    std::string backend_;
+    proxy_op_metrics ops_[N_METRIC_OPS];
+
+    void record(int op, uint64_t start_tsc, int rval, uint64_t bytes_in, uint64_t bytes_out);
+
+  public:
+    //Takes ownership of inner.
+    MetricsProxy(BaseProxy<K, V> *inner, const std::string &backend);
+    ~MetricsProxy();
+    int put(const K& key, const V& value);
+    int get(const K& key, V& value);
+    int init(const char* filename);
+    int contain(const K& key);
+    void close();
+
+    const proxy_op_metrics& metrics(int op) { return ops_[op]; }
+    void reset();
+
+    //Reduce the metrics of every rank to MASTER, which writes them to f as
+    //JSON. Must be called on every rank.
+    void report(mpi_coordinator *coord, FILE *f);
+};
+
+template<class K, class V>
+MetricsProxy<K, V>::MetricsProxy(BaseProxy<K, V> *inner, const std::string &backend){
+  inner_ = inner;
+  backend_ = backend;
+  reset();
+}
+
+template<class K, class V>
+MetricsProxy<K, V>::~MetricsProxy(){
+  delete inner_;
+}
+
+template<class K, class V>
+void MetricsProxy<K, V>::reset(){
+  for(int i = 0; i < N_METRIC_OPS; i++){
+    ops_[i].latency.reset();
+    ops_[i].bytes_in = 0;
+    ops_[i].bytes_out = 0;
+    memset(ops_[i].codes, 0, sizeof(ops_[i].codes));
+  }
+}
+
+template<class K, class V>
+void MetricsProxy<K, V>::record(int op, uint64_t start_tsc, int rval,
+    uint64_t bytes_in, uint64_t bytes_out){
+  proxy_op_metrics &m = ops_[op];
+  m.latency.record(tsc_to_ns(read_tsc() - start_tsc));
+  m.bytes_in += bytes_in;
+  m.bytes_out += bytes_out;
+  m.codes[(rval >= 0 && rval < N_METRIC_CODES) ? rval : N_METRIC_CODES]++;
+}
+
+template<class K, class V>
+int MetricsProxy<K, V>::put(const K& key, const V& value){
+  uint64_t start = read_tsc();
+  int ret = inner_->put(key, value);
+  record(METRIC_PUT, start, ret, 0, key.ByteSizeLong() + value.ByteSizeLong());
+  return ret;
+}
+
+template<class K, class V>
+int MetricsProxy<K, V>::get(const K& key, V& value){
+  uint64_t start = read_tsc();
+  int ret = inner_->get(key, value);
+  record(METRIC_GET, start, ret, (ret == PROXY_FOUND) ? value.ByteSizeLong() : 0, key.ByteSizeLong());
+  return ret;
+}
+
+template<class K, class V>
+int MetricsProxy<K, V>::contain(const K& key){
+  uint64_t start = read_tsc();
+  int ret = inner_->contain(key);
+  record(METRIC_CONTAIN, start, ret, 0, key.ByteSizeLong());
+  return ret;
+}
+
+template<class K, class V>
+int MetricsProxy<K, V>::init(const char* filename){
+  return inner_->init(filename);
+}
+
+template<class K, class V>
+void MetricsProxy<K, V>::close(){
+  inner_->close();
+}
+
+template<class K, class V>
+void MetricsProxy<K, V>::report(mpi_coordinator *coord, FILE *f){
+  static const char* op_names[N_METRIC_OPS] = {"get", "put", "contain"};
+  //PROXY_FOUND and PROXY_PUT_DONE are both 0.
+  static const char* ratio_names[N_METRIC_OPS] = {"hit_ratio", "ok_ratio", "ok_ratio"};
+
+  //Counters to sum: bytes_in, bytes_out and the return codes.
+  const int n_counters = 2 + N_METRIC_CODES + 1;
+  uint64_t counters[N_METRIC_OPS][n_counters];
+  uint64_t totals[N_METRIC_OPS][n_counters];
+  LatencyHistogram latency[N_METRIC_OPS];
+
+  for(int i = 0; i < N_METRIC_OPS; i++){
+    counters[i][0] = ops_[i].bytes_in;
+    counters[i][1] = ops_[i].bytes_out;
+    memcpy(&counters[i][2], ops_[i].codes, sizeof(ops_[i].codes));
+    latency[i] = ops_[i].latency;
+    reduce_histogram(coord, latency[i]);
+  }
+  coord->reduce(&counters[0][0], &totals[0][0], N_METRIC_OPS * n_counters);
+
+  if(!coord->is_master())
+    return;
+
+  fprintf(f, "{\"backend\": \"%s\", \"ranks\": %d, \"ops\": {", backend_.c_str(), coord->get_size());
+  for(int i = 0; i < N_METRIC_OPS; i++){
+    const LatencyHistogram &h = latency[i];
+    fprintf(f, "%s\n  \"%s\": {\"count\": %llu, \"bytes_in\": %llu, \"bytes_out\": %llu, ",
+        i ? "," : "", op_names[i], (unsigned long long)h.count(),
+        (unsigned long long)totals[i][0], (unsigned long long)totals[i][1]);
+
+    fprintf(f, "\"%s\": %.4f, \"codes\": {", ratio_names[i],
+        h.count() ? (double)totals[i][2] / h.count() : 0);
+    for(int c = 0; c <= N_METRIC_CODES; c++){
+      if(c < N_METRIC_CODES)
+        fprintf(f, "\"%d\": %llu, ", c, (unsigned long long)totals[i][2 + c]);
+      else
+        fprintf(f, "\"other\": %llu}, ", (unsigned long long)totals[i][2 + c]);
+    }
+
+    fprintf(f, "\"latency\": ");
+    h.dump_json(f);
+    fprintf(f, "}");
+  }
+  fprintf(f, "\n}}\n");
+}
+
+#endif
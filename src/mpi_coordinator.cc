@@ -1,9 +1,12 @@
 #include "mpi_coordinator.h"
+#include "trace_recorder.h"
+#include <string.h>
 
 mpi_coordinator::mpi_coordinator(MPI_Comm comm){
   comm_ = comm;
   MPI_Comm_size(comm_, &size_);
   MPI_Comm_rank(comm_, &rank_);
+  tracer_ = 0;
 }
 
 void mpi_coordinator::finalize(){
@@ -23,15 +26,38 @@ void mpi_coordinator::die(const std::string& str){
   MPI_Abort(MPI_COMM_WORLD, -1);
 }
 
+FILE* mpi_coordinator::open_output(const char* path){
+  FILE* f = stdout;
+  if(is_master() && strcmp(path, "-") != 0){
+    f = fopen(path, "w");
+    if(f == 0){
+      fprintf(stderr, "Couldn't open file %s, writing to stdout\n", path);
+      f = stdout;
+    }
+  }
+  return f;
+}
+
+void mpi_coordinator::close_output(FILE* f){
+  if(f != stdout)
+    fclose(f);
+}
+
 void mpi_coordinator::bcast(int *buf, int count, int root){
+  trace_span span(tracer_, TRACE_BCAST);
   MPI_Bcast(buf, count, MPI_INT, root, comm_);
 }
 
 void mpi_coordinator::gather(int *send_buf, int *recv_buf, int count){
   MPI_Gather(send_buf, count, MPI_INT, recv_buf, count, MPI_INT, MASTER, comm_);
 }
+
+void mpi_coordinator::reduce(uint64_t *send_buf, uint64_t *recv_buf, int count, MPI_Op op){
+  MPI_Reduce(send_buf, recv_buf, count, MPI_UNSIGNED_LONG_LONG, op, MASTER, comm_);
+}
     
 std::vector<uint64_t> mpi_coordinator::gather_vectors(std::vector<uint64_t> &data){
+  trace_span span(tracer_, TRACE_GATHER);
   int count = data.size();
   int *count_array = 0;
   int *disp_array = 0;
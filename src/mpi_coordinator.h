@@ -5,11 +5,14 @@
 #define MPI_COORDINATOR_H
 #include "mpi.h"
 #include <stdint.h>
+#include <stdio.h>
 #include <string>
 #include <vector>
 
 const int MASTER = 0;
 
+class TraceRecorder;
+
 class mpi_coordinator{
   public: 
     mpi_coordinator(MPI_Comm comm = MPI_COMM_WORLD);
@@ -25,10 +28,21 @@ class mpi_coordinator{
     void bcast(int* buf, int count = 1, int root = 0);
     void gather(int *send_buf, int *recv_buf, int count);
 
+    //Reduce count 64-bit counters element-wise to MASTER (MPI_SUM, MPI_MIN, MPI_MAX).
+    void reduce(uint64_t *send_buf, uint64_t *recv_buf, int count, MPI_Op op = MPI_SUM);
+
     //Gather the vetors from all processes. ONLY return the 
     //gathered result vector to MASTER process.
     std::vector<uint64_t> gather_vectors(std::vector<uint64_t> &data); 
 
+    //Open the file the master writes a report to, "-" or a failed open
+    //means stdout. Other ranks get stdout too.
+    FILE* open_output(const char* path);
+    void close_output(FILE* f);
+
+    //Record bcast and gather spans into t, 0 disables tracing.
+    void set_tracer(TraceRecorder *t) { tracer_ = t; }
+
     static void die(const std::string& str);
     static void finalize();
     static void init(int argc, char* argv[]);
@@ -37,6 +51,7 @@ class mpi_coordinator{
     MPI_Comm comm_;
     int rank_;
     int size_;
+    TraceRecorder *tracer_;
 
   private:
     //Disable copy constructor.
@@ -7,7 +7,9 @@
 #include <string>
 #include "store-client.h"
 #include "config.h"
-#define MAX_BUF_LEN 40000000
+
+//Leave the read mode to the Pilaf client, which picks one per transport.
+#define PILAF_CLIENT_READ_MODE ((read_modes)-1)
 
 template<class K, class V>
 class PilafProxy:public BaseProxy<K, V>{
@@ -16,14 +18,14 @@ class PilafProxy:public BaseProxy<K, V>{
     PilafProxy(const PilafProxy& p);
   
   protected:
-    //We use this buffer to receive the data from server.
+    //Values are parsed in place from the client's fetch buffer.
     //This is OK since Pilaf is not thread-safe itself.
     //So we won't get data from different threads.
-    char buffer_[MAX_BUF_LEN];
     Client *clt_;
+    read_modes read_mode_;
 
   public:
-    PilafProxy();    
+    PilafProxy(read_modes read_mode = PILAF_CLIENT_READ_MODE);
     int put(const K& key, const V& value);
     int get(const K& key, V& value);
     int init(const char* filename);
@@ -32,8 +34,9 @@ class PilafProxy:public BaseProxy<K, V>{
 };
 
 template<class K, class V>
-PilafProxy<K, V>::PilafProxy(){
+PilafProxy<K, V>::PilafProxy(read_modes read_mode){
   clt_ = 0;
+  read_mode_ = read_mode;
 }
 
 template<class K, class V>
@@ -49,13 +52,14 @@ int PilafProxy<K, V>::put(const K& key, const V& value){
 
 template<class K, class V>
 int PilafProxy<K, V>::get(const K& key, V& value){
-  std::string k_str, v_str;
+  std::string k_str;
   key.SerializeToString(&k_str);
+  const char* val;
   size_t val_len;
 
-  int ret = clt_->get_with_size(k_str.c_str(), buffer_, k_str.size(), val_len); 
+  int ret = clt_->get_view(k_str.c_str(), k_str.size(), val, val_len);
   if(ret == POST_GET_FOUND){
-    value.ParseFromString(std::string(buffer_, val_len));
+    value.ParseFromArray(val, val_len);
     return PROXY_FOUND;
   }  
   return PROXY_NOT_FOUND;
@@ -74,7 +78,8 @@ int PilafProxy<K, V>::init(const char* filename){
       return -1;
   }
 
-  clt_->set_read_mode((read_modes)0);
+  if(read_mode_ != PILAF_CLIENT_READ_MODE)
+    clt_->set_read_mode(read_mode_);
   clt_->ready();
   return 0;
 }
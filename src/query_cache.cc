@@ -0,0 +1,135 @@
+#include "query_cache.h"
+
+#define GET_DIST(v) (v >> 32)
+
+//Rough per-entry bookkeeping: map node, lru node and the vector header.
+#define ENTRY_OVERHEAD 128
+
+bool QueryCache::key_st::operator < (const key_st &k) const{
+  if(code != k.code)
+    return code < k.code;
+  if(approximate != k.approximate)
+    return approximate < k.approximate;
+  return knn < k.knn;
+}
+
+QueryCache::QueryCache(size_t budget_bytes){
+  budget_ = budget_bytes;
+  bytes_ = 0;
+  version_ = 0;
+  n_hits_ = 0;
+  n_misses_ = 0;
+  n_seeds_ = 0;
+}
+
+bool QueryCache::lookup(const std::string &code, int knn, bool approximate,
+    std::vector<uint64_t> &result){
+  key_st key;
+  key.code = code;
+  key.approximate = approximate;
+  key.knn = knn;
+
+  table_t::iterator iter = table_.find(key);
+  if(iter == table_.end()){
+    n_misses_++;
+    return false;
+  }
+
+  //Move to the front of the lru list.
+  lru_.splice(lru_.begin(), lru_, iter->second.lru_pos);
+  result = iter->second.result;
+  n_hits_++;
+  return true;
+}
+
+int QueryCache::bound_from(const std::string &code, int knn, int flip_dist){
+  key_st key;
+  key.code = code;
+  key.approximate = false;
+  key.knn = knn;
+
+  //Exact entries of the same code are ordered by knn, so the first one at or
+  //after knn gives the tightest bound.
+  table_t::iterator iter = table_.lower_bound(key);
+  for(; iter != table_.end(); ++iter){
+    if(iter->first.code != code || iter->first.approximate)
+      break;
+    const std::vector<uint64_t> &result = iter->second.result;
+    if(result.size() < (size_t)knn)
+      continue;
+    //Exact results are stored farthest first.
+    return GET_DIST(result[result.size() - knn]) + flip_dist;
+  }
+  return NO_DIST_THRESHOLD;
+}
+
+int QueryCache::seed_threshold(const std::string &code, int knn){
+  if(table_.empty())
+    return NO_DIST_THRESHOLD;
+
+  int threshold = bound_from(code, knn, 0);
+  std::string neighbor = code;
+
+  //An image at distance d from a code one bit away is at most d+1 from the
+  //query, so the neighbor's knn-th distance plus one bounds ours.
+  for(size_t i = 0; i < neighbor.size() * 8; i++){
+    neighbor[i / 8] ^= (1 << (i % 8));
+    int bound = bound_from(neighbor, knn, 1);
+    neighbor[i / 8] ^= (1 << (i % 8));
+
+    if(bound != NO_DIST_THRESHOLD && (threshold == NO_DIST_THRESHOLD || bound < threshold))
+      threshold = bound;
+  }
+
+  if(threshold != NO_DIST_THRESHOLD)
+    n_seeds_++;
+  return threshold;
+}
+
+void QueryCache::insert(const std::string &code, int knn, bool approximate,
+    const std::vector<uint64_t> &result){
+  key_st key;
+  key.code = code;
+  key.approximate = approximate;
+  key.knn = knn;
+
+  size_t entry_bytes = ENTRY_OVERHEAD + 2 * code.size() + result.size() * sizeof(uint64_t);
+  if(entry_bytes > budget_)
+    return;
+
+  table_t::iterator iter = table_.find(key);
+  if(iter != table_.end())
+    erase(iter);
+
+  lru_.push_front(key);
+  entry_st &entry = table_[key];
+  entry.result = result;
+  entry.bytes = entry_bytes;
+  entry.lru_pos = lru_.begin();
+  bytes_ += entry_bytes;
+
+  evict();
+}
+
+void QueryCache::set_version(uint64_t version){
+  if(version == version_)
+    return;
+
+  //Stale entries can never be served again, so drop them all now rather than
+  //letting them age out of the lru list.
+  version_ = version;
+  table_.clear();
+  lru_.clear();
+  bytes_ = 0;
+}
+
+void QueryCache::erase(table_t::iterator iter){
+  bytes_ -= iter->second.bytes;
+  lru_.erase(iter->second.lru_pos);
+  table_.erase(iter);
+}
+
+void QueryCache::evict(){
+  while(bytes_ > budget_ && !lru_.empty())
+    erase(table_.find(lru_.back()));
+}
@@ -0,0 +1,78 @@
+// Result cache for repeated KNN queries, kept at the master rank.
+// Near-duplicate images share a binary code, so the same (code, k, approximate)
+// lookup shows up again and again. Results are stored packed the same way the
+// workers gather them: image id in the low 32 bits, distance in the high 32 bits.
+
+#ifndef QUERY_CACHE_H
+#define QUERY_CACHE_H
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <list>
+#include <map>
+
+#define NO_DIST_THRESHOLD -1
+
+class QueryCache{
+  public:
+    //budget_bytes bounds the estimated memory used by all cached entries.
+    QueryCache(size_t budget_bytes);
+
+    //Return true and fill result if (code, knn, approximate) is cached.
+    bool lookup(const std::string &code, int knn, bool approximate, std::vector<uint64_t> &result);
+
+    //Return an upper bound of the knn-th nearest distance for code, derived from
+    //cached exact results of the same code or of a code one bit away. Return
+    //NO_DIST_THRESHOLD if no cached entry can provide one.
+    int seed_threshold(const std::string &code, int knn);
+
+    void insert(const std::string &code, int knn, bool approximate, const std::vector<uint64_t> &result);
+
+    //Drop every entry when the version changes. Bump the version whenever the
+    //hash tables are rebuilt.
+    void set_version(uint64_t version);
+    uint64_t version() { return version_; }
+
+    size_t bytes() { return bytes_; }
+    size_t entries() { return table_.size(); }
+    uint64_t hits() { return n_hits_; }
+    uint64_t misses() { return n_misses_; }
+    uint64_t seeds() { return n_seeds_; }
+
+  protected:
+    struct key_st{
+      std::string code;
+      bool approximate;
+      int knn;
+      bool operator < (const key_st &k) const;
+    };
+
+    struct entry_st{
+      std::vector<uint64_t> result;
+      size_t bytes;
+      std::list<key_st>::iterator lru_pos;
+    };
+
+    typedef std::map<key_st, entry_st> table_t;
+
+    table_t table_;
+    std::list<key_st> lru_; //Most recently used at the front.
+    size_t budget_;
+    size_t bytes_;
+    uint64_t version_;
+    uint64_t n_hits_;
+    uint64_t n_misses_;
+    uint64_t n_seeds_;
+
+    void erase(table_t::iterator iter);
+    void evict();
+
+    //Bound from the smallest exact entry of code with at least knn results, plus flip_dist.
+    int bound_from(const std::string &code, int knn, int flip_dist);
+
+  private:
+    //Disable copy constructor.
+    QueryCache(const QueryCache &c);
+};
+
+#endif
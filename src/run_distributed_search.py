@@ -19,14 +19,17 @@ config_path = None
 approximate_knn = 0
 query_id = 34
 query_file = None
+cache_mb = 0
+metrics_file = "none"
+trace_file = "none"
 
 def usage():
   print "Usage :"
   print """./run_distributed_search.py [-q query id] [-a approximate knn][-c config path], [-i image count], [-f query file],
-  [-b binary bits], [-s substr len],[-k k nearest] [-n n workers] [-r read mode] [--server memcached|pilaf|redis]"""
+  [-b binary bits], [-s substr len],[-k k nearest] [-n n workers] [-r read mode: 0 rdma, 1 server, 2 rdma parallel, 3 adaptive] [-m query cache MB] [-M metrics json file|-] [-T trace json file|-] [--server memcached|pilaf|redis]"""
 
 try:
-  opts, args = getopt.getopt(sys.argv[1:], "f:q:c:i:b:s:k:n:r:a", ['server=', ])
+  opts, args = getopt.getopt(sys.argv[1:], "f:q:c:i:b:s:k:n:r:m:M:T:a", ['server=', ])
 except getopt.GetoptError as err:
   print str(err)
   usage()
@@ -55,6 +58,12 @@ for o, a in opts:
     query_id = a
   elif o == "-f":
     query_file = a
+  elif o == "-m":
+    cache_mb = a
+  elif o == "-M":
+    metrics_file = a
+  elif o == "-T":
+    trace_file = a
   else:
     usage()
 
@@ -77,6 +86,9 @@ arg = ['mpirun', '-n', str(n),  cur_dir + '/distributed-image-search', config_pa
 
 if query_file is not None:
   arg.append(query_file)
+  arg.append(str(cache_mb))
+  arg.append(metrics_file)
+  arg.append(trace_file)
 
 print "Run with config_path = %s, image_count = %s, binary_bits = %s, substr_bits = %s,\
 k = %s, server: %s, read_mode = %s apprximate_knn = %s, query id: %s" % (config_path, image_count, binary_bits, substr_len, 
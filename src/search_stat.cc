@@ -0,0 +1,152 @@
+#include "search_stat.h"
+#include "mpi_coordinator.h"
+#include <string.h>
+
+static const char* stage_names[N_SEARCH_STAGES] = {
+  "enumerate", "bitmap", "fetch", "gather", "merge", "bcast", "total"
+};
+
+//Counters summed across ranks, in the order they are packed.
+#define N_SUM_COUNTERS 8
+#define N_STAT_SUMS (N_SUM_COUNTERS + MAX_STAT_RADIUS + 1)
+//Query count, cache hits and radius, then the stage durations.
+#define N_STAT_MAXES (3 + N_SEARCH_STAGES)
+
+void search_stat_st::clear(){
+  memset(this, 0, sizeof(*this));
+}
+
+void search_stat_st::accumulate(const search_stat_st &s){
+  n_queries += s.n_queries;
+  n_cache_hits += s.n_cache_hits;
+  radius += s.radius;
+  n_main_reads += s.n_main_reads;
+  n_sub_reads += s.n_sub_reads;
+  n_local_reads += s.n_local_reads;
+  n_bitmap_skips += s.n_bitmap_skips;
+  n_found += s.n_found;
+  bytes_fetched += s.bytes_fetched;
+  n_candidates += s.n_candidates;
+  n_duplicates += s.n_duplicates;
+  for(int i = 0; i <= MAX_STAT_RADIUS; i++)
+    probes[i] += s.probes[i];
+  for(int i = 0; i < N_SEARCH_STAGES; i++)
+    stage_ns[i] += s.stage_ns[i];
+}
+
+void search_stat_st::pack_sums(uint64_t *sums) const{
+  sums[0] = n_main_reads;
+  sums[1] = n_sub_reads;
+  sums[2] = n_local_reads;
+  sums[3] = n_bitmap_skips;
+  sums[4] = n_found;
+  sums[5] = bytes_fetched;
+  sums[6] = n_candidates;
+  sums[7] = n_duplicates;
+  memcpy(&sums[N_SUM_COUNTERS], probes, sizeof(probes));
+}
+
+void search_stat_st::unpack_sums(const uint64_t *sums){
+  n_main_reads = sums[0];
+  n_sub_reads = sums[1];
+  n_local_reads = sums[2];
+  n_bitmap_skips = sums[3];
+  n_found = sums[4];
+  bytes_fetched = sums[5];
+  n_candidates = sums[6];
+  n_duplicates = sums[7];
+  memcpy(probes, &sums[N_SUM_COUNTERS], sizeof(probes));
+}
+
+//The master's query and cache hit counts are the same on every rank.
+void search_stat_st::pack_maxes(uint64_t *maxes) const{
+  maxes[0] = n_queries;
+  maxes[1] = n_cache_hits;
+  maxes[2] = radius;
+  memcpy(&maxes[3], stage_ns, sizeof(stage_ns));
+}
+
+void search_stat_st::unpack_maxes(const uint64_t *maxes){
+  n_queries = maxes[0];
+  n_cache_hits = maxes[1];
+  radius = maxes[2];
+  memcpy(stage_ns, &maxes[3], sizeof(stage_ns));
+}
+
+void search_stat_st::reduce(mpi_coordinator *coord){
+  uint64_t sums[N_STAT_SUMS];
+  uint64_t maxes[N_STAT_MAXES];
+  uint64_t sums_total[N_STAT_SUMS];
+  uint64_t maxes_total[N_STAT_MAXES];
+
+  pack_sums(sums);
+  pack_maxes(maxes);
+
+  coord->reduce(sums, sums_total, N_STAT_SUMS);
+  coord->reduce(maxes, maxes_total, N_STAT_MAXES, MPI_MAX);
+
+  if(!coord->is_master())
+    return;
+
+  unpack_sums(sums_total);
+  unpack_maxes(maxes_total);
+}
+
+void search_stat_st::reduce_queries(const std::vector<search_stat_st> &queries,
+    mpi_coordinator *coord){
+  int n = queries.size();
+  uint64_t sums[N_STAT_SUMS];
+  uint64_t sums_total[N_STAT_SUMS];
+  std::vector<uint64_t> maxes(N_STAT_MAXES * n + 1);
+  std::vector<uint64_t> maxes_total(N_STAT_MAXES * n + 1);
+
+  //Sums don't care about query boundaries, so only the local total is sent.
+  clear();
+  for(int i = 0; i < n; i++){
+    accumulate(queries[i]);
+    queries[i].pack_maxes(&maxes[N_STAT_MAXES * i]);
+  }
+  pack_sums(sums);
+
+  coord->reduce(sums, sums_total, N_STAT_SUMS);
+  coord->reduce(&maxes[0], &maxes_total[0], N_STAT_MAXES * n, MPI_MAX);
+
+  if(!coord->is_master())
+    return;
+
+  unpack_sums(sums_total);
+  n_queries = n_cache_hits = radius = 0;
+  memset(stage_ns, 0, sizeof(stage_ns));
+  for(int i = 0; i < n; i++){
+    search_stat_st q;
+    q.unpack_maxes(&maxes_total[N_STAT_MAXES * i]);
+    n_queries += q.n_queries;
+    n_cache_hits += q.n_cache_hits;
+    radius += q.radius;
+    for(int j = 0; j < N_SEARCH_STAGES; j++)
+      stage_ns[j] += q.stage_ns[j];
+  }
+}
+
+void search_stat_st::print(FILE *f) const{
+  double n = n_queries ? n_queries : 1;
+
+  fprintf(f, "queries : %llu, cache hits : %llu, radius : %.2f\n",
+      (unsigned long long)n_queries, (unsigned long long)n_cache_hits, radius / n);
+  fprintf(f, "n_main_reads : %.1f, n_sub_reads : %.1f, n_local_reads : %.1f, bitmap skips : %.1f, found : %.1f\n",
+      n_main_reads / n, n_sub_reads / n, n_local_reads / n, n_bitmap_skips / n, n_found / n);
+  fprintf(f, "bytes fetched : %.1f, candidates : %.1f, duplicates : %.1f\n",
+      bytes_fetched / n, n_candidates / n, n_duplicates / n);
+
+  fprintf(f, "probes per radius :");
+  for(int i = 0; i <= MAX_STAT_RADIUS; i++){
+    if(probes[i])
+      fprintf(f, " %d:%.1f", i, probes[i] / n);
+  }
+  fprintf(f, "\n");
+
+  fprintf(f, "stage us :");
+  for(int i = 0; i < N_SEARCH_STAGES; i++)
+    fprintf(f, " %s:%.1f", stage_names[i], stage_ns[i] / n / 1e3);
+  fprintf(f, "\n");
+}
@@ -0,0 +1,82 @@
+// Per-query statistics of SearchWorker::find: what was probed at every radius,
+// what the bitmap saved, how much was fetched and merged, and how long each
+// stage took. Stats can be reduced across ranks and accumulated over queries.
+
+#ifndef SEARCH_STAT_H
+#define SEARCH_STAT_H
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
+#include "latency_histogram.h"
+
+class mpi_coordinator;
+
+//Probes at larger radii are counted in the last slot.
+#define MAX_STAT_RADIUS 128
+
+enum search_stages{
+  STAGE_ENUMERATE,  //Walking the hash buckets of one radius, including bitmap and fetch
+  STAGE_BITMAP,     //Bitmap lookups
+  STAGE_FETCH,      //Key-value store reads
+  STAGE_GATHER,     //Shipping candidates to the master, including waiting for peers
+  STAGE_MERGE,      //Master deduplication and top-k
+  STAGE_BCAST,      //Stop broadcast after every radius
+  STAGE_TOTAL,      //The whole find() call
+  N_SEARCH_STAGES
+};
+
+struct search_stat_st{
+  uint64_t n_queries;
+  uint64_t n_cache_hits;
+  uint64_t radius;          //Last radius searched, summed over queries
+  uint64_t n_main_reads;
+  uint64_t n_sub_reads;     //Buckets read from the key-value store
+  uint64_t n_local_reads;   //Bitmap lookups
+  uint64_t n_bitmap_skips;  //Buckets the bitmap proved empty
+  uint64_t n_found;         //Buckets that held images
+  uint64_t bytes_fetched;   //Serialized size of the image lists read
+  uint64_t n_candidates;    //Candidates gathered at the master
+  uint64_t n_duplicates;    //Candidates dropped because an earlier radius had them
+  uint64_t probes[MAX_STAT_RADIUS + 1]; //Buckets read per radius
+  uint64_t stage_ns[N_SEARCH_STAGES];
+
+  search_stat_st() { clear(); }
+  void clear();
+
+  //Add the stats of another query (or rank) to this one.
+  void accumulate(const search_stat_st &s);
+
+  //Combine the stats of one query across ranks at MASTER: counters are summed,
+  //radius and stage durations take the maximum since the slowest rank sets
+  //the latency. Must be called on every rank.
+  void reduce(mpi_coordinator *coord);
+
+  //Reduce a run of queries at MASTER into their total with two collectives,
+  //each query still taking the maximum of its own stage durations across
+  //ranks. Replaces this stat. Must be called on every rank with the same
+  //number of queries.
+  void reduce_queries(const std::vector<search_stat_st> &queries,
+      mpi_coordinator *coord);
+
+  //Print per-query averages.
+  void print(FILE *f) const;
+
+  protected:
+    void pack_sums(uint64_t *sums) const;
+    void unpack_sums(const uint64_t *sums);
+    void pack_maxes(uint64_t *maxes) const;
+    void unpack_maxes(const uint64_t *maxes);
+};
+
+//Add the TSC ticks spent in the enclosing block to ticks.
+class stage_timer{
+  public:
+    stage_timer(uint64_t &ticks) : ticks_(ticks) { start_ = read_tsc(); }
+    ~stage_timer() { ticks_ += read_tsc() - start_; }
+
+  protected:
+    uint64_t &ticks_;
+    uint64_t start_;
+};
+
+#endif
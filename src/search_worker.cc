@@ -21,14 +21,6 @@ bool operator + (const SearchWorker::search_result_st &a,const SearchWorker::sea
 }
 
 
-void SearchWorker::get_stat(uint64_t &n_main_reads, uint64_t &n_sub_reads, 
-                                uint64_t &n_local_reads, uint32_t &radius){
-  n_main_reads = n_main_reads_;
-  n_sub_reads = n_sub_reads_;
-  n_local_reads = n_local_reads_;
-  radius = radius_;
-}
-
 bool SearchWorker::connect_bitmap_deamon(unsigned long long size){
   int shared_fd_ = shm_open(MEM_ID, O_RDWR, 0666);
   if(shared_fd_ == -1)
@@ -57,20 +49,31 @@ SearchWorker::SearchWorker(mpi_coordinator *coord,
   image_total_ = image_total;
   table_idx_ = coord->get_rank();
   bmp_ = 0;
+  cache_ = 0;
+  use_cache_ = false;
+  dist_threshold_ = NO_DIST_THRESHOLD;
+  tracer_ = 0;
+  n_queries_ = 0;
   
   //connect_bitmap_deamon();
   //printf("init : %d\n", connect_bitmap_deamon());
 }
 
-std::list<SearchWorker::search_result_st> SearchWorker::find(const char *binary_code, 
+const search_stat_st& SearchWorker::find(const char *binary_code, 
     size_t nbytes, int knn, bool approximate){
+  uint64_t start_tsc = read_tsc();
+  TIMED_SCOPE("query");
+  trace_span span(tracer_, TRACE_QUERY, n_queries_++);
+  if(tracer_)
+    tracer_->set_radius(0);
   
   knn_ = knn;
   knn_found_.clear();
   result_.clear();
-  n_main_reads_ = 0;
-  n_sub_reads_ = 0;
-  n_local_reads_ = 0;
+  stat_.clear();
+  stat_.n_queries = 1;
+  memset(stage_ticks_, 0, sizeof(stage_ticks_));
+  dist_threshold_ = NO_DIST_THRESHOLD;
 
   assert(nbytes % coord_->get_size() == 0);
   n_local_bytes_ = nbytes / coord_->get_size();
@@ -79,13 +82,94 @@ std::list<SearchWorker::search_result_st> SearchWorker::find(const char *binary_
   ID image_id;
   
   code.set_code(binary_code, nbytes);
-  
-  if(approximate) //find approximate neighbors
-    radius_ = search_K_approximate_nearest_neighbors(code);
-  else
-    radius_ = search_K_nearest_neighbors(code);
 
-  return result_;
+  if(use_cache_ && lookup_cache(code.code(), approximate)){
+    stat_.n_cache_hits = 1;
+  }else{
+    if(approximate) //find approximate neighbors
+      stat_.radius = search_K_approximate_nearest_neighbors(code);
+    else
+      stat_.radius = search_K_nearest_neighbors(code);
+
+    if(use_cache_)
+      store_cache(code.code(), approximate);
+  }
+
+  stage_ticks_[STAGE_TOTAL] = read_tsc() - start_tsc;
+  for(int i = 0; i < N_SEARCH_STAGES; i++)
+    stat_.stage_ns[i] = tsc_to_ns(stage_ticks_[i]);
+  return stat_;
+}
+
+void SearchWorker::enable_cache(size_t budget_bytes){
+  use_cache_ = true;
+  if(coord_->is_master() && cache_ == 0)
+    cache_ = new QueryCache(budget_bytes);
+}
+
+void SearchWorker::enable_tracing(size_t capacity){
+  if(tracer_ == 0)
+    tracer_ = new TraceRecorder(capacity);
+  tracer_->synchronize(coord_);
+  coord_->set_tracer(tracer_);
+}
+
+void SearchWorker::dump_trace(FILE *f){
+  //Keep the gather below out of the trace.
+  coord_->set_tracer(0);
+  tracer_->dump_json(coord_, f);
+  coord_->set_tracer(tracer_);
+}
+
+void SearchWorker::trace_counters(){
+  if(tracer_ == 0)
+    return;
+  tracer_->counter(TRACE_MAIN_READS, stat_.n_main_reads);
+  tracer_->counter(TRACE_SUB_READS, stat_.n_sub_reads);
+  tracer_->counter(TRACE_LOCAL_READS, stat_.n_local_reads);
+}
+
+void SearchWorker::invalidate_cache(uint64_t version){
+  if(cache_)
+    cache_->set_version(version);
+}
+
+bool SearchWorker::lookup_cache(const std::string &query_code, bool approximate){
+  //msg[0] : cache hit, msg[1] : distance threshold seeded from a cached neighbor.
+  int msg[2] = {0, NO_DIST_THRESHOLD};
+
+  if(coord_->is_master()){
+    std::vector<uint64_t> cached;
+    if(cache_->lookup(query_code, knn_, approximate, cached)){
+      msg[0] = 1;
+      for(size_t i = 0; i < cached.size(); i++){
+        search_result_st item;
+        item.image_id = GET_ID(cached[i]);
+        item.dist = GET_DIST(cached[i]);
+        result_.push_back(item);
+      }
+    }else if(!approximate){
+      //Pruning would shrink the candidate pool the approximate search ranks.
+      msg[1] = cache_->seed_threshold(query_code, knn_);
+    }
+  }
+
+  coord_->bcast(msg, 2);
+  dist_threshold_ = msg[1];
+  return msg[0];
+}
+
+void SearchWorker::store_cache(const std::string &query_code, bool approximate){
+  if(!coord_->is_master())
+    return;
+
+  std::vector<uint64_t> packed;
+  packed.reserve(result_.size());
+  std::list<search_result_st>::iterator iter = result_.begin();
+  for(; iter != result_.end(); ++iter)
+    packed.push_back(iter->image_id | ((uint64_t)iter->dist << 32));
+
+  cache_->insert(query_code, knn_, approximate, packed);
 }
 
 
@@ -102,20 +186,40 @@ size_t SearchWorker::search_K_approximate_nearest_neighbors(BinaryCode& code){
   int is_stop = 0;
 
   while(!is_stop && radius <= n_local_bytes_ * 8){ 
+    TIMED_SCOPE("radius");
+    if(tracer_)
+      tracer_->set_radius(radius);
+    trace_span radius_span(tracer_, TRACE_RADIUS);
     //Clear kn_candidates
     kn_candidates.clear();
     kn_candidates.reserve(8192);
-    search_R_neighbors(query_code, radius, search_index, kn_candidates);
+    {
+      TIMED_SCOPE("fetch");
+      trace_span span(tracer_, TRACE_ENUMERATE);
+      stage_timer st(stage_ticks_[STAGE_ENUMERATE]);
+      search_R_neighbors(query_code, radius, search_index, kn_candidates);
+    }
+    trace_counters();
     vector<uint64_t> gathered_vector;
   
-    gathered_vector = coord_->gather_vectors(kn_candidates);
+    {
+      TIMED_SCOPE("gather");
+      stage_timer st(stage_ticks_[STAGE_GATHER]);
+      gathered_vector = coord_->gather_vectors(kn_candidates);
+    }
 
     if(coord_->is_master()){
+      TIMED_SCOPE("merge");
+      trace_span span(tracer_, TRACE_MERGE);
+      stage_timer st(stage_ticks_[STAGE_MERGE]);
+      stat_.n_candidates += gathered_vector.size();
        for(int i = 0; i < gathered_vector.size(); ++i){ 
         uint32_t id = GET_ID(gathered_vector[i]);
         
-        if(knn_found_.find(id) != knn_found_.end())
+        if(knn_found_.find(id) != knn_found_.end()){
+          stat_.n_duplicates++;
           continue;
+        }
 
         search_result_st item;
         item.image_id = id;
@@ -136,7 +240,10 @@ size_t SearchWorker::search_K_approximate_nearest_neighbors(BinaryCode& code){
     if(coord_->is_master() && qmax.size() == knn_ * APPROXIMATE_FACTOR)
       is_stop = 1;
 
-    coord_->bcast(&is_stop);
+    {
+      stage_timer st(stage_ticks_[STAGE_BCAST]);
+      coord_->bcast(&is_stop);
+    }
   }
   
   int i = 0;
@@ -168,20 +275,40 @@ size_t SearchWorker::search_K_nearest_neighbors(BinaryCode& code){
   int is_stop = 0;
   
   while(!is_stop && radius <= n_local_bytes_ * 8){ 
+    TIMED_SCOPE("radius");
+    if(tracer_)
+      tracer_->set_radius(radius);
+    trace_span radius_span(tracer_, TRACE_RADIUS);
     //Clear kn_candidates
     kn_candidates.clear();
     kn_candidates.reserve(8192 * 500);
-    search_R_neighbors(query_code, radius, search_index, kn_candidates);
+    {
+      TIMED_SCOPE("fetch");
+      trace_span span(tracer_, TRACE_ENUMERATE);
+      stage_timer st(stage_ticks_[STAGE_ENUMERATE]);
+      search_R_neighbors(query_code, radius, search_index, kn_candidates);
+    }
+    trace_counters();
     vector<uint64_t> gathered_vector;
   
-    gathered_vector = coord_->gather_vectors(kn_candidates);
+    {
+      TIMED_SCOPE("gather");
+      stage_timer st(stage_ticks_[STAGE_GATHER]);
+      gathered_vector = coord_->gather_vectors(kn_candidates);
+    }
 
     if(coord_->is_master()){
+      TIMED_SCOPE("merge");
+      trace_span span(tracer_, TRACE_MERGE);
+      stage_timer st(stage_ticks_[STAGE_MERGE]);
+      stat_.n_candidates += gathered_vector.size();
        for(int i = 0; i < gathered_vector.size(); ++i){ 
         uint32_t id = GET_ID(gathered_vector[i]);
         
-        if(knn_found_.find(id) != knn_found_.end())
+        if(knn_found_.find(id) != knn_found_.end()){
+          stat_.n_duplicates++;
           continue;
+        }
         
         search_result_st item;
         item.image_id = id;
@@ -204,7 +331,10 @@ size_t SearchWorker::search_K_nearest_neighbors(BinaryCode& code){
     if(coord_->is_master() && qmax.size() == knn_ && qmax.top().dist <= radius * 4)
       is_stop = 1;
 
-    coord_->bcast(&is_stop);
+    {
+      stage_timer st(stage_ticks_[STAGE_BCAST]);
+      coord_->bcast(&is_stop);
+    }
   }
    
   if(coord_->is_master()){
@@ -223,6 +353,7 @@ void SearchWorker::search_R_neighbors(std::string& query_code, int r, uint32_t s
     std::vector<uint64_t>& kn_candidates){ 
   HashIndex idx;
   idx.set_table_id(coord_->get_rank());
+  probe_radius_ = (r < MAX_STAT_RADIUS) ? r : MAX_STAT_RADIUS;
   enumerate_entry(query_code, search_index, 0, r, idx, kn_candidates);
 }
 
@@ -236,21 +367,33 @@ void SearchWorker::enumerate_entry(std::string& query_code, uint32_t curr, int l
     int rval;
   
     if(bmp_){
-      n_local_reads_++;
+      trace_span span(tracer_, TRACE_BITMAP);
+      stage_timer st(stage_ticks_[STAGE_BITMAP]);
+      stat_.n_local_reads++;
       if(bmp_->get_idx(curr) == 0){
+        stat_.n_bitmap_skips++;
         return;
       }
     }
   
-    n_sub_reads_++;
-    rval = proxy_clt_->get(idx, img_list);
+    stat_.n_sub_reads++;
+    stat_.probes[probe_radius_]++;
+    {
+      trace_span span(tracer_, TRACE_FETCH);
+      stage_timer st(stage_ticks_[STAGE_FETCH]);
+      rval = proxy_clt_->get(idx, img_list);
+    }
     
     if (rval == PROXY_FOUND) {
+      stat_.n_found++;
+      stat_.bytes_fetched += img_list.ByteSize();
       for(int i = 0; i < img_list.images_size(); i++){
         ID_Code_Pair pair = img_list.images(i);
         std::string code = pair.code();
         uint32_t id = pair.id();
         uint32_t dist = compute_hamming_dist(code, query_code);
+        if(dist_threshold_ != NO_DIST_THRESHOLD && dist > dist_threshold_)
+          continue;
         uint64_t value = id;
         value |= ((uint64_t)dist << 32);
         kn_candidates.push_back(value);
@@ -10,6 +10,9 @@
 #include <list>
 #include <stdint.h>
 #include "bitmap.h"
+#include "query_cache.h"
+#include "trace_recorder.h"
+#include "search_stat.h"
 //#include <unordered_map>
 #define APPROXIMATE_FACTOR 20
 
@@ -26,11 +29,28 @@ class SearchWorker{
                 BaseProxy<protobuf::Message, protobuf::Message> *proxy_clt,
                 int image_total);
 
-    std::list<search_result_st> find(const char *binary_code, size_t nbytes, 
+    //Search the knn nearest neighbors and return this rank's stats of the
+    //query, valid until the next call. The result is available at MASTER
+    //through get_knn().
+    const search_stat_st& find(const char *binary_code, size_t nbytes, 
                                       int knn, bool approximate);
 
     std::list<search_result_st> get_knn() { return result_; };
-    void get_stat(uint64_t &n_main_reads, uint64_t &n_sub_reads, uint64_t &n_local_reads, uint32_t &radius);
+
+    //Cache query results at the master rank. Must be called on every rank.
+    void enable_cache(size_t budget_bytes);
+    //Drop all cached results, e.g. after the hash tables were rebuilt. The
+    //search drivers query tables that stay fixed for the whole run, so nothing
+    //here calls it; whatever rebuilds the tables under a live worker must.
+    void invalidate_cache(uint64_t version);
+    QueryCache* get_cache() { return cache_; }
+
+    //Record per-stage spans of every query into a ring buffer of capacity
+    //events. Must be called on every rank.
+    void enable_tracing(size_t capacity);
+    //Write the traces of all ranks as trace-event JSON at the master. Must be
+    //called on every rank.
+    void dump_trace(FILE *f);
 
   protected:
     mpi_coordinator* coord_;
@@ -39,10 +59,18 @@ class SearchWorker{
     //std::unordered_map<int, bool> knn_found_;
     std::map<int, bool> knn_found_;
     ImageBitmap *bmp_;
-    uint64_t n_main_reads_;
-    uint64_t n_sub_reads_;
-    uint64_t n_local_reads_;
-    uint32_t radius_;
+    QueryCache *cache_;
+    bool use_cache_;
+    //Candidates farther than this can't be in the result, NO_DIST_THRESHOLD if unknown.
+    int dist_threshold_;
+    TraceRecorder *tracer_;
+    uint64_t n_queries_;
+    search_stat_st stat_;
+    uint64_t stage_ticks_[N_SEARCH_STAGES]; //TSC ticks of the current query
+    int probe_radius_;                       //Radius being enumerated
+
+    //Record the read counters of the current query into the trace.
+    void trace_counters();
 
     int knn_;
     int image_total_;
@@ -59,6 +87,10 @@ class SearchWorker{
     void enumerate_entry(std::string &query_code, uint32_t curr, int len, int rr, HashIndex &idx, 
         std::vector<uint64_t> &knn_candidates);
     
+    //Serve the query from the cache, or seed dist_threshold_ from it. Return true on a hit.
+    bool lookup_cache(const std::string &query_code, bool approximate);
+    void store_cache(const std::string &query_code, bool approximate);
+
     //try to map the memory space of bitmap deamon to local memory.
     bool connect_bitmap_deamon(unsigned long long size = ((unsigned long long )1 << 32) / 8 * 4);
 };
@@ -1,3 +1,208 @@
 #include "timer.h"
+#include "mpi_coordinator.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <map>
 
-std::map<std::string, double> timer::table_ = std::map<std::string, double>();
+typedef std::vector<std::string> timer_path_t;
+typedef std::map<timer_path_t, LatencyHistogram> timer_table_t;
+
+__thread timer_thread_st* timer::thread_state_ = 0;
+
+//Name registry and the list of threads that ever timed a scope. Only touched
+//on first use of a call site or thread and when reporting.
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static std::map<std::string, int> name_ids;
+static std::vector<std::string> names;
+static std::vector<timer_thread_st*> threads;
+
+timer_thread_st::timer_thread_st(){
+  nodes.resize(1);
+  nodes[0].name = -1;
+  nodes[0].parent = -1;
+  current = 0;
+}
+
+int timer_thread_st::child(int parent, int name){
+  std::vector<int> &children = nodes[parent].children;
+  for(size_t i = 0; i < children.size(); i++){
+    if(nodes[children[i]].name == name)
+      return children[i];
+  }
+
+  //First time this scope is entered under parent on this thread.
+  int id = nodes.size();
+  nodes.resize(id + 1);
+  nodes[id].name = name;
+  nodes[id].parent = parent;
+  nodes[parent].children.push_back(id);
+  return id;
+}
+
+int timer::intern(const std::string &name){
+  pthread_mutex_lock(&registry_lock);
+  std::map<std::string, int>::iterator iter = name_ids.find(name);
+  int id;
+  if(iter == name_ids.end()){
+    id = names.size();
+    names.push_back(name);
+    name_ids[name] = id;
+  }else{
+    id = iter->second;
+  }
+  pthread_mutex_unlock(&registry_lock);
+  return id;
+}
+
+timer_thread_st* timer::register_thread(){
+  //Calibrate the TSC now rather than inside the first timed scope.
+  tsc_ticks_per_ns();
+
+  timer_thread_st *t = new timer_thread_st;
+  pthread_mutex_lock(&registry_lock);
+  threads.push_back(t);
+  pthread_mutex_unlock(&registry_lock);
+  return t;
+}
+
+void timer::reset(){
+  pthread_mutex_lock(&registry_lock);
+  for(size_t i = 0; i < threads.size(); i++){
+    std::vector<timer_node_st> &nodes = threads[i]->nodes;
+    for(size_t n = 0; n < nodes.size(); n++)
+      nodes[n].latency.reset();
+  }
+  pthread_mutex_unlock(&registry_lock);
+}
+
+//Merge the scope trees of all threads by path.
+static void collect(timer_table_t &table){
+  pthread_mutex_lock(&registry_lock);
+  for(size_t i = 0; i < threads.size(); i++){
+    std::vector<timer_node_st> &nodes = threads[i]->nodes;
+    for(size_t n = 1; n < nodes.size(); n++){
+      if(nodes[n].latency.count() == 0)
+        continue;
+
+      timer_path_t path;
+      for(int p = n; p != 0; p = nodes[p].parent)
+        path.insert(path.begin(), names[nodes[p].name]);
+      table[path].merge(nodes[n].latency);
+    }
+  }
+  pthread_mutex_unlock(&registry_lock);
+}
+
+static void print_table(timer_table_t &table, int n_ranks){
+  timer_table_t::iterator iter = table.begin();
+
+  printf("-------Timings-------\n");
+  if(n_ranks > 1)
+    printf("(summed over %d ranks)\n", n_ranks);
+  printf("%-32s %10s %12s %10s %10s %10s %10s %10s\n", "scope", "count", "total s",
+      "mean us", "min us", "p50 us", "p99 us", "max us");
+
+  for(; iter != table.end(); ++iter){
+    const timer_path_t &path = iter->first;
+    const LatencyHistogram &h = iter->second;
+    std::string label = std::string(2 * (path.size() - 1), ' ') + path.back();
+
+    printf("%-32s %10llu %12.6f %10.1f %10.1f %10.1f %10.1f %10.1f\n", label.c_str(),
+        (unsigned long long)h.count(), h.sum() / 1e9, h.mean() / 1e3, h.min() / 1e3,
+        h.percentile(50) / 1e3, h.percentile(99) / 1e3, h.max() / 1e3);
+  }
+  printf("---------------------\n");
+}
+
+void timer::show_all_timings(){
+  timer_table_t table;
+  collect(table);
+  print_table(table, 1);
+}
+
+//Scope names are interned per rank, so ranks exchange paths as strings.
+//Layout per entry : depth, (length, packed chars) per component, count, sum,
+//min, max, number of non-empty buckets, (bucket, count) pairs.
+static void pack_string(const std::string &s, std::vector<uint64_t> &buf){
+  buf.push_back(s.size());
+  for(size_t i = 0; i < s.size(); i += 8){
+    uint64_t word = 0;
+    memcpy(&word, s.data() + i, (s.size() - i < 8) ? s.size() - i : 8);
+    buf.push_back(word);
+  }
+}
+
+static std::string unpack_string(const uint64_t *&p){
+  size_t len = *p++;
+  std::string s(len, '\0');
+  for(size_t i = 0; i < len; i += 8){
+    uint64_t word = *p++;
+    memcpy(&s[i], &word, (len - i < 8) ? len - i : 8);
+  }
+  return s;
+}
+
+static void pack_table(timer_table_t &table, std::vector<uint64_t> &buf){
+  timer_table_t::iterator iter = table.begin();
+  for(; iter != table.end(); ++iter){
+    const timer_path_t &path = iter->first;
+    const LatencyHistogram &h = iter->second;
+
+    buf.push_back(path.size());
+    for(size_t i = 0; i < path.size(); i++)
+      pack_string(path[i], buf);
+
+    buf.push_back(h.count());
+    buf.push_back(h.sum());
+    buf.push_back(h.min());
+    buf.push_back(h.max());
+
+    const uint64_t *buckets = h.buckets();
+    size_t n_pos = buf.size();
+    buf.push_back(0);
+    for(int i = 0; i < HIST_BUCKETS; i++){
+      if(buckets[i] == 0)
+        continue;
+      buf.push_back(i);
+      buf.push_back(buckets[i]);
+      buf[n_pos]++;
+    }
+  }
+}
+
+static void unpack_table(const std::vector<uint64_t> &buf, timer_table_t &table){
+  const uint64_t *p = buf.data();
+  const uint64_t *end = p + buf.size();
+
+  while(p < end){
+    timer_path_t path(*p++);
+    for(size_t i = 0; i < path.size(); i++)
+      path[i] = unpack_string(p);
+
+    LatencyHistogram h;
+    uint64_t count = p[0], sum = p[1], min = p[2], max = p[3];
+    uint64_t n_buckets = p[4];
+    p += 5;
+    for(uint64_t i = 0; i < n_buckets; i++, p += 2)
+      h.buckets()[p[0]] = p[1];
+    h.set_summary(count, sum, min, max);
+
+    table[path].merge(h);
+  }
+}
+
+void timer::show_all_timings(mpi_coordinator *coord){
+  timer_table_t table;
+  std::vector<uint64_t> buf;
+
+  collect(table);
+  pack_table(table, buf);
+  buf = coord->gather_vectors(buf);
+
+  if(!coord->is_master())
+    return;
+
+  table.clear();
+  unpack_table(buf, table);
+  print_table(table, coord->get_size());
+}
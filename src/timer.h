@@ -1,39 +1,104 @@
+// Hierarchical scope timer cheap enough to stay enabled in production.
+// Scope names are interned once per call site, timestamps come from the TSC
+// and every thread accumulates into its own tree of scopes, so timing a scope
+// costs two rdtsc and a short child lookup with no lock and no string compare.
+// Scopes nest (query -> radius -> fetch/gather/merge) and each one keeps a
+// count/min/max latency histogram.
+//
+// Usage:
+//   TIMED_SCOPE("query");
+//   ...
+//   timer::show_all_timings(coord); //On every rank, MASTER prints the sum.
+
 #ifndef TIMER_S_H
 #define TIMER_S_H
-#include <iostream>
-#include <map>
 #include <string>
-#include <sys/time.h>
+#include <vector>
 #include <stdint.h>
+#include "latency_histogram.h"
+
+class mpi_coordinator;
+
+struct timer_node_st{
+  int name;
+  int parent;
+  std::vector<int> children;
+  LatencyHistogram latency;
+};
+
+//Per-thread scope tree. Node 0 is the root, which is never timed.
+struct timer_thread_st{
+  std::vector<timer_node_st> nodes;
+  int current;
+
+  timer_thread_st();
+  int child(int parent, int name);
+};
 
 class timer{
   protected:
-    static std::map<std::string, double> table_; 
-    struct timeval start_t_;
-    struct timeval end_t_;
-    std::string timer_id_;
+    static __thread timer_thread_st *thread_state_;
+
+    timer_thread_st *thread_;
+    int node_;
+    int parent_;
+    uint64_t start_tsc_;
+
+    static timer_thread_st* this_thread(){
+      if(thread_state_ == 0)
+        thread_state_ = register_thread();
+      return thread_state_;
+    }
+    static timer_thread_st* register_thread();
 
   public:
-    timer(const std::string& s){ 
-      timer_id_ = s;
-      gettimeofday(&start_t_, NULL);
+    //Return the id of a scope name, registering it on first use. Takes a lock,
+    //so call it once per call site (TIMED_SCOPE does) rather than per scope.
+    static int intern(const std::string &name);
+
+    timer(int id){
+      thread_ = this_thread();
+      parent_ = thread_->current;
+      node_ = thread_->child(parent_, id);
+      thread_->current = node_;
+      start_tsc_ = read_tsc();
     }
 
-    ~timer(){ 
-      gettimeofday(&end_t_, NULL);
-      table_[timer_id_] += (double)((1000000 * (end_t_.tv_sec - start_t_.tv_sec)) + 
-        (end_t_.tv_usec - start_t_.tv_usec)) / 1000000;
+    //Convenience for cold paths, interns the name on every call.
+    timer(const std::string &s){
+      thread_ = this_thread();
+      parent_ = thread_->current;
+      node_ = thread_->child(parent_, intern(s));
+      thread_->current = node_;
+      start_tsc_ = read_tsc();
     }
-  
-    static void show_all_timings(){
-      std::map<std::string, double>::iterator iter = table_.begin();
-      
-      std::cout<<"-------Timings-------"<<std::endl;
-      for(; iter != table_.end(); ++iter)
-        std::cout<<iter->first<<" : "<<iter->second<<" s"<<std::endl;
-      std::cout<<"---------------------"<<std::endl; 
+
+    ~timer(){
+      thread_->nodes[node_].latency.record(tsc_to_ns(read_tsc() - start_tsc_));
+      thread_->current = parent_;
     }
+
+    //Print the timings of every thread of this process.
+    static void show_all_timings();
+
+    //Reduce the timings of every rank to MASTER and print them there. Must be
+    //called on every rank. Threads should not be inside a timed scope.
+    static void show_all_timings(mpi_coordinator *coord);
+
+    //Clear the accumulated timings of every thread.
+    static void reset();
+
+  private:
+    //Disable copy constructor.
+    timer(const timer &t);
 };
 
+#define TIMER_CONCAT_(a, b) a##b
+#define TIMER_CONCAT(a, b) TIMER_CONCAT_(a, b)
+
+//Time the rest of the enclosing block as scope name.
+#define TIMED_SCOPE(name) \
+  static const int TIMER_CONCAT(timer_id_, __LINE__) = timer::intern(name); \
+  timer TIMER_CONCAT(timer_, __LINE__)(TIMER_CONCAT(timer_id_, __LINE__))
 
 #endif
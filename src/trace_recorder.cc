@@ -0,0 +1,93 @@
+#include "trace_recorder.h"
+#include "mpi_coordinator.h"
+#include <vector>
+
+static const char* trace_name_strs[N_TRACE_NAMES] = {
+  "query", "radius", "enumerate", "bitmap", "fetch", "gather", "merge", "bcast",
+  "n_main_reads", "n_sub_reads", "n_local_reads"
+};
+
+//Words per event when shipped to MASTER.
+#define TRACE_EVENT_WORDS 4
+
+TraceRecorder::TraceRecorder(size_t capacity){
+  size_t n = 1;
+  while(n < capacity)
+    n <<= 1;
+  events_ = new trace_event_st[n];
+  mask_ = n - 1;
+  head_ = 0;
+  origin_ = read_tsc();
+  radius_ = 0;
+}
+
+TraceRecorder::~TraceRecorder(){
+  delete [] events_;
+}
+
+void TraceRecorder::synchronize(mpi_coordinator *coord){
+  //Calibrate before the barrier so it doesn't skew the origin.
+  tsc_ticks_per_ns();
+  coord->synchronize();
+  origin_ = read_tsc();
+  head_ = 0;
+}
+
+void TraceRecorder::dump_json(mpi_coordinator *coord, FILE *f){
+  uint64_t head = head_;
+  uint64_t n = (head > mask_ + 1) ? mask_ + 1 : head;
+  std::vector<uint64_t> buf;
+
+  //Per rank : rank, number of events, number of overwritten events, events.
+  buf.reserve(3 + n * TRACE_EVENT_WORDS);
+  buf.push_back(coord->get_rank());
+  buf.push_back(n);
+  buf.push_back(head - n);
+  for(uint64_t i = head - n; i < head; i++){
+    trace_event_st &e = events_[i & mask_];
+    buf.push_back(tsc_to_ns(e.start));
+    buf.push_back(e.type == TRACE_SPAN ? tsc_to_ns(e.value) : e.value);
+    buf.push_back(((uint64_t)e.type << 32) | e.name);
+    buf.push_back(e.arg);
+  }
+
+  buf = coord->gather_vectors(buf);
+  if(!coord->is_master())
+    return;
+
+  const uint64_t *p = buf.data();
+  const uint64_t *end = p + buf.size();
+  bool first = true;
+
+  fprintf(f, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [");
+  while(p < end){
+    uint64_t rank = p[0], n_events = p[1], dropped = p[2];
+    p += 3;
+
+    fprintf(f, "%s\n{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": %llu, \"tid\": 0, "
+        "\"args\": {\"name\": \"rank %llu\"}}", first ? "" : ",",
+        (unsigned long long)rank, (unsigned long long)rank);
+    if(dropped)
+      fprintf(f, ",\n{\"name\": \"dropped_events\", \"ph\": \"C\", \"ts\": 0, \"pid\": %llu, "
+          "\"args\": {\"value\": %llu}}", (unsigned long long)rank, (unsigned long long)dropped);
+    first = false;
+
+    for(uint64_t i = 0; i < n_events; i++, p += TRACE_EVENT_WORDS){
+      uint64_t ts = p[0], value = p[1], arg = p[3];
+      int name = p[2] & 0xffffffff;
+      int type = p[2] >> 32;
+      const char* name_str = (name < N_TRACE_NAMES) ? trace_name_strs[name] : "unknown";
+
+      if(type == TRACE_SPAN)
+        fprintf(f, ",\n{\"name\": \"%s\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, \"pid\": %llu, "
+            "\"tid\": 0, \"args\": {\"%s\": %llu}}", name_str, ts / 1e3, value / 1e3,
+            (unsigned long long)rank, name == TRACE_QUERY ? "query" : "radius",
+            (unsigned long long)arg);
+      else
+        fprintf(f, ",\n{\"name\": \"%s\", \"ph\": \"C\", \"ts\": %.3f, \"pid\": %llu, "
+            "\"args\": {\"value\": %llu}}", name_str, ts / 1e3,
+            (unsigned long long)rank, (unsigned long long)value);
+    }
+  }
+  fprintf(f, "\n]}\n");
+}
@@ -0,0 +1,128 @@
+// Per-rank trace of search stages, exported as Chrome trace-event JSON
+// (viewable in Perfetto or chrome://tracing). Every rank records spans and
+// counters into a fixed-size ring buffer; the master gathers the buffers and
+// writes one track per rank so stragglers show up next to each other.
+
+#ifndef TRACE_RECORDER_H
+#define TRACE_RECORDER_H
+#include <stdint.h>
+#include <stdio.h>
+#include "latency_histogram.h"
+
+class mpi_coordinator;
+
+enum trace_names{
+  //Spans.
+  TRACE_QUERY,
+  TRACE_RADIUS,
+  TRACE_ENUMERATE,
+  TRACE_BITMAP,
+  TRACE_FETCH,
+  TRACE_GATHER,
+  TRACE_MERGE,
+  TRACE_BCAST,
+  //Counters.
+  TRACE_MAIN_READS,
+  TRACE_SUB_READS,
+  TRACE_LOCAL_READS,
+  N_TRACE_NAMES
+};
+
+enum trace_types{
+  TRACE_SPAN,
+  TRACE_COUNTER
+};
+
+struct trace_event_st{
+  uint64_t start;   //TSC ticks since the recorder's origin
+  uint64_t value;   //Duration in ticks for spans, the value for counters
+  uint32_t name;
+  uint32_t type;
+  uint64_t arg;     //Radius for spans, query number for queries
+};
+
+class TraceRecorder{
+  public:
+    //capacity is rounded up to a power of two. Once full, the oldest events
+    //are overwritten.
+    TraceRecorder(size_t capacity);
+    ~TraceRecorder();
+
+    //Align the origins of all ranks with a barrier. Must be called on every rank.
+    void synchronize(mpi_coordinator *coord);
+
+    uint64_t now() { return read_tsc() - origin_; }
+
+    void span(int name, uint64_t start, uint64_t arg = 0){
+      record(name, TRACE_SPAN, start, now() - start, arg);
+    }
+
+    void counter(int name, uint64_t value){
+      record(name, TRACE_COUNTER, now(), value, 0);
+    }
+
+    void clear() { head_ = 0; }
+
+    //Radius attached to spans that don't name their own argument.
+    void set_radius(uint64_t radius) { radius_ = radius; }
+    uint64_t radius() { return radius_; }
+
+    //Gather the events of every rank and write them as trace-event JSON at
+    //MASTER. Must be called on every rank.
+    void dump_json(mpi_coordinator *coord, FILE *f);
+
+  protected:
+    trace_event_st *events_;
+    uint64_t mask_;
+    volatile uint64_t head_;
+    uint64_t origin_;
+    uint64_t radius_;
+
+    void record(int name, int type, uint64_t start, uint64_t value, uint64_t arg){
+      //Claim a slot without locking, so several threads may record at once.
+      trace_event_st &e = events_[__sync_fetch_and_add(&head_, 1) & mask_];
+      e.start = start;
+      e.value = value;
+      e.name = name;
+      e.type = type;
+      e.arg = arg;
+    }
+
+  private:
+    //Disable copy constructor.
+    TraceRecorder(const TraceRecorder &t);
+};
+
+//Record a span for the enclosing block if tracing is enabled.
+class trace_span{
+  public:
+    trace_span(TraceRecorder *t, int name){
+      tracer_ = t;
+      name_ = name;
+      if(tracer_){
+        arg_ = tracer_->radius();
+        start_ = tracer_->now();
+      }
+    }
+
+    trace_span(TraceRecorder *t, int name, uint64_t arg){
+      tracer_ = t;
+      name_ = name;
+      arg_ = arg;
+      if(tracer_)
+        start_ = tracer_->now();
+    }
+
+    ~trace_span(){
+      if(tracer_)
+        tracer_->span(name_, start_, arg_);
+    }
+
+  protected:
+    TraceRecorder *tracer_;
+    int name_;
+    uint64_t arg_;
+    uint64_t start_;
+};
+
+#endif